@@ -0,0 +1,507 @@
+/**
+ * @abstruct in-memory static asset cache module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "http.h"
+#include "staticfile.h"
+#include "compress.h"
+#include "assetcache.h"
+
+// private functions
+static assetcacheEntry*	lookupEntry(assetcache* cache, const char* path);
+static assetcacheEntry*	loadEntry(assetcache* cache, const char* key, const char* path, int fd, const struct stat* st);
+static void				evictEntry(assetcache* cache, assetcacheEntry* entry);
+static void				touchEntry(assetcache* cache, assetcacheEntry* entry);
+static assetbuf*		newBuffer(size_t size);
+static void				unrefBuffer(assetbuf* buf);
+static void				releaseBuffer(const void* data, size_t datalen, void* extra);
+static assetbuf*		buildHeader(assetcacheEntry* entry, const char* mimetype, const char* encoding, size_t size, const char* etag);
+static assetbuf*		gzipBuffer(const assetbuf* src);
+static bool				matchEtag(const char* ifnonematch, const char* etag);
+
+/**
+* Create an in-memory asset cache in front of a static file mount.
+*
+* Small files under the mount are served from memory, everything else is
+* escalated to the next hook, so staticFileHandler() must be registered right
+* after this hook with the same staticfile object.
+*
+* @param sf static file mount to serve.
+* @param maxbytes memory cap of the cache. 0 for default.
+* @param maxfilesize maximum file size to cache. 0 for default.
+*
+* @code
+* staticfile* sf = staticFileNew("/assets", "/var/www/assets", 0);
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, assetCacheHandler, assetCacheNew(sf, 0, 0));
+* serverRegisterHook(webserver, staticFileHandler, sf);
+* @endcode
+*/
+assetcache* assetCacheNew(staticfile* sf, size_t maxbytes, size_t maxfilesize) {
+
+	if (sf == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	assetcache* cache = NEW(assetcache);
+
+	if (cache == NULL) return NULL;
+
+	cache->sf			= sf;
+	cache->maxbytes		= (maxbytes > 0) ? maxbytes : ASSETCACHE_DEF_MAXBYTES;
+	cache->maxfilesize	= (maxfilesize > 0) ? maxfilesize : ASSETCACHE_DEF_MAXFILESIZE;
+	cache->entries		= ahashtable(0, 0);
+
+	if (cache->entries == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/**
+* Release the cache. Buffers still referenced by out-buffers are released
+* when they are sent.
+*/
+void assetCacheFree(assetcache* cache) {
+
+	if (cache == NULL) return;
+
+	while (cache->first) evictEntry(cache, cache->first);
+
+	cache->entries->free(cache->entries);
+
+	free(cache);
+}
+
+/**
+* Asset cache hook.
+*
+* @note
+* This hook must be registered after httpHandler and before staticFileHandler.
+*/
+int assetCacheHandler(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) {
+		return OK;
+	}
+
+	assetcache* cache	= (assetcache*) userdata;
+	http* ahttp			= (http*) connectionGetExtra(conn);
+
+	if (!staticFileMatch(cache->sf, ahttp->request.path)) {
+		return OK;
+	}
+
+	bool head = !strcmp(ahttp->request.method, "HEAD");
+
+	if (!head && strcmp(ahttp->request.method, "GET")) {
+		return OK;
+	}
+
+	// ranges are left to staticfile.
+	if (httpGetRequestHeader(conn, "Range") != NULL) {
+		return OK;
+	}
+
+	char filepath[PATH_MAX + 1];
+
+	if (staticFileMapPath(cache->sf, ahttp->request.path, filepath, sizeof(filepath)) != 0) {
+		return OK;
+	}
+
+	assetcacheEntry* entry = lookupEntry(cache, filepath);
+
+	if (entry == NULL) {
+		return OK;
+	}
+
+	// pick a variant
+	bool gzip				= (entry->gzbody != NULL && httpAcceptsEncoding(conn, "gzip"));
+	const assetbuf* body	= (gzip) ? entry->gzbody : entry->body;
+	const assetbuf* header	= (gzip) ? entry->gzheader : entry->header;
+	const char* etag		= (gzip) ? entry->gzetag : entry->etag;
+
+	if (httpGetResponseHeader(conn, "Connection") == NULL) {
+
+		httpSetResponseHeader(conn, "Connection", (httpIsKeepaliveRequest(conn)) ? "Keep-Alive" : "close");
+	}
+
+	// conditional request
+	const char* ifnonematch = httpGetRequestHeader(conn, "If-None-Match");
+
+	if (ifnonematch != NULL && matchEtag(ifnonematch, etag)) {
+
+		httpSetResponseHeader(conn, "ETag", etag);
+
+		if (entry->gzbody != NULL) {
+			httpSetResponseHeader(conn, "Vary", "Accept-Encoding");
+		}
+
+		httpSetResponseCode(conn, HTTP_CODE_NOT_MODIFIED, httpGetReason(HTTP_CODE_NOT_MODIFIED));
+		httpSendHeader(conn);
+
+		return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+	}
+
+	httpSetResponseCode(conn, HTTP_CODE_OK, httpGetReason(HTTP_CODE_OK));
+	httpSendHeaderBlock(conn, header->data, header->size, body->size);
+
+	if (!head && body->size > 0) {
+
+		// out-buffer holds a reference until the data is written out.
+		__sync_add_and_fetch(&((assetbuf*) body)->refcount, 1);
+
+		if (httpSendDataRef(conn, body->data, body->size, releaseBuffer, (void*) body) == 0) {
+
+			ERROR("Failed to add asset to out-buffer. (%s)", entry->path);
+			return CLOSE;
+		}
+	}
+
+	return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+}
+
+// private functions
+
+/**
+* Find cached asset or load it.
+*
+* @return entry or NULL if the file is not cacheable.
+*/
+static assetcacheEntry* lookupEntry(assetcache* cache, const char* path) {
+
+	assetcacheEntry** found = (assetcacheEntry**) cache->entries->get(cache->entries, path, NULL, false);
+	time_t now = time(NULL);
+
+	if (found != NULL && now - (*found)->checked < ASSETCACHE_DEF_VALIDITY) {
+		touchEntry(cache, *found);
+		cache->hits++;
+		return *found;
+	}
+
+	// resolve directory index. staticFileOpen() refuses links leading out of the docroot
+	// through any component, the file and its index alike.
+	char filepath[PATH_MAX + 1];
+	struct stat st;
+
+	snprintf(filepath, sizeof(filepath), "%s", path);
+
+	int fd = staticFileOpen(cache->sf, filepath);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) close(fd);
+		if (found != NULL) evictEntry(cache, *found);
+		return NULL;
+	}
+
+	if (S_ISDIR(st.st_mode) && cache->sf->index != NULL) {
+
+		size_t len = strlen(filepath);
+
+		close(fd);
+
+		if (snprintf(filepath + len, sizeof(filepath) - len, "/%s", cache->sf->index) >= (int) (sizeof(filepath) - len)) {
+			return NULL;
+		}
+
+		if ((fd = staticFileOpen(cache->sf, filepath)) < 0 || fstat(fd, &st) != 0) {
+			if (fd >= 0) close(fd);
+			if (found != NULL) evictEntry(cache, *found);
+			return NULL;
+		}
+	}
+
+	if (found != NULL) {
+
+		assetcacheEntry* entry = *found;
+
+		if (st.st_ino == entry->st.st_ino && st.st_size == entry->st.st_size && st.st_mtime == entry->st.st_mtime) {
+			close(fd);
+			entry->checked = now;
+			touchEntry(cache, entry);
+			cache->hits++;
+			return entry;
+		}
+
+		DEBUG("Stale asset. %s", path);
+		evictEntry(cache, entry);
+	}
+
+	if (!S_ISREG(st.st_mode) || (size_t) st.st_size > cache->maxfilesize || (size_t) st.st_size > cache->maxbytes / 2) {
+		close(fd);
+		return NULL;
+	}
+
+	return loadEntry(cache, path, filepath, fd, &st);
+}
+
+/**
+* Read the file into a new entry, fd is closed either way.
+*/
+static assetcacheEntry* loadEntry(assetcache* cache, const char* key, const char* path, int fd, const struct stat* st) {
+
+	assetcacheEntry* entry = NEW(assetcacheEntry);
+
+	if (entry == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	entry->path = strdup(key);
+	entry->body = newBuffer(st->st_size);
+
+	if (entry->path == NULL || entry->body == NULL) goto error;
+
+	// load whole file
+	size_t total = 0;
+
+	while (total < entry->body->size) {
+
+		ssize_t n = read(fd, entry->body->data + total, entry->body->size - total);
+
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) goto error;
+
+		total += n;
+	}
+
+	close(fd);
+	fd = -1;
+
+	memcpy(&entry->st, st, sizeof(struct stat));
+	entry->checked = time(NULL);
+
+	// strong entity tag from the content, FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < entry->body->size; i++) {
+		hash ^= (unsigned char) entry->body->data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	snprintf(entry->etag, sizeof(entry->etag), "\"%016jx\"", (uintmax_t) hash);
+	snprintf(entry->gzetag, sizeof(entry->gzetag), "\"%016jx-gz\"", (uintmax_t) hash);
+
+	// precompressed variant, kept only when it saves at least 10%.
+	const char* mimetype = staticFileGetMimetype(path);
+
+	if (entry->body->size >= ASSETCACHE_MIN_GZIPSIZE && compressIsCompressible(mimetype)) {
+
+		entry->gzbody = gzipBuffer(entry->body);
+
+		if (entry->gzbody != NULL && entry->gzbody->size > entry->body->size / 10 * 9) {
+			unrefBuffer(entry->gzbody);
+			entry->gzbody = NULL;
+		}
+	}
+
+	entry->header = buildHeader(entry, mimetype, NULL, entry->body->size, entry->etag);
+	if (entry->header == NULL) goto error;
+
+	if (entry->gzbody != NULL) {
+		entry->gzheader = buildHeader(entry, mimetype, "gzip", entry->gzbody->size, entry->gzetag);
+		if (entry->gzheader == NULL) goto error;
+	}
+
+	entry->numbytes = sizeof(assetcacheEntry) + strlen(entry->path) + entry->body->size + entry->header->size
+		+ ((entry->gzbody) ? entry->gzbody->size + entry->gzheader->size : 0);
+
+	// make room
+	while (cache->last != NULL && cache->numbytes + entry->numbytes > cache->maxbytes) {
+		evictEntry(cache, cache->last);
+	}
+
+	cache->entries->put(cache->entries, entry->path, &entry, sizeof(assetcacheEntry*));
+
+	entry->prev = NULL;
+	entry->next = cache->first;
+
+	if (cache->first) cache->first->prev = entry;
+	else cache->last = entry;
+
+	cache->first		= entry;
+	cache->numbytes		+= entry->numbytes;
+	cache->misses++;
+
+	DEBUG("Cached asset. %s (size:%zu, gzip:%zu, total:%zu)", path, entry->body->size,
+		(entry->gzbody) ? entry->gzbody->size : 0, cache->numbytes);
+
+	return entry;
+
+	error:
+		if (fd >= 0) close(fd);
+		if (entry->path) free(entry->path);
+		if (entry->body) unrefBuffer(entry->body);
+		if (entry->header) unrefBuffer(entry->header);
+		if (entry->gzbody) unrefBuffer(entry->gzbody);
+		free(entry);
+		return NULL;
+}
+
+static void evictEntry(assetcache* cache, assetcacheEntry* entry) {
+
+	cache->entries->remove(cache->entries, entry->path);
+
+	if (entry->prev) entry->prev->next = entry->next;
+	else cache->first = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->last = entry->prev;
+
+	cache->numbytes -= entry->numbytes;
+
+	// buffers live on while out-buffers still reference them.
+	unrefBuffer(entry->body);
+	unrefBuffer(entry->header);
+
+	if (entry->gzbody) unrefBuffer(entry->gzbody);
+
+	if (entry->gzheader) unrefBuffer(entry->gzheader);
+
+	free(entry->path);
+	free(entry);
+}
+
+static void touchEntry(assetcache* cache, assetcacheEntry* entry) {
+
+	if (cache->first == entry) return;
+
+	entry->prev->next = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->last = entry->prev;
+
+	entry->prev			= NULL;
+	entry->next			= cache->first;
+	cache->first->prev	= entry;
+	cache->first		= entry;
+}
+
+static assetbuf* newBuffer(size_t size) {
+
+	assetbuf* buf = (assetbuf*) malloc(sizeof(assetbuf) + size);
+
+	if (buf == NULL) return NULL;
+
+	buf->refcount	= 1;
+	buf->size		= size;
+
+	return buf;
+}
+
+static void unrefBuffer(assetbuf* buf) {
+
+	if (__sync_sub_and_fetch(&buf->refcount, 1) == 0) {
+		free(buf);
+	}
+}
+
+static void releaseBuffer(const void* data, size_t datalen, void* extra) {
+
+	unrefBuffer((assetbuf*) extra);
+}
+
+/**
+* Build header lines of a variant, sent with httpSendHeaderBlock().
+*/
+static assetbuf* buildHeader(assetcacheEntry* entry, const char* mimetype, const char* encoding, size_t size, const char* etag) {
+
+	char lastmodified[32];
+	struct tm tm;
+
+	gmtime_r(&entry->st.st_mtime, &tm);
+	strftime(lastmodified, sizeof(lastmodified), HTTP_DATE_FORMAT, &tm);
+
+	char block[512];
+	int len = snprintf(block, sizeof(block),
+		"Content-Type: %s" HTTP_CRLF
+		"Content-Length: %zu" HTTP_CRLF
+		"Last-Modified: %s" HTTP_CRLF
+		"ETag: %s" HTTP_CRLF
+		"%s%s%s"
+		"%s",
+		mimetype, size, lastmodified, etag,
+		(encoding) ? "Content-Encoding: " : "", (encoding) ? encoding : "", (encoding) ? HTTP_CRLF : "",
+		(entry->gzbody) ? "Vary: Accept-Encoding" HTTP_CRLF : "");
+
+	if (len < 0 || len >= (int) sizeof(block)) return NULL;
+
+	assetbuf* buf = newBuffer(len);
+
+	if (buf == NULL) return NULL;
+
+	memcpy(buf->data, block, len);
+
+	return buf;
+}
+
+static assetbuf* gzipBuffer(const assetbuf* src) {
+
+	z_stream zs;
+	bzero((void*) &zs, sizeof(zs));
+
+	// windowBits + 16 writes gzip wrapper instead of zlib.
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	assetbuf* dst = newBuffer(deflateBound(&zs, src->size));
+
+	if (dst == NULL) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in		= (Bytef*) src->data;
+	zs.avail_in		= src->size;
+	zs.next_out		= (Bytef*) dst->data;
+	zs.avail_out	= dst->size;
+
+	int status = deflate(&zs, Z_FINISH);
+	dst->size = zs.total_out;
+	deflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		unrefBuffer(dst);
+		return NULL;
+	}
+
+	return dst;
+}
+
+static bool matchEtag(const char* ifnonematch, const char* etag) {
+
+	if (!strcmp(ifnonematch, "*")) return true;
+
+	size_t etaglen = strlen(etag);
+
+	for (const char* tag = strstr(ifnonematch, etag); tag != NULL; tag = strstr(tag + 1, etag)) {
+
+		char next = tag[etaglen];
+
+		if (next == '\0' || next == ',' || next == ' ' || next == '\t') return true;
+	}
+
+	return false;
+}
@@ -2,14 +2,30 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include "coder.h"
 #include "helper.h"
 #include "string.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// private functions
+static int		hexValue(unsigned char c);
+static paramSpan*	findSpan(paramview* pv, const char* name, int nth);
+static bool		spanNameEquals(const paramSpan* span, const char* name);
+static char*		decodeSpan(const char* str, size_t size);
+static bool		isPlainPathByte(unsigned char prev, unsigned char c);
+static size_t	pathPlainRun(const char* path, size_t from, size_t len, unsigned char prev);
+static size_t	closePathSegment(const char* path, size_t seg, size_t w);
+
 listtable* parseQueries(listtable* tbl, const char* query, char equalchar, char sepchar, int* count) {
 
 	if (tbl == NULL && (tbl = listTable(0)) == NULL) {
@@ -21,17 +37,14 @@ listtable* parseQueries(listtable* tbl, const char* query, char equalchar, char
 	}
 
 	int cnt			= 0;
-	char* newquery	= strdup(query);
+	paramview* pv	= paramViewNew(query, strlen(query), equalchar, sepchar);
 
-	while (newquery && *newquery) {
+	for (int i = 0; pv != NULL && i < pv->count; i++) {
 
-		char* value	= makeword(newquery, sepchar);
-		char* name	= strTrim(makeword(value, equalchar));
+		char* name	= strTrim(decodeSpan(pv->spans[i].name, pv->spans[i].namelen));
+		char* value	= decodeSpan(pv->spans[i].value, pv->spans[i].valuelen);
 
-		urlDecode(name);
-		urlDecode(value);
-
-		if (tbl->putstr(tbl, name, value) == true) {
+		if (name && value && tbl->putstr(tbl, name, value) == true) {
 			cnt++;
 		}
 
@@ -43,13 +56,474 @@ listtable* parseQueries(listtable* tbl, const char* query, char equalchar, char
 		*count = cnt;
 	}
 
-	free(newquery);
+	paramViewFree(pv);
 
 	return tbl;
 }
 
+/**
+* Record where the name=value pairs of str are, nothing is copied or decoded.
+*
+* @param str query string or form body, not required to be NUL terminated.
+* It must stay unchanged while the view is used.
+*
+* @return view to free with paramViewFree(), NULL on allocation failure.
+*/
+paramview* paramViewNew(const char* str, size_t size, char equalchar, char sepchar) {
+
+	paramview* pv = calloc(1, sizeof(paramview));
+
+	if (pv == NULL) return NULL;
+
+	pv->str		= str;
+	pv->size	= size;
+
+	const char* p	= str;
+	const char* end	= str + size;
+
+	while (p < end) {
+
+		const char* sep = memchr(p, sepchar, end - p);
+
+		if (sep == NULL) sep = end;
+
+		// skip empty pairs ex) a=1&&b=2
+		if (sep > p) {
+
+			if (pv->count == pv->capacity) {
+
+				int capacity	= (pv->capacity) ? pv->capacity * 2 : 16;
+				paramSpan* spans	= realloc(pv->spans, capacity * sizeof(paramSpan));
+
+				if (spans == NULL) {
+					paramViewFree(pv);
+					return NULL;
+				}
+
+				pv->spans		= spans;
+				pv->capacity	= capacity;
+			}
+
+			const char* eq	= memchr(p, equalchar, sep - p);
+			paramSpan* span	= &pv->spans[pv->count++];
+
+			span->name		= p;
+			span->namelen	= (eq) ? (size_t) (eq - p) : (size_t) (sep - p);
+			span->value		= (eq) ? eq + 1 : sep;
+			span->valuelen	= (eq) ? (size_t) (sep - eq - 1) : 0;
+		}
+
+		if (sep == end) break;
+
+		p = sep + 1;
+	}
+
+	return pv;
+}
+
+/**
+* @param name decoded name, NULL to count every pair.
+*
+* @return number of values the name has.
+*/
+int paramViewCount(paramview* pv, const char* name) {
+
+	if (pv == NULL) return 0;
+	if (name == NULL) return pv->count;
+
+	int cnt = 0;
+
+	for (int i = 0; i < pv->count; i++) {
+		if (spanNameEquals(&pv->spans[i], name)) cnt++;
+	}
+
+	return cnt;
+}
+
+/**
+* Get the value as it is in the viewed string, still encoded.
+*
+* @param nth which value of a repeated name, 0 for the first.
+* @param size length of the value is stored here, it is not NUL terminated.
+*
+* @return pointer into the viewed string, NULL if there is no such value.
+*/
+const char* paramViewGetRaw(paramview* pv, const char* name, int nth, size_t* size) {
+
+	paramSpan* span = findSpan(pv, name, nth);
+
+	if (span == NULL) return NULL;
+	if (size) *size = span->valuelen;
+
+	return span->value;
+}
+
+/**
+* Get the decoded value.
+*
+* @param nth which value of a repeated name, 0 for the first.
+*
+* @return malloced NUL terminated string, NULL if there is no such value.
+*/
+char* paramViewGet(paramview* pv, const char* name, int nth) {
+
+	paramSpan* span = findSpan(pv, name, nth);
+
+	if (span == NULL) return NULL;
+
+	return decodeSpan(span->value, span->valuelen);
+}
+
+void paramViewFree(paramview* pv) {
+
+	if (pv) {
+
+		if (pv->spans) free(pv->spans);
+
+		free(pv);
+	}
+}
+
+/**
+* Decode percent-encoded string in place, '+' turns into a space.
+*
+* Malformed escapes are kept as they are.
+*
+* @return length of the decoded string.
+*/
+size_t urlDecode(char* str) {
+
+	if (str == NULL) return 0;
+
+	// most names and values have nothing to decode.
+	size_t r = strcspn(str, "%+");
+
+	if (str[r] == '\0') return r;
+
+	size_t w = r;
+
+	for (; str[r] != '\0'; w++) {
+
+		if (str[r] == '+') {
+
+			str[w] = ' ';
+			r++;
+
+		} else if (str[r] == '%' && hexValue(str[r + 1]) >= 0 && hexValue(str[r + 2]) >= 0) {
+
+			str[w] = (char) ((hexValue(str[r + 1]) << 4) | hexValue(str[r + 2]));
+			r += 3;
+
+		} else {
+
+			str[w] = str[r++];
+		}
+	}
+
+	str[w] = '\0';
+
+	return w;
+}
+
+/**
+* Decode and normalize request path in place, in a single pass.
+*
+* Percent escapes are decoded, duplicate slashes collapsed, "." and ".."
+* segments resolved (".." never climbs above the root) and the trailing slash
+* removed. Runs that need none of this are skipped without copying.
+*
+* @return length of the normalized path, -1 when the path is not absolute, has
+* a malformed escape, a control character or one of \\:*?"<>|, or is too long.
+*/
+int urlNormalizePath(char* path) {
+
+	if (path == NULL || path[0] != '/') return -1;
+
+	size_t len	= strlen(path);
+	size_t r	= 1;	// read position
+	size_t w	= 1;	// write position, never ahead of r
+	size_t seg	= 1;	// start of the segment being written
+
+	for (;;) {
+
+		// copy the run that needs no attention, slashes in it start new segments.
+		size_t n = pathPlainRun(path, r, len, (unsigned char) path[w - 1]);
+
+		if (n > 0) {
+
+			if (w != r) memmove(path + w, path + r, n);
+
+			const char* slash = memrchr(path + w, '/', n);
+
+			if (slash != NULL) seg = slash - path + 1;
+
+			r += n;
+			w += n;
+		}
+
+		if (r >= len) break;
+
+		unsigned char c = (unsigned char) path[r];
+
+		if (c == '%') {
+
+			int hi = hexValue(path[r + 1]);
+			int lo = (hi >= 0) ? hexValue(path[r + 2]) : -1;
+
+			if (lo < 0) return -1;
+
+			c = (unsigned char) ((hi << 4) | lo);
+			r += 3;
+
+		} else {
+
+			r++;
+		}
+
+		if (c == '/') {
+
+			w = closePathSegment(path, seg, w);
+
+			if (path[w - 1] != '/') path[w++] = '/';
+
+			seg = w;
+			continue;
+		}
+
+		if (c < 0x20 || c == 0x7f || strchr("\\:*?\"<>|", c) != NULL) return -1;
+
+		path[w++] = (char) c;
+	}
+
+	w = closePathSegment(path, seg, w);
+
+	// take care of tailing slash
+	if (w > 1 && path[w - 1] == '/') w--;
+
+	path[w] = '\0';
+
+	if (w >= PATH_MAX) return -1;
+
+	// check folder name length, only a path longer than that can have a long one.
+	if (w > FILENAME_MAX) {
+
+		for (size_t i = 0, n = 0; i < w; i++) {
+
+			n = (path[i] == '/') ? 0 : n + 1;
+
+			if (n > FILENAME_MAX) return -1;
+		}
+	}
+
+	return (int) w;
+}
+
+/**
+* Encode binary data into base64 string.
+*
+* @return malloced NUL terminated string or NULL on failure.
+*/
+char* base64Encode(const void* bin, size_t size) {
+
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	const unsigned char* src	= (const unsigned char*) bin;
+	char* str					= malloc(((size + 2) / 3) * 4 + 1);
+
+	if (str == NULL) return NULL;
+
+	char* p = str;
+	size_t i;
+
+	for (i = 0; i + 3 <= size; i += 3) {
+		*p++ = table[src[i] >> 2];
+		*p++ = table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+		*p++ = table[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+		*p++ = table[src[i + 2] & 0x3f];
+	}
+
+	if (i < size) {
+
+		*p++ = table[src[i] >> 2];
+
+		if (i + 1 < size) {
+			*p++ = table[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+			*p++ = table[(src[i + 1] & 0x0f) << 2];
+		} else {
+			*p++ = table[(src[i] & 0x03) << 4];
+			*p++ = '=';
+		}
+
+		*p++ = '=';
+	}
+
+	*p = '\0';
+
+	return str;
+}
+
+// private functions
+
+static paramSpan* findSpan(paramview* pv, const char* name, int nth) {
+
+	if (pv == NULL || name == NULL || nth < 0) return NULL;
+
+	for (int i = 0; i < pv->count; i++) {
+		if (spanNameEquals(&pv->spans[i], name) && nth-- == 0) return &pv->spans[i];
+	}
+
+	return NULL;
+}
+
+/**
+* Compare the raw name with a decoded one, decoding as it goes.
+*/
+static bool spanNameEquals(const paramSpan* span, const char* name) {
+
+	const unsigned char* r		= (const unsigned char*) span->name;
+	const unsigned char* end	= r + span->namelen;
+
+	for (; r < end; name++) {
+
+		int c = *r;
+
+		if (c == '+') {
+
+			c = ' ';
+			r++;
+
+		} else if (c == '%' && end - r >= 3 && hexValue(r[1]) >= 0 && hexValue(r[2]) >= 0) {
+
+			c = (hexValue(r[1]) << 4) | hexValue(r[2]);
+			r += 3;
+
+		} else {
+
+			r++;
+		}
+
+		if (*name == '\0' || (unsigned char) *name != c) return false;
+	}
+
+	return (*name == '\0');
+}
+
+/**
+* @return malloced decoded copy of the span.
+*/
+static char* decodeSpan(const char* str, size_t size) {
+
+	char* decoded = strndup(str, size);
+
+	if (decoded) urlDecode(decoded);
+
+	return decoded;
+}
+
+/**
+* @return value of hexadecimal digit, -1 if c is not one.
+*/
+static int hexValue(unsigned char c) {
+
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+	return -1;
+}
+
+/**
+* A byte urlNormalizePath() keeps as is: not an escape, not illegal, and not
+* a slash or dot which may start a "//", "." or ".." after prev.
+*/
+static bool isPlainPathByte(unsigned char prev, unsigned char c) {
+
+	if (c == '%' || c < 0x20 || c == 0x7f) return false;
+	if (c == '\\' || c == ':' || c == '*' || c == '?' || c == '"' || c == '<' || c == '>' || c == '|') return false;
+	if (prev == '/' && (c == '/' || c == '.')) return false;
+	if (prev == '.' && c == '/') return false;
+
+	return true;
+}
+
+/**
+* Length of the plain run at path + from. The first byte is checked against
+* prev, the byte already written before it, the rest against the bytes in
+* front of them which get copied along.
+*/
+static size_t pathPlainRun(const char* path, size_t from, size_t len, unsigned char prev) {
+
+	const unsigned char* p = (const unsigned char*) path;
+	size_t i = from;
+
+	if (i >= len || isPlainPathByte(prev, p[i]) == false) return 0;
+
+	i++;
+
+#if defined(__SSE2__)
+	const __m128i pct	= _mm_set1_epi8('%');
+	const __m128i slash	= _mm_set1_epi8('/');
+	const __m128i dot	= _mm_set1_epi8('.');
+	const __m128i del	= _mm_set1_epi8(0x7f);
+	const __m128i ctl	= _mm_set1_epi8(0x1f);
+	const __m128i zero	= _mm_setzero_si128();
+	const __m128i ill[]	= {
+		_mm_set1_epi8('\\'), _mm_set1_epi8(':'), _mm_set1_epi8('*'), _mm_set1_epi8('?'),
+		_mm_set1_epi8('"'), _mm_set1_epi8('<'), _mm_set1_epi8('>'), _mm_set1_epi8('|'),
+	};
+
+	for (; i + 16 <= len; i += 16) {
+
+		__m128i cur		= _mm_loadu_si128((const __m128i*) (p + i));
+		__m128i before	= _mm_loadu_si128((const __m128i*) (p + i - 1));
+
+		// unsigned cur <= 0x1f
+		__m128i bad = _mm_cmpeq_epi8(_mm_subs_epu8(cur, ctl), zero);
+
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(cur, pct));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi8(cur, del));
+
+		for (size_t k = 0; k < sizeof(ill) / sizeof(ill[0]); k++) {
+			bad = _mm_or_si128(bad, _mm_cmpeq_epi8(cur, ill[k]));
+		}
+
+		__m128i curslash	= _mm_cmpeq_epi8(cur, slash);
+		__m128i curdot		= _mm_cmpeq_epi8(cur, dot);
+
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(before, slash), _mm_or_si128(curslash, curdot)));
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(before, dot), curslash));
+
+		int mask = _mm_movemask_epi8(bad);
+
+		if (mask != 0) return i + __builtin_ctz(mask) - from;
+	}
+#endif
+
+	for (; i < len && isPlainPathByte(p[i - 1], p[i]); i++);
+
+	return i - from;
+}
+
+/**
+* Drop the segment at seg when it is "." or "..", the one before it too for "..".
+*
+* @return new write position.
+*/
+static size_t closePathSegment(const char* path, size_t seg, size_t w) {
+
+	size_t n = w - seg;
 
+	if (n == 1 && path[seg] == '.') return seg;
 
+	if (n == 2 && path[seg] == '.' && path[seg + 1] == '.') {
 
+		// "/.." stays at the root.
+		if (seg <= 1) return 1;
 
+		for (w = seg - 1; path[w - 1] != '/'; w--);
 
+		return w;
+	}
+
+	return w;
+}
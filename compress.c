@@ -0,0 +1,261 @@
+/**
+ * @abstruct response compression module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "compress.h"
+
+#define COMPRESS_RESERVE_SIZE	(16 * 1024)	// out-buffer space reserved per deflate() call
+
+// idle streams of a thread
+struct compressorPool_t {
+	compressor*	idle[COMPRESS_NUM_ENCODINGS];
+	int			numidle[COMPRESS_NUM_ENCODINGS];
+};
+
+typedef struct compressorPool_t compressorPool;
+
+static pthread_key_t	poolkey;
+static pthread_once_t	poolonce = PTHREAD_ONCE_INIT;
+
+// private functions
+static void				createPoolKey(void);
+static compressorPool*	getPool(void);
+static void				freePool(void* userdata);
+static void				freeCompressor(compressor* c);
+
+/**
+* Get a deflate stream from the pool of calling thread.
+*
+* deflateInit2() is paid only when the pool is empty, otherwise an idle
+* stream is reset and reused.
+*
+* @return compressor or NULL on failure.
+*/
+compressor* compressorGet(enum compress_encoding_e encoding, int level) {
+
+	if (encoding <= COMPRESS_NONE || encoding >= COMPRESS_NUM_ENCODINGS) return NULL;
+
+	compressorPool* pool = getPool();
+
+	if (pool != NULL && pool->idle[encoding] != NULL) {
+
+		compressor* c = pool->idle[encoding];
+
+		pool->idle[encoding] = c->next;
+		pool->numidle[encoding]--;
+		c->next = NULL;
+
+		if (c->level != level) {
+
+			if (deflateParams(&c->zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+				freeCompressor(c);
+				return NULL;
+			}
+
+			c->level = level;
+		}
+
+		return c;
+	}
+
+	compressor* c = NEW(compressor);
+
+	if (c == NULL) return NULL;
+
+	// windowBits + 16 writes gzip wrapper, plain windowBits writes zlib wrapper for "deflate".
+	int windowbits = (encoding == COMPRESS_GZIP) ? MAX_WBITS + 16 : MAX_WBITS;
+
+	if (deflateInit2(&c->zs, level, Z_DEFLATED, windowbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(c);
+		return NULL;
+	}
+
+	if ((c->buf = evbuffer_new()) == NULL) {
+		deflateEnd(&c->zs);
+		free(c);
+		return NULL;
+	}
+
+	c->encoding	= encoding;
+	c->level	= level;
+
+	return c;
+}
+
+/**
+* Return a stream to the pool of calling thread.
+*/
+void compressorRelease(compressor* c) {
+
+	if (c == NULL) return;
+
+	compressorPool* pool = getPool();
+
+	if (pool == NULL || pool->numidle[c->encoding] >= COMPRESS_POOL_SIZE || deflateReset(&c->zs) != Z_OK) {
+		freeCompressor(c);
+		return;
+	}
+
+	evbuffer_drain(c->buf, evbuffer_get_length(c->buf));
+
+	c->next						= pool->idle[c->encoding];
+	pool->idle[c->encoding]		= c;
+	pool->numidle[c->encoding]++;
+}
+
+/**
+* Compress data and append the output to the buffer.
+*
+* Output is deflated directly into space reserved in the buffer.
+*
+* @param flush Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH.
+*
+* @return 0 on success, -1 on error.
+*/
+int compressorWrite(compressor* c, struct evbuffer* out, const void* data, size_t size, int flush) {
+
+	c->zs.next_in	= (Bytef*) data;
+	c->zs.avail_in	= size;
+
+	for (;;) {
+
+		struct evbuffer_iovec vec;
+
+		if (evbuffer_reserve_space(out, COMPRESS_RESERVE_SIZE, &vec, 1) < 1) return -1;
+
+		c->zs.next_out	= (Bytef*) vec.iov_base;
+		c->zs.avail_out	= vec.iov_len;
+
+		int status = deflate(&c->zs, flush);
+
+		vec.iov_len -= c->zs.avail_out;
+
+		if (evbuffer_commit_space(out, &vec, 1)) return -1;
+
+		if (status == Z_STREAM_ERROR) return -1;
+
+		// Z_BUF_ERROR only means there was nothing to do.
+		if (status == Z_STREAM_END || status == Z_BUF_ERROR) break;
+
+		if (c->zs.avail_out != 0 && c->zs.avail_in == 0) break;
+	}
+
+	return 0;
+}
+
+/**
+* @return content-coding name for Content-Encoding header.
+*/
+const char* compressGetEncodingName(enum compress_encoding_e encoding) {
+
+	switch (encoding) {
+		case COMPRESS_GZIP:
+			return "gzip";
+
+		case COMPRESS_DEFLATE:
+			return "deflate";
+
+		default:
+			return "identity";
+	}
+}
+
+/**
+* Check whether the content type is worth compressing.
+*
+* Already compressed formats such as images, video and archives only get
+* bigger and cost CPU.
+*/
+bool compressIsCompressible(const char* contenttype) {
+
+	if (contenttype == NULL) return false;
+
+	// ignore parameters ex) text/html; charset=utf-8
+	size_t len = strcspn(contenttype, "; \t");
+
+	static const char* types[] = {
+		"application/javascript",
+		"application/json",
+		"application/xml",
+		"application/xhtml+xml",
+		"application/wasm",
+		"application/x-www-form-urlencoded",
+		"image/svg+xml",
+		"image/x-icon",
+		"font/ttf",
+		NULL
+	};
+
+	if (len > STRLEN("text/") && !strncasecmp(contenttype, "text/", STRLEN("text/"))) return true;
+
+	for (int i = 0; types[i] != NULL; i++) {
+		if (strlen(types[i]) == len && !strncasecmp(contenttype, types[i], len)) return true;
+	}
+
+	// structured syntax suffixes ex) application/problem+json
+	if (len > STRLEN("+json") && !strncasecmp(contenttype + len - STRLEN("+json"), "+json", STRLEN("+json"))) return true;
+	if (len > STRLEN("+xml") && !strncasecmp(contenttype + len - STRLEN("+xml"), "+xml", STRLEN("+xml"))) return true;
+
+	return false;
+}
+
+// private functions
+
+static void createPoolKey(void) {
+
+	pthread_key_create(&poolkey, freePool);
+}
+
+static compressorPool* getPool(void) {
+
+	pthread_once(&poolonce, createPoolKey);
+
+	compressorPool* pool = (compressorPool*) pthread_getspecific(poolkey);
+
+	if (pool == NULL) {
+
+		pool = NEW(compressorPool);
+
+		if (pool == NULL || pthread_setspecific(poolkey, pool)) {
+			if (pool) free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+static void freePool(void* userdata) {
+
+	compressorPool* pool = (compressorPool*) userdata;
+
+	for (int i = 0; i < COMPRESS_NUM_ENCODINGS; i++) {
+
+		compressor* c;
+
+		while ((c = pool->idle[i]) != NULL) {
+			pool->idle[i] = c->next;
+			freeCompressor(c);
+		}
+	}
+
+	free(pool);
+}
+
+static void freeCompressor(compressor* c) {
+
+	deflateEnd(&c->zs);
+	evbuffer_free(c->buf);
+	free(c);
+}
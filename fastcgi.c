@@ -0,0 +1,1174 @@
+/**
+ * @abstruct FastCGI client module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "http2.h"
+#include "fastcgi.h"
+
+// private functions
+static void				startRequest(fastcgiRequest* req);
+static void				dispatchWaiting(fastcgi* fcgi);
+static void				finishRequest(fastcgiRequest* req);
+static void				failRequest(fastcgiRequest* req, int code);
+static void				freeRequest(fastcgiRequest* req);
+static fastcgiConn*		newConn(fastcgi* fcgi);
+static void				failConn(fastcgiConn* fconn, int code);
+static void				releaseSlot(fastcgiConn* fconn, uint16_t id);
+static void				sendBeginRequest(fastcgiRequest* req);
+static void				sendParams(fastcgiRequest* req);
+static void				sendGetValues(fastcgiConn* fconn);
+static void				forwardStdin(fastcgiRequest* req);
+static void				writeRecordHeader(uint8_t* p, uint8_t type, uint16_t id, uint16_t len);
+static int				writeBytes(fastcgiRecord* rec, const void* data, size_t size, bool cginame);
+static int				writePair(fastcgiRecord* rec, const char* name, bool header, const char* value, const char* value2);
+static int				closeRecord(fastcgiRecord* rec);
+static void				readRecords(fastcgiConn* fconn);
+static void				handleStdout(fastcgiConn* fconn, fastcgiRequest* req, struct evbuffer* in, size_t size);
+static int				parseResponseHeader(fastcgiRequest* req);
+static void				handleEndRequest(fastcgiConn* fconn, fastcgiRequest* req, const uint8_t* body);
+static void				handleGetValuesResult(fastcgiConn* fconn, const uint8_t* body, size_t size);
+static bool				isKeepalive(connection* conn);
+static void				backendReadCallback(struct bufferevent* buffer, void* userdata);
+static void				backendWriteCallback(struct bufferevent* buffer, void* userdata);
+static void				backendEventCallback(struct bufferevent* buffer, short what, void* userdata);
+
+/**
+* Create a FastCGI client.
+*
+* Requests are translated to FastCGI responder requests on persistent
+* connections to the backend. Several requests share one connection when the
+* backend reports FCGI_MPXS_CONNS, otherwise each connection carries one
+* request at a time.
+*
+* @param prefix url prefix to forward, ex) "/app". NULL forwards every request.
+* @param address "unix:/path/to/socket" or numeric "host:port".
+* @param root document root SCRIPT_FILENAME is built from. NULL for none.
+*
+* @code
+* fastcgi* fcgi = fastcgiNew("/php", "unix:/run/php-fpm.sock", "/var/www");
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, fastcgiHandler, fcgi);
+* @endcode
+*
+* @return client or NULL on failure.
+*/
+fastcgi* fastcgiNew(const char* prefix, const char* address, const char* root) {
+
+	fastcgi* fcgi = NEW(fastcgi);
+
+	if (fcgi == NULL) return NULL;
+
+	fcgi->maxconns	= FASTCGI_DEF_MAX_CONNS;
+	fcgi->timeout	= FASTCGI_DEF_TIMEOUT;
+	fcgi->address	= strdup(address);
+
+	if (prefix != NULL) {
+		fcgi->prefix	= strdup(prefix);
+		fcgi->prefixlen	= strlen(prefix);
+	}
+
+	if (root != NULL) fcgi->root = strdup(root);
+
+	if (fcgi->address == NULL
+	|| (prefix != NULL && fcgi->prefix == NULL) || (root != NULL && fcgi->root == NULL)) {
+		fastcgiFree(fcgi);
+		return NULL;
+	}
+
+	if (!strncmp(address, "unix:", STRLEN("unix:"))) {
+
+		struct sockaddr_un* sun	= (struct sockaddr_un*) &fcgi->addr;
+		const char* path		= address + STRLEN("unix:");
+
+		if (strlen(path) == 0 || strlen(path) >= sizeof(sun->sun_path)) {
+			fastcgiFree(fcgi);
+			errno = EINVAL;
+			return NULL;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, path);
+		fcgi->addrlen = sizeof(struct sockaddr_un);
+
+	} else {
+
+		fcgi->addrlen = sizeof(fcgi->addr);
+
+		if (evutil_parse_sockaddr_port(address, (struct sockaddr*) &fcgi->addr, &fcgi->addrlen)) {
+			WARN("Invalid FastCGI address. %s", address);
+			fastcgiFree(fcgi);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	return fcgi;
+}
+
+void fastcgiSetMaxConns(fastcgi* fcgi, int maxconns) {
+
+	fcgi->maxconns = (maxconns > 0) ? maxconns : 1;
+}
+
+/**
+* @param timeout seconds the backend may stay silent while serving requests, 0 for none.
+*/
+void fastcgiSetTimeout(fastcgi* fcgi, int timeout) {
+
+	fcgi->timeout = timeout;
+}
+
+/**
+* Release the client. Must not be called while requests are in flight.
+*/
+void fastcgiFree(fastcgi* fcgi) {
+
+	if (fcgi == NULL) return;
+
+	while (fcgi->conns != NULL) {
+
+		fastcgiConn* fconn = fcgi->conns;
+
+		fcgi->conns = fconn->next;
+
+		bufferevent_free(fconn->buffer);
+		free(fconn);
+	}
+
+	if (fcgi->prefix)	free(fcgi->prefix);
+	if (fcgi->address)	free(fcgi->address);
+	if (fcgi->root)		free(fcgi->root);
+
+	free(fcgi);
+}
+
+/**
+* FastCGI hook.
+*
+* Requests with Content-Length are forwarded as soon as the header is in and
+* their body follows as FCGI_STDIN records as it arrives. Chunked requests
+* are forwarded once complete, CGI needs CONTENT_LENGTH up front.
+*
+* @note
+* This hook must be registered after httpHandler. Connections are bound to
+* one event loop, use one client per server.
+*/
+int fastcgiHandler(short event, connection* conn, void* userdata) {
+
+	fastcgi* fcgi = (fastcgi*) userdata;
+
+	if (event & EVENT_CLOSE) {
+
+		fastcgiRequest* req = (fastcgiRequest*) connectionGetHookData(conn, fcgi);
+
+		if (req != NULL) freeRequest(req);
+
+		return OK;
+	}
+
+	fastcgiRequest* req = (fastcgiRequest*) connectionGetHookData(conn, fcgi);
+
+	if (req != NULL) {
+
+		if (req->done) return req->result;
+
+		if (event & EVENT_WRITE) {
+
+			// client caught up, read the rest of the response.
+			fastcgiConn* fconn = req->fconn;
+
+			if (fconn != NULL && fconn->paused) {
+
+				fconn->paused = false;
+				bufferevent_enable(fconn->buffer, EV_READ);
+				readRecords(fconn);
+			}
+
+		} else if (event & EVENT_READ) {
+
+			forwardStdin(req);
+		}
+
+		return (req->done) ? req->result : TAKEOVER;
+	}
+
+	if (!(event & EVENT_READ) || conn->protocol != NULL) {
+		return OK;
+	}
+
+	http* ahttp							= (http*) connectionGetExtra(conn);
+	enum http_request_status_e status	= httpGetStatus(conn);
+
+	// wait for the whole body unless its length is known.
+	if (status != HTTP_REQ_DONE && (status != HTTP_REQ_HEADER_DONE || ahttp->request.contentlength < 0
+	|| httpGetRequestHeader(conn, "Transfer-Encoding") != NULL)) {
+		return OK;
+	}
+
+	const char* path = ahttp->request.path;
+
+	if (fcgi->prefix != NULL && (path == NULL || strncmp(path, fcgi->prefix, fcgi->prefixlen)
+	|| (path[fcgi->prefixlen] != '/' && path[fcgi->prefixlen] != '\0'))) {
+		return OK;
+	}
+
+	if ((req = NEW(fastcgiRequest)) == NULL) return CLOSE;
+
+	if ((req->header = evbuffer_new()) == NULL) {
+		free(req);
+		return CLOSE;
+	}
+
+	req->fcgi	= fcgi;
+	req->conn	= conn;
+	req->head	= !strcmp(ahttp->request.method, "HEAD");
+
+	if (connectionSetHookData(conn, fcgi, req) < 0) {
+		evbuffer_free(req->header);
+		free(req);
+		return CLOSE;
+	}
+
+	if (fcgi->evbase == NULL) fcgi->evbase = conn->webserver->evbase;
+
+	fcgi->requests++;
+
+	if (status != HTTP_REQ_DONE) httpSetBodyStreaming(conn, true);
+
+	req->inhook = true;
+	startRequest(req);
+	req->inhook = false;
+
+	return (req->done) ? req->result : TAKEOVER;
+}
+
+// private functions
+
+/**
+* Put the request on a connection with a free request id, open a new one if
+* allowed, or queue it until a request id frees up.
+*/
+static void startRequest(fastcgiRequest* req) {
+
+	fastcgi* fcgi		= req->fcgi;
+	fastcgiConn* fconn	= NULL;
+
+	for (fastcgiConn* c = fcgi->conns; c != NULL; c = c->next) {
+		if (c->numreqs < c->maxreqs) {
+			fconn = c;
+			break;
+		}
+	}
+
+	if (fconn == NULL && fcgi->numconns < fcgi->maxconns) {
+
+		if ((fconn = newConn(fcgi)) == NULL) {
+			fcgi->failures++;
+			failRequest(req, HTTP_CODE_BAD_GATEWAY);
+			return;
+		}
+	}
+
+	if (fconn == NULL) {
+
+		if (fcgi->waitlast) fcgi->waitlast->next = req;
+		else fcgi->waitfirst = req;
+
+		fcgi->waitlast = req;
+		return;
+	}
+
+	int slot = 0;
+	while (fconn->reqs[slot] != NULL) slot++;
+
+	if (fconn->numreqs > 0) fcgi->multiplexed++;
+
+	fconn->reqs[slot]	= req;
+	req->fconn			= fconn;
+	req->id				= slot + 1;
+
+	// the backend is silent only while it works on something.
+	if (fconn->numreqs++ == 0 && fcgi->timeout > 0) {
+		struct timeval tv = { fcgi->timeout, 0 };
+		bufferevent_set_timeouts(fconn->buffer, &tv, &tv);
+	}
+
+	sendBeginRequest(req);
+	sendParams(req);
+	forwardStdin(req);
+}
+
+static void dispatchWaiting(fastcgi* fcgi) {
+
+	while (fcgi->waitfirst != NULL) {
+
+		fastcgiRequest* req = fcgi->waitfirst;
+
+		// stop once nothing is free, the request went back to the queue.
+		bool available = (fcgi->numconns < fcgi->maxconns);
+
+		for (fastcgiConn* c = fcgi->conns; c != NULL && !available; c = c->next) {
+			available = (c->numreqs < c->maxreqs);
+		}
+
+		if (!available) return;
+
+		fcgi->waitfirst = req->next;
+		if (fcgi->waitfirst == NULL) fcgi->waitlast = NULL;
+		req->next = NULL;
+
+		startRequest(req);
+	}
+}
+
+/**
+* Exchange is over, let the hook chain finish the client request.
+*/
+static void finishRequest(fastcgiRequest* req) {
+
+	connection* conn = req->conn;
+
+	req->done	= true;
+	req->result	= isKeepalive(conn) ? DONE : CLOSE;
+
+	if (req->paused) {
+		req->paused = false;
+		bufferevent_enable(conn->buffer, EV_READ);
+	}
+
+	// streams are done when their body ends, only HTTP/1.x needs a nudge.
+	if (!req->inhook) connectionResume(conn);
+}
+
+/**
+* Answer with an error, or cut the response short if its header is out.
+*/
+static void failRequest(fastcgiRequest* req, int code) {
+
+	connection* conn = req->conn;
+
+	if (req->headersent) {
+
+		req->done	= true;
+		req->result	= CLOSE;
+
+		if (conn->parent != NULL) {
+			http2ResetStream((http*) connectionGetExtra(conn));
+		} else {
+			connectionClose(conn);
+		}
+
+		return;
+	}
+
+	const char* reason = httpGetReason(code);
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", isKeepalive(conn) ? "Keep-Alive" : "close");
+	}
+
+	httpResponse(conn, code, "text/plain", reason, strlen(reason));
+
+	finishRequest(req);
+}
+
+/**
+* Client is gone. A request the backend still works on is aborted and kept
+* until its FCGI_END_REQUEST arrives, its request id is not free before that.
+*/
+static void freeRequest(fastcgiRequest* req) {
+
+	fastcgi* fcgi = req->fcgi;
+
+	connectionSetHookData(req->conn, fcgi, NULL);
+
+	req->conn = NULL;
+
+	if (req->fconn != NULL) {
+
+		if (!req->done) {
+
+			uint8_t record[FCGI_HEADER_LEN];
+
+			writeRecordHeader(record, FCGI_ABORT_REQUEST, req->id, 0);
+			bufferevent_write(req->fconn->buffer, record, sizeof(record));
+		}
+
+		return;
+	}
+
+	// still waiting for a request id.
+	for (fastcgiRequest** p = &fcgi->waitfirst; *p != NULL; p = &(*p)->next) {
+
+		if (*p == req) {
+
+			*p = req->next;
+
+			if (fcgi->waitlast == req) {
+				fcgi->waitlast = NULL;
+				for (fastcgiRequest* r = fcgi->waitfirst; r != NULL; r = r->next) fcgi->waitlast = r;
+			}
+
+			break;
+		}
+	}
+
+	evbuffer_free(req->header);
+	free(req);
+}
+
+static fastcgiConn* newConn(fastcgi* fcgi) {
+
+	fastcgiConn* fconn = NEW(fastcgiConn);
+
+	if (fconn == NULL) return NULL;
+
+	fconn->fcgi		= fcgi;
+	fconn->maxreqs	= 1;
+	fconn->buffer	= bufferevent_socket_new(fcgi->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+
+	if (fconn->buffer == NULL) {
+		free(fconn);
+		return NULL;
+	}
+
+	bufferevent_setcb(fconn->buffer, backendReadCallback, backendWriteCallback, backendEventCallback, fconn);
+
+	if (bufferevent_socket_connect(fconn->buffer, (struct sockaddr*) &fcgi->addr, fcgi->addrlen)) {
+
+		WARN("Failed to connect to FastCGI backend. %s", fcgi->address);
+		bufferevent_free(fconn->buffer);
+		free(fconn);
+		return NULL;
+	}
+
+	bufferevent_enable(fconn->buffer, EV_READ | EV_WRITE);
+
+	fconn->next		= fcgi->conns;
+	fcgi->conns		= fconn;
+	fcgi->numconns++;
+	fcgi->connects++;
+
+	// ask whether requests can share the connection.
+	sendGetValues(fconn);
+
+	return fconn;
+}
+
+/**
+* Connection broke, fail its requests and let the waiting ones retry.
+*/
+static void failConn(fastcgiConn* fconn, int code) {
+
+	fastcgi* fcgi = fconn->fcgi;
+
+	for (fastcgiConn** p = &fcgi->conns; *p != NULL; p = &(*p)->next) {
+		if (*p == fconn) {
+			*p = fconn->next;
+			fcgi->numconns--;
+			break;
+		}
+	}
+
+	for (int i = 0; i < FASTCGI_MAX_REQS_PER_CONN; i++) {
+
+		fastcgiRequest* req = fconn->reqs[i];
+
+		if (req == NULL) continue;
+
+		fconn->reqs[i]	= NULL;
+		req->fconn		= NULL;
+
+		if (req->conn == NULL) {
+
+			evbuffer_free(req->header);
+			free(req);
+
+		} else if (!req->done) {
+
+			fcgi->failures++;
+			failRequest(req, code);
+		}
+	}
+
+	bufferevent_free(fconn->buffer);
+	free(fconn);
+
+	dispatchWaiting(fcgi);
+}
+
+static void releaseSlot(fastcgiConn* fconn, uint16_t id) {
+
+	fconn->reqs[id - 1] = NULL;
+
+	if (--fconn->numreqs == 0) bufferevent_set_timeouts(fconn->buffer, NULL, NULL);
+}
+
+static void sendBeginRequest(fastcgiRequest* req) {
+
+	uint8_t record[FCGI_HEADER_LEN + 8] = { 0 };
+
+	writeRecordHeader(record, FCGI_BEGIN_REQUEST, req->id, 8);
+
+	record[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+	record[FCGI_HEADER_LEN + 2] = FCGI_KEEP_CONN;
+
+	bufferevent_write(req->fconn->buffer, record, sizeof(record));
+}
+
+/**
+* Translate the request into CGI variables.
+*
+* Pairs are written into out-buffer space reserved for the record, request
+* header names are converted to HTTP_* while being copied.
+*/
+static void sendParams(fastcgiRequest* req) {
+
+	connection* conn	= req->conn;
+	http* ahttp			= (http*) connectionGetExtra(conn);
+	fastcgi* fcgi		= req->fcgi;
+	listtable* tbl		= ahttp->request.headers;
+	fastcgiRecord rec	= { bufferevent_get_output(req->fconn->buffer), FCGI_PARAMS, req->id };
+	int status			= 0;
+
+	status |= writePair(&rec, "GATEWAY_INTERFACE", false, "CGI/1.1", NULL);
+	status |= writePair(&rec, "SERVER_SOFTWARE", false, "Rumi", NULL);
+	status |= writePair(&rec, "SERVER_PROTOCOL", false, ahttp->request.httpver, NULL);
+	status |= writePair(&rec, "REQUEST_METHOD", false, ahttp->request.method, NULL);
+	status |= writePair(&rec, "REQUEST_URI", false, ahttp->request.uri, NULL);
+	status |= writePair(&rec, "SCRIPT_NAME", false, ahttp->request.path, NULL);
+	status |= writePair(&rec, "QUERY_STRING", false, (ahttp->request.query) ? ahttp->request.query : "", NULL);
+
+	if (fcgi->root != NULL) {
+		status |= writePair(&rec, "DOCUMENT_ROOT", false, fcgi->root, NULL);
+		status |= writePair(&rec, "SCRIPT_FILENAME", false, fcgi->root, ahttp->request.path);
+	}
+
+	if (conn->webserver->sslctx != NULL) status |= writePair(&rec, "HTTPS", false, "on", NULL);
+
+	const char* host = (ahttp->request.domain) ? ahttp->request.domain : tbl->getstr(tbl, "Host", false);
+
+	if (host != NULL) status |= writePair(&rec, "SERVER_NAME", false, host, NULL);
+
+	// addresses of both ends
+	connection* socket	= (conn->parent != NULL) ? conn->parent : conn;
+	int fd				= bufferevent_getfd(socket->buffer);
+	char ip[INET6_ADDRSTRLEN];
+	char port[8];
+	struct sockaddr_storage sa;
+
+	for (int peer = 1; peer >= 0; peer--) {
+
+		socklen_t salen = sizeof(sa);
+
+		if ((peer ? getpeername(fd, (struct sockaddr*) &sa, &salen) : getsockname(fd, (struct sockaddr*) &sa, &salen)) != 0) continue;
+
+		if (sa.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in*) &sa)->sin_addr, ip, sizeof(ip));
+			snprintf(port, sizeof(port), "%u", ntohs(((struct sockaddr_in*) &sa)->sin_port));
+		} else if (sa.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*) &sa)->sin6_addr, ip, sizeof(ip));
+			snprintf(port, sizeof(port), "%u", ntohs(((struct sockaddr_in6*) &sa)->sin6_port));
+		} else {
+			continue;
+		}
+
+		status |= writePair(&rec, (peer) ? "REMOTE_ADDR" : "SERVER_ADDR", false, ip, NULL);
+		status |= writePair(&rec, (peer) ? "REMOTE_PORT" : "SERVER_PORT", false, port, NULL);
+	}
+
+	char clen[24] = "";
+
+	if (httpGetStatus(conn) == HTTP_REQ_DONE) {
+
+		size_t inlen = httpGetContentSize(conn);
+		if (inlen > 0 || ahttp->request.contentlength >= 0) snprintf(clen, sizeof(clen), "%zu", inlen);
+
+	} else {
+
+		snprintf(clen, sizeof(clen), "%jd", (intmax_t) ahttp->request.contentlength);
+	}
+
+	if (clen[0] != '\0') status |= writePair(&rec, "CONTENT_LENGTH", false, clen, NULL);
+
+	listtableObj obj;
+
+	bzero((void*) &obj, sizeof(obj));
+
+	tbl->lock(tbl);
+
+	while (tbl->getnext(tbl, &obj, NULL, false)) {
+
+		const char* name = (const char*) obj.name;
+
+		if (!strcasecmp(name, "Content-Type")) {
+			status |= writePair(&rec, "CONTENT_TYPE", false, (const char*) obj.data, NULL);
+			continue;
+		}
+
+		// body framing is ours. Proxy would become HTTP_PROXY, which CGI apps mistake for a proxy setting.
+		if (!strcasecmp(name, "Content-Length") || !strcasecmp(name, "Transfer-Encoding") || !strcasecmp(name, "Proxy")) {
+			continue;
+		}
+
+		status |= writePair(&rec, name, true, (const char*) obj.data, NULL);
+	}
+
+	tbl->unlock(tbl);
+
+	status |= closeRecord(&rec);
+
+	// empty record ends the stream.
+	uint8_t record[FCGI_HEADER_LEN];
+
+	writeRecordHeader(record, FCGI_PARAMS, req->id, 0);
+	status |= evbuffer_add(rec.out, record, sizeof(record));
+
+	if (status) WARN("Failed to add FastCGI params to out-buffer.");
+}
+
+static void sendGetValues(fastcgiConn* fconn) {
+
+	fastcgiRecord rec = { bufferevent_get_output(fconn->buffer), FCGI_GET_VALUES, 0 };
+
+	writePair(&rec, "FCGI_MPXS_CONNS", false, "", NULL);
+	writePair(&rec, "FCGI_MAX_REQS", false, "", NULL);
+	closeRecord(&rec);
+}
+
+/**
+* Move request body received so far to the backend as FCGI_STDIN without
+* copying.
+*/
+static void forwardStdin(fastcgiRequest* req) {
+
+	fastcgiConn* fconn = req->fconn;
+
+	if (fconn == NULL || req->stdindone) return;
+
+	connection* conn		= req->conn;
+	struct evbuffer* in		= httpGetInbuf(conn);
+	struct evbuffer* out	= bufferevent_get_output(fconn->buffer);
+	uint8_t record[FCGI_HEADER_LEN];
+
+	for (size_t len = evbuffer_get_length(in); len > 0; len = evbuffer_get_length(in)) {
+
+		uint16_t size = (len > FCGI_MAX_CONTENT_LEN) ? FCGI_MAX_CONTENT_LEN : len;
+
+		writeRecordHeader(record, FCGI_STDIN, req->id, size);
+		evbuffer_add(out, record, sizeof(record));
+		evbuffer_remove_buffer(in, out, size);
+	}
+
+	if (httpGetStatus(conn) == HTTP_REQ_DONE) {
+
+		writeRecordHeader(record, FCGI_STDIN, req->id, 0);
+		evbuffer_add(out, record, sizeof(record));
+
+		req->stdindone = true;
+
+	} else if (!req->paused && conn->parent == NULL && evbuffer_get_length(out) > FASTCGI_MAX_BUFFERED) {
+
+		// backend is slower than the client, stop reading until it catches up.
+		req->paused = true;
+		bufferevent_disable(conn->buffer, EV_READ);
+	}
+}
+
+static void writeRecordHeader(uint8_t* p, uint8_t type, uint16_t id, uint16_t len) {
+
+	p[0] = FCGI_VERSION_1;
+	p[1] = type;
+	p[2] = id >> 8;
+	p[3] = id & 0xff;
+	p[4] = len >> 8;
+	p[5] = len & 0xff;
+	p[6] = 0;		// padding
+	p[7] = 0;		// reserved
+}
+
+/**
+* Append bytes to the open record, starting a new one when it's full. Pairs
+* may span records, the backend reads them as one stream.
+*
+* @param cginame convert a header name, ex) User-Agent to USER_AGENT.
+*/
+static int writeBytes(fastcgiRecord* rec, const void* data, size_t size, bool cginame) {
+
+	const uint8_t* src = (const uint8_t*) data;
+
+	while (size > 0) {
+
+		if (!rec->open) {
+
+			if (evbuffer_reserve_space(rec->out, FCGI_HEADER_LEN + FCGI_MAX_CONTENT_LEN, &rec->vec, 1) < 1) return -1;
+
+			rec->used = 0;
+			rec->open = true;
+		}
+
+		uint8_t* dst	= (uint8_t*) rec->vec.iov_base + FCGI_HEADER_LEN + rec->used;
+		size_t n		= FCGI_MAX_CONTENT_LEN - rec->used;
+
+		if (n > size) n = size;
+
+		if (cginame) {
+			for (size_t i = 0; i < n; i++) dst[i] = (src[i] == '-') ? '_' : toupper(src[i]);
+		} else {
+			memcpy(dst, src, n);
+		}
+
+		rec->used	+= n;
+		src			+= n;
+		size		-= n;
+
+		if (rec->used == FCGI_MAX_CONTENT_LEN && closeRecord(rec)) return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Write a name-value pair.
+*
+* @param header name is a request header, written as HTTP_NAME.
+* @param value2 appended to value when not NULL.
+*/
+static int writePair(fastcgiRecord* rec, const char* name, bool header, const char* value, const char* value2) {
+
+	size_t namelen	= strlen(name) + ((header) ? STRLEN("HTTP_") : 0);
+	size_t valuelen	= strlen(value);
+	size_t value2len	= (value2 != NULL) ? strlen(value2) : 0;
+	size_t lengths[2]	= { namelen, valuelen + value2len };
+	uint8_t buf[8];
+	size_t buflen	= 0;
+
+	for (int i = 0; i < 2; i++) {
+
+		if (lengths[i] < 128) {
+			buf[buflen++] = lengths[i];
+		} else {
+			buf[buflen++] = ((lengths[i] >> 24) & 0x7f) | 0x80;
+			buf[buflen++] = (lengths[i] >> 16) & 0xff;
+			buf[buflen++] = (lengths[i] >> 8) & 0xff;
+			buf[buflen++] = lengths[i] & 0xff;
+		}
+	}
+
+	if (writeBytes(rec, buf, buflen, false)
+	|| (header && writeBytes(rec, "HTTP_", STRLEN("HTTP_"), false))
+	|| writeBytes(rec, name, strlen(name), header)
+	|| writeBytes(rec, value, valuelen, false)
+	|| (value2len > 0 && writeBytes(rec, value2, value2len, false))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Fill in the header of the open record and commit it to the out-buffer.
+*/
+static int closeRecord(fastcgiRecord* rec) {
+
+	if (!rec->open) return 0;
+
+	rec->open = false;
+
+	writeRecordHeader((uint8_t*) rec->vec.iov_base, rec->type, rec->id, rec->used);
+
+	rec->vec.iov_len = FCGI_HEADER_LEN + rec->used;
+
+	return evbuffer_commit_space(rec->out, &rec->vec, 1);
+}
+
+/**
+* Demultiplex records. FCGI_STDOUT content is relayed as it arrives, other
+* records are handled once complete.
+*/
+static void readRecords(fastcgiConn* fconn) {
+
+	struct evbuffer* in = bufferevent_get_input(fconn->buffer);
+
+	while (!fconn->paused) {
+
+		size_t len = evbuffer_get_length(in);
+
+		if (!fconn->rec.active) {
+
+			uint8_t header[FCGI_HEADER_LEN];
+
+			if (len < FCGI_HEADER_LEN) return;
+
+			evbuffer_remove(in, header, sizeof(header));
+
+			if (header[0] != FCGI_VERSION_1) {
+				WARN("Invalid FastCGI record from backend. %s", fconn->fcgi->address);
+				failConn(fconn, HTTP_CODE_BAD_GATEWAY);
+				return;
+			}
+
+			fconn->rec.type			= header[1];
+			fconn->rec.id			= (header[2] << 8) | header[3];
+			fconn->rec.remaining	= (header[4] << 8) | header[5];
+			fconn->rec.padding		= header[6];
+			fconn->rec.active		= true;
+
+			len -= FCGI_HEADER_LEN;
+		}
+
+		uint16_t id			= fconn->rec.id;
+		fastcgiRequest* req	= (id >= 1 && id <= FASTCGI_MAX_REQS_PER_CONN) ? fconn->reqs[id - 1] : NULL;
+
+		if (fconn->rec.remaining > 0) {
+
+			if (fconn->rec.type == FCGI_STDOUT) {
+
+				if (len == 0) return;
+
+				size_t size = (fconn->rec.remaining < len) ? fconn->rec.remaining : len;
+
+				handleStdout(fconn, req, in, size);
+
+				fconn->rec.remaining -= size;
+				continue;
+			}
+
+			if (len < fconn->rec.remaining) return;
+
+			size_t size			= fconn->rec.remaining;
+			const uint8_t* body	= evbuffer_pullup(in, size);
+
+			fconn->rec.remaining = 0;
+
+			if (fconn->rec.type == FCGI_END_REQUEST && size >= 8) {
+
+				handleEndRequest(fconn, req, body);
+
+			} else if (fconn->rec.type == FCGI_GET_VALUES_RESULT) {
+
+				handleGetValuesResult(fconn, body, size);
+
+			} else if (fconn->rec.type == FCGI_STDERR) {
+
+				WARN("FastCGI stderr: %.*s", (int) size, (const char*) body);
+			}
+
+			evbuffer_drain(in, size);
+			len -= size;
+		}
+
+		if (len < fconn->rec.padding) {
+			fconn->rec.padding -= len;
+			evbuffer_drain(in, len);
+			return;
+		}
+
+		evbuffer_drain(in, fconn->rec.padding);
+
+		fconn->rec.padding	= 0;
+		fconn->rec.active	= false;
+	}
+}
+
+static void handleStdout(fastcgiConn* fconn, fastcgiRequest* req, struct evbuffer* in, size_t size) {
+
+	if (req == NULL || req->conn == NULL || req->done) {
+		evbuffer_drain(in, size);
+		return;
+	}
+
+	connection* conn = req->conn;
+
+	if (!req->headersent) {
+
+		evbuffer_remove_buffer(in, req->header, size);
+
+		if (parseResponseHeader(req) || !req->headersent) return;
+
+		// rest of what came with the header is the beginning of the body.
+		in		= req->header;
+		size	= evbuffer_get_length(in);
+	}
+
+	if (size == 0) return;
+
+	if (req->head) {
+		evbuffer_drain(in, size);
+		return;
+	}
+
+	if (httpSendBuffer(conn, in, size) != size) {
+		evbuffer_drain(in, evbuffer_get_length(in));
+		failRequest(req, HTTP_CODE_BAD_GATEWAY);
+		return;
+	}
+
+	// client is slower than the backend. only a connection serving nothing else can wait for it.
+	if (conn->parent == NULL && fconn->numreqs == 1 && evbuffer_get_length(conn->out) > FASTCGI_MAX_BUFFERED) {
+		fconn->paused = true;
+		bufferevent_disable(fconn->buffer, EV_READ);
+	}
+}
+
+/**
+* Collect CGI response header lines and send them to the client on the
+* empty line.
+*
+* @return 0 on success, -1 if the header was invalid and an error was sent.
+*/
+static int parseResponseHeader(fastcgiRequest* req) {
+
+	connection* conn	= req->conn;
+	char* line			= NULL;
+	size_t linelen		= 0;
+
+	while ((line = evbuffer_readln(req->header, &linelen, EVBUFFER_EOL_CRLF)) != NULL) {
+
+		if (linelen == 0) {
+			free(line);
+			break;
+		}
+
+		char* colon = strchr(line, ':');
+
+		if (colon == NULL || colon == line) {
+			free(line);
+			failRequest(req, HTTP_CODE_BAD_GATEWAY);
+			return -1;
+		}
+
+		char* value = colon + 1;
+
+		*colon = '\0';
+		while (*value == ' ' || *value == '\t') value++;
+
+		if (!strcasecmp(line, "Status")) {
+
+			char* reason	= NULL;
+			int code		= strtol(value, &reason, 10);
+
+			while (reason != NULL && *reason == ' ') reason++;
+
+			if (code >= 100 && code <= 999) {
+				httpSetResponseCode(conn, code, (reason != NULL && *reason != '\0') ? reason : httpGetReason(code));
+			}
+
+		} else if (!strcasecmp(line, "Location") && ((http*) connectionGetExtra(conn))->response.code == HTTP_NO_RESPONSE) {
+
+			httpSetResponseCode(conn, HTTP_CODE_MOVED_TEMPORARILY, httpGetReason(HTTP_CODE_MOVED_TEMPORARILY));
+			httpSetResponseHeader(conn, line, value);
+
+		} else if (strcasecmp(line, "Connection") && strcasecmp(line, "Keep-Alive") && strcasecmp(line, "Transfer-Encoding")) {
+
+			httpSetResponseHeader(conn, line, value);
+		}
+
+		free(line);
+	}
+
+	if (line == NULL) {
+
+		if (evbuffer_get_length(req->header) > FASTCGI_MAX_HEADER_SIZE) {
+			WARN("Too big FastCGI response header.");
+			failRequest(req, HTTP_CODE_BAD_GATEWAY);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	http* ahttp	= (http*) connectionGetExtra(conn);
+	int code	= (ahttp->response.code != HTTP_NO_RESPONSE) ? ahttp->response.code : HTTP_CODE_OK;
+
+	if (ahttp->response.code == HTTP_NO_RESPONSE) httpSetResponseCode(conn, code, httpGetReason(code));
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", isKeepalive(conn) ? "Keep-Alive" : "close");
+	}
+
+	const char* clenval	= httpGetResponseHeader(conn, "Content-Length");
+	off_t clen			= (clenval != NULL) ? strtoll(clenval, NULL, 10) : -1;
+
+	req->headersent = true;
+
+	if (req->head || code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_NOT_MODIFIED) {
+
+		httpSendHeaderBlock(conn, NULL, 0, 0);
+		httpSendData(conn, NULL, 0);
+		req->head = true;
+
+		return 0;
+	}
+
+	httpSetResponseContent(conn, httpGetResponseHeader(conn, "Content-Type"), clen);
+	httpSendHeader(conn);
+
+	return 0;
+}
+
+static void handleEndRequest(fastcgiConn* fconn, fastcgiRequest* req, const uint8_t* body) {
+
+	if (req == NULL) return;
+
+	releaseSlot(fconn, req->id);
+	req->fconn = NULL;
+
+	if (req->conn == NULL) {
+
+		// client left before the backend finished.
+		evbuffer_free(req->header);
+		free(req);
+
+	} else if (!req->done) {
+
+		uint8_t protocolstatus	= body[4];
+		http* ahttp				= (http*) connectionGetExtra(req->conn);
+
+		if (protocolstatus == FCGI_CANT_MPX_CONN) fconn->maxreqs = 1;
+
+		if (!req->headersent) {
+
+			req->fcgi->failures++;
+			failRequest(req, (protocolstatus == FCGI_REQUEST_COMPLETE) ? HTTP_CODE_BAD_GATEWAY : HTTP_CODE_SERVICE_UNAVAILABLE);
+
+		} else if (ahttp->response.contentlength < 0) {
+
+			httpSendChunk(req->conn, NULL, 0);
+			finishRequest(req);
+
+		} else if (!req->head && ahttp->response.bodyout < (size_t) ahttp->response.contentlength) {
+
+			WARN("FastCGI response is shorter than its Content-Length.");
+			failRequest(req, HTTP_CODE_BAD_GATEWAY);
+
+		} else {
+
+			finishRequest(req);
+		}
+	}
+
+	dispatchWaiting(fconn->fcgi);
+}
+
+/**
+* FCGI_MPXS_CONNS and FCGI_MAX_REQS tell how many requests can share the
+* connection.
+*/
+static void handleGetValuesResult(fastcgiConn* fconn, const uint8_t* body, size_t size) {
+
+	bool mpxs	= false;
+	int maxreqs	= FASTCGI_MAX_REQS_PER_CONN;
+
+	for (size_t i = 0; i < size;) {
+
+		size_t lengths[2];
+
+		for (int j = 0; j < 2; j++) {
+
+			if (i >= size) return;
+
+			if (body[i] & 0x80) {
+
+				if (i + 4 > size) return;
+
+				lengths[j] = ((size_t) (body[i] & 0x7f) << 24) | (body[i + 1] << 16) | (body[i + 2] << 8) | body[i + 3];
+				i += 4;
+
+			} else {
+
+				lengths[j] = body[i++];
+			}
+		}
+
+		if (i + lengths[0] + lengths[1] > size) return;
+
+		const char* name	= (const char*) body + i;
+		const char* value	= name + lengths[0];
+		int num				= atoi(strndupa(value, lengths[1]));
+
+		if (lengths[0] == STRLEN("FCGI_MPXS_CONNS") && !strncmp(name, "FCGI_MPXS_CONNS", lengths[0])) {
+			mpxs = (num > 0);
+		} else if (lengths[0] == STRLEN("FCGI_MAX_REQS") && !strncmp(name, "FCGI_MAX_REQS", lengths[0]) && num > 0) {
+			maxreqs = (num < FASTCGI_MAX_REQS_PER_CONN) ? num : FASTCGI_MAX_REQS_PER_CONN;
+		}
+
+		i += lengths[0] + lengths[1];
+	}
+
+	fconn->maxreqs = (mpxs) ? maxreqs : 1;
+
+	DEBUG("FastCGI backend takes %d requests per connection.", fconn->maxreqs);
+
+	dispatchWaiting(fconn->fcgi);
+}
+
+/**
+* the client connection can take the next request once the response is out.
+* Not when part of the request body is still unread.
+*/
+static bool isKeepalive(connection* conn) {
+
+	return httpIsKeepaliveRequest(conn) && httpGetStatus(conn) == HTTP_REQ_DONE;
+}
+
+static void backendReadCallback(struct bufferevent* buffer, void* userdata) {
+
+	readRecords((fastcgiConn*) userdata);
+}
+
+static void backendWriteCallback(struct bufferevent* buffer, void* userdata) {
+
+	fastcgiConn* fconn = (fastcgiConn*) userdata;
+
+	// backend caught up, read more of the request bodies.
+	for (int i = 0; i < FASTCGI_MAX_REQS_PER_CONN; i++) {
+
+		fastcgiRequest* req = fconn->reqs[i];
+
+		if (req != NULL && req->conn != NULL && req->paused) {
+			req->paused = false;
+			bufferevent_enable(req->conn->buffer, EV_READ);
+		}
+	}
+}
+
+static void backendEventCallback(struct bufferevent* buffer, short what, void* userdata) {
+
+	fastcgiConn* fconn = (fastcgiConn*) userdata;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		fconn->connected = true;
+		return;
+	}
+
+	if (fconn->numreqs > 0) {
+		DEBUG("FastCGI connection failed. (what:0x%x)", what);
+	}
+
+	failConn(fconn, (what & BEV_EVENT_TIMEOUT) ? HTTP_CODE_GATEWAY_TIME_OUT : HTTP_CODE_BAD_GATEWAY);
+}
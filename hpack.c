@@ -0,0 +1,765 @@
+/**
+ * @abstruct HPACK header compression module (RFC 7541)
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "hpack.h"
+
+#define HPACK_HUFFMAN_EOS		(256)
+#define HPACK_HUFFMAN_ACCEPT	(1)		// string may end after this nibble
+#define HPACK_HUFFMAN_SYMBOL	(1 << 1)	// nibble completes a symbol
+#define HPACK_HUFFMAN_FAIL		(1 << 2)	// nibble decodes EOS, invalid
+
+struct hpackStatic_t {
+	const char*	name;
+	const char*	value;
+};
+
+struct hpackHuffmanCode_t {
+	uint32_t	code;
+	uint8_t		length;
+};
+
+// one transition of the nibble driven huffman decoder
+struct hpackHuffmanState_t {
+	uint8_t		state;
+	uint8_t		flags;
+	uint8_t		symbol;
+};
+
+typedef struct hpackStatic_t		hpackStatic;
+typedef struct hpackHuffmanCode_t	hpackHuffmanCode;
+typedef struct hpackHuffmanState_t	hpackHuffmanState;
+
+// RFC 7541 Appendix A
+static const hpackStatic statictable[HPACK_STATIC_TABLE_SIZE] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B, indexed by symbol, EOS is 0x3fffffff in 30 bits.
+static const hpackHuffmanCode huffmancodes[256] = {
+	{ 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+	{ 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+	{ 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+	{ 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+	{ 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+	{ 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+	{ 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+	{ 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+	{ 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+	{ 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+	{ 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+	{ 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+	{ 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+	{ 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+	{ 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+	{ 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+	{ 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+	{ 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+	{ 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+	{ 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+	{ 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+	{ 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+	{ 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+	{ 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+	{ 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+	{ 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+	{ 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+	{ 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+	{ 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+	{ 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+	{ 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+	{ 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+	{ 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+	{ 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+	{ 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+	{ 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+	{ 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+	{ 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+	{ 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+	{ 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+	{ 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+	{ 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+	{ 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+	{ 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+	{ 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+	{ 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+	{ 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+	{ 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+	{ 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+	{ 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+	{ 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+	{ 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+	{ 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+	{ 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+	{ 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+	{ 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+	{ 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+	{ 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+	{ 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+	{ 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+	{ 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+	{ 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+	{ 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+	{ 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+};
+
+// decoder states are the 256 internal nodes of the code tree, 0 is the root.
+static hpackHuffmanState	huffmandecoder[256][16];
+static pthread_once_t		huffmanonce = PTHREAD_ONCE_INIT;
+
+// private functions
+static void			buildHuffmanDecoder(void);
+static int			decodeInteger(const uint8_t** p, const uint8_t* end, int prefixbits, uint64_t* value);
+static int			decodeString(hpack* ctx, const uint8_t** p, const uint8_t* end, size_t offset, size_t* length);
+static int			decodeHuffman(const uint8_t* src, size_t size, char* dst, size_t* length);
+static int			copyIndexed(hpack* ctx, uint64_t index, bool nameonly, size_t* namelen, size_t* valuelen);
+static int			reserveScratch(hpack* ctx, size_t size);
+static int			addEntry(hpack* ctx, const char* name, size_t namelen, const char* value, size_t valuelen);
+static void			evictEntries(hpack* ctx, size_t maxsize);
+static hpackEntry*	getEntry(hpack* ctx, uint64_t index);
+static size_t		encodeInteger(uint8_t* buf, uint8_t first, int prefixbits, uint64_t value);
+static int			encodeString(struct evbuffer* out, const char* str, size_t len, bool lowercase);
+static int			findStatic(const char* name, const char* value, bool* exact);
+
+/**
+* Create a decoding context.
+*
+* @param settingsmax SETTINGS_HEADER_TABLE_SIZE we advertise to the peer.
+*
+* @return context or NULL on failure.
+*/
+hpack* hpackNew(size_t settingsmax) {
+
+	pthread_once(&huffmanonce, buildHuffmanDecoder);
+
+	hpack* ctx = NEW(hpack);
+
+	if (ctx == NULL) return NULL;
+
+	ctx->maxsize		= settingsmax;
+	ctx->settingsmax	= settingsmax;
+
+	return ctx;
+}
+
+void hpackFree(hpack* ctx) {
+
+	if (ctx == NULL) return;
+
+	evictEntries(ctx, 0);
+
+	if (ctx->entries)	free(ctx->entries);
+	if (ctx->scratch)	free(ctx->scratch);
+
+	free(ctx);
+}
+
+/**
+* Decode a complete header block.
+*
+* The dynamic table is updated as fields are decoded, so the blocks of a
+* connection must be decoded in the order they were received.
+*
+* @return 0 on success, -1 on compression error.
+*/
+int hpackDecode(hpack* ctx, const uint8_t* src, size_t size, hpackHeaderCallback cb, void* userdata) {
+
+	const uint8_t* p	= src;
+	const uint8_t* end	= src + size;
+	bool fieldseen		= false;
+
+	while (p < end) {
+
+		uint8_t b = *p;
+		uint64_t index;
+		size_t namelen, valuelen;
+
+		if (b & 0x80) {
+
+			// indexed header field
+			if (decodeInteger(&p, end, 7, &index) || index == 0) return -1;
+			if (copyIndexed(ctx, index, false, &namelen, &valuelen)) return -1;
+
+		} else if ((b & 0xe0) == 0x20) {
+
+			// dynamic table size update, only allowed at the beginning of a block.
+			if (fieldseen || decodeInteger(&p, end, 5, &index) || index > ctx->settingsmax) return -1;
+
+			ctx->maxsize = index;
+			evictEntries(ctx, ctx->maxsize);
+			continue;
+
+		} else {
+
+			// literal header field, with incremental indexing (01), without indexing (0000) or never indexed (0001).
+			bool indexing = ((b & 0xc0) == 0x40);
+
+			if (decodeInteger(&p, end, (indexing) ? 6 : 4, &index)) return -1;
+
+			if (index > 0) {
+				if (copyIndexed(ctx, index, true, &namelen, &valuelen)) return -1;
+			} else if (decodeString(ctx, &p, end, 0, &namelen)) {
+				return -1;
+			}
+
+			if (decodeString(ctx, &p, end, namelen + 1, &valuelen)) return -1;
+
+			if (indexing && addEntry(ctx, ctx->scratch, namelen, ctx->scratch + namelen + 1, valuelen)) return -1;
+		}
+
+		fieldseen = true;
+
+		if (cb != NULL && cb(ctx->scratch, namelen, ctx->scratch + namelen + 1, valuelen, userdata)) return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Encode a header field as a literal without indexing.
+*
+* Responses are encoded without touching the dynamic table, so the encoder
+* keeps no state and field names are lowercased on the fly as HTTP/2 requires.
+*
+* @return 0 on success, -1 on error.
+*/
+int hpackEncodeHeader(struct evbuffer* out, const char* name, const char* value) {
+
+	uint8_t buf[16];
+	bool exact;
+	int index = findStatic(name, value, &exact);
+
+	if (index > 0 && exact) {
+		return evbuffer_add(out, buf, encodeInteger(buf, 0x80, 7, index));
+	}
+
+	if (evbuffer_add(out, buf, encodeInteger(buf, 0x00, 4, (index > 0) ? index : 0))) return -1;
+
+	if (index <= 0 && encodeString(out, name, strlen(name), true)) return -1;
+
+	return encodeString(out, value, strlen(value), false);
+}
+
+/**
+* Encode :status pseudo header.
+*
+* @return 0 on success, -1 on error.
+*/
+int hpackEncodeStatus(struct evbuffer* out, int code) {
+
+	// static table indexes 8 to 14
+	static const int codes[] = { 200, 204, 206, 304, 400, 404, 500 };
+
+	uint8_t buf[16];
+
+	for (int i = 0; i < (int)(sizeof(codes) / sizeof(codes[0])); i++) {
+		if (codes[i] == code) return evbuffer_add(out, buf, encodeInteger(buf, 0x80, 7, 8 + i));
+	}
+
+	char value[8];
+	snprintf(value, sizeof(value), "%03d", code % 1000);
+
+	if (evbuffer_add(out, buf, encodeInteger(buf, 0x00, 4, 8))) return -1;
+
+	return encodeString(out, value, strlen(value), false);
+}
+
+// private functions
+
+/**
+* Build nibble transition table from the code tree.
+*
+* Every state is an internal node of the tree. Feeding 4 bits walks the tree
+* and emits at most one symbol since the shortest code is 5 bits long.
+*/
+static void buildHuffmanDecoder(void) {
+
+	// 257 leaves and 256 internal nodes, internal nodes are numbered first.
+	int16_t children[256][2];
+	int16_t numnodes = 1;
+
+	memset(children, 0, sizeof(children));
+
+	for (int sym = 0; sym <= HPACK_HUFFMAN_EOS; sym++) {
+
+		uint32_t code	= (sym < 256) ? huffmancodes[sym].code : 0x3fffffff;
+		int length		= (sym < 256) ? huffmancodes[sym].length : 30;
+		int node		= 0;
+
+		for (int bit = length - 1; bit > 0; bit--) {
+
+			int b = (code >> bit) & 1;
+
+			if (children[node][b] == 0) children[node][b] = numnodes++;
+
+			node = children[node][b];
+		}
+
+		// leaves are stored as negative symbol - 1
+		children[node][code & 1] = -1 - sym;
+	}
+
+	// depth and whether the path from root is all 1 bits, valid padding is up to 7 of them.
+	uint8_t depth[256]	= { 0 };
+	bool allones[256]	= { true };
+
+	for (int node = 0; node < 256; node++) {
+		for (int b = 0; b < 2; b++) {
+
+			int child = children[node][b];
+
+			if (child > 0) {
+				depth[child]	= depth[node] + 1;
+				allones[child]	= allones[node] && b;
+			}
+		}
+	}
+
+	for (int state = 0; state < 256; state++) {
+		for (int nibble = 0; nibble < 16; nibble++) {
+
+			hpackHuffmanState* t	= &huffmandecoder[state][nibble];
+			int node				= state;
+
+			t->flags = 0;
+
+			for (int bit = 3; bit >= 0; bit--) {
+
+				int child = children[node][(nibble >> bit) & 1];
+
+				if (child < 0) {
+
+					if (-1 - child == HPACK_HUFFMAN_EOS) {
+						t->flags |= HPACK_HUFFMAN_FAIL;
+						break;
+					}
+
+					t->flags	|= HPACK_HUFFMAN_SYMBOL;
+					t->symbol	= -1 - child;
+					node		= 0;
+
+				} else {
+
+					node = child;
+				}
+			}
+
+			t->state = node;
+
+			if (node == 0 || (allones[node] && depth[node] <= 7)) t->flags |= HPACK_HUFFMAN_ACCEPT;
+		}
+	}
+}
+
+static int decodeInteger(const uint8_t** p, const uint8_t* end, int prefixbits, uint64_t* value) {
+
+	const uint8_t* q	= *p;
+	uint64_t mask		= (1 << prefixbits) - 1;
+	uint64_t v			= *q++ & mask;
+
+	if (v == mask) {
+
+		int shift = 0;
+
+		for (;;) {
+
+			// 4 continuation bytes are plenty for any sane index or length.
+			if (q >= end || shift > 28) return -1;
+
+			uint8_t b = *q++;
+
+			v		+= (uint64_t)(b & 0x7f) << shift;
+			shift	+= 7;
+
+			if (!(b & 0x80)) break;
+		}
+	}
+
+	*p		= q;
+	*value	= v;
+
+	return 0;
+}
+
+/**
+* Decode a string literal into scratch at the offset and terminate it.
+*/
+static int decodeString(hpack* ctx, const uint8_t** p, const uint8_t* end, size_t offset, size_t* length) {
+
+	if (*p >= end) return -1;
+
+	bool huffman = (**p & 0x80);
+	uint64_t len;
+
+	if (decodeInteger(p, end, 7, &len) || len > (uint64_t)(end - *p) || len > HPACK_MAX_STRING_SIZE) return -1;
+
+	// huffman codes are at least 5 bits, so output is at most 8/5 of input.
+	if (reserveScratch(ctx, offset + ((huffman) ? (len * 8 / 5) + 1 : len) + 1)) return -1;
+
+	char* dst = ctx->scratch + offset;
+
+	if (huffman) {
+
+		if (decodeHuffman(*p, len, dst, length)) return -1;
+
+	} else {
+
+		memcpy(dst, *p, len);
+		*length = len;
+	}
+
+	dst[*length] = '\0';
+	*p += len;
+
+	return 0;
+}
+
+static int decodeHuffman(const uint8_t* src, size_t size, char* dst, size_t* length) {
+
+	char* q			= dst;
+	uint8_t state	= 0;
+	uint8_t flags	= HPACK_HUFFMAN_ACCEPT;
+
+	for (size_t i = 0; i < size; i++) {
+
+		const hpackHuffmanState* t = &huffmandecoder[state][src[i] >> 4];
+
+		if (t->flags & HPACK_HUFFMAN_FAIL) return -1;
+		if (t->flags & HPACK_HUFFMAN_SYMBOL) *q++ = t->symbol;
+
+		t = &huffmandecoder[t->state][src[i] & 0x0f];
+
+		if (t->flags & HPACK_HUFFMAN_FAIL) return -1;
+		if (t->flags & HPACK_HUFFMAN_SYMBOL) *q++ = t->symbol;
+
+		state	= t->state;
+		flags	= t->flags;
+	}
+
+	if (!(flags & HPACK_HUFFMAN_ACCEPT)) return -1;
+
+	*length = q - dst;
+
+	return 0;
+}
+
+/**
+* Copy name, and value unless nameonly, of a table entry into scratch.
+*
+* A copy is needed since inserting a literal may evict the entry it refers to.
+*/
+static int copyIndexed(hpack* ctx, uint64_t index, bool nameonly, size_t* namelen, size_t* valuelen) {
+
+	const char* name;
+	const char* value;
+
+	if (index == 0) return -1;
+
+	if (index <= HPACK_STATIC_TABLE_SIZE) {
+
+		name		= statictable[index - 1].name;
+		value		= statictable[index - 1].value;
+		*namelen	= strlen(name);
+		*valuelen	= strlen(value);
+
+	} else {
+
+		hpackEntry* entry = getEntry(ctx, index - HPACK_STATIC_TABLE_SIZE - 1);
+
+		if (entry == NULL) return -1;
+
+		name		= entry->data;
+		value		= entry->data + entry->namelen + 1;
+		*namelen	= entry->namelen;
+		*valuelen	= entry->valuelen;
+	}
+
+	if (nameonly) *valuelen = 0;
+
+	if (reserveScratch(ctx, *namelen + *valuelen + 2)) return -1;
+
+	memcpy(ctx->scratch, name, *namelen + 1);
+
+	if (!nameonly) memcpy(ctx->scratch + *namelen + 1, value, *valuelen + 1);
+
+	return 0;
+}
+
+static int reserveScratch(hpack* ctx, size_t size) {
+
+	if (size <= ctx->scratchsize) return 0;
+
+	size_t newsize = (ctx->scratchsize > 0) ? ctx->scratchsize : 256;
+
+	while (newsize < size) newsize *= 2;
+
+	char* scratch = realloc(ctx->scratch, newsize);
+
+	if (scratch == NULL) return -1;
+
+	ctx->scratch		= scratch;
+	ctx->scratchsize	= newsize;
+
+	return 0;
+}
+
+static int addEntry(hpack* ctx, const char* name, size_t namelen, const char* value, size_t valuelen) {
+
+	size_t entrysize = namelen + valuelen + HPACK_ENTRY_OVERHEAD;
+
+	// an entry larger than the table empties it and is not inserted.
+	if (entrysize > ctx->maxsize) {
+		evictEntries(ctx, 0);
+		return 0;
+	}
+
+	evictEntries(ctx, ctx->maxsize - entrysize);
+
+	if (ctx->numentries == ctx->capacity) {
+
+		size_t newcapacity		= (ctx->capacity > 0) ? ctx->capacity * 2 : 16;
+		hpackEntry** entries	= malloc(newcapacity * sizeof(hpackEntry*));
+
+		if (entries == NULL) return -1;
+
+		// unroll the ring, newest first.
+		for (size_t i = 0; i < ctx->numentries; i++) {
+			entries[i] = ctx->entries[(ctx->head + i) % ctx->capacity];
+		}
+
+		if (ctx->entries) free(ctx->entries);
+
+		ctx->entries	= entries;
+		ctx->capacity	= newcapacity;
+		ctx->head		= 0;
+	}
+
+	hpackEntry* entry = malloc(sizeof(hpackEntry) + namelen + valuelen + 2);
+
+	if (entry == NULL) return -1;
+
+	entry->namelen	= namelen;
+	entry->valuelen	= valuelen;
+	memcpy(entry->data, name, namelen);
+	entry->data[namelen] = '\0';
+	memcpy(entry->data + namelen + 1, value, valuelen);
+	entry->data[namelen + 1 + valuelen] = '\0';
+
+	ctx->head = (ctx->head + ctx->capacity - 1) % ctx->capacity;
+	ctx->entries[ctx->head] = entry;
+	ctx->numentries++;
+	ctx->size += entrysize;
+
+	return 0;
+}
+
+// drop oldest entries until the table fits in maxsize.
+static void evictEntries(hpack* ctx, size_t maxsize) {
+
+	while (ctx->numentries > 0 && ctx->size > maxsize) {
+
+		size_t slot			= (ctx->head + ctx->numentries - 1) % ctx->capacity;
+		hpackEntry* entry	= ctx->entries[slot];
+
+		ctx->size -= entry->namelen + entry->valuelen + HPACK_ENTRY_OVERHEAD;
+		ctx->numentries--;
+		ctx->entries[slot] = NULL;
+
+		free(entry);
+	}
+}
+
+// dynamic table entry by 0 based index, 0 is the newest.
+static hpackEntry* getEntry(hpack* ctx, uint64_t index) {
+
+	if (index >= ctx->numentries) return NULL;
+
+	return ctx->entries[(ctx->head + index) % ctx->capacity];
+}
+
+static size_t encodeInteger(uint8_t* buf, uint8_t first, int prefixbits, uint64_t value) {
+
+	uint64_t mask = (1 << prefixbits) - 1;
+
+	if (value < mask) {
+		buf[0] = first | value;
+		return 1;
+	}
+
+	size_t len	= 0;
+	buf[len++]	= first | mask;
+	value		-= mask;
+
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+
+	buf[len++] = value;
+
+	return len;
+}
+
+/**
+* Encode a string literal, huffman coded when it comes out shorter.
+*/
+static int encodeString(struct evbuffer* out, const char* str, size_t len, bool lowercase) {
+
+	const uint8_t* s	= (const uint8_t*) str;
+	uint64_t numbits	= 0;
+
+	for (size_t i = 0; i < len; i++) {
+		numbits += huffmancodes[(lowercase) ? tolower(s[i]) : s[i]].length;
+	}
+
+	size_t hufflen		= (numbits + 7) / 8;
+	bool huffman		= (hufflen < len);
+	size_t encodedlen	= (huffman) ? hufflen : len;
+
+	struct evbuffer_iovec vec;
+
+	if (evbuffer_reserve_space(out, encodedlen + 16, &vec, 1) < 1) return -1;
+
+	uint8_t* p = (uint8_t*) vec.iov_base;
+
+	p += encodeInteger(p, (huffman) ? 0x80 : 0x00, 7, encodedlen);
+
+	if (huffman) {
+
+		uint64_t bits	= 0;
+		int numpending	= 0;
+
+		for (size_t i = 0; i < len; i++) {
+
+			const hpackHuffmanCode* c = &huffmancodes[(lowercase) ? tolower(s[i]) : s[i]];
+
+			bits		= (bits << c->length) | c->code;
+			numpending	+= c->length;
+
+			while (numpending >= 8) {
+				numpending -= 8;
+				*p++ = bits >> numpending;
+			}
+		}
+
+		// pad with the most significant bits of EOS.
+		if (numpending > 0) {
+			*p++ = (bits << (8 - numpending)) | (0xff >> numpending);
+		}
+
+	} else if (lowercase) {
+
+		for (size_t i = 0; i < len; i++) *p++ = tolower(s[i]);
+
+	} else {
+
+		memcpy(p, s, len);
+		p += len;
+	}
+
+	vec.iov_len = p - (uint8_t*) vec.iov_base;
+
+	return evbuffer_commit_space(out, &vec, 1);
+}
+
+/**
+* Find a static table entry by name, case-insensitively.
+*
+* @param exact set true when the value matches too.
+*
+* @return 1 based index, 0 if the name is not in the table.
+*/
+static int findStatic(const char* name, const char* value, bool* exact) {
+
+	int found	= 0;
+	*exact		= false;
+
+	for (int i = 0; i < HPACK_STATIC_TABLE_SIZE; i++) {
+
+		if (strcasecmp(statictable[i].name, name)) {
+			if (found) break;	// entries of the same name are adjacent.
+			continue;
+		}
+
+		if (!found) found = i + 1;
+
+		if (!strcmp(statictable[i].value, value)) {
+			*exact = true;
+			return i + 1;
+		}
+	}
+
+	return found;
+}
@@ -2,33 +2,76 @@
  * @author
  */
 
+#define _GNU_SOURCE
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <limits.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <event2/buffer.h>
 #include "server.h"
 #include "http.h"
 #include "coder.h"
+#include "compress.h"
+#include "http2.h"
+#include "string.h"
+
+// shared release of multiple referenced segments
+struct refgroup_t {
+	int						refcount;
+	const void*				data;
+	size_t					size;
+	evbuffer_ref_cleanup_cb	release;
+	void*					userdata;
+};
+
+typedef struct refgroup_t refgroup;
 
 // private functions
 static http*	httpNew(struct evbuffer* out);
 static void		httpFree(http* http);
 static void		httpFreeCallback(connection* conn, void *userdata);
 static size_t	httpAddInbuf(struct evbuffer* buffer, http* http, size_t maxsize);
+static int		openSpoolFile(const char* dir);
+static int		spoolBody(http* ahttp);
+static void*	readSpool(http* ahttp, size_t maxsize, size_t* storedsize);
+static void		unspoolBody(http* ahttp);
+static void		failSpool(http* ahttp);
+static void		rejectSpoolFailure(connection* conn, http* ahttp);
+static size_t	sendHeader(connection* conn, const void* block, size_t size, off_t contentlength, bool compress);
+static enum compress_encoding_e negotiateCompression(connection* conn, http* ahttp);
+static int		sendCompressedChunk(http* ahttp, const struct iovec* iov, int iovcnt, int flush);
+static size_t	sendData(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata, bool copy);
+static size_t	sendChunk(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata, bool copy);
+static size_t	formatChunkHeader(char* buf, size_t size);
+static size_t	iovecLength(const struct iovec* iov, int iovcnt);
+static void		captureBody(http* ahttp, const struct iovec* iov, int iovcnt);
+static void		stopCapture(http* ahttp);
+static int		addReference(struct evbuffer* out, const struct iovec* iov, int iovcnt, size_t size, evbuffer_ref_cleanup_cb release, void* userdata);
+static void		releaseReference(const struct iovec* iov, int iovcnt, size_t size, evbuffer_ref_cleanup_cb release, void* userdata);
+static void		releaseGroup(const void* data, size_t size, void* userdata);
 static int		httpParser(http* http, struct evbuffer *in);
+static void		setRequestPhase(connection* conn, http* ahttp);
+static void		rejectRequest(connection* conn, http* ahttp);
+static bool		isLineTooLong(struct evbuffer* in, size_t maxsize);
+static bool		expectsContinue(http* ahttp, struct evbuffer* in);
+static void		holdBody(connection* conn, http* ahttp);
+static void		sendContinue(connection* conn, http* ahttp);
+static bool		isBodyHeld(http* ahttp);
 static int		parseRequestLine(http* http, char* line);
 static int		parseHeaders(http* http, struct evbuffer* in);
 static int		parseBody(http* http, struct evbuffer* in);
-static ssize_t	parseChunkedBody(http* http, struct evbuffer* in);
-static bool		isValidPathname(const char* path);
-static void		correctPathname(char* path);
-static char*	evbufferPeekln(struct evbuffer* buffer, size_t* n_reout, enum evbuffer_eol_style eol_style);
-static ssize_t	evbufferDrainln(struct evbuffer* buffer, size_t* n_reout, enum evbuffer_eol_style eol_style);
+static int		parseChunkedBody(http* http, struct evbuffer* in);
+static int		parseChunkedTrailer(http* http, struct evbuffer* in);
+static bool		isChunkedRequest(http* ahttp);
 
 
 /**
@@ -49,22 +92,47 @@ int httpHandler(short event, connection* conn, void* userdata) {
 	if (event & EVENT_INIT) {
 
 		DEBUG("==> HTTP INIT");
-		http* httpinit = httpNew(conn->out);
-		if (httpinit == NULL) return CLOSE;
+		http* ahttp = httpNew(conn->out);
+		if (ahttp == NULL) return CLOSE;
+
+		char* maxbodysize = serverGetOptionAsString(conn->webserver, "server.max_body_size");
+		ahttp->request.maxbodysize = (maxbodysize) ? strtoll(maxbodysize, NULL, 10) : 0;
 
-		connectionSetExtra(conn, http, httpFreeCallback);
+		ahttp->request.maxrequestline	= serverGetOptionAsInt(conn->webserver, "server.max_request_line");
+		ahttp->request.maxheadersize	= serverGetOptionAsInt(conn->webserver, "server.max_header_size");
+		ahttp->request.maxheaders		= serverGetOptionAsInt(conn->webserver, "server.max_headers");
+
+		ahttp->request.spool.threshold	= serverGetOptionAsInt(conn->webserver, "server.body_spool_size");
+		ahttp->request.spool.dir		= serverGetOptionAsString(conn->webserver, "server.body_spool_dir");
+
+		connectionSetExtra(conn, ahttp, httpFreeCallback);
 		return OK;
 
 	} else if (event & EVENT_READ) {
 
 		DEBUG("==> HTTP READ");
-		http* httpinit = (http*) connectionGetExtra(conn);
+		http* ahttp = (http*) connectionGetExtra(conn);
+
+		// connection was upgraded to another protocol, in-buffer is not ours anymore.
+		if (conn->protocol != NULL) return OK;
+
+		// hooks let the header through, ask the client for the body.
+		if (ahttp->request.expect == HTTP_EXPECT_ACCEPT) sendContinue(conn, ahttp);
 
-		int status = httpParser(http, conn->in);
+		// HTTP/2 streams are handed over already parsed.
+		int status = (ahttp->stream != NULL) ? OK : httpParser(ahttp, conn->in);
 
-		if (conn->method == NULL && httpinit->request.method != NULL) {
+		if (ahttp->stream == NULL) setRequestPhase(conn, ahttp);
 
-			connectionSetMethod(conn, httpinit->request.method);
+		if (ahttp->request.status == HTTP_ERROR && ahttp->request.errorcode > 0) {
+			rejectRequest(conn, ahttp);
+		}
+
+		if (ahttp->request.expect == HTTP_EXPECT_HOLD) holdBody(conn, ahttp);
+
+		if (conn->method == NULL && ahttp->request.method != NULL) {
+
+			connectionSetMethod(conn, ahttp->request.method);
 		}
 
 		return status;
@@ -100,9 +168,23 @@ enum http_request_status_e httpGetStatus(connection* conn) {
 	return ahttp->request.status;
 }
 
+/**
+* return the in-buffer holding the request body.
+*
+* A spooled body is put back in as a mapped file segment and the rest of
+* the request stays in memory, so hooks can use the evbuffer API as usual.
+* If it can't be put back the request is answered with 500 unless the
+* response is under way, either way httpGetStatus() returns HTTP_ERROR.
+*/
 struct evbuffer* httpGetInbuf(connection* conn) {
 
 	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (ahttp->request.spool.fd >= 0) {
+		unspoolBody(ahttp);
+		rejectSpoolFailure(conn, ahttp);
+	}
+
 	return ahttp->request.inbuf;
 }
 
@@ -136,31 +218,181 @@ off_t httpGetContentLength(connection* conn) {
 	return ahttp->request.contentlength;
 }
 
+/**
+* return the bytes of request body received and not removed yet, spooled
+* ones included. Unlike Content-Length, known for chunked bodies too.
+*/
+size_t httpGetContentSize(connection* conn) {
+
+	http* ahttp		= (http*) connectionGetExtra(conn);
+	size_t size		= evbuffer_get_length(ahttp->request.inbuf);
+
+	if (ahttp->request.spool.fd >= 0) {
+		size += ahttp->request.spool.size - ahttp->request.spool.offset;
+	}
+
+	return size;
+}
+
+/**
+* Get the query parameters, the view is built on the first call and kept
+* with the request. Values are decoded only when asked for.
+*
+* @code
+* paramview* params = httpGetQueryParams(conn);
+* char* id = paramViewGet(params, "id", 0);
+* @endcode
+*/
+paramview* httpGetQueryParams(connection* conn) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (ahttp->request.queryparams == NULL && ahttp->request.query != NULL) {
+
+		ahttp->request.queryparams = paramViewNew(ahttp->request.query, strlen(ahttp->request.query), '=', '&');
+	}
+
+	return ahttp->request.queryparams;
+}
+
+/**
+* Get the parameters of an application/x-www-form-urlencoded body.
+*
+* Available on HTTP_REQ_DONE. The view points into the in-buffer, it becomes
+* invalid once the body is removed with httpGetContent().
+*
+* @return NULL if the request has no such body.
+*/
+paramview* httpGetFormParams(connection* conn) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (ahttp->request.formparams != NULL) return ahttp->request.formparams;
+
+	if (ahttp->request.status != HTTP_REQ_DONE) return NULL;
+
+	const char* contenttype = httpGetRequestHeader(conn, "Content-Type");
+
+	if (contenttype == NULL || strncasecmp(contenttype, "application/x-www-form-urlencoded", STRLEN("application/x-www-form-urlencoded"))) {
+		return NULL;
+	}
+
+	size_t size			= 0;
+	const char* body	= (const char*) httpMapContent(conn, &size);
+
+	if (body == NULL && size > 0) return NULL;
+
+	ahttp->request.formparams = paramViewNew((body) ? body : "", size, '=', '&');
+
+	return ahttp->request.formparams;
+}
+
 /**
 * remove content from the in-buffer.
 *
 * @param maxsize maximum length of data to pull up. 0 to pull up everything.
+*
+* @return malloced data, NULL if there's none or on error. A spooled body
+* that can't be read back fails the request like httpGetInbuf() does.
 */
 void* httpGetContent(connection* conn, size_t maxsize, size_t* storedsize) {
 
 	http* ahttp = (http*) connectionGetExtra(conn);
 
-	size_t inbuflen	= evbuffer_get_length(ahttp->request.inbuf);
-	size_t readlen	= (maxsize == 0) ? inbuflen : ((inbuflen < maxsize) ? inbuflen : maxsize);
+	void* data			= NULL;
+	size_t removedlen	= 0;
 
-	if (readlen == 0) return NULL;
+	if (ahttp->request.spool.fd >= 0) {
+
+		data = readSpool(ahttp, maxsize, &removedlen);
+
+		if (data == NULL) rejectSpoolFailure(conn, ahttp);
+
+	} else {
+
+		size_t inbuflen	= evbuffer_get_length(ahttp->request.inbuf);
+		size_t readlen	= (maxsize == 0) ? inbuflen : ((inbuflen < maxsize) ? inbuflen : maxsize);
 
-	void* data = malloc(readlen);
+		if (readlen > 0 && (data = malloc(readlen)) != NULL) {
+			removedlen = evbuffer_remove(ahttp->request.inbuf, data, readlen);
+		}
+	}
 
 	if (data == NULL) return NULL;
 
-	size_t removedlen = evbuffer_remove(ahttp->request.inbuf, data, readlen);
+	// the form view pointed into what was just removed.
+	if (ahttp->request.formparams) {
+		paramViewFree(ahttp->request.formparams);
+		ahttp->request.formparams = NULL;
+	}
 
 	if (storedsize) *storedsize = removedlen;
 
 	return data;
 }
 
+/**
+* Map the request body into memory without copying it.
+*
+* Available on HTTP_REQ_DONE, the body is mapped once it's complete. A
+* spooled body is mapped from its temp file, otherwise the in-buffer is
+* made contiguous. The view is read-only and stays valid until the request
+* is over, what httpGetContent() removed is not part of it.
+*
+* @param size set to the bytes of the view.
+*
+* @return NULL if there's no body, it's not complete or it can't be mapped.
+* A spooled body that can't be flushed to its file fails the request like
+* httpGetInbuf() does.
+*/
+const void* httpMapContent(connection* conn, size_t* size) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (size) *size = 0;
+
+	if (ahttp->request.status != HTTP_REQ_DONE) return NULL;
+
+	if (ahttp->request.spool.fd < 0) {
+
+		size_t inbuflen = evbuffer_get_length(ahttp->request.inbuf);
+
+		if (inbuflen == 0) return NULL;
+
+		if (size) *size = inbuflen;
+		return evbuffer_pullup(ahttp->request.inbuf, -1);
+	}
+
+	// the tail still in memory goes to the file first, nothing is added after that.
+	if (spoolBody(ahttp) < 0) {
+		rejectSpoolFailure(conn, ahttp);
+		return NULL;
+	}
+
+	size_t spooled = (size_t) ahttp->request.spool.size;
+
+	if (ahttp->request.spool.map == NULL && spooled > 0) {
+
+		void* map = mmap(NULL, spooled, PROT_READ, MAP_SHARED, ahttp->request.spool.fd, 0);
+
+		if (map == MAP_FAILED) {
+			WARN("Failed to map request body. (%s)", strerror(errno));
+			return NULL;
+		}
+
+		madvise(map, spooled, MADV_SEQUENTIAL);
+
+		ahttp->request.spool.map	= map;
+		ahttp->request.spool.maplen	= spooled;
+	}
+
+	if (spooled <= (size_t) ahttp->request.spool.offset) return NULL;
+
+	if (size) *size = spooled - ahttp->request.spool.offset;
+
+	return (const char*) ahttp->request.spool.map + ahttp->request.spool.offset;
+}
+
 /**
 * Return whether the request is keep-alive request or not.
 *
@@ -174,6 +406,16 @@ int httpIsKeepaliveRequest(connection* conn) {
 		return 0;
 	}
 
+	// closing a stream never closes the connection.
+	if (ahttp->stream != NULL) {
+		return 1;
+	}
+
+	// body the client may still send was never read, it can't be told from the next request.
+	if (isBodyHeld(ahttp)) {
+		return 0;
+	}
+
 	const char* aconnection = httpGetRequestHeader(conn, "Connection");
 
 	if (!strcmp(ahttp->request.httpver, HTTP_PROTOCOL_11)) {
@@ -197,6 +439,49 @@ int httpIsKeepaliveRequest(connection* conn) {
 	}
 }
 
+/**
+* Check whether the client accepts the given content-coding.
+*
+* @param coding content-coding name. ex) gzip
+*
+* @return true if listed or covered by "*" with non-zero q-value.
+*/
+bool httpAcceptsEncoding(connection* conn, const char* coding) {
+
+	const char* accept = httpGetRequestHeader(conn, "Accept-Encoding");
+
+	if (accept == NULL) return false;
+
+	size_t codinglen	= strlen(coding);
+	bool wildcard		= false;
+
+	for (const char* p = accept; *p != '\0';) {
+
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+
+		const char* name = p;
+		while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		size_t namelen = p - name;
+
+		// q-value, "q=0" means not acceptable.
+		double q = 1.0;
+		const char* param = p;
+		while (*param != '\0' && *param != ',') {
+			if ((*param == 'q' || *param == 'Q') && param[1] == '=') q = atof(param + 2);
+			param++;
+		}
+		p = param;
+
+		if (namelen == codinglen && !strncasecmp(name, coding, codinglen)) {
+			return (q > 0);
+		} else if (namelen == 1 && *name == '*') {
+			wildcard = (q > 0);
+		}
+	}
+
+	return wildcard;
+}
+
 /**
 * Set response header.
 *
@@ -322,44 +607,110 @@ size_t httpResponse(connection* conn, int code, const char* contenttype, const v
 */
 size_t httpSendHeader(connection* conn) {
 
-	http* ahttp = (http*) connectionGetExtra(conn);
+	return sendHeader(conn, NULL, 0, ((http*) connectionGetExtra(conn))->response.contentlength, true);
+}
 
-	if (ahttp->response.frozen_header) {
-		return 0;
-	}
+/**
+* Send header with prebuilt header lines.
+*
+* Headers set by httpSetResponseHeader() go out first, then the block is
+* appended as is. Useful for cached responses whose headers never change.
+*
+* @param block header lines each terminated by CRLF, without the empty line.
+* @param contentlength content length declared in the block, -1 for chunked.
+*
+* @return 0 total bytes put in out buffer, -1 if we already sent it out.
+*/
+size_t httpSendHeaderBlock(connection* conn, const void* block, size_t size, off_t contentlength) {
 
-	ahttp->response.frozen_header = true;
+	return sendHeader(conn, block, size, contentlength, false);
+}
 
-	// Send status line.
-	const char* reason = (ahttp->response.reason) ? ahttp->response.reason : httpGetReason(ahttp->response.code);
+/**
+*
+* @return 0 on success, -1 if we already sent it out.
+*/
+size_t httpSendData(connection* conn, const void* data, size_t size) {
 
-	evbuffer_add_printf(ahttp->response.outbuf, "%s %d %s" HTTP_CRLF, ahttp->request.httpver, ahttp->response.code, reason);
+	struct iovec iov = { (void*) data, size };
 
-	// Send headers.
-	listableObj obj;
+	return sendData(conn, &iov, 1, NULL, NULL, true);
+}
 
-	bzero((void*) &obj, sizeof(obj));
+/**
+* Send body data by reference, without copying it into the out-buffer.
+*
+* The memory must stay untouched until release is called, which happens once
+* the data has been written to the socket. release is always called exactly
+* once, also on error. NULL release for memory that lives forever.
+*
+* @return total bytes put in out buffer, 0 on error.
+*/
+size_t httpSendDataRef(connection* conn, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata) {
 
-	listtable* tbl = ahttp->response.headers;
+	struct iovec iov = { (void*) data, size };
 
-	tbl->lock(tbl);
+	return sendData(conn, &iov, 1, release, userdata, false);
+}
 
-	while (tbl->getnext(tbl, &obj, NULL, false)) {
-		evbuffer_add_printf(ahttp->response.outbuf, "%s: %s" HTTP_CRLF, (char*) obj.name, (char*) obj.data);
-	}
+/**
+* Send multiple segments of body data by reference.
+*
+* release is called once after all the segments are sent, with the first
+* segment and the total size.
+*
+* @return total bytes put in out buffer, 0 on error.
+*/
+size_t httpSendDatav(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata) {
 
-	tbl->unlock(tbl);
+	return sendData(conn, iov, iovcnt, release, userdata, false);
+}
 
-	// Send empty line, indicator of end of header.
-	evbuffer_add(ahttp->response.outbuf, HTTP_CRLF, STRLEN(HTTP_CRLF));
-	return evbuffer_get_length(ahttp->response.outbuf);
+size_t httpSendChunk(connection* conn, const void* data, size_t size) {
+
+	struct iovec iov = { (void*) data, size };
+
+	return sendChunk(conn, &iov, (size > 0) ? 1 : 0, NULL, NULL, true);
 }
 
 /**
+* Send a chunk by reference, without copying it into the out-buffer.
 *
-* @return 0 on success, -1 if we already sent it out.
+* Only chunk framing is written to the out-buffer. Zero size sends the last
+* chunk. release follows the same rules as httpSendDataRef().
+*
+* @return total bytes put in out buffer, 0 on error.
 */
-size_t httpSendData(connection* conn, const void* data, size_t size) {
+size_t httpSendChunkRef(connection* conn, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata) {
+
+	struct iovec iov = { (void*) data, size };
+
+	return sendChunk(conn, &iov, (size > 0) ? 1 : 0, release, userdata, false);
+}
+
+/**
+* Send multiple segments by reference as one chunk.
+*
+* @return total bytes put in out buffer, 0 on error.
+*/
+size_t httpSendChunkv(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata) {
+
+	return sendChunk(conn, iov, iovcnt, release, userdata, false);
+}
+
+/**
+* Send a range of file segment as body without copying it into memory.
+*
+* The segment is referenced by the out-buffer, so libevent can use sendfile()
+* when the connection is not encrypted. On TLS connections where the kernel
+* encrypts records the file goes out with SSL_sendfile() instead, see
+* connectionSendFile().
+*
+* @param fd file the segment was made of, -1 to always use the segment.
+*
+* @return total bytes put in out buffer or handed to the connection, 0 on error.
+*/
+size_t httpSendFileSegment(connection* conn, struct evbuffer_file_segment* seg, int fd, off_t offset, off_t size) {
 
 	http* ahttp = (http*) connectionGetExtra(conn);
 
@@ -376,27 +727,55 @@ size_t httpSendData(connection* conn, const void* data, size_t size) {
 
 	size_t beforesize = evbuffer_get_length(ahttp->response.outbuf);
 
+	// file segments go out as they are, no compression.
 	if (!ahttp->response.frozen_header) {
 
-		httpSendHeader(conn);
+		sendHeader(conn, NULL, 0, ahttp->response.contentlength, false);
 	}
 
-	if (data != NULL && size > 0) {
-		if (evbuffer_add(ahttp->response.outbuf, data, size)) return 0;
+	size_t handed = 0;
+
+	if (seg != NULL && size > 0) {
+
+		if (fd >= 0 && ahttp->response.outbuf == conn->out && connectionSendFile(conn, fd, offset, size) == 0) {
+			handed = size;
+		} else if (evbuffer_add_file_segment(ahttp->response.outbuf, seg, offset, size)) {
+			return 0;
+		}
 	}
 
+	// file content is not copied into memory, so the response can't be captured.
+	stopCapture(ahttp);
+
 	ahttp->response.bodyout += size;
 
-	return (evbuffer_get_length(ahttp->response.outbuf) - beforesize);
+	if (ahttp->response.bodyout == ahttp->response.contentlength) {
+
+		ahttp->response.complete = true;
+
+		if (ahttp->stream != NULL) http2EndStream(ahttp);
+	}
+
+	return (evbuffer_get_length(ahttp->response.outbuf) - beforesize + handed);
 }
 
-size_t httpSendChunk(connection* conn, const void* data, size_t size) {
+/**
+* Move data from an evbuffer into the body without copying, ex) relaying
+* another connection. Framed as a chunk when Content-Length is not set.
+*
+* @return bytes taken from buf, 0 on error.
+*/
+size_t httpSendBuffer(connection* conn, struct evbuffer* buf, size_t size) {
 
 	http* ahttp = (http*) connectionGetExtra(conn);
 
-	if (ahttp->response.contentlength >= 0) {
+	size_t avail = evbuffer_get_length(buf);
+	if (size > avail) size = avail;
 
-		WARN("Content-Length is set. Invalid usage.");
+	if (size == 0) return 0;
+
+	if (ahttp->response.contentlength >= 0 && (ahttp->response.bodyout + size) > ahttp->response.contentlength) {
+		WARN("Trying to send more data than supposed to");
 		return 0;
 	}
 
@@ -404,33 +783,85 @@ size_t httpSendChunk(connection* conn, const void* data, size_t size) {
 		httpSendHeader(conn);
 	}
 
-	size_t beforesize = evbuffer_get_length(ahttp->response.outbuf);
+	// compression and capture need the bytes themselves, hand them over as iovec.
+	if (ahttp->response.compressor != NULL || ahttp->response.capture != NULL) {
 
-	int status = 0;
+		int n = evbuffer_peek(buf, size, NULL, NULL, 0);
+
+		struct evbuffer_iovec vecs[n];
+		struct iovec iov[n];
 
-	if (size > 0) {
+		evbuffer_peek(buf, size, NULL, vecs, n);
 
-		status += evbuffer_add_printf(ahttp->response.outbuf, "%zu" HTTP_CRLF,
-		size);
-		status += evbuffer_add(ahttp->response.outbuf, data, size);
-		status += evbuffer_add(ahttp->response.outbuf, HTTP_CRLF,
-		CONST_STRLEN(HTTP_CRLF));
+		size_t left = size;
+
+		for (int i = 0; i < n; i++) {
+			iov[i].iov_base	= vecs[i].iov_base;
+			iov[i].iov_len	= (vecs[i].iov_len < left) ? vecs[i].iov_len : left;
+			left			-= iov[i].iov_len;
+		}
+
+		size_t sent = (ahttp->response.contentlength >= 0)
+			? sendData(conn, iov, n, NULL, NULL, true)
+			: sendChunk(conn, iov, n, NULL, NULL, true);
+
+		evbuffer_drain(buf, size);
+
+		return (sent > 0) ? size : 0;
+	}
+
+	struct evbuffer* out	= ahttp->response.outbuf;
+	size_t beforesize		= evbuffer_get_length(out);
+
+	if (ahttp->response.contentlength >= 0 || ahttp->stream != NULL) {
+
+		if (evbuffer_remove_buffer(buf, out, size) != (int) size) return 0;
 
 	} else {
 
-		status += evbuffer_add_printf(ahttp->response.outbuf, "0" HTTP_CRLF HTTP_CRLF);
+		char header[HTTP_CHUNK_HEADER_SIZE];
+		size_t headerlen = formatChunkHeader(header, size);
+
+		if (evbuffer_add(out, header, headerlen)
+			|| evbuffer_remove_buffer(buf, out, size) != (int) size
+			|| evbuffer_add(out, HTTP_CRLF, STRLEN(HTTP_CRLF))) {
+
+			WARN("Failed to add data to out-buffer. (size:%zu)", size);
+			return 0;
+		}
 	}
 
-	if (status != 0) {
+	if (ahttp->response.contentlength >= 0) {
 
-		WARN("Failed to add data to out-buffer. (size:%jd)", size);
-		return 0;
+		ahttp->response.bodyout += size;
+
+		if (ahttp->response.bodyout == ahttp->response.contentlength) {
+
+			ahttp->response.complete = true;
+
+			if (ahttp->stream != NULL) http2EndStream(ahttp);
+		}
+
+	} else {
+
+		ahttp->response.bodyout += evbuffer_get_length(out) - beforesize;
 	}
 
-	size_t bytesout = evbuffer_get_length(ahttp->response.outbuf) - beforesize;
-	ahttp->response.bodyout += bytesout;
+	return size;
+}
 
-	return bytesout;
+/**
+* Ask to be called on every piece of request body.
+*
+* Hooks are called once with HTTP_REQ_HEADER_DONE before the body arrives.
+* After this call they are also called each time body data is moved to the
+* in-buffer, so the body can be consumed as it comes instead of piling up.
+*/
+void httpSetBodyStreaming(connection* conn, bool streaming) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	ahttp->request.streambody = streaming;
 }
 
 const char *ad_http_get_reason(int code) {
@@ -439,6 +870,9 @@ const char *ad_http_get_reason(int code) {
 		case HTTP_CODE_CONTINUE:
 			return "Continue";
 
+		case HTTP_CODE_SWITCHING_PROTOCOLS:
+			return "Switching Protocols";
+
 		case HTTP_CODE_OK:
 			return "OK";
 
@@ -454,6 +888,9 @@ const char *ad_http_get_reason(int code) {
 		case HTTP_CODE_MULTI_STATUS:
 			return "Multi Status";
 
+		case HTTP_CODE_MOVED_PERMANENTLY:
+			return "Moved Permanently";
+
 		case HTTP_CODE_MOVED_TEMPORARILY:
 			return "Moved Temporarily";
 
@@ -481,20 +918,41 @@ const char *ad_http_get_reason(int code) {
 		case HTTP_CODE_GONE:
 			return "Gone";
 
+		case HTTP_CODE_REQUEST_ENTITY_TOO_LARGE:
+			return "Request Entity Too Large";
+
 		case HTTP_CODE_REQUEST_URI_TOO_LONG:
 			return "Request URI Too Long";
 
+		case HTTP_CODE_RANGE_NOT_SATISFIABLE:
+			return "Requested Range Not Satisfiable";
+
 		case HTTP_CODE_LOCKED:
 			return "Locked";
 
+		case HTTP_CODE_UPGRADE_REQUIRED:
+			return "Upgrade Required";
+
+		case HTTP_CODE_TOO_MANY_REQUESTS:
+			return "Too Many Requests";
+
+		case HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE:
+			return "Request Header Fields Too Large";
+
 		case HTTP_CODE_INTERNAL_SERVER_ERROR:
 			return "Internal Server Error";
 
 		case HTTP_CODE_NOT_IMPLEMENTED:
 			return "Not Implemented";
 
+		case HTTP_CODE_BAD_GATEWAY:
+			return "Bad Gateway";
+
 		case HTTP_CODE_SERVICE_UNAVAILABLE:
 			return "Service Unavailable";
+
+		case HTTP_CODE_GATEWAY_TIME_OUT:
+			return "Gateway Time Out";
 	}
 
 	WARN("Undefined code found. %d", code);
@@ -523,6 +981,7 @@ static http* httpNew(struct evbuffer* out) {
 	// initialize structure
 	ahttp->request.status			= HTTP_REQ_INIT;
 	ahttp->request.contentlength	= -1;
+	ahttp->request.spool.fd			= -1;
 	ahttp->response.contentlength	= -1;
 	ahttp->response.outbuf			= out;
 
@@ -535,6 +994,10 @@ static void httpFree(http* ahttp) {
 
 		if (ahttp->request.inbuf)		evbuffer_free(ahttp->request.inbuf);
 
+		if (ahttp->request.spool.map)	munmap(ahttp->request.spool.map, ahttp->request.spool.maplen);
+
+		if (ahttp->request.spool.fd >= 0)	close(ahttp->request.spool.fd);
+
 		if (ahttp->request.method)		free(ahttp->request.method);
 
 		if (ahttp->request.uri)			free(ahttp->request.uri);
@@ -545,6 +1008,10 @@ static void httpFree(http* ahttp) {
 
 		if (ahttp->request.query)		free(ahttp->request.query);
 
+		if (ahttp->request.queryparams)	paramViewFree(ahttp->request.queryparams);
+
+		if (ahttp->request.formparams)	paramViewFree(ahttp->request.formparams);
+
 		if (ahttp->request.headers)		ahttp->request.headers->free(ahttp->request.headers);
 
 		if (ahttp->request.host)		free(ahttp->request.host);
@@ -555,6 +1022,8 @@ static void httpFree(http* ahttp) {
 
 		if (ahttp->response.reason)		free(ahttp->response.reason);
 
+		if (ahttp->response.compressor)	compressorRelease(ahttp->response.compressor);
+
 		free(ahttp);
 	}
 }
@@ -570,15 +1039,331 @@ static size_t httpAddInbuf(struct evbuffer *buffer, http* ahttp, size_t maxsize)
 		return 0;
 	}
 
-	return evbuffer_remove_buffer(buffer, ahttp->request.inbuf, maxsize);
-}
+	size_t moved = evbuffer_remove_buffer(buffer, ahttp->request.inbuf, maxsize);
 
-static int httpParser(http* ahttp, struct evbuffer* in) {
+	// hooks consuming the body as it comes keep it in memory.
+	if (ahttp->request.spool.threshold > 0 && !ahttp->request.streambody) {
+
+		size_t buffered = evbuffer_get_length(ahttp->request.inbuf);
+
+		if ((ahttp->request.spool.fd < 0 && buffered > ahttp->request.spool.threshold)
+		|| (ahttp->request.spool.fd >= 0 && buffered >= HTTP_SPOOL_WRITE_SIZE)) {
+
+			spoolBody(ahttp);
+		}
+	}
+
+	return moved;
+}
+
+/**
+* Open an unlinked temp file, it's gone with its descriptor.
+*/
+static int openSpoolFile(const char* dir) {
+
+	if (dir == NULL || *dir == '\0') dir = "/tmp";
+
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+	// file systems without O_TMPFILE
+	if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+
+		char path[PATH_MAX];
+
+		if (snprintf(path, sizeof(path), "%s/body.XXXXXX", dir) >= (int) sizeof(path)) return -1;
+
+		if ((fd = mkostemp(path, O_CLOEXEC)) >= 0) unlink(path);
+	}
+
+	if (fd < 0) {
+		WARN("Failed to open request body spool in %s. (%s)", dir, strerror(errno));
+	}
+
+	return fd;
+}
+
+/**
+* Move the body in the in-buffer to the spool file, opened on first use.
+*
+* @return 0 on success, -1 on error and the request is failed.
+*/
+static int spoolBody(http* ahttp) {
+
+	if (ahttp->request.spool.fd < 0) {
+
+		if ((ahttp->request.spool.fd = openSpoolFile(ahttp->request.spool.dir)) < 0) {
+			failSpool(ahttp);
+			return -1;
+		}
+
+		DEBUG("Spooling request body. %zu bytes buffered", evbuffer_get_length(ahttp->request.inbuf));
+	}
+
+	while (evbuffer_get_length(ahttp->request.inbuf) > 0) {
+
+		int written = evbuffer_write(ahttp->request.inbuf, ahttp->request.spool.fd);
+
+		if (written < 0) {
+
+			if (errno == EINTR) continue;
+
+			WARN("Failed to spool request body. (%s)", strerror(errno));
+			failSpool(ahttp);
+			return -1;
+		}
+
+		ahttp->request.spool.size += written;
+	}
+
+	return 0;
+}
+
+/**
+* Remove up to maxsize bytes of the spooled body, 0 for everything.
+*/
+static void* readSpool(http* ahttp, size_t maxsize, size_t* storedsize) {
+
+	if (spoolBody(ahttp) < 0) return NULL;
+
+	size_t left		= ahttp->request.spool.size - ahttp->request.spool.offset;
+	size_t readlen	= (maxsize == 0 || left < maxsize) ? left : maxsize;
+
+	if (readlen == 0) return NULL;
+
+	char* data = malloc(readlen);
+
+	if (data == NULL) return NULL;
+
+	size_t readsize = 0;
+
+	while (readsize < readlen) {
+
+		ssize_t n = pread(ahttp->request.spool.fd, data + readsize, readlen - readsize, ahttp->request.spool.offset + readsize);
+
+		if (n < 0 && errno == EINTR) continue;
+
+		if (n <= 0) {
+			WARN("Failed to read spooled request body. (%s)", (n < 0) ? strerror(errno) : "short file");
+			failSpool(ahttp);
+			free(data);
+			return NULL;
+		}
+
+		readsize += n;
+	}
+
+	ahttp->request.spool.offset += readsize;
+	*storedsize = readsize;
+
+	return data;
+}
+
+/**
+* Put what is left of the spooled body back in the in-buffer as a mapped
+* file segment and keep the rest of the request in memory.
+*/
+static void unspoolBody(http* ahttp) {
+
+	// the tail still in memory goes after the file segment.
+	if (spoolBody(ahttp) < 0) return;
+
+	int fd		= ahttp->request.spool.fd;
+	off_t left	= ahttp->request.spool.size - ahttp->request.spool.offset;
+
+	ahttp->request.spool.fd			= -1;
+	ahttp->request.spool.threshold	= 0;
+
+	if (left <= 0) {
+		close(fd);
+		return;
+	}
+
+	// the segment owns the descriptor once created, the in-buffer holds its own reference.
+	struct evbuffer_file_segment* seg = evbuffer_file_segment_new(fd, ahttp->request.spool.offset, left, EVBUF_FS_CLOSE_ON_FREE);
+
+	if (seg == NULL) {
+		close(fd);
+	}
+
+	if (seg == NULL || evbuffer_add_file_segment(ahttp->request.inbuf, seg, 0, left) < 0) {
+		WARN("Failed to load spooled request body.");
+		failSpool(ahttp);
+	}
+
+	if (seg != NULL) evbuffer_file_segment_free(seg);
+}
+
+/**
+* Fail the request whose body can't be spooled or read back, hooks see
+* HTTP_ERROR. The parser answers it with 500 on its own, accessors called
+* by hooks go through rejectSpoolFailure().
+*/
+static void failSpool(http* ahttp) {
+
+	ahttp->request.errorcode	= HTTP_CODE_INTERNAL_SERVER_ERROR;
+	ahttp->request.status		= HTTP_ERROR;
+}
+
+/**
+* Answer a request failed by failSpool() with 500 and close the connection
+* after it, unless the response is under way already.
+*/
+static void rejectSpoolFailure(connection* conn, http* ahttp) {
+
+	if (ahttp->request.status != HTTP_ERROR || ahttp->request.errorcode == 0 || ahttp->response.frozen_header) {
+		return;
+	}
+
+	rejectRequest(conn, ahttp);
+
+	if (conn->parent == NULL) conn->status = CLOSE;
+}
+
+/**
+* Let the server enforce the deadline of where the request is at. The header
+* phase starts with the first byte of the request, not while a keep-alive
+* connection waits for it.
+*/
+static void setRequestPhase(connection* conn, http* ahttp) {
+
+	switch (ahttp->request.status) {
+
+		case HTTP_REQ_INIT : {
+			if (evbuffer_get_length(conn->in) > 0) connectionSetPhase(conn, CONN_PHASE_HEADER);
+			break;
+		}
+
+		case HTTP_REQ_REQUESTLINE_DONE : {
+			connectionSetPhase(conn, CONN_PHASE_HEADER);
+			break;
+		}
+
+		case HTTP_REQ_HEADER_DONE : {
+			connectionSetPhase(conn, CONN_PHASE_BODY);
+			break;
+		}
+
+		default : {
+			connectionSetPhase(conn, CONN_PHASE_IDLE);
+			break;
+		}
+	}
+}
+
+/**
+* Answer a request rejected by the parser with its error code and close the
+* connection. The rest of the request is neither buffered nor read.
+*/
+static void rejectRequest(connection* conn, http* ahttp) {
+
+	int code			= ahttp->request.errorcode;
+	const char* reason	= httpGetReason(code);
+
+	DEBUG("Request rejected. %d %s", code, reason);
+
+	// request line may be the part that was rejected.
+	if (ahttp->request.httpver == NULL) {
+		ahttp->request.httpver = strdup(HTTP_PROTOCOL_11);
+	}
+
+	// streams share the bufferevent of their connection.
+	if (conn->buffer != NULL && conn->parent == NULL) {
+		bufferevent_disable(conn->buffer, EV_READ);
+	}
+
+	evbuffer_drain(conn->in, evbuffer_get_length(conn->in));
+
+	httpSetResponseHeader(conn, "Connection", "close");
+	httpResponse(conn, code, "text/plain", reason, strlen(reason));
+}
+
+/**
+* Check the line at the head of the buffer against a size limit, whether the
+* line is complete or not, so a long line is caught before it is buffered.
+*
+* @param maxsize bytes the line can have without its line ending.
+*/
+static bool isLineTooLong(struct evbuffer* in, size_t maxsize) {
+
+	size_t eollen			= 0;
+	struct evbuffer_ptr eol	= evbuffer_search_eol(in, NULL, &eollen, EVBUFFER_EOL_CRLF);
+	size_t linesize			= (eol.pos >= 0) ? (size_t) eol.pos : evbuffer_get_length(in);
+
+	return (linesize > maxsize);
+}
+
+/**
+* Check if the client waits for 100 Continue before sending the body.
+*
+* Nothing is held back for HTTP/1.0 clients, requests without a body, or
+* clients that started sending the body without waiting.
+*/
+static bool expectsContinue(http* ahttp, struct evbuffer* in) {
+
+	const char* expect = ahttp->request.headers->getstr(ahttp->request.headers, "Expect", false);
+
+	if (expect == NULL || strcasecmp(expect, "100-continue")) return false;
+
+	if (strcmp(ahttp->request.httpver, HTTP_PROTOCOL_11)) return false;
+
+	if (ahttp->request.contentlength <= 0 && !isChunkedRequest(ahttp)) return false;
+
+	return (evbuffer_get_length(in) == 0);
+}
+
+/**
+* Stop reading while the hooks decide on the header, then come back on the
+* next loop. Hooks reject the request by answering it, neither 100 Continue
+* nor the body goes over the wire then and the connection is closed once
+* the answer is sent.
+*
+* @note
+* The header is accepted once the hook chain has seen it, hooks that park
+* the request with TAKEOVER to decide later must answer before the body
+* is needed.
+*/
+static void holdBody(connection* conn, http* ahttp) {
+
+	ahttp->request.expect = HTTP_EXPECT_ACCEPT;
+
+	bufferevent_disable(conn->buffer, EV_READ);
+	connectionResume(conn);
+}
+
+/**
+* Send 100 Continue and read the body.
+*/
+static void sendContinue(connection* conn, http* ahttp) {
+
+	ahttp->request.expect = HTTP_EXPECT_CONTINUED;
+
+	evbuffer_add_printf(ahttp->response.outbuf, "%s %d %s" HTTP_CRLF HTTP_CRLF,
+		HTTP_PROTOCOL_11, HTTP_CODE_CONTINUE, httpGetReason(HTTP_CODE_CONTINUE));
+
+	bufferevent_enable(conn->buffer, EV_READ);
+}
+
+/**
+* check if the body of an Expect: 100-continue request is held back unread.
+*/
+static bool isBodyHeld(http* ahttp) {
+
+	return (ahttp->request.expect == HTTP_EXPECT_HOLD || ahttp->request.expect == HTTP_EXPECT_ACCEPT);
+}
+
+static int httpParser(http* ahttp, struct evbuffer* in) {
 
 	ASSERT(http != NULL && in != NULL);
 
 	if (ahttp->request.status == HTTP_REQ_INIT) {
 
+		if (ahttp->request.maxrequestline > 0 && isLineTooLong(in, ahttp->request.maxrequestline)) {
+			DEBUG("Request line is too long. (max:%zu)", ahttp->request.maxrequestline);
+			ahttp->request.errorcode	= HTTP_CODE_REQUEST_URI_TOO_LONG;
+			ahttp->request.status		= HTTP_ERROR;
+			return CLOSE;
+		}
+
 		char* line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF);
 		if (line == NULL) return ahttp->request.status;
 
@@ -591,6 +1376,8 @@ static int httpParser(http* ahttp, struct evbuffer* in) {
 		}
 	}
 
+	bool headerdone = false;
+
 	if (ahttp->request.status == HTTP_REQ_REQUESTLINE_DONE) {
 
 		ahttp->request.status = parse_headers(http, in);
@@ -599,15 +1386,28 @@ static int httpParser(http* ahttp, struct evbuffer* in) {
 		if (ahttp->request.status == HTTP_REQ_REQUESTLINE_DONE) {
 			return TAKEOVER;
 		}
+
+		headerdone = (ahttp->request.status == HTTP_REQ_HEADER_DONE);
 	}
 
 	if (ahttp->request.status == HTTP_REQ_HEADER_DONE) {
 
+		// body is held back until hooks accepted the header.
+		if (ahttp->request.expect == HTTP_EXPECT_HOLD) {
+			return OK;
+		}
+
 		ahttp->request.status = parse_body(http, in);
 
-		// Do not call user callbacks until I reach the next state.
+		// body could not be spooled.
+		if (ahttp->request.errorcode > 0) {
+			ahttp->request.status = HTTP_ERROR;
+		}
+
+		// Hooks see the headers once before the body, then every piece of the
+		// body only if one of them asked to stream it.
 		if (ahttp->request.status == HTTP_REQ_HEADER_DONE) {
-			return TAKEOVER;
+			return (headerdone || ahttp->request.streambody) ? OK : TAKEOVER;
 		}
 	}
 
@@ -638,19 +1438,33 @@ static int parseRequestLine(http* ahttp, char* line) {
 		return HTTP_ERROR;
 	}
 
+	if (strcasecmp(httpver, HTTP_PROTOCOL_09)
+	&& strcasecmp(httpver, HTTP_PROTOCOL_10)
+	&& strcasecmp(httpver, HTTP_PROTOCOL_11)) {
+		DEBUG("Unknown protocol: %s", httpver);
+		return HTTP_ERROR;
+	}
+
+	return httpSetRequestLine(ahttp, method, uri, httpver);
+}
+
+/**
+* Set method, URI and version of the request, URI is split into path and query.
+*
+* Used by parsers of protocols that don't have a request line, such as HTTP/2.
+*
+* @return HTTP_REQ_REQUESTLINE_DONE on success, HTTP_ERROR on invalid URI.
+*/
+int httpSetRequestLine(http* ahttp, const char* method, const char* uri, const char* httpver) {
+
+	char* tmp;
+
 	// set request method
 	ahttp->request.method = qstrupper(strdup(method));
 
 	// set HTTP version
 	ahttp->request.httpver = qstrupper(strdup(httpver));
 
-	if (strcmp(ahttp->request.httpver, HTTP_PROTOCOL_09)
-	&& strcmp(ahttp->request.httpver, HTTP_PROTOCOL_10)
-	&& strcmp(ahttp->request.httpver, HTTP_PROTOCOL_11)) {
-		DEBUG("Unknown protocol: %s", ahttp->request.httpver);
-		return HTTP_ERROR;
-	}
-
 	// set URI
 	if (uri[0] == '/') {
 
@@ -658,190 +1472,528 @@ static int parseRequestLine(http* ahttp, char* line) {
 
 	} else if ((tmp = strstr(uri, "://"))) {
 
-		// divide URI into host and path
-		char* path = strstr(tmp + STRLEN("://"), "/");
+		// divide URI into host and path ex) http://domain.com:80/path
+		const char* host	= tmp + STRLEN("://");
+		const char* path	= strchr(host, '/');
+		char* hostname		= (path) ? strndup(host, path - host) : strdup(host);
 
-		if (path == NULL) { // URI has no path ex) http://domain.com:80
+		if (hostname) {
+			ahttp->request.headers->putstr(ahttp->request.headers, "Host", hostname);
+			free(hostname);
+		}
 
-			ahttp->request.headers->putstr(ahttp->request.headers, "Host",
-			tmp + STRLEN("://"));
-			ahttp->request.uri = strdup("/");
+		// URI has no path ex) http://domain.com:80
+		ahttp->request.uri = strdup((path) ? path : "/");
 
-		} else { // URI has path, ex) http://domain.com:80/path
-			*path = '\0';
-			ahttp->request.headers->putstr(ahttp->request.headers, "Host",
-			tmp + STRLEN("://"));
-			*path = '/';
-			ahttp->request.uri = strdup(path);
-		}
 	} else {
 		DEBUG("Invalid URI format. %s", uri);
 		return HTTP_ERROR;
 	}
 
 	// Set request path. Only path part from URI.
-	ahttp->request.path = strdup(ahttp->request.uri);
-	tmp = strstr(ahttp->request.path, "?");
-
-	if (tmp) {
+	size_t pathlen	= strcspn(ahttp->request.uri, "?");
+	const char* q	= ahttp->request.uri + pathlen;
 
-		*tmp = '\0';
-		ahttp->request.query = strdup(tmp + 1);
+	ahttp->request.path		= strndup(ahttp->request.uri, pathlen);
+	ahttp->request.query	= strdup((*q == '?') ? q + 1 : "");
 
-	} else {
-
-		ahttp->request.query = strdup("");
-	}
-
-	urlDecode(ahttp->request.path);
-
-	// check path
-	if (isValidPathname(ahttp->request.path) == false) {
+	// decode, validate and correct path in one pass
+	if (ahttp->request.path == NULL || urlNormalizePath(ahttp->request.path) < 0) {
 
 		DEBUG("Invalid URI format : %s", ahttp->request.uri);
 		return HTTP_ERROR;
 	}
 
-	correctPathname(ahttp->request.path);
 	DEBUG("Method=%s, URI=%s, VER=%s", ahttp->request.method,ahttp->request.uri, ahttp->request.httpver);
 
 	return HTTP_REQ_REQUESTLINE_DONE;
 }
 
-static int parseHeaders(http* ahttp, struct evbuffer* in) {
-
-	char* line;
-
-	while ((line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF))) {
-
-		if (IS_EMPTY_STR(line)) {
+/**
+* Set host and domain of the request from the Host header. Domain is
+* lowercased, without port and trailing dot, ready for lookups.
+*
+* Used by parsers once the request header is complete.
+*/
+void httpSetRequestHost(http* ahttp) {
 
-			const char* clen = ahttp->request.headers->getstr(ahttp->request.headers, "Content-Length", false);
-			ahttp->request.contentlength = (clen) ? atol(clen) : -1;
-			free(line);
-			return HTTP_REQ_HEADER_DONE;
-		}
+	const char* host = ahttp->request.headers->getstr(ahttp->request.headers, "Host", false);
 
-		// parse
-		char* name;
-		char* value;
-		char* tmp = strstr(line, ":");
+	if (host == NULL || *host == '\0') return;
 
-		if (tmp) {
+	if (ahttp->request.host)	free(ahttp->request.host);
+	if (ahttp->request.domain)	free(ahttp->request.domain);
 
-			*tmp	= '\0';
-			name	= qstrtrim(line);
-			value	= qstrtrim(tmp + 1);
+	// ex) www.domain.com:8080, [::1]:8080
+	const char* end	= (host[0] == '[') ? strchr(host, ']') : NULL;
+	size_t len		= (end) ? (size_t) (end - host + 1) : strcspn(host, ":");
 
-		} else {
+	if (len > 1 && host[len - 1] == '.') len--;
 
-			name = qstrtrim(line);
-			value = "";
-		}
+	ahttp->request.host		= strdup(host);
+	ahttp->request.domain	= strndup(host, len);
 
-		// add
-		ahttp->request.headers->putstr(ahttp->request.headers, name, value);
-		free(line);
+	for (char* p = ahttp->request.domain; p != NULL && *p != '\0'; p++) {
+		*p = tolower((unsigned char) *p);
 	}
-
-	return ahttp->request.status;
 }
 
-static int parseBody(http* ahttp, struct evbuffer* in) {
-
-	// handle static data case
-	if (ahttp->request.contentlength == 0) {
-
-		return HTTP_REQ_DONE;
-
-	} else if (ahttp->request.contentlength > 0) {
-
-		if (ahttp->request.contentlength > ahttp->request.bodyin) {
-			size_t maxread = ahttp->request.contentlength - ahttp->request.bodyin;
-			if (maxread > 0 && evbuffer_get_length(in) > 0) {
-				ahttp->request.bodyin += httpAddInbuf(in, http, maxread);
-			}
-		}
-
-		if (ahttp->request.contentlength == ahttp->request.bodyin) {
-			return HTTP_REQ_DONE;
-		}
-
-	} else {
+/**
+* Add a request header. A Content-Length given again must repeat the same
+* value, otherwise the body length is ambiguous.
+*
+* Used by parsers of every protocol so framing headers are checked alike.
+*
+* @return 0 on success, -1 on a conflicting header with errorcode set to 400.
+*/
+int httpAddRequestHeader(http* ahttp, const char* name, const char* value) {
 
-		// check if Transfer-Encoding is chunked
-		const char* tranenc = ahttp->request.headers->getstr(ahttp->request.headers, "Transfer-Encoding", false);
+	listtable* headers = ahttp->request.headers;
 
-		if (tranenc != NULL && !strcmp(tranenc, "chunked")) {
-			// TODO: handle chunked encoding
-			for (;;) {
+	if (!strcasecmp(name, "Content-Length")) {
 
-				ssize_t chunksize = parseChunkedBody(http, in);
+		const char* prev = headers->getstr(headers, "Content-Length", false);
 
-				if (chunksize > 0) {
-					continue;
-				} else if (chunksize == 0) {
-					return HTTP_REQ_DONE;
-				} else if (chunksize == -1) {
-					return ahttp->request.status;
-				} else {
-					return HTTP_ERROR;
-				}
-			}
-		} else {
-			return HTTP_REQ_DONE;
+		if (prev != NULL && strcmp(prev, value)) {
+			DEBUG("Conflicting Content-Length. %s, %s", prev, value);
+			ahttp->request.errorcode = HTTP_CODE_BAD_REQUEST;
+			return -1;
 		}
 	}
 
-	return ahttp->request.status;
+	headers->putstr(headers, name, value);
+
+	return 0;
 }
 
 /**
-* parse chunked body and append it to inbuf
+* Set the body length from the Content-Length header, -1 if there's none.
+*
+* Used by parsers once the request header is complete. Only plain digits
+* are taken, and not along with Transfer-Encoding. Anything else could be
+* framed differently by a proxy in front of us and smuggle a request in.
 *
-* @return number of bytes in a chunk. so 0 for the ending chunk. -1 for not enough data, -2 format error.
+* @return 0 on success, -1 on an invalid Content-Length with errorcode set to 400.
 */
-static ssize_t parseChunkedBody(http* ahttp, struct evbuffer* in) {
+int httpSetContentLength(http* ahttp) {
 
-	// peek chunk size.
-	size_t crlf_len = 0;
-	char* line		= evbufferPeekln(in, &crlf_len, EVBUFFER_EOL_CRLF);
+	const char* clen = ahttp->request.headers->getstr(ahttp->request.headers, "Content-Length", false);
 
-	if (line == NULL)return -1; // not enough data.
+	ahttp->request.contentlength = -1;
 
-	size_t linelen = strlen(line);
+	if (clen == NULL) return 0;
 
-	// parse chunk size
-	int chunksize = -1;
-	sscanf(line, "%x", &chunksize);
-	free(line);
+	char* end		= NULL;
+	errno			= 0;
+	long long len	= strtoll(clen, &end, 10);
 
-	if (chunksize < 0)return -2; // format error
+	if (!isdigit((unsigned char) clen[0]) || *end != '\0' || errno == ERANGE
+	|| ahttp->request.headers->getstr(ahttp->request.headers, "Transfer-Encoding", false) != NULL) {
 
-	// check if we've received whole data of this chunk.
-	size_t datalen	= linelen + crlf_len + chunksize + crlf_len;
-	size_t inbuflen = evbuffer_get_length(in);
-
-	if (inbuflen < datalen) {
-		return -1; // not enough data.
+		DEBUG("Invalid Content-Length. %s", clen);
+		ahttp->request.errorcode = HTTP_CODE_BAD_REQUEST;
+		return -1;
 	}
 
-	// copy chunk body
-	evbufferDrainln(in, NULL, EVBUFFER_EOL_CRLF);
-	httpAddInbuf(in, ahttp, chunksize);
-	evbufferDrainln(in, NULL, EVBUFFER_EOL_CRLF);
+	ahttp->request.contentlength = len;
 
-	return chunksize;
+	return 0;
 }
 
 /**
-* validate file path
+* Move request body from a buffer to the request, spooled the same way as a
+* body read by the HTTP/1.x parser.
+*
+* Used by parsers of protocols that frame the body themselves, such as HTTP/2.
+*
+* @return bytes moved. The request is in HTTP_ERROR if the body can't be spooled.
 */
-static bool isValidPathname(const char* path) {
+size_t httpAddContent(http* ahttp, struct evbuffer* buffer, size_t size) {
 
-	if (path == NULL) return false;
+	size_t moved = httpAddInbuf(buffer, ahttp, size);
 
-	int len = strlen(path);
+	ahttp->request.bodyin += moved;
+
+	return moved;
+}
+
+static int parseHeaders(http* ahttp, struct evbuffer* in) {
+
+	char* line;
+
+	for (;;) {
+
+		// header lines are counted against the limits before they are read out.
+		if (ahttp->request.maxheadersize > 0) {
+
+			size_t left = (ahttp->request.headersize < ahttp->request.maxheadersize)
+				? ahttp->request.maxheadersize - ahttp->request.headersize : 0;
+
+			if (isLineTooLong(in, left)) {
+				DEBUG("Request header is too large. (max:%zu)", ahttp->request.maxheadersize);
+				ahttp->request.errorcode = HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE;
+				return HTTP_ERROR;
+			}
+		}
+
+		size_t buffered = evbuffer_get_length(in);
+
+		if ((line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF)) == NULL) break;
+
+		ahttp->request.headersize += buffered - evbuffer_get_length(in);
+
+		if (IS_EMPTY_STR(line)) {
+
+			free(line);
+
+			if (httpSetContentLength(ahttp) < 0) return HTTP_ERROR;
+
+			httpSetRequestHost(ahttp);
+
+			// refuse a body known to be too large before any of it is buffered.
+			if (ahttp->request.maxbodysize > 0 && ahttp->request.contentlength > ahttp->request.maxbodysize && !isChunkedRequest(ahttp)) {
+				DEBUG("Request body is too large. %jd (max:%jd)", (intmax_t) ahttp->request.contentlength, (intmax_t) ahttp->request.maxbodysize);
+				ahttp->request.errorcode = HTTP_CODE_REQUEST_ENTITY_TOO_LARGE;
+				return HTTP_ERROR;
+			}
+
+			if (expectsContinue(ahttp, in)) {
+				ahttp->request.expect = HTTP_EXPECT_HOLD;
+			}
+
+			return HTTP_REQ_HEADER_DONE;
+		}
+
+		if (ahttp->request.maxheaders > 0 && ++ahttp->request.numheaders > ahttp->request.maxheaders) {
+			DEBUG("Too many request headers. (max:%d)", ahttp->request.maxheaders);
+			ahttp->request.errorcode = HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE;
+			free(line);
+			return HTTP_ERROR;
+		}
+
+		// parse
+		char* name;
+		char* value;
+		char* tmp = strstr(line, ":");
+
+		if (tmp) {
+
+			*tmp	= '\0';
+			name	= qstrtrim(line);
+			value	= qstrtrim(tmp + 1);
+
+		} else {
+
+			name = qstrtrim(line);
+			value = "";
+		}
+
+		// add
+		int added = httpAddRequestHeader(ahttp, name, value);
+		free(line);
+
+		if (added < 0) return HTTP_ERROR;
+	}
+
+	return ahttp->request.status;
+}
+
+static int parseBody(http* ahttp, struct evbuffer* in) {
+
+	// Transfer-Encoding overrides Content-Length.
+	if (isChunkedRequest(ahttp)) {
+
+		return parseChunkedBody(ahttp, in);
+
+	} else if (ahttp->request.contentlength == 0) {
+
+		return HTTP_REQ_DONE;
+
+	} else if (ahttp->request.contentlength > 0) {
+
+		if (ahttp->request.contentlength > ahttp->request.bodyin) {
+			size_t maxread = ahttp->request.contentlength - ahttp->request.bodyin;
+			if (maxread > 0 && evbuffer_get_length(in) > 0) {
+				ahttp->request.bodyin += httpAddInbuf(in, ahttp, maxread);
+			}
+		}
+
+		if (ahttp->request.contentlength == ahttp->request.bodyin) {
+			return HTTP_REQ_DONE;
+		}
+
+	} else {
+
+		return HTTP_REQ_DONE;
+	}
+
+	return ahttp->request.status;
+}
+
+/**
+* check if chunked is the final transfer-coding. ex) "gzip, chunked"
+*/
+static bool isChunkedRequest(http* ahttp) {
+
+	const char* tranenc = ahttp->request.headers->getstr(ahttp->request.headers, "Transfer-Encoding", false);
+
+	if (tranenc == NULL) return false;
+
+	const char* last = strrchr(tranenc, ',');
+	last = (last) ? last + 1 : tranenc;
+
+	while (*last == ' ' || *last == '\t') last++;
+
+	return (!strncasecmp(last, "chunked", STRLEN("chunked")) && strspn(last + STRLEN("chunked"), " \t") == strlen(last + STRLEN("chunked")));
+}
+
+/**
+* Decode chunked body incrementally and move chunk data to inbuf as it arrives.
+*
+* The decoder is a byte-level state machine, so it never waits for a whole
+* chunk nor copies framing into temporary lines. Chunk data is moved between
+* evbuffers without copying.
+*
+* @return HTTP_REQ_DONE after the trailer, HTTP_ERROR on format error or
+* size limit, otherwise current status to wait for more data.
+*/
+static int parseChunkedBody(http* ahttp, struct evbuffer* in) {
+
+	while (evbuffer_get_length(in) > 0) {
+
+		// chunk data
+		if (ahttp->request.chunked.state == HTTP_CHUNK_DATA) {
+
+			uint64_t remaining	= ahttp->request.chunked.remaining;
+			size_t maxread		= (remaining < SIZE_MAX) ? (size_t) remaining : SIZE_MAX;
+			size_t moved		= httpAddInbuf(in, ahttp, maxread);
+
+			ahttp->request.bodyin				+= moved;
+			ahttp->request.chunked.remaining	-= moved;
+
+			if (ahttp->request.chunked.remaining > 0) {
+				return ahttp->request.status;
+			}
+
+			ahttp->request.chunked.state = HTTP_CHUNK_DATA_CR;
+			continue;
+		}
+
+		// trailer section, small and rare. parsed line by line.
+		if (ahttp->request.chunked.state == HTTP_CHUNK_TRAILER) {
+			return parseChunkedTrailer(ahttp, in);
+		}
+
+		// framing bytes, scan contiguous memory of the first chain.
+		struct evbuffer_iovec vec;
+
+		if (evbuffer_peek(in, -1, NULL, &vec, 1) < 1 || vec.iov_len == 0) {
+			return ahttp->request.status;
+		}
+
+		const unsigned char* p		= (const unsigned char*) vec.iov_base;
+		const unsigned char* end	= p + vec.iov_len;
+
+		while (p < end && ahttp->request.chunked.state != HTTP_CHUNK_DATA && ahttp->request.chunked.state != HTTP_CHUNK_TRAILER) {
+
+			unsigned char c = *p++;
+
+			switch (ahttp->request.chunked.state) {
+
+				case HTTP_CHUNK_SIZE: {
+
+					int digit = (c >= '0' && c <= '9') ? c - '0'
+						: (c >= 'a' && c <= 'f') ? c - 'a' + 10
+						: (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+
+					if (digit >= 0) {
+
+						if (ahttp->request.chunked.remaining > (UINT64_MAX >> 4)) {
+							DEBUG("Chunk size overflow.");
+							return HTTP_ERROR;
+						}
+
+						ahttp->request.chunked.remaining = (ahttp->request.chunked.remaining << 4) | digit;
+						ahttp->request.chunked.numdigits++;
+						break;
+					}
+
+					if (ahttp->request.chunked.numdigits == 0) {
+						DEBUG("Invalid chunk size. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					// enforce body size before the chunk data arrives.
+					if (ahttp->request.maxbodysize > 0
+					&& ahttp->request.chunked.remaining > (uint64_t) (ahttp->request.maxbodysize - ahttp->request.bodyin)) {
+						DEBUG("Chunked body is too large. (max:%jd)", (intmax_t) ahttp->request.maxbodysize);
+						ahttp->request.errorcode = HTTP_CODE_REQUEST_ENTITY_TOO_LARGE;
+						return HTTP_ERROR;
+					}
+
+					if (c == ';') {
+						ahttp->request.chunked.state = HTTP_CHUNK_EXT;
+					} else if (c == ' ' || c == '\t') {
+						ahttp->request.chunked.state = HTTP_CHUNK_SIZE_WS;
+					} else if (c == '\r') {
+						ahttp->request.chunked.state = HTTP_CHUNK_SIZE_LF;
+					} else if (c == '\n') {
+						ahttp->request.chunked.state = (ahttp->request.chunked.remaining > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+					} else {
+						DEBUG("Invalid chunk size. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					break;
+				}
+
+				case HTTP_CHUNK_SIZE_WS:
+
+					if (c == ';') {
+						ahttp->request.chunked.state = HTTP_CHUNK_EXT;
+					} else if (c == '\r') {
+						ahttp->request.chunked.state = HTTP_CHUNK_SIZE_LF;
+					} else if (c == '\n') {
+						ahttp->request.chunked.state = (ahttp->request.chunked.remaining > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+					} else if (c != ' ' && c != '\t') {
+						DEBUG("Invalid chunk size line. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					break;
+
+				case HTTP_CHUNK_EXT:
+
+					// chunk extensions are not used, skip them.
+					if (c == '\r') {
+						ahttp->request.chunked.state = HTTP_CHUNK_SIZE_LF;
+					} else if (c == '\n') {
+						ahttp->request.chunked.state = (ahttp->request.chunked.remaining > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+					} else if (++ahttp->request.chunked.extlen > HTTP_CHUNK_MAX_EXTSIZE) {
+						DEBUG("Chunk extension is too long.");
+						return HTTP_ERROR;
+					}
+
+					break;
+
+				case HTTP_CHUNK_SIZE_LF:
+
+					if (c != '\n') {
+						DEBUG("Expected LF after chunk size. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					ahttp->request.chunked.state = (ahttp->request.chunked.remaining > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+					break;
+
+				case HTTP_CHUNK_DATA_CR:
+
+					if (c == '\r') {
+						ahttp->request.chunked.state = HTTP_CHUNK_DATA_LF;
+						break;
+					}
+
+					// bare LF is tolerated
+					if (c != '\n') {
+						DEBUG("Expected CRLF after chunk data. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					// fall through
+				case HTTP_CHUNK_DATA_LF:
+
+					if (c != '\n') {
+						DEBUG("Expected LF after chunk data. 0x%02x", c);
+						return HTTP_ERROR;
+					}
+
+					// next chunk
+					ahttp->request.chunked.state		= HTTP_CHUNK_SIZE;
+					ahttp->request.chunked.remaining	= 0;
+					ahttp->request.chunked.numdigits	= 0;
+					ahttp->request.chunked.extlen		= 0;
+					break;
+
+				default:
+					BUG_EXIT();
+					return HTTP_ERROR;
+			}
+		}
+
+		evbuffer_drain(in, p - (const unsigned char*) vec.iov_base);
+	}
+
+	return ahttp->request.status;
+}
+
+/**
+* parse trailer fields after the last chunk and merge them into request headers.
+*/
+static int parseChunkedTrailer(http* ahttp, struct evbuffer* in) {
+
+	for (;;) {
+
+		size_t eollen = 0;
+		struct evbuffer_ptr eol = evbuffer_search_eol(in, NULL, &eollen, EVBUFFER_EOL_CRLF);
+
+		if (eol.pos < 0) {
+
+			// no line yet, make sure nobody feeds us an endless trailer.
+			if (ahttp->request.chunked.trailerlen + evbuffer_get_length(in) > HTTP_CHUNK_MAX_TRAILERSIZE) {
+				DEBUG("Trailer is too long.");
+				return HTTP_ERROR;
+			}
+
+			return ahttp->request.status;
+		}
+
+		ahttp->request.chunked.trailerlen += eol.pos + eollen;
+
+		if (ahttp->request.chunked.trailerlen > HTTP_CHUNK_MAX_TRAILERSIZE) {
+			DEBUG("Trailer is too long.");
+			return HTTP_ERROR;
+		}
+
+		char* line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF);
+
+		if (line == NULL) return HTTP_ERROR;
+
+		// end of trailer
+		if (IS_EMPTY_STR(line)) {
+			free(line);
+			return HTTP_REQ_DONE;
+		}
+
+		char* tmp = strchr(line, ':');
+
+		if (tmp == NULL) {
+			DEBUG("Invalid trailer field. %s", line);
+			free(line);
+			return HTTP_ERROR;
+		}
+
+		*tmp		= '\0';
+		char* name	= strTrim(line);
+		char* value	= strTrim(tmp + 1);
+
+		// fields that control framing or routing are not allowed in trailers.
+		if (strcasecmp(name, "Content-Length") && strcasecmp(name, "Transfer-Encoding")
+		&& strcasecmp(name, "Host") && strcasecmp(name, "Trailer")) {
+			ahttp->request.headers->putstr(ahttp->request.headers, name, value);
+		}
+
+		free(line);
+	}
+}
+
+/**
+* validate file path
+*/
+bool isValidPathname(const char* path) {
+
+	if (path == NULL) return false;
+
+	int len = strlen(path);
 	if (len == 0 || len >= PATH_MAX) return false;
 	else if (path[0] != '/') return false;
 	else if (strpbrk(path, "\\:*?\"<>|") != NULL) return false;
@@ -873,51 +2025,527 @@ static bool isValidPathname(const char* path) {
 * @note
 * remove : heading & tailing white spaces, double slashes, tailing slash
 */
-static void correctPathname(char* path) {
+void correctPathname(char* path) {
 
 	// take care of head & tail white spaces
 	strTrim(path);
 
-	// take care of double slashes
-	while (strstr(path, "//") != NULL) strReplace("sr", path, "//", "/");
+	// take care of double slashes in a single pass
+	char* w = path;
+
+	for (const char* r = path; *r != '\0'; r++) {
+		if (*r == '/' && w > path && w[-1] == '/') continue;
+		*w++ = *r;
+	}
+
+	*w = '\0';
 
 	// take care of tailing slash
-	int len = strlen(path);
+	if (w - path > 1 && w[-1] == '/') w[-1] = '\0';
+}
+
+static size_t sendHeader(connection* conn, const void* block, size_t size, off_t contentlength, bool compress) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (ahttp->response.frozen_header) {
+		return 0;
+	}
+
+	// answered without reading the held body, close even if the hook asks to keep the connection.
+	if (isBodyHeld(ahttp)) {
+		httpSetResponseHeader(conn, "Connection", "close");
+		conn->status = CLOSE;
+	}
+
+	ahttp->response.contentlength = contentlength;
+
+	// Turn on compression filter while headers can still be changed.
+	enum compress_encoding_e encoding = (compress) ? negotiateCompression(conn, ahttp) : COMPRESS_NONE;
+
+	if (encoding != COMPRESS_NONE) {
+
+		int level = serverGetOptionAsInt(conn->webserver, "server.compression_level");
+		ahttp->response.compressor = compressorGet(encoding, level);
+
+		if (ahttp->response.compressor != NULL) {
+
+			const char* vary = httpGetResponseHeader(conn, "Vary");
+
+			if (vary == NULL) {
+
+				httpSetResponseHeader(conn, "Vary", "Accept-Encoding");
+
+			} else if (strcasestr(vary, "Accept-Encoding") == NULL) {
+
+				char* newvary = NULL;
+				if (asprintf(&newvary, "%s, Accept-Encoding", vary) > 0) {
+					httpSetResponseHeader(conn, "Vary", newvary);
+					free(newvary);
+				}
+			}
+
+			// compressed representation is not byte-identical anymore.
+			const char* etag = httpGetResponseHeader(conn, "ETag");
+
+			if (etag != NULL && etag[0] == '"') {
+
+				char* weaketag = NULL;
+				if (asprintf(&weaketag, "W/%s", etag) > 0) {
+					httpSetResponseHeader(conn, "ETag", weaketag);
+					free(weaketag);
+				}
+			}
+
+			httpSetResponseHeader(conn, "Content-Encoding", compressGetEncodingName(encoding));
+			httpSetResponseHeader(conn, "Content-Length", NULL);
+			httpSetResponseHeader(conn, "Transfer-Encoding", "chunked");
+		}
+	}
+
+	ahttp->response.frozen_header = true;
+
+	// HTTP/2 streams carry headers in HEADERS frames.
+	if (ahttp->stream != NULL) {
+		return http2SendHeader(ahttp, block, size);
+	}
 
-	if (len <= 1) return;
+	// Send status line.
+	const char* reason = (ahttp->response.reason) ? ahttp->response.reason : httpGetReason(ahttp->response.code);
+
+	evbuffer_add_printf(ahttp->response.outbuf, "%s %d %s" HTTP_CRLF, ahttp->request.httpver, ahttp->response.code, reason);
+
+	// Send headers.
+	listableObj obj;
 
-	if (path[len - 1] == '/') path[len - 1] = '\0';
+	bzero((void*) &obj, sizeof(obj));
+
+	listtable* tbl = ahttp->response.headers;
+
+	tbl->lock(tbl);
+
+	while (tbl->getnext(tbl, &obj, NULL, false)) {
+		evbuffer_add_printf(ahttp->response.outbuf, "%s: %s" HTTP_CRLF, (char*) obj.name, (char*) obj.data);
+	}
+
+	tbl->unlock(tbl);
+
+	if (block != NULL && size > 0) {
+		evbuffer_add(ahttp->response.outbuf, block, size);
+	}
+
+	// Send empty line, indicator of end of header.
+	evbuffer_add(ahttp->response.outbuf, HTTP_CRLF, STRLEN(HTTP_CRLF));
+	return evbuffer_get_length(ahttp->response.outbuf);
 }
 
-static char* evbufferPeekln(struct evbuffer* buffer, size_t* n_read_out, enum evbuffer_eol_style eol_style) {
+static size_t sendData(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata, bool copy) {
 
-	// Check if first line has arrived.
-	struct evbuffer_ptr ptr = evbuffer_search_eol(buffer, NULL, n_read_out,eol_style);
+	http* ahttp = (http*) connectionGetExtra(conn);
+	size_t size	= iovecLength(iov, iovcnt);
 
-	if (ptr.pos == -1) return NULL;
+	if (ahttp->response.contentlength < 0) {
 
-	char* line = (char*) malloc(ptr.pos + 1);
+		WARN("Content-Length is not set. Invalid usage.");
+		releaseReference(iov, iovcnt, size, release, userdata);
+		return 0;
+	}
 
-	if (line == NULL) return NULL;
+	if ((ahttp->response.bodyout + size) > ahttp->response.contentlength) {
+		WARN("Trying to send more data than supposed to");
+		releaseReference(iov, iovcnt, size, release, userdata);
+		return 0;
+	}
+
+	size_t beforesize = evbuffer_get_length(ahttp->response.outbuf);
+
+	if (!ahttp->response.frozen_header) {
 
-	// Linearizes buffer
-	if (ptr.pos > 0) {
-		char* bufferptr = (char*) evbuffer_pullup(buffer, ptr.pos);
-		ASSERT(bufferptr != NULL);
-		strncpy(line, bufferptr, ptr.pos);
+		httpSendHeader(conn);
 	}
 
-	line[ptr.pos] = '\0';
+	// referenced data may be released below, copy it first.
+	if (ahttp->response.capture != NULL) captureBody(ahttp, iov, iovcnt);
+
+	if (ahttp->response.compressor != NULL) {
+
+		// let zlib buffer until the whole body is in. compressing consumes the data right away.
+		bool last	= ((ahttp->response.bodyout + size) == ahttp->response.contentlength);
+		int status	= sendCompressedChunk(ahttp, iov, iovcnt, (last) ? Z_FINISH : Z_NO_FLUSH);
+
+		releaseReference(iov, iovcnt, size, release, userdata);
+
+		if (status) return 0;
+
+	} else if (copy) {
 
-	return line;
+		for (int i = 0; i < iovcnt; i++) {
+			if (iov[i].iov_base != NULL && iov[i].iov_len > 0) {
+				if (evbuffer_add(ahttp->response.outbuf, iov[i].iov_base, iov[i].iov_len)) return 0;
+			}
+		}
+
+	} else if (addReference(ahttp->response.outbuf, iov, iovcnt, size, release, userdata)) {
+
+		return 0;
+	}
+
+	ahttp->response.bodyout += size;
+
+	if (ahttp->response.bodyout == ahttp->response.contentlength) {
+
+		ahttp->response.complete = true;
+
+		if (ahttp->stream != NULL) http2EndStream(ahttp);
+	}
+
+	return (evbuffer_get_length(ahttp->response.outbuf) - beforesize);
 }
 
-static ssize_t evbufferDrainln(struct evbuffer* buffer, size_t* n_read_out, enum evbuffer_eol_style eol_style) {
+static size_t sendChunk(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata, bool copy) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+	size_t size	= iovecLength(iov, iovcnt);
+
+	if (ahttp->response.contentlength >= 0) {
+
+		WARN("Content-Length is set. Invalid usage.");
+		releaseReference(iov, iovcnt, size, release, userdata);
+		return 0;
+	}
+
+	if (!ahttp->response.frozen_header) {
+		httpSendHeader(conn);
+	}
+
+	struct evbuffer* out	= ahttp->response.outbuf;
+	size_t beforesize		= evbuffer_get_length(out);
+	int status				= 0;
+
+	if (ahttp->response.capture != NULL) captureBody(ahttp, iov, iovcnt);
+
+	// an empty chunk ends the body.
+	if (size == 0) ahttp->response.complete = true;
+
+	if (ahttp->response.compressor != NULL) {
+
+		// every chunk is flushed so streaming clients see it right away.
+		status = sendCompressedChunk(ahttp, iov, iovcnt, (size > 0) ? Z_SYNC_FLUSH : Z_FINISH);
+		releaseReference(iov, iovcnt, size, release, userdata);
+
+	} else if (ahttp->stream != NULL) {
+
+		// HTTP/2 has its own framing, data goes out as is and the last chunk ends the stream.
+		if (size == 0) {
+
+			http2EndStream(ahttp);
+
+		} else if (copy) {
+
+			for (int i = 0; i < iovcnt && status == 0; i++) {
+				status = evbuffer_add(out, iov[i].iov_base, iov[i].iov_len);
+			}
+
+		} else {
+
+			status = addReference(out, iov, iovcnt, size, release, userdata);
+		}
+
+	} else if (size > 0) {
+
+		char header[HTTP_CHUNK_HEADER_SIZE];
+		size_t headerlen = formatChunkHeader(header, size);
+
+		if (copy) {
+
+			// framing and data in a single contiguous reservation, no printf.
+			struct evbuffer_iovec vec;
+
+			if (evbuffer_reserve_space(out, headerlen + size + STRLEN(HTTP_CRLF), &vec, 1) < 1) {
+				status = -1;
+			} else {
+
+				char* p = (char*) vec.iov_base;
+
+				memcpy(p, header, headerlen);
+				p += headerlen;
+
+				for (int i = 0; i < iovcnt; i++) {
+					memcpy(p, iov[i].iov_base, iov[i].iov_len);
+					p += iov[i].iov_len;
+				}
+
+				memcpy(p, HTTP_CRLF, STRLEN(HTTP_CRLF));
+
+				vec.iov_len	= headerlen + size + STRLEN(HTTP_CRLF);
+				status		= evbuffer_commit_space(out, &vec, 1);
+			}
+
+		} else {
+
+			status = evbuffer_add(out, header, headerlen);
+
+			if (status == 0) {
+				status = addReference(out, iov, iovcnt, size, release, userdata);
+			} else {
+				releaseReference(iov, iovcnt, size, release, userdata);
+			}
+
+			if (status == 0) {
+				status = evbuffer_add(out, HTTP_CRLF, STRLEN(HTTP_CRLF));
+			}
+		}
+
+	} else {
+
+		status = evbuffer_add(out, "0" HTTP_CRLF HTTP_CRLF, STRLEN("0" HTTP_CRLF HTTP_CRLF));
+	}
+
+	if (status != 0) {
+
+		WARN("Failed to add data to out-buffer. (size:%zu)", size);
+		return 0;
+	}
+
+	size_t bytesout = evbuffer_get_length(out) - beforesize;
+	ahttp->response.bodyout += bytesout;
+
+	return bytesout;
+}
+
+/**
+* Format chunk size line in hex without printf.
+*
+* @return length of the line including CRLF.
+*/
+static size_t formatChunkHeader(char* buf, size_t size) {
+
+	static const char hexdigits[] = "0123456789abcdef";
+
+	int numdigits = 1;
+	for (size_t tmp = size >> 4; tmp > 0; tmp >>= 4) numdigits++;
+
+	for (int i = numdigits - 1; i >= 0; i--) {
+		buf[i] = hexdigits[size & 0xf];
+		size >>= 4;
+	}
+
+	buf[numdigits]		= '\r';
+	buf[numdigits + 1]	= '\n';
 
-	char *line = evbuffer_readln(buffer, n_read_out, eol_style);
-	if (line == NULL)
-	return -1;
-	size_t linelen = strlen(line);
-	free(line);
-	return linelen;
+	return numdigits + STRLEN(HTTP_CRLF);
+}
+
+static size_t iovecLength(const struct iovec* iov, int iovcnt) {
+
+	size_t size = 0;
+
+	for (int i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+
+	return size;
+}
+
+/**
+* Copy body data to the capture buffer. Capturing stops on failure or once
+* the body grows past capturemax.
+*/
+static void captureBody(http* ahttp, const struct iovec* iov, int iovcnt) {
+
+	for (int i = 0; i < iovcnt; i++) {
+
+		if (iov[i].iov_base == NULL || iov[i].iov_len == 0) continue;
+
+		if (evbuffer_get_length(ahttp->response.capture) + iov[i].iov_len > ahttp->response.capturemax
+		|| evbuffer_add(ahttp->response.capture, iov[i].iov_base, iov[i].iov_len)) {
+			stopCapture(ahttp);
+			return;
+		}
+	}
+}
+
+/**
+* Stop capturing, what was captured is released right away so a large body
+* is not held twice. The buffer itself belongs to the cache.
+*/
+static void stopCapture(http* ahttp) {
+
+	if (ahttp->response.capture == NULL) return;
+
+	evbuffer_drain(ahttp->response.capture, evbuffer_get_length(ahttp->response.capture));
+	ahttp->response.capture = NULL;
+}
+
+/**
+* Attach segments to the buffer by reference.
+*
+* Multiple segments share one release call through a small refcounted group.
+* release is called even if attaching fails.
+*
+* @return 0 on success, -1 on error.
+*/
+static int addReference(struct evbuffer* out, const struct iovec* iov, int iovcnt, size_t size, evbuffer_ref_cleanup_cb release, void* userdata) {
+
+	if (iovcnt == 1 || release == NULL) {
+
+		for (int i = 0; i < iovcnt; i++) {
+
+			if (evbuffer_add_reference(out, iov[i].iov_base, iov[i].iov_len, release, userdata)) {
+				if (release) release(iov[i].iov_base, iov[i].iov_len, userdata);
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	refgroup* group = NEW(refgroup);
+
+	if (group == NULL) {
+		release(iov[0].iov_base, size, userdata);
+		return -1;
+	}
+
+	// we hold one reference ourselves until all the segments are attached.
+	group->refcount	= 1;
+	group->data		= iov[0].iov_base;
+	group->size		= size;
+	group->release	= release;
+	group->userdata	= userdata;
+
+	int status = 0;
+
+	for (int i = 0; i < iovcnt && status == 0; i++) {
+
+		if (iov[i].iov_len == 0) continue;
+
+		group->refcount++;
+
+		if (evbuffer_add_reference(out, iov[i].iov_base, iov[i].iov_len, releaseGroup, group)) {
+			group->refcount--;
+			status = -1;
+		}
+	}
+
+	releaseGroup(NULL, 0, group);
+
+	return status;
+}
+
+static void releaseReference(const struct iovec* iov, int iovcnt, size_t size, evbuffer_ref_cleanup_cb release, void* userdata) {
+
+	if (release != NULL) {
+		release((iovcnt > 0) ? iov[0].iov_base : NULL, size, userdata);
+	}
+}
+
+static void releaseGroup(const void* data, size_t size, void* userdata) {
+
+	refgroup* group = (refgroup*) userdata;
+
+	if (--group->refcount == 0) {
+		group->release(group->data, group->size, group->userdata);
+		free(group);
+	}
+}
+
+/**
+* Decide content-coding of the response.
+*
+* Compression is skipped for bodyless or partial responses, already encoded
+* or already compressed content types, small bodies and HTTP/1.0 clients that
+* can't take the switch to chunked transfer encoding.
+*/
+static enum compress_encoding_e negotiateCompression(connection* conn, http* ahttp) {
+
+	if (!serverGetOptionAsInt(conn->webserver, "server.compression")) {
+		return COMPRESS_NONE;
+	}
+
+	int code = ahttp->response.code;
+
+	if (code < HTTP_CODE_OK || code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_PARTIAL_CONTENT || code == HTTP_CODE_NOT_MODIFIED) {
+		return COMPRESS_NONE;
+	}
+
+	if (ahttp->request.method == NULL || !strcmp(ahttp->request.method, "HEAD")) {
+		return COMPRESS_NONE;
+	}
+
+	if (httpGetResponseHeader(conn, "Content-Encoding") != NULL) {
+		return COMPRESS_NONE;
+	}
+
+	if (!compressIsCompressible(httpGetResponseHeader(conn, "Content-Type"))) {
+		return COMPRESS_NONE;
+	}
+
+	if (ahttp->response.contentlength >= 0) {
+
+		if (ahttp->response.contentlength < serverGetOptionAsInt(conn->webserver, "server.compression_min_size")) {
+			return COMPRESS_NONE;
+		}
+
+		if (ahttp->stream == NULL && strcmp(ahttp->request.httpver, HTTP_PROTOCOL_11)) {
+			return COMPRESS_NONE;
+		}
+	}
+
+	if (httpAcceptsEncoding(conn, "gzip")) return COMPRESS_GZIP;
+
+	if (httpAcceptsEncoding(conn, "deflate")) return COMPRESS_DEFLATE;
+
+	return COMPRESS_NONE;
+}
+
+/**
+* Compress data and frame the output as a chunk.
+*
+* @param flush Z_NO_FLUSH to let zlib buffer, Z_SYNC_FLUSH to push out what
+* we have, Z_FINISH to end the body with the last chunk.
+*
+* @return 0 on success, -1 on error.
+*/
+static int sendCompressedChunk(http* ahttp, const struct iovec* iov, int iovcnt, int flush) {
+
+	compressor* c = ahttp->response.compressor;
+
+	for (int i = 0; i < iovcnt - 1; i++) {
+		if (compressorWrite(c, c->buf, iov[i].iov_base, iov[i].iov_len, Z_NO_FLUSH)) {
+			return -1;
+		}
+	}
+
+	// flush mode applies to the last segment.
+	if (compressorWrite(c, c->buf, (iovcnt > 0) ? iov[iovcnt - 1].iov_base : NULL, (iovcnt > 0) ? iov[iovcnt - 1].iov_len : 0, flush)) {
+		return -1;
+	}
+
+	size_t len = evbuffer_get_length(c->buf);
+
+	if (len > 0 && ahttp->stream != NULL) {
+
+		if (evbuffer_add_buffer(ahttp->response.outbuf, c->buf)) return -1;
+
+	} else if (len > 0) {
+
+		if (evbuffer_add_printf(ahttp->response.outbuf, "%zx" HTTP_CRLF, len) < 0
+		|| evbuffer_add_buffer(ahttp->response.outbuf, c->buf)
+		|| evbuffer_add(ahttp->response.outbuf, HTTP_CRLF, STRLEN(HTTP_CRLF))) {
+			return -1;
+		}
+	}
+
+	if (flush == Z_FINISH) {
+
+		if (ahttp->stream != NULL) {
+			http2EndStream(ahttp);
+		} else {
+			evbuffer_add(ahttp->response.outbuf, "0" HTTP_CRLF HTTP_CRLF, STRLEN("0" HTTP_CRLF HTTP_CRLF));
+		}
+
+		compressorRelease(c);
+		ahttp->response.compressor = NULL;
+	}
+
+	return 0;
 }
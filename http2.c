@@ -0,0 +1,1329 @@
+/**
+ * @abstruct HTTP/2 protocol module (RFC 9113)
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <openssl/ssl.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "hpack.h"
+#include "http2.h"
+
+// private functions
+static int				detectHttp2(connection* conn);
+static http2session*		sessionNew(connection* conn);
+static void				sessionFree(http2session* session);
+static void				sessionFreeCallback(connection* conn, void* userdata);
+static int				sessionRead(http2session* session);
+static int				processFrame(http2session* session, uint8_t type, uint8_t flags, uint32_t streamid, uint32_t length);
+static int				processData(http2session* session, uint8_t flags, uint32_t streamid, uint32_t length);
+static int				processHeaders(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length);
+static int				processContinuation(http2session* session, uint8_t flags, const uint8_t* payload, uint32_t length);
+static int				endHeaderBlock(http2session* session);
+static int				processSettings(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length);
+static int				applySettings(http2session* session, const uint8_t* payload, uint32_t length);
+static int				processWindowUpdate(http2session* session, uint32_t streamid, const uint8_t* payload, uint32_t length);
+static int				processRstStream(http2session* session, uint32_t streamid, uint32_t length);
+static int				processPing(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length);
+static int				addRequestHeader(const char* name, size_t namelen, const char* value, size_t valuelen, void* userdata);
+static http2stream*		streamNew(http2session* session, uint32_t id);
+static void				streamFree(http2stream* stream);
+static http2stream*		findStream(http2session* session, uint32_t id);
+static void				closeStreams(http2session* session);
+static void				endRemote(http2stream* stream);
+static void				dispatchStream(http2stream* stream);
+static void				resetStream(http2stream* stream, uint32_t error);
+static void				flushStreams(http2session* session);
+static void				reapStreams(http2session* session);
+static void				flushCallback(evutil_socket_t fd, short what, void* userdata);
+static void				outbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata);
+static void				writeFrameHeader(struct evbuffer* out, uint32_t length, uint8_t type, uint8_t flags, uint32_t streamid);
+static void				writeHeaders(http2session* session, uint32_t streamid, struct evbuffer* block, bool endstream);
+static void				sendSettings(http2session* session);
+static void				sendGoaway(http2session* session, uint32_t error);
+static void				sendRstStream(http2session* session, uint32_t streamid, uint32_t error);
+static void				sendWindowUpdate(http2session* session, uint32_t streamid, uint32_t increment);
+static void				creditWindow(http2session* session, http2stream* stream, uint32_t increment);
+static bool				isConnectionHeader(const char* name);
+static bool				hasToken(const char* list, const char* token);
+static bool				isUpgradeRequest(connection* conn);
+static int				upgradeConnection(connection* conn);
+static int				decodeBase64Url(const char* src, uint8_t* dst, size_t size);
+
+/**
+* HTTP/2 protocol handler hook.
+*
+* Speaks HTTP/2 on connections that negotiated "h2" with ALPN, start with the
+* connection preface (prior knowledge) or ask for "Upgrade: h2c", and leaves
+* everything else to httpHandler(). Every stream is handed to the rest of the
+* hook chain as its own connection with a parsed request, so hooks written for
+* HTTP/1.x work unchanged with httpGetRequestHeader(), httpResponse() and so on.
+*
+* @note
+* Register this hook instead of httpHandler at the top of hook chain.
+*
+* @code
+* server* webserver = serverNew();
+* serverSetOption(webserver, "server.http2", "1");
+* serverRegisterHook(webserver, http2Handler, NULL);
+* @endcode
+*/
+int http2Handler(short event, connection* conn, void* userdata) {
+
+	// streams come back through the hook chain, they only need the request attached.
+	if (conn->parent != NULL) {
+		return httpHandler(event, conn, userdata);
+	}
+
+	http2session* session = (http2session*) connectionGetProtocol(conn, HTTP2_PROTOCOL_NAME);
+
+	if (session == NULL && (event & EVENT_READ)) {
+
+		int detected = detectHttp2(conn);
+
+		// wait for the rest of the preface.
+		if (detected < 0) return TAKEOVER;
+
+		if (detected > 0 && (session = sessionNew(conn)) == NULL) return CLOSE;
+	}
+
+	if (session == NULL) {
+
+		int status = httpHandler(event, conn, userdata);
+
+		if ((event & EVENT_READ) && status == OK && httpGetStatus(conn) == HTTP_REQ_DONE && isUpgradeRequest(conn)) {
+			return upgradeConnection(conn);
+		}
+
+		return status;
+	}
+
+	if (event & EVENT_READ) {
+
+		DEBUG("==> HTTP2 READ");
+		return sessionRead(session);
+
+	} else if (event & EVENT_CLOSE) {
+
+		DEBUG("==> HTTP2 CLOSE=%x", event);
+		closeStreams(session);
+		return OK;
+	}
+
+	// out-buffer drained, close after GOAWAY once the last stream is done.
+	return (session->goaway && session->numstreams == 0) ? CLOSE : TAKEOVER;
+}
+
+/**
+* Send response headers of a stream in HEADERS frames.
+*
+* Called by http module in place of the HTTP/1.x status line and header lines.
+* Connection specific headers are dropped as HTTP/2 forbids them.
+*
+* @param block prebuilt header lines each terminated by CRLF, may be NULL.
+*
+* @return bytes put in the connection out-buffer.
+*/
+size_t http2SendHeader(http* ahttp, const void* block, size_t size) {
+
+	http2stream* stream		= ahttp->stream;
+	http2session* session	= stream->session;
+
+	if (stream->reset || stream->endlocal) return 0;
+
+	struct evbuffer* hbuf = evbuffer_new();
+
+	if (hbuf == NULL) return 0;
+
+	int status = hpackEncodeStatus(hbuf, ahttp->response.code);
+
+	listtableObj obj;
+
+	bzero((void*) &obj, sizeof(obj));
+
+	listtable* tbl = ahttp->response.headers;
+
+	tbl->lock(tbl);
+
+	while (tbl->getnext(tbl, &obj, NULL, false)) {
+		if (!isConnectionHeader((char*) obj.name)) {
+			status |= hpackEncodeHeader(hbuf, (char*) obj.name, (char*) obj.data);
+		}
+	}
+
+	tbl->unlock(tbl);
+
+	const char* p	= (const char*) block;
+	const char* end	= p + ((block != NULL) ? size : 0);
+
+	while (p < end) {
+
+		const char* eol = memmem(p, end - p, HTTP_CRLF, STRLEN(HTTP_CRLF));
+
+		if (eol == NULL) eol = end;
+
+		char* line	= strndup(p, eol - p);
+		char* colon	= (line) ? strchr(line, ':') : NULL;
+
+		if (colon != NULL) {
+
+			char* value = colon + 1;
+
+			*colon = '\0';
+			while (*value == ' ' || *value == '\t') value++;
+
+			if (!isConnectionHeader(line)) status |= hpackEncodeHeader(hbuf, line, value);
+		}
+
+		if (line) free(line);
+
+		p = (eol < end) ? eol + STRLEN(HTTP_CRLF) : end;
+	}
+
+	if (status != 0) {
+
+		evbuffer_free(hbuf);
+		resetStream(stream, HTTP2_INTERNAL_ERROR);
+		return 0;
+	}
+
+	int code = ahttp->response.code;
+
+	bool endstream = (code >= HTTP_CODE_OK)
+	&& (code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_NOT_MODIFIED
+	|| ahttp->response.contentlength == 0
+	|| (ahttp->request.method != NULL && !strcmp(ahttp->request.method, "HEAD")));
+
+	size_t beforesize = evbuffer_get_length(session->conn->out);
+
+	writeHeaders(session, stream->id, hbuf, endstream);
+	evbuffer_free(hbuf);
+
+	if (endstream) {
+
+		stream->endpending	= true;
+		stream->endlocal	= true;
+		event_active(session->flushev, EV_WRITE, 0);
+	}
+
+	return evbuffer_get_length(session->conn->out) - beforesize;
+}
+
+/**
+* Mark the response body of a stream complete.
+*
+* END_STREAM goes out with the last DATA frame once flow control lets the
+* remaining body out.
+*/
+void http2EndStream(http* ahttp) {
+
+	http2stream* stream = ahttp->stream;
+
+	if (stream == NULL || stream->endpending || stream->reset) return;
+
+	stream->endpending = true;
+	event_active(stream->session->flushev, EV_WRITE, 0);
+}
+
+/**
+* Abort the stream with RST_STREAM, ex) when the response can't be completed
+* after its header went out. The stream is freed on the next flush.
+*/
+void http2ResetStream(http* ahttp) {
+
+	if (ahttp->stream != NULL) resetStream(ahttp->stream, HTTP2_INTERNAL_ERROR);
+}
+
+// private functions
+
+/**
+* @return 1 for HTTP/2, 0 for HTTP/1.x, -1 if more data is needed to tell.
+*/
+static int detectHttp2(connection* conn) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	// only at the beginning of a request, never in the middle of a body.
+	if (ahttp != NULL && ahttp->request.status != HTTP_REQ_INIT) return 0;
+
+	if (conn->webserver->sslctx != NULL) {
+
+		SSL* ssl = bufferevent_openssl_get_ssl(conn->buffer);
+
+		if (ssl != NULL) {
+
+			const unsigned char* protocol	= NULL;
+			unsigned int len				= 0;
+
+			SSL_get0_alpn_selected(ssl, &protocol, &len);
+
+			if (len == STRLEN(HTTP2_PROTOCOL_NAME) && !memcmp(protocol, HTTP2_PROTOCOL_NAME, len)) return 1;
+		}
+	}
+
+	size_t len = evbuffer_get_length(conn->in);
+
+	if (len > STRLEN(HTTP2_PREFACE)) len = STRLEN(HTTP2_PREFACE);
+
+	if (len == 0 || memcmp(evbuffer_pullup(conn->in, len), HTTP2_PREFACE, len)) return 0;
+
+	return (len == STRLEN(HTTP2_PREFACE)) ? 1 : -1;
+}
+
+static http2session* sessionNew(connection* conn) {
+
+	http2session* session = NEW(http2session);
+
+	if (session == NULL) return NULL;
+
+	session->conn			= conn;
+	session->decoder		= hpackNew(HPACK_DEF_TABLE_SIZE);
+	session->headerblock	= evbuffer_new();
+	session->flushev		= event_new(bufferevent_get_base(conn->buffer), -1, 0, flushCallback, session);
+	session->maxstreams		= serverGetOptionAsInt(conn->webserver, "server.http2_max_streams");
+	session->sendwindow		= HTTP2_DEF_WINDOW_SIZE;
+	session->recvwindow		= HTTP2_DEF_WINDOW_SIZE;
+	session->initialwindow	= HTTP2_DEF_WINDOW_SIZE;
+	session->maxframesize	= HTTP2_DEF_MAX_FRAME_SIZE;
+
+	if (session->decoder == NULL || session->headerblock == NULL || session->flushev == NULL) {
+		sessionFree(session);
+		return NULL;
+	}
+
+	connectionSetProtocol(conn, HTTP2_PROTOCOL_NAME, session, sessionFreeCallback);
+
+	// server connection preface
+	sendSettings(session);
+
+	DEBUG("HTTP/2 session started.");
+
+	return session;
+}
+
+static void sessionFree(http2session* session) {
+
+	closeStreams(session);
+
+	if (session->flushev)		event_free(session->flushev);
+	if (session->headerblock)	evbuffer_free(session->headerblock);
+	if (session->decoder)		hpackFree(session->decoder);
+
+	free(session);
+}
+
+static void sessionFreeCallback(connection* conn, void* userdata) {
+
+	sessionFree((http2session*) userdata);
+}
+
+/**
+* Process complete frames in the in-buffer.
+*
+* @return TAKEOVER to keep the connection, CLOSE on connection error or
+* after GOAWAY.
+*/
+static int sessionRead(http2session* session) {
+
+	struct evbuffer* in = session->conn->in;
+
+	if (!session->prefacedone) {
+
+		size_t len = evbuffer_get_length(in);
+
+		if (len > STRLEN(HTTP2_PREFACE)) len = STRLEN(HTTP2_PREFACE);
+
+		if (len > 0 && memcmp(evbuffer_pullup(in, len), HTTP2_PREFACE, len)) {
+			sendGoaway(session, HTTP2_PROTOCOL_ERROR);
+			return CLOSE;
+		}
+
+		if (len < STRLEN(HTTP2_PREFACE)) return TAKEOVER;
+
+		evbuffer_drain(in, len);
+		session->prefacedone = true;
+	}
+
+	uint8_t header[HTTP2_FRAME_HEADER_SIZE];
+
+	while (evbuffer_copyout(in, header, sizeof(header)) == sizeof(header)) {
+
+		uint32_t length		= ((uint32_t) header[0] << 16) | (header[1] << 8) | header[2];
+		uint8_t type		= header[3];
+		uint8_t flags		= header[4];
+		uint32_t streamid	= ((uint32_t)(header[5] & 0x7f) << 24) | (header[6] << 16) | (header[7] << 8) | header[8];
+
+		// we never raise SETTINGS_MAX_FRAME_SIZE.
+		if (length > HTTP2_DEF_MAX_FRAME_SIZE) {
+			sendGoaway(session, HTTP2_FRAME_SIZE_ERROR);
+			return CLOSE;
+		}
+
+		if (evbuffer_get_length(in) < sizeof(header) + length) break;
+
+		evbuffer_drain(in, sizeof(header));
+
+		int error = processFrame(session, type, flags, streamid, length);
+
+		if (error != HTTP2_NO_ERROR) {
+			DEBUG("HTTP/2 connection error. (type:%d, error:%d)", type, error);
+			sendGoaway(session, error);
+			return CLOSE;
+		}
+	}
+
+	flushStreams(session);
+
+	return (session->goaway && session->numstreams == 0) ? CLOSE : TAKEOVER;
+}
+
+/**
+* Process a frame, the payload is drained from the in-buffer.
+*
+* @return HTTP2_NO_ERROR or connection error code.
+*/
+static int processFrame(http2session* session, uint8_t type, uint8_t flags, uint32_t streamid, uint32_t length) {
+
+	struct evbuffer* in = session->conn->in;
+
+	// nothing may come between the frames of a header block.
+	if (session->headerstreamid != 0 && (type != HTTP2_CONTINUATION || streamid != session->headerstreamid)) {
+		evbuffer_drain(in, length);
+		return HTTP2_PROTOCOL_ERROR;
+	}
+
+	// body is moved to the request without copying.
+	if (type == HTTP2_DATA) {
+		return processData(session, flags, streamid, length);
+	}
+
+	const uint8_t* payload = (length > 0) ? evbuffer_pullup(in, length) : NULL;
+
+	if (length > 0 && payload == NULL) return HTTP2_INTERNAL_ERROR;
+
+	int error = HTTP2_NO_ERROR;
+
+	switch (type) {
+		case HTTP2_HEADERS:
+			error = processHeaders(session, flags, streamid, payload, length);
+			break;
+
+		case HTTP2_CONTINUATION:
+			error = processContinuation(session, flags, payload, length);
+			break;
+
+		case HTTP2_PRIORITY:
+			// prioritization is advisory, streams are served round-robin.
+			if (streamid == 0) error = HTTP2_PROTOCOL_ERROR;
+			else if (length != 5) error = HTTP2_FRAME_SIZE_ERROR;
+			break;
+
+		case HTTP2_RST_STREAM:
+			error = processRstStream(session, streamid, length);
+			break;
+
+		case HTTP2_SETTINGS:
+			error = processSettings(session, flags, streamid, payload, length);
+			break;
+
+		case HTTP2_PUSH_PROMISE:
+			// clients never push.
+			error = HTTP2_PROTOCOL_ERROR;
+			break;
+
+		case HTTP2_PING:
+			error = processPing(session, flags, streamid, payload, length);
+			break;
+
+		case HTTP2_GOAWAY:
+			if (streamid != 0) error = HTTP2_PROTOCOL_ERROR;
+			else if (length < 8) error = HTTP2_FRAME_SIZE_ERROR;
+			else session->goaway = true;
+			break;
+
+		case HTTP2_WINDOW_UPDATE:
+			error = processWindowUpdate(session, streamid, payload, length);
+			break;
+
+		default:
+			// unknown frame types must be ignored.
+			break;
+	}
+
+	evbuffer_drain(in, length);
+
+	return error;
+}
+
+static int processData(http2session* session, uint8_t flags, uint32_t streamid, uint32_t length) {
+
+	struct evbuffer* in = session->conn->in;
+
+	if (streamid == 0 || streamid > session->laststreamid) {
+		evbuffer_drain(in, length);
+		return HTTP2_PROTOCOL_ERROR;
+	}
+
+	uint32_t framelen	= length;
+	uint8_t padlen		= 0;
+
+	if (flags & HTTP2_FLAG_PADDED) {
+
+		if (length < 1) return HTTP2_PROTOCOL_ERROR;
+
+		evbuffer_remove(in, &padlen, 1);
+		length--;
+
+		if (padlen > length) {
+			evbuffer_drain(in, length);
+			return HTTP2_PROTOCOL_ERROR;
+		}
+	}
+
+	uint32_t datalen = length - padlen;
+
+	// whole frame counts against the windows.
+	if (framelen > session->recvwindow) {
+		evbuffer_drain(in, length);
+		return HTTP2_FLOW_CONTROL_ERROR;
+	}
+
+	session->recvwindow -= framelen;
+
+	http2stream* stream = findStream(session, streamid);
+
+	// closed stream, frames in flight are discarded.
+	if (stream == NULL || stream->reset) {
+		evbuffer_drain(in, length);
+		creditWindow(session, NULL, framelen);
+		return HTTP2_NO_ERROR;
+	}
+
+	if (stream->endremote || framelen > stream->recvwindow) {
+		evbuffer_drain(in, length);
+		resetStream(stream, (stream->endremote) ? HTTP2_STREAM_CLOSED : HTTP2_FLOW_CONTROL_ERROR);
+		creditWindow(session, NULL, framelen);
+		return HTTP2_NO_ERROR;
+	}
+
+	stream->recvwindow -= framelen;
+
+	http* ahttp = (http*) connectionGetExtra(stream->conn);
+
+	if ((ahttp->request.maxbodysize > 0 && ahttp->request.bodyin + datalen > ahttp->request.maxbodysize)
+	|| (ahttp->request.contentlength >= 0 && ahttp->request.bodyin + datalen > ahttp->request.contentlength)) {
+
+		DEBUG("HTTP/2 request body exceeds the limit. (stream:%u)", streamid);
+		evbuffer_drain(in, length);
+		resetStream(stream, (ahttp->request.contentlength >= 0) ? HTTP2_PROTOCOL_ERROR : HTTP2_CANCEL);
+		creditWindow(session, NULL, framelen);
+		return HTTP2_NO_ERROR;
+	}
+
+	// body goes through the spool like an HTTP/1.x one, memory held by the stream stays bounded.
+	if (datalen > 0) httpAddContent(ahttp, in, datalen);
+
+	evbuffer_drain(in, padlen);
+
+	if (ahttp->request.status == HTTP_ERROR) {
+		resetStream(stream, HTTP2_INTERNAL_ERROR);
+		creditWindow(session, NULL, framelen);
+		return HTTP2_NO_ERROR;
+	}
+
+	// the frame is spooled or within the spool threshold, the client may send more.
+	creditWindow(session, (flags & HTTP2_FLAG_END_STREAM) ? NULL : stream, framelen);
+
+	if (flags & HTTP2_FLAG_END_STREAM) endRemote(stream);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processHeaders(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length) {
+
+	if (streamid == 0) return HTTP2_PROTOCOL_ERROR;
+
+	const uint8_t* p	= payload;
+	uint8_t padlen		= 0;
+
+	if (flags & HTTP2_FLAG_PADDED) {
+
+		if (length < 1) return HTTP2_FRAME_SIZE_ERROR;
+
+		padlen = *p++;
+		length--;
+	}
+
+	// stream dependency and weight
+	if (flags & HTTP2_FLAG_PRIORITY) {
+
+		if (length < 5) return HTTP2_FRAME_SIZE_ERROR;
+
+		p += 5;
+		length -= 5;
+	}
+
+	if (padlen > length) return HTTP2_PROTOCOL_ERROR;
+
+	length -= padlen;
+
+	http2stream* stream = findStream(session, streamid);
+
+	if (stream == NULL) {
+
+		// client streams are odd and increasing, lower ids are closed.
+		if (streamid % 2 == 0) return HTTP2_PROTOCOL_ERROR;
+		if (streamid <= session->laststreamid) return HTTP2_STREAM_CLOSED;
+
+		session->laststreamid = streamid;
+
+		// the block is still decoded below to keep the dynamic table in sync.
+		if (session->goaway || session->numstreams >= session->maxstreams || streamNew(session, streamid) == NULL) {
+			sendRstStream(session, streamid, HTTP2_REFUSED_STREAM);
+		}
+	}
+
+	session->headerstreamid		= streamid;
+	session->headerendstream	= (flags & HTTP2_FLAG_END_STREAM);
+
+	if (evbuffer_add(session->headerblock, p, length)) return HTTP2_INTERNAL_ERROR;
+
+	if (flags & HTTP2_FLAG_END_HEADERS) return endHeaderBlock(session);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processContinuation(http2session* session, uint8_t flags, const uint8_t* payload, uint32_t length) {
+
+	if (session->headerstreamid == 0) return HTTP2_PROTOCOL_ERROR;
+
+	if (evbuffer_get_length(session->headerblock) + length > HTTP2_MAX_HEADER_BLOCK_SIZE) return HTTP2_ENHANCE_YOUR_CALM;
+
+	if (length > 0 && evbuffer_add(session->headerblock, payload, length)) return HTTP2_INTERNAL_ERROR;
+
+	if (flags & HTTP2_FLAG_END_HEADERS) return endHeaderBlock(session);
+
+	return HTTP2_NO_ERROR;
+}
+
+/**
+* Decode a complete header block into the request of the stream.
+*
+* The first block of a stream carries the request headers, a second one is
+* trailers and must end the stream.
+*/
+static int endHeaderBlock(http2session* session) {
+
+	http2stream* stream	= findStream(session, session->headerstreamid);
+	bool accept			= (stream != NULL && !stream->reset && !stream->endremote);
+	size_t len			= evbuffer_get_length(session->headerblock);
+
+	int status = hpackDecode(session->decoder, evbuffer_pullup(session->headerblock, len), len, (accept) ? addRequestHeader : NULL, stream);
+
+	evbuffer_drain(session->headerblock, len);
+	session->headerstreamid = 0;
+
+	if (status) return HTTP2_COMPRESSION_ERROR;
+
+	if (stream == NULL || stream->reset) return HTTP2_NO_ERROR;
+
+	if (stream->endremote) {
+		resetStream(stream, HTTP2_STREAM_CLOSED);
+		return HTTP2_NO_ERROR;
+	}
+
+	http* ahttp = (http*) connectionGetExtra(stream->conn);
+
+	if (!stream->headerdone) {
+
+		stream->headerdone = true;
+
+		// CONNECT has no :path and is not supported.
+		if (stream->malformed || stream->method == NULL || stream->path == NULL
+		|| httpSetRequestLine(ahttp, stream->method, stream->path, HTTP_PROTOCOL_20) != HTTP_REQ_REQUESTLINE_DONE
+		|| httpSetContentLength(ahttp) < 0) {
+
+			DEBUG("Malformed HTTP/2 request. (stream:%u)", stream->id);
+			resetStream(stream, HTTP2_PROTOCOL_ERROR);
+			return HTTP2_NO_ERROR;
+		}
+
+		ahttp->request.status = HTTP_REQ_HEADER_DONE;
+
+		httpSetRequestHost(ahttp);
+
+	} else if (!session->headerendstream || stream->malformed) {
+
+		// trailers without END_STREAM or with pseudo headers
+		resetStream(stream, HTTP2_PROTOCOL_ERROR);
+		return HTTP2_NO_ERROR;
+	}
+
+	if (session->headerendstream) endRemote(stream);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processSettings(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length) {
+
+	if (streamid != 0) return HTTP2_PROTOCOL_ERROR;
+
+	if (flags & HTTP2_FLAG_ACK) {
+		return (length == 0) ? HTTP2_NO_ERROR : HTTP2_FRAME_SIZE_ERROR;
+	}
+
+	if (length % 6) return HTTP2_FRAME_SIZE_ERROR;
+
+	int error = applySettings(session, payload, length);
+
+	if (error != HTTP2_NO_ERROR) return error;
+
+	writeFrameHeader(session->conn->out, 0, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int applySettings(http2session* session, const uint8_t* payload, uint32_t length) {
+
+	for (uint32_t i = 0; i + 6 <= length; i += 6) {
+
+		const uint8_t* p	= payload + i;
+		uint16_t id			= (p[0] << 8) | p[1];
+		uint32_t value		= ((uint32_t) p[2] << 24) | (p[3] << 16) | (p[4] << 8) | p[5];
+
+		switch (id) {
+			case HTTP2_SETTINGS_ENABLE_PUSH:
+				if (value > 1) return HTTP2_PROTOCOL_ERROR;
+				break;
+
+			case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE: {
+
+				if (value > HTTP2_MAX_WINDOW_SIZE) return HTTP2_FLOW_CONTROL_ERROR;
+
+				// applies to the windows of open streams as a delta.
+				int64_t delta = (int64_t) value - session->initialwindow;
+
+				for (http2stream* stream = session->streams; stream != NULL; stream = stream->next) {
+
+					stream->sendwindow += delta;
+
+					if (stream->sendwindow > HTTP2_MAX_WINDOW_SIZE) return HTTP2_FLOW_CONTROL_ERROR;
+				}
+
+				session->initialwindow = value;
+				break;
+			}
+
+			case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+				if (value < HTTP2_DEF_MAX_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE) return HTTP2_PROTOCOL_ERROR;
+				session->maxframesize = value;
+				break;
+
+			default:
+				// HEADER_TABLE_SIZE doesn't matter as responses are never indexed,
+				// the others are advisory or unknown.
+				break;
+		}
+	}
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processWindowUpdate(http2session* session, uint32_t streamid, const uint8_t* payload, uint32_t length) {
+
+	if (length != 4) return HTTP2_FRAME_SIZE_ERROR;
+
+	uint32_t increment = ((uint32_t)(payload[0] & 0x7f) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+
+	if (streamid == 0) {
+
+		if (increment == 0) return HTTP2_PROTOCOL_ERROR;
+
+		session->sendwindow += increment;
+
+		return (session->sendwindow > HTTP2_MAX_WINDOW_SIZE) ? HTTP2_FLOW_CONTROL_ERROR : HTTP2_NO_ERROR;
+	}
+
+	if (streamid > session->laststreamid) return HTTP2_PROTOCOL_ERROR;
+
+	http2stream* stream = findStream(session, streamid);
+
+	if (stream == NULL || stream->reset) return HTTP2_NO_ERROR;
+
+	if (increment == 0) {
+
+		resetStream(stream, HTTP2_PROTOCOL_ERROR);
+
+	} else if ((stream->sendwindow += increment) > HTTP2_MAX_WINDOW_SIZE) {
+
+		resetStream(stream, HTTP2_FLOW_CONTROL_ERROR);
+	}
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processRstStream(http2session* session, uint32_t streamid, uint32_t length) {
+
+	if (streamid == 0 || streamid > session->laststreamid) return HTTP2_PROTOCOL_ERROR;
+
+	if (length != 4) return HTTP2_FRAME_SIZE_ERROR;
+
+	http2stream* stream = findStream(session, streamid);
+
+	// no RST_STREAM back, it's freed on the next flush.
+	if (stream != NULL) stream->reset = true;
+
+	return HTTP2_NO_ERROR;
+}
+
+static int processPing(http2session* session, uint8_t flags, uint32_t streamid, const uint8_t* payload, uint32_t length) {
+
+	if (streamid != 0) return HTTP2_PROTOCOL_ERROR;
+
+	if (length != 8) return HTTP2_FRAME_SIZE_ERROR;
+
+	if (!(flags & HTTP2_FLAG_ACK)) {
+		writeFrameHeader(session->conn->out, length, HTTP2_PING, HTTP2_FLAG_ACK, 0);
+		evbuffer_add(session->conn->out, payload, length);
+	}
+
+	return HTTP2_NO_ERROR;
+}
+
+/**
+* hpack callback, put a decoded field into the request.
+*
+* Violations of message rules only mark the stream malformed, the block must
+* be decoded to the end anyway to keep the dynamic table in sync.
+*/
+static int addRequestHeader(const char* name, size_t namelen, const char* value, size_t valuelen, void* userdata) {
+
+	http2stream* stream	= (http2stream*) userdata;
+	http* ahttp			= (http*) connectionGetExtra(stream->conn);
+	listtable* headers	= ahttp->request.headers;
+
+	if (name[0] == ':') {
+
+		// pseudo headers are not allowed in trailers.
+		if (stream->headerdone) {
+			stream->malformed = true;
+		} else if (!strcmp(name, ":method") && stream->method == NULL) {
+			stream->method = strdup(value);
+		} else if (!strcmp(name, ":path") && stream->path == NULL && valuelen > 0) {
+			stream->path = strdup(value);
+		} else if (!strcmp(name, ":authority")) {
+			headers->putstr(headers, "Host", value);
+		} else if (strcmp(name, ":scheme")) {
+			stream->malformed = true;
+		}
+
+		return 0;
+	}
+
+	// field names must be lowercase and connection specific fields are not allowed.
+	for (size_t i = 0; i < namelen; i++) {
+		if (isupper((unsigned char) name[i])) stream->malformed = true;
+	}
+
+	if (isConnectionHeader(name) || (!strcmp(name, "te") && strcmp(value, "trailers"))) {
+		stream->malformed = true;
+	}
+
+	if (stream->malformed) return 0;
+
+	// cookie may be split into crumbs, join them back.
+	const char* cookie = (!strcmp(name, "cookie")) ? headers->getstr(headers, "cookie", false) : NULL;
+
+	if (cookie != NULL) {
+
+		char* joined = NULL;
+
+		if (asprintf(&joined, "%s; %s", cookie, value) > 0) {
+			headers->putstr(headers, name, joined);
+			free(joined);
+		}
+
+		return 0;
+	}
+
+	// :authority wins over host.
+	if (!strcmp(name, "host") && headers->getstr(headers, "Host", false) != NULL) return 0;
+
+	if (httpAddRequestHeader(ahttp, name, value) < 0) stream->malformed = true;
+
+	return 0;
+}
+
+/**
+* Open a stream and attach a request to it through EVENT_INIT hooks.
+*/
+static http2stream* streamNew(http2session* session, uint32_t id) {
+
+	http2stream* stream = NEW(http2stream);
+
+	if (stream == NULL) return NULL;
+
+	stream->id			= id;
+	stream->session		= session;
+	stream->sendwindow	= session->initialwindow;
+	stream->recvwindow	= HTTP2_DEF_WINDOW_SIZE;
+	stream->in			= evbuffer_new();
+	stream->out			= evbuffer_new();
+
+	if (stream->in == NULL || stream->out == NULL
+	|| (stream->conn = connectionNewStream(session->conn, stream->in, stream->out)) == NULL) {
+
+		if (stream->in) evbuffer_free(stream->in);
+		if (stream->out) evbuffer_free(stream->out);
+		free(stream);
+		return NULL;
+	}
+
+	stream->next		= session->streams;
+	session->streams	= stream;
+	session->numstreams++;
+
+	// http handler attaches the request here.
+	stream->conn->status = connectionCallHooks(stream->conn, EVENT_INIT);
+
+	http* ahttp = (http*) connectionGetExtra(stream->conn);
+
+	if (ahttp == NULL) {
+		session->streams = stream->next;
+		streamFree(stream);
+		return NULL;
+	}
+
+	ahttp->stream = stream;
+
+	// body written by hooks is framed later, possibly long after they returned.
+	evbuffer_add_cb(stream->out, outbufCallback, stream);
+
+	return stream;
+}
+
+// free a stream unlinked from the session, hooks get EVENT_CLOSE.
+static void streamFree(http2stream* stream) {
+
+	stream->session->numstreams--;
+
+	connectionFreeStream(stream->conn);
+
+	if (stream->method)	free(stream->method);
+	if (stream->path)	free(stream->path);
+
+	evbuffer_free(stream->in);
+	evbuffer_free(stream->out);
+
+	free(stream);
+}
+
+static http2stream* findStream(http2session* session, uint32_t id) {
+
+	for (http2stream* stream = session->streams; stream != NULL; stream = stream->next) {
+		if (stream->id == id) return stream;
+	}
+
+	return NULL;
+}
+
+static void closeStreams(http2session* session) {
+
+	http2stream* stream;
+
+	while ((stream = session->streams) != NULL) {
+		session->streams = stream->next;
+		streamFree(stream);
+	}
+}
+
+// client finished the request, check it and run the hooks.
+static void endRemote(http2stream* stream) {
+
+	http* ahttp = (http*) connectionGetExtra(stream->conn);
+
+	stream->endremote = true;
+
+	if (ahttp->request.contentlength >= 0 && (size_t) ahttp->request.contentlength != ahttp->request.bodyin) {
+		resetStream(stream, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+
+	ahttp->request.status = HTTP_REQ_DONE;
+
+	dispatchStream(stream);
+}
+
+static void dispatchStream(http2stream* stream) {
+
+	stream->dispatching		= true;
+	int status				= connectionCallHooks(stream->conn, EVENT_READ);
+	stream->dispatching		= false;
+	stream->conn->status	= status;
+
+	if ((status != DONE && status != CLOSE) || stream->endpending || stream->reset) return;
+
+	// hooks are done with the request but the response is not complete.
+	http* ahttp = (http*) connectionGetExtra(stream->conn);
+
+	if (!ahttp->response.frozen_header
+	|| (ahttp->response.contentlength >= 0 && ahttp->response.bodyout < (size_t) ahttp->response.contentlength)) {
+
+		resetStream(stream, HTTP2_INTERNAL_ERROR);
+
+	} else {
+
+		http2EndStream(ahttp);
+	}
+}
+
+static void resetStream(http2stream* stream, uint32_t error) {
+
+	if (stream->reset) return;
+
+	DEBUG("Reset HTTP/2 stream. (stream:%u, error:%u)", stream->id, error);
+
+	stream->reset = true;
+	sendRstStream(stream->session, stream->id, error);
+	event_active(stream->session->flushev, EV_WRITE, 0);
+}
+
+/**
+* Frame pending output of streams as DATA within flow-control windows.
+*
+* Streams take turns one frame at a time so a large response can't hold
+* back the others. Output is moved to the connection without copying.
+*/
+static void flushStreams(http2session* session) {
+
+	struct evbuffer* out	= session->conn->out;
+	bool progress			= true;
+
+	while (progress) {
+
+		progress = false;
+
+		for (http2stream* stream = session->streams; stream != NULL; stream = stream->next) {
+
+			if (stream->endlocal || stream->reset) continue;
+
+			size_t len = evbuffer_get_length(stream->out);
+
+			if (len == 0 && !stream->endpending) continue;
+
+			int64_t window	= (stream->sendwindow < session->sendwindow) ? stream->sendwindow : session->sendwindow;
+			size_t n		= (len < session->maxframesize) ? len : session->maxframesize;
+
+			if (window < (int64_t) n) n = (window > 0) ? window : 0;
+
+			// blocked until WINDOW_UPDATE
+			if (n == 0 && len > 0) continue;
+
+			bool end = (stream->endpending && n == len);
+
+			writeFrameHeader(out, n, HTTP2_DATA, (end) ? HTTP2_FLAG_END_STREAM : 0, stream->id);
+
+			if (n > 0) evbuffer_remove_buffer(stream->out, out, n);
+
+			stream->sendwindow	-= n;
+			session->sendwindow	-= n;
+
+			if (end) stream->endlocal = true;
+
+			progress = true;
+		}
+	}
+
+	reapStreams(session);
+}
+
+// free streams that are done in both directions or reset.
+static void reapStreams(http2session* session) {
+
+	http2stream** link = &session->streams;
+
+	while (*link != NULL) {
+
+		http2stream* stream = *link;
+
+		if (stream->dispatching) {
+			link = &stream->next;
+			continue;
+		}
+
+		// response is complete, tell the client not to bother with the rest of the request.
+		if (stream->endlocal && !stream->endremote && !stream->reset) {
+			sendRstStream(session, stream->id, HTTP2_NO_ERROR);
+			stream->reset = true;
+		}
+
+		if (stream->reset || (stream->endlocal && stream->endremote)) {
+			*link = stream->next;
+			streamFree(stream);
+			continue;
+		}
+
+		link = &stream->next;
+	}
+}
+
+static void flushCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	flushStreams((http2session*) userdata);
+}
+
+static void outbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata) {
+
+	http2stream* stream = (http2stream*) userdata;
+
+	if (info->n_added > 0) event_active(stream->session->flushev, EV_WRITE, 0);
+}
+
+static void writeFrameHeader(struct evbuffer* out, uint32_t length, uint8_t type, uint8_t flags, uint32_t streamid) {
+
+	uint8_t header[HTTP2_FRAME_HEADER_SIZE] = {
+		length >> 16, length >> 8, length,
+		type,
+		flags,
+		(streamid >> 24) & 0x7f, streamid >> 16, streamid >> 8, streamid
+	};
+
+	evbuffer_add(out, header, sizeof(header));
+}
+
+// send encoded header block in HEADERS and CONTINUATION frames.
+static void writeHeaders(http2session* session, uint32_t streamid, struct evbuffer* block, bool endstream) {
+
+	struct evbuffer* out	= session->conn->out;
+	size_t len				= evbuffer_get_length(block);
+	uint8_t type			= HTTP2_HEADERS;
+	uint8_t flags			= (endstream) ? HTTP2_FLAG_END_STREAM : 0;
+
+	do {
+
+		size_t n = (len < session->maxframesize) ? len : session->maxframesize;
+
+		len -= n;
+
+		writeFrameHeader(out, n, type, flags | ((len == 0) ? HTTP2_FLAG_END_HEADERS : 0), streamid);
+		evbuffer_remove_buffer(block, out, n);
+
+		type	= HTTP2_CONTINUATION;
+		flags	= 0;
+
+	} while (len > 0);
+}
+
+static void sendSettings(http2session* session) {
+
+	uint8_t payload[12] = {
+		0, HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+		session->maxstreams >> 24, session->maxstreams >> 16, session->maxstreams >> 8, session->maxstreams,
+		0, HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE,
+		0, HTTP2_MAX_HEADER_BLOCK_SIZE >> 16, (HTTP2_MAX_HEADER_BLOCK_SIZE >> 8) & 0xff, HTTP2_MAX_HEADER_BLOCK_SIZE & 0xff
+	};
+
+	writeFrameHeader(session->conn->out, sizeof(payload), HTTP2_SETTINGS, 0, 0);
+	evbuffer_add(session->conn->out, payload, sizeof(payload));
+}
+
+static void sendGoaway(http2session* session, uint32_t error) {
+
+	uint32_t last = session->laststreamid;
+
+	uint8_t payload[8] = {
+		(last >> 24) & 0x7f, last >> 16, last >> 8, last,
+		error >> 24, error >> 16, error >> 8, error
+	};
+
+	writeFrameHeader(session->conn->out, sizeof(payload), HTTP2_GOAWAY, 0, 0);
+	evbuffer_add(session->conn->out, payload, sizeof(payload));
+
+	session->goaway = true;
+}
+
+static void sendRstStream(http2session* session, uint32_t streamid, uint32_t error) {
+
+	uint8_t payload[4] = { error >> 24, error >> 16, error >> 8, error };
+
+	writeFrameHeader(session->conn->out, sizeof(payload), HTTP2_RST_STREAM, 0, streamid);
+	evbuffer_add(session->conn->out, payload, sizeof(payload));
+}
+
+static void sendWindowUpdate(http2session* session, uint32_t streamid, uint32_t increment) {
+
+	uint8_t payload[4] = { (increment >> 24) & 0x7f, increment >> 16, increment >> 8, increment };
+
+	writeFrameHeader(session->conn->out, sizeof(payload), HTTP2_WINDOW_UPDATE, 0, streamid);
+	evbuffer_add(session->conn->out, payload, sizeof(payload));
+}
+
+/**
+* Give received bytes back to the connection window, and to the stream
+* window unless stream is NULL.
+*/
+static void creditWindow(http2session* session, http2stream* stream, uint32_t increment) {
+
+	if (increment == 0) return;
+
+	session->recvwindow += increment;
+	sendWindowUpdate(session, 0, increment);
+
+	if (stream == NULL) return;
+
+	stream->recvwindow += increment;
+	sendWindowUpdate(session, stream->id, increment);
+}
+
+static bool isConnectionHeader(const char* name) {
+
+	static const char* names[] = {
+		"connection",
+		"keep-alive",
+		"proxy-connection",
+		"transfer-encoding",
+		"upgrade",
+		NULL
+	};
+
+	for (int i = 0; names[i] != NULL; i++) {
+		if (!strcasecmp(name, names[i])) return true;
+	}
+
+	return false;
+}
+
+/**
+* check if a comma separated header value lists the token. ex) "Upgrade, HTTP2-Settings"
+*/
+static bool hasToken(const char* list, const char* token) {
+
+	size_t len = strlen(token);
+
+	for (const char* p = list; p != NULL && *p != '\0'; p = strchr(p, ',')) {
+
+		if (*p == ',') p++;
+
+		while (*p == ' ' || *p == '\t') p++;
+
+		if (!strncasecmp(p, token, len) && strspn(p + len, " \t") == strcspn(p + len, ",")) return true;
+	}
+
+	return false;
+}
+
+// h2c upgrade of a cleartext HTTP/1.1 request.
+static bool isUpgradeRequest(connection* conn) {
+
+	if (conn->webserver->sslctx != NULL) return false;
+
+	const char* upgrade		= httpGetRequestHeader(conn, "Upgrade");
+	const char* aconnection	= httpGetRequestHeader(conn, "Connection");
+
+	if (upgrade == NULL || aconnection == NULL || httpGetRequestHeader(conn, "HTTP2-Settings") == NULL) return false;
+
+	return hasToken(upgrade, "h2c") && hasToken(aconnection, "Upgrade") && hasToken(aconnection, "HTTP2-Settings");
+}
+
+/**
+* Switch to HTTP/2 and answer the upgrade request on stream 1.
+*/
+static int upgradeConnection(connection* conn) {
+
+	uint8_t settings[256];
+	int len = decodeBase64Url(httpGetRequestHeader(conn, "HTTP2-Settings"), settings, sizeof(settings));
+
+	// keep speaking HTTP/1.1 on broken settings.
+	if (len < 0 || len % 6) return OK;
+
+	evbuffer_add_printf(conn->out, "%s 101 Switching Protocols" HTTP_CRLF "Connection: Upgrade" HTTP_CRLF "Upgrade: h2c" HTTP_CRLF HTTP_CRLF, HTTP_PROTOCOL_11);
+
+	http2session* session = sessionNew(conn);
+
+	if (session == NULL) return CLOSE;
+
+	int error = applySettings(session, settings, len);
+
+	if (error != HTTP2_NO_ERROR) {
+		sendGoaway(session, error);
+		return CLOSE;
+	}
+
+	// the request becomes stream 1, half-closed as it has been received in full.
+	session->laststreamid = 1;
+
+	http2stream* stream = streamNew(session, 1);
+
+	if (stream == NULL) {
+		sendGoaway(session, HTTP2_INTERNAL_ERROR);
+		return CLOSE;
+	}
+
+	http* ahttp			= (http*) connectionGetExtra(conn);
+	http* streamhttp	= (http*) connectionGetExtra(stream->conn);
+
+	__typeof__(ahttp->request) request	= streamhttp->request;
+	streamhttp->request					= ahttp->request;
+	ahttp->request						= request;
+
+	stream->headerdone	= true;
+	stream->endremote	= true;
+
+	dispatchStream(stream);
+
+	// client connection preface follows the upgrade request.
+	return sessionRead(session);
+}
+
+/**
+* Decode base64url without padding, as in HTTP2-Settings header.
+*
+* @return decoded length, -1 on invalid input or overflow.
+*/
+static int decodeBase64Url(const char* src, uint8_t* dst, size_t size) {
+
+	uint32_t bits	= 0;
+	int numbits		= 0;
+	size_t len		= 0;
+
+	for (; *src != '\0' && *src != '='; src++) {
+
+		int v;
+		char c = *src;
+
+		if (c >= 'A' && c <= 'Z') v = c - 'A';
+		else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') v = c - '0' + 52;
+		else if (c == '-') v = 62;
+		else if (c == '_') v = 63;
+		else return -1;
+
+		bits		= ((bits << 6) | v) & 0xffffff;
+		numbits		+= 6;
+
+		if (numbits >= 8) {
+
+			if (len >= size) return -1;
+
+			numbits -= 8;
+			dst[len++] = bits >> numbits;
+		}
+	}
+
+	return len;
+}
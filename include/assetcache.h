@@ -0,0 +1,74 @@
+/**
+ * @abstruct in-memory static asset cache library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __assetcache_h__
+#define __assetcache_h__
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "hashtable.h"
+#include "staticfile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ASSETCACHE_DEF_MAXBYTES		(32 * 1024 * 1024)	// total bytes of cached assets
+#define ASSETCACHE_DEF_MAXFILESIZE	(256 * 1024)		// files bigger than this are left to staticfile
+#define ASSETCACHE_DEF_VALIDITY		(1)					// seconds to trust a cached asset without stat()
+#define ASSETCACHE_MIN_GZIPSIZE		(256)				// files smaller than this are not gzipped
+
+typedef struct assetcache_t			assetcache;
+typedef struct assetcacheEntry_t	assetcacheEntry;
+typedef struct assetbuf_t			assetbuf;
+
+// immutable refcounted buffer, referenced by out-buffers while being sent
+struct assetbuf_t {
+	int		refcount;		// number of owners, freed on 0
+	size_t	size;			// data size
+	char	data[];			// data
+};
+
+// asset cache structure
+struct assetcache_t {
+	staticfile*			sf;				// mount to resolve paths and to fall back to
+	size_t				maxbytes;		// maximum total bytes
+	size_t				maxfilesize;	// maximum size of a file to cache
+	size_t				numbytes;		// total bytes in cache
+	hashtable*			entries;		// file path -> entry lookup
+	assetcacheEntry*	first;			// most recently used entry
+	assetcacheEntry*	last;			// least recently used entry
+	uint64_t			hits;			// number of responses served from cache
+	uint64_t			misses;			// number of files loaded into cache
+};
+
+// cached asset
+struct assetcacheEntry_t {
+	char*				path;			// cache key, mapped file path
+	struct stat			st;				// stat() of the loaded file
+	time_t				checked;		// last time st was validated
+	size_t				numbytes;		// bytes accounted for this entry
+	assetbuf*			body;			// identity body
+	assetbuf*			header;			// prebuilt header lines for body
+	assetbuf*			gzbody;			// gzip body, NULL if not worth it
+	assetbuf*			gzheader;		// prebuilt header lines for gzbody
+	char				etag[24];		// strong entity tag of body
+	char				gzetag[28];		// strong entity tag of gzbody
+	assetcacheEntry*	prev;			// LRU links
+	assetcacheEntry*	next;
+};
+
+// public functions
+extern assetcache*	assetCacheNew(staticfile* sf, size_t maxbytes, size_t maxfilesize);
+extern void			assetCacheFree(assetcache* cache);
+extern int			assetCacheHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
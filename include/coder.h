@@ -14,9 +14,35 @@
 extern "C" {
 #endif
 
+typedef struct paramview_t	paramview;
+typedef struct paramSpan_t	paramSpan;
+
+// one name=value pair, raw bytes of the viewed string
+struct paramSpan_t {
+	const char*	name;		// not NUL terminated
+	size_t		namelen;
+	const char*	value;		// not NUL terminated, empty when there is no '='
+	size_t		valuelen;
+};
+
+// name=value pairs of a query string or form body, decoded on demand
+struct paramview_t {
+	const char*	str;		// viewed string, must outlive the view
+	size_t		size;		// length of str
+	paramSpan*	spans;		// pairs in the order they appear
+	int			count;		// number of pairs
+	int			capacity;	// allocated spans
+};
+
 extern listtable*	parseQueries(listtable* tbl, const char* query, char equalchar, char sepchar, int* count);
+extern paramview*	paramViewNew(const char* str, size_t size, char equalchar, char sepchar);
+extern int			paramViewCount(paramview* pv, const char* name);
+extern const char*	paramViewGetRaw(paramview* pv, const char* name, int nth, size_t* size);
+extern char*		paramViewGet(paramview* pv, const char* name, int nth);
+extern void			paramViewFree(paramview* pv);
 extern char*		urlEncode(const void* bin, size_t size);
 extern size_t		urlDecode(char* str);
+extern int			urlNormalizePath(char* path);
 extern char*		base64Encode(const void* bin, size_t size);
 extern size_t		base64Decode(char* str);
 extern char*		hexEncode(const void* bin, size_t size);
@@ -0,0 +1,49 @@
+/**
+ * @abstruct response compression library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __compress_h__
+#define __compress_h__
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMPRESS_POOL_SIZE	(16)	// idle streams kept per thread and encoding
+
+// content-codings
+enum compress_encoding_e {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_DEFLATE,
+	COMPRESS_NUM_ENCODINGS
+};
+
+typedef struct compressor_t compressor;
+
+// pooled deflate stream
+struct compressor_t {
+	z_stream					zs;			// zlib stream, initialized once
+	enum compress_encoding_e	encoding;	// content-coding this stream writes
+	int							level;		// compression level
+	struct evbuffer*			buf;		// compressed output, drained after every write
+	compressor*					next;		// link in the idle pool
+};
+
+// public functions
+extern compressor*	compressorGet(enum compress_encoding_e encoding, int level);
+extern void			compressorRelease(compressor* c);
+extern int			compressorWrite(compressor* c, struct evbuffer* out, const void* data, size_t size, int flush);
+extern const char*	compressGetEncodingName(enum compress_encoding_e encoding);
+extern bool			compressIsCompressible(const char* contenttype);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
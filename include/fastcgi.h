@@ -0,0 +1,136 @@
+/**
+ * @abstruct FastCGI client library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __fastcgi_h__
+#define __fastcgi_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// record types
+#define FCGI_VERSION_1				(1)
+#define FCGI_BEGIN_REQUEST			(1)
+#define FCGI_ABORT_REQUEST			(2)
+#define FCGI_END_REQUEST			(3)
+#define FCGI_PARAMS					(4)
+#define FCGI_STDIN					(5)
+#define FCGI_STDOUT					(6)
+#define FCGI_STDERR					(7)
+#define FCGI_DATA					(8)
+#define FCGI_GET_VALUES				(9)
+#define FCGI_GET_VALUES_RESULT		(10)
+#define FCGI_UNKNOWN_TYPE			(11)
+
+#define FCGI_RESPONDER				(1)		// role
+#define FCGI_KEEP_CONN				(1)		// begin request flag
+#define FCGI_REQUEST_COMPLETE		(0)		// protocol status of end request
+#define FCGI_CANT_MPX_CONN			(1)
+#define FCGI_OVERLOADED				(2)
+#define FCGI_UNKNOWN_ROLE			(3)
+
+#define FCGI_HEADER_LEN				(8)
+#define FCGI_MAX_CONTENT_LEN		(65535)
+
+#define FASTCGI_DEF_MAX_CONNS		(8)					// connections to the backend
+#define FASTCGI_MAX_REQS_PER_CONN	(32)				// requests multiplexed on one connection at most
+#define FASTCGI_DEF_TIMEOUT			(60)				// seconds the backend may stay silent
+#define FASTCGI_MAX_BUFFERED		(256 * 1024)		// bytes queued towards one side before reading the other side stops
+#define FASTCGI_MAX_HEADER_SIZE		(64 * 1024)			// maximum size of CGI response header
+
+typedef struct fastcgi_t		fastcgi;
+typedef struct fastcgiConn_t	fastcgiConn;
+typedef struct fastcgiRequest_t	fastcgiRequest;
+typedef struct fastcgiRecord_t	fastcgiRecord;
+
+// FastCGI backend
+struct fastcgi_t {
+	char*					prefix;		// url prefix to forward, NULL for every request
+	size_t					prefixlen;	// length of prefix
+	char*					address;	// ex) unix:/run/php-fpm.sock, 127.0.0.1:9000
+	struct sockaddr_storage	addr;		// parsed address
+	int						addrlen;	// length of addr
+	char*					root;		// document root for SCRIPT_FILENAME
+	int						maxconns;	// connections to the backend
+	int						timeout;	// seconds the backend may stay silent, 0 for none
+	struct event_base*		evbase;		// loop the connections are bound to
+	fastcgiConn*			conns;		// open connections
+	int						numconns;	// number of open connections
+	fastcgiRequest*			waitfirst;	// requests waiting for a free request slot
+	fastcgiRequest*			waitlast;
+	uint64_t				requests;	// requests forwarded
+	uint64_t				multiplexed;// requests sent next to others on a connection
+	uint64_t				connects;	// connections opened
+	uint64_t				failures;	// requests that failed
+};
+
+// backend connection
+struct fastcgiConn_t {
+	fastcgi*				fcgi;		// backend the connection belongs to
+	struct bufferevent*		buffer;		// socket
+	bool					connected;	// connect succeeded
+	bool					paused;		// reading stopped until the client drains
+	int						maxreqs;	// requests it can carry at once, 1 until the backend allows more
+	int						numreqs;	// requests in flight
+	fastcgiRequest*			reqs[FASTCGI_MAX_REQS_PER_CONN];	// request id - 1 -> request
+	// record being read
+	struct {
+		uint8_t				type;		// record type
+		uint16_t			id;			// request id
+		uint16_t			remaining;	// content bytes left
+		uint8_t				padding;	// padding bytes left after the content
+		bool				active;		// header was read
+	} rec;
+	fastcgiConn*			next;		// connection list link
+};
+
+// request being served by the backend
+struct fastcgiRequest_t {
+	fastcgi*				fcgi;		// backend handling the request
+	connection*				conn;		// client connection, NULL once the client is gone
+	fastcgiConn*			fconn;		// backend connection, NULL while waiting
+	uint16_t				id;			// request id on fconn
+	bool					head;		// HEAD request, response has no body
+	bool					stdindone;	// whole body went out as FCGI_STDIN
+	bool					headersent;	// response header went to the client
+	bool					paused;		// client reading stopped until the backend drains
+	bool					done;		// exchange is over
+	int						result;		// hook result once done
+	bool					inhook;		// called from fastcgiHandler, don't resume
+	struct evbuffer*		header;		// CGI response header being collected
+	fastcgiRequest*			next;		// wait list link
+};
+
+// name-value pairs written straight into reserved out-buffer space, split into records as they fill up
+struct fastcgiRecord_t {
+	struct evbuffer*		out;		// out-buffer of the backend connection
+	uint8_t					type;		// FCGI_PARAMS or FCGI_GET_VALUES
+	uint16_t				id;			// request id
+	struct evbuffer_iovec	vec;		// reserved space of the open record
+	size_t					used;		// content bytes in the open record
+	bool					open;		// space is reserved
+};
+
+// public functions
+extern fastcgi*	fastcgiNew(const char* prefix, const char* address, const char* root);
+extern void		fastcgiSetMaxConns(fastcgi* fcgi, int maxconns);
+extern void		fastcgiSetTimeout(fastcgi* fcgi, int timeout);
+extern void		fastcgiFree(fastcgi* fcgi);
+extern int		fastcgiHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,63 @@
+/**
+ * @abstruct HPACK header compression library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __hpack_h__
+#define __hpack_h__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <event2/buffer.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HPACK_DEF_TABLE_SIZE		(4096)	// SETTINGS_HEADER_TABLE_SIZE default
+#define HPACK_STATIC_TABLE_SIZE		(61)	// number of static table entries
+#define HPACK_ENTRY_OVERHEAD		(32)	// bytes accounted per entry on top of name and value
+#define HPACK_MAX_STRING_SIZE		(64 * 1024)	// longest name or value accepted
+
+typedef struct hpack_t		hpack;
+typedef struct hpackEntry_t	hpackEntry;
+
+/**
+* Called with every decoded header field, name and value are NUL terminated.
+*
+* @return 0 to continue, otherwise decoding stops with error.
+*/
+typedef int (*hpackHeaderCallback)(const char* name, size_t namelen, const char* value, size_t valuelen, void* userdata);
+
+// dynamic table entry
+struct hpackEntry_t {
+	size_t	namelen;		// length of name
+	size_t	valuelen;		// length of value
+	char	data[];			// name, NUL, value, NUL
+};
+
+// decoding context, one per connection
+struct hpack_t {
+	hpackEntry**	entries;		// dynamic table ring, entries[head] is the newest
+	size_t			capacity;		// number of slots in entries
+	size_t			head;			// slot of the newest entry
+	size_t			numentries;		// number of entries in the table
+	size_t			size;			// table size as accounted by RFC 7541
+	size_t			maxsize;		// current table size limit
+	size_t			settingsmax;	// upper limit we advertised in SETTINGS
+	char*			scratch;		// decoded name and value of current field
+	size_t			scratchsize;	// allocated size of scratch
+};
+
+// public functions
+extern hpack*	hpackNew(size_t settingsmax);
+extern void		hpackFree(hpack* ctx);
+extern int		hpackDecode(hpack* ctx, const uint8_t* src, size_t size, hpackHeaderCallback cb, void* userdata);
+extern int		hpackEncodeHeader(struct evbuffer* out, const char* name, const char* value);
+extern int		hpackEncodeStatus(struct evbuffer* out, int code);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -6,10 +6,15 @@
 #ifndef __http_h__
 #define __http_h__
 
+#include <stdint.h>
+#include <sys/uio.h>
+#include <event2/buffer.h>
+
 #include "common.h"
 #include "hashtable.h"
 #include "list.h"
 #include "listtable.h"
+#include "coder.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,15 +24,18 @@ extern "C" {
 #define HTTP_PROTOCOL_09 "HTTP/0.9"
 #define HTTP_PROTOCOL_10 "HTTP/1.0"
 #define HTTP_PROTOCOL_11 "HTTP/1.1"
+#define HTTP_PROTOCOL_20 "HTTP/2.0"
 
 // HTTP RESPONSE CODES
 #define HTTP_NO_RESPONSE				(0)
 #define HTTP_CODE_CONTINUE				(100)
+#define HTTP_CODE_SWITCHING_PROTOCOLS	(101)
 #define HTTP_CODE_OK					(200)
 #define HTTP_CODE_CREATED				(201)
 #define HTTP_CODE_NO_CONTENT			(204)
 #define HTTP_CODE_PARTIAL_CONTENT		(206)
 #define HTTP_CODE_MULTI_STATUS			(207)
+#define HTTP_CODE_MOVED_PERMANENTLY		(301)
 #define HTTP_CODE_MOVED_TEMPORARILY		(302)
 #define HTTP_CODE_NOT_MODIFIED			(304)
 #define HTTP_CODE_BAD_REQUEST			(400)
@@ -37,15 +45,23 @@ extern "C" {
 #define HTTP_CODE_METHOD_NOT_ALLOWED	(405)
 #define HTTP_CODE_REQUEST_TIME_OUT		(408)
 #define HTTP_CODE_GONE					(410)
+#define HTTP_CODE_REQUEST_ENTITY_TOO_LARGE	(413)
 #define HTTP_CODE_REQUEST_URI_TOO_LONG	(414)
+#define HTTP_CODE_RANGE_NOT_SATISFIABLE	(416)
 #define HTTP_CODE_LOCKED				(423)
+#define HTTP_CODE_UPGRADE_REQUIRED		(426)
+#define HTTP_CODE_TOO_MANY_REQUESTS		(429)
+#define HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE	(431)
 #define HTTP_CODE_INTERNAL_SERVER_ERROR (500)
 #define HTTP_CODE_NOT_IMPLEMENTED		(501)
+#define HTTP_CODE_BAD_GATEWAY			(502)
 #define HTTP_CODE_SERVICE_UNAVAILABLE	(503)
+#define HTTP_CODE_GATEWAY_TIME_OUT		(504)
 
 // DEFAULT BEHAVIORS
 #define HTTP_CRLF "\r\n"
 #define HTTP_DEF_CONTENT_TYPE "application/octet-stream"
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
 
 // Hook type
 #define HOOK_ALL				(0)			// call on each and every phases
@@ -56,6 +72,34 @@ extern "C" {
 #define HOOK_ON_REQUEST			(1 << 5)	// call with complete request
 #define HOOK_ON_CLOSE			(1 << 6)	// call right before closing or next request
 
+// chunk size line, 16 hex digits and CRLF
+#define HTTP_CHUNK_HEADER_SIZE		(16 + 2)
+
+// chunked transfer decoding limits
+#define HTTP_CHUNK_MAX_EXTSIZE		(4096)	// bytes of chunk extensions per chunk
+#define HTTP_CHUNK_MAX_TRAILERSIZE	(8192)	// bytes of the whole trailer section
+
+// request body gathered in memory before each write to its spool file
+#define HTTP_SPOOL_WRITE_SIZE		(256 * 1024)
+
+enum http_chunk_state_e {
+	HTTP_CHUNK_SIZE = 0,		// reading hex digits of chunk size
+	HTTP_CHUNK_SIZE_WS,			// white spaces after chunk size
+	HTTP_CHUNK_EXT,				// skipping chunk extensions
+	HTTP_CHUNK_SIZE_LF,			// expecting LF of chunk size line
+	HTTP_CHUNK_DATA,			// moving chunk data to in-buff
+	HTTP_CHUNK_DATA_CR,			// expecting CR after chunk data
+	HTTP_CHUNK_DATA_LF,			// expecting LF after chunk data
+	HTTP_CHUNK_TRAILER,			// reading trailer fields after the last chunk
+};
+
+enum http_expect_e {
+	HTTP_EXPECT_NONE = 0,		// body is read as it arrives
+	HTTP_EXPECT_HOLD,			// Expect: 100-continue, body is held back while hooks see the header
+	HTTP_EXPECT_ACCEPT,			// header went through the hooks, 100 Continue goes out on the next pass
+	HTTP_EXPECT_CONTINUED,		// 100 Continue was sent or skipped, body is read
+};
+
 enum http_request_status_e {
 	HTTP_REQ_INIT = 0,			// initial state
 	HTTP_REQ_REQUESTLINE_DONE,	// received 1st line
@@ -77,12 +121,41 @@ struct http_t {
 		char* httpver;						// version ex) HTTP/1.1
 		char* path;							// decoded path ex) /data path
 		char* query;						// query string ex) query=the%20value
+		paramview* queryparams;				// parameters of query, built on first access
+		paramview* formparams;				// parameters of form body, built on first access
 		// request header - available on REQ_HEADER_DONE.
 		listtable* headers;					// parsed request header entries
 		char* host;							// host ex) www.domain.com or www.domain.com:8080
 		char* domain;						// domain name ex) www.domain.com (no port number)
 		off_t contentlength;				// value of Content-Length header.*/
 		size_t bodyin;						// bytes moved to in-buff
+		off_t maxbodysize;					// maximum body size, 0 for unlimited
+		size_t maxrequestline;				// maximum request line size, 0 for unlimited
+		size_t maxheadersize;				// maximum bytes of all header lines, 0 for unlimited
+		int maxheaders;						// maximum number of header lines, 0 for unlimited
+		size_t headersize;					// bytes of header lines read so far
+		int numheaders;						// header lines read so far
+		int errorcode;						// status code to reject the request with on HTTP_ERROR, 0 to just close
+		enum http_expect_e expect;			// Expect: 100-continue handling
+		bool streambody;					// hooks are called on every piece of body
+		// chunked transfer decoder
+		struct {
+			enum http_chunk_state_e state;	// decoder state
+			uint64_t remaining;				// chunk size while parsing, then bytes left in the chunk
+			int numdigits;					// digits of chunk size
+			size_t extlen;					// bytes of chunk extensions
+			size_t trailerlen;				// bytes of trailer section
+		} chunked;
+		// body spooled to a temp file
+		struct {
+			size_t threshold;				// body size above which it's spooled, 0 to keep it in memory
+			const char* dir;				// directory of the temp file
+			int fd;							// unlinked temp file, -1 while the body is in memory
+			off_t size;						// bytes written to the temp file
+			off_t offset;					// bytes removed with httpGetContent()
+			void* map;						// mapping given out by httpMapContent(), NULL if none
+			size_t maplen;					// bytes mapped
+		} spool;
 	} request;
 
 	// HTTP Response
@@ -95,7 +168,13 @@ struct http_t {
 		listtable* headers;					// response header entries
 		off_t contentlength;				// content length in response
 		size_t bodyout;						// bytes added to out-buffer
+		struct compressor_t* compressor;	// compression filter, NULL if not compressing
+		struct evbuffer* capture;			// copy of identity body for caches, NULL if not capturing
+		size_t capturemax;					// body size to capture at most, capturing stops past it
+		bool complete;						// whole body is in the out-buffer
 	} response;
+
+	struct http2stream_t* stream;			// HTTP/2 stream carrying this exchange, NULL for HTTP/1.x
 };
 
 typedef struct http_t http;
@@ -107,17 +186,37 @@ extern struct evbuffer*				httpGetInbuf(connection* conn);
 extern struct evbuffer*				httpGetOutbuf(connection* conn);
 extern const char*					httpGetRequestHeader(connection* conn, const char* name);
 extern off_t						httpGetContentLength(connection* conn);
+extern size_t						httpGetContentSize(connection* conn);
+extern paramview*					httpGetQueryParams(connection* conn);
+extern paramview*					httpGetFormParams(connection* conn);
 extern void*						httpGetContent(connection* conn, size_t maxsize, size_t* storedsize);
+extern const void*					httpMapContent(connection* conn, size_t* size);
 extern int							httpIsKeepaliveRequest(connection* conn);
+extern bool							httpAcceptsEncoding(connection* conn, const char* coding);
 extern int							httpSetResponseHeader(connection* conn, const char* name, const char* value);
 extern const char*					httpGetResponseHeader(connection* conn, const char* name);
 extern int							httpSetResponseCode(connection* conn, int code, const char* reason);
 extern int							httpSetResponseContent(connection* conn, const char* contenttype, off_t size);
 extern size_t						httpResponse(connection* conn, int code, const char* contenttype, const void* data, off_t size);
 extern size_t						httpSendHeader(connection* conn);
+extern size_t						httpSendHeaderBlock(connection* conn, const void* block, size_t size, off_t contentlength);
 extern size_t						httpSendData(connection* conn, const void* data, size_t size);
+extern size_t						httpSendDataRef(connection* conn, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata);
+extern size_t						httpSendDatav(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata);
 extern size_t						httpSendChunk(connection* conn, const void* data, size_t size);
+extern size_t						httpSendChunkRef(connection* conn, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata);
+extern size_t						httpSendChunkv(connection* conn, const struct iovec* iov, int iovcnt, evbuffer_ref_cleanup_cb release, void* userdata);
+extern size_t						httpSendFileSegment(connection* conn, struct evbuffer_file_segment* seg, int fd, off_t offset, off_t size);
+extern size_t						httpSendBuffer(connection* conn, struct evbuffer* buf, size_t size);
+extern void							httpSetBodyStreaming(connection* conn, bool streaming);
 extern const char*					httpGetReason(int code);
+extern int							httpSetRequestLine(http* ahttp, const char* method, const char* uri, const char* httpver);
+extern void							httpSetRequestHost(http* ahttp);
+extern int							httpAddRequestHeader(http* ahttp, const char* name, const char* value);
+extern int							httpSetContentLength(http* ahttp);
+extern size_t						httpAddContent(http* ahttp, struct evbuffer* buffer, size_t size);
+extern bool							isValidPathname(const char* path);
+extern void							correctPathname(char* path);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,133 @@
+/**
+ * @abstruct HTTP/2 library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __http2_h__
+#define __http2_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "http.h"
+#include "hpack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTP2_PROTOCOL_NAME			"h2"
+#define HTTP2_PREFACE				"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_FRAME_HEADER_SIZE		(9)
+#define HTTP2_DEF_WINDOW_SIZE		(65535)
+#define HTTP2_MAX_WINDOW_SIZE		(0x7fffffff)
+#define HTTP2_DEF_MAX_FRAME_SIZE	(16384)			// SETTINGS_MAX_FRAME_SIZE default, also our limit
+#define HTTP2_MAX_FRAME_SIZE		(16777215)
+#define HTTP2_MAX_HEADER_BLOCK_SIZE	(64 * 1024)		// HEADERS and CONTINUATION fragments of a block
+
+// frame types
+enum http2_frame_e {
+	HTTP2_DATA = 0,
+	HTTP2_HEADERS,
+	HTTP2_PRIORITY,
+	HTTP2_RST_STREAM,
+	HTTP2_SETTINGS,
+	HTTP2_PUSH_PROMISE,
+	HTTP2_PING,
+	HTTP2_GOAWAY,
+	HTTP2_WINDOW_UPDATE,
+	HTTP2_CONTINUATION
+};
+
+// frame flags
+#define HTTP2_FLAG_END_STREAM	(0x01)
+#define HTTP2_FLAG_ACK			(0x01)
+#define HTTP2_FLAG_END_HEADERS	(0x04)
+#define HTTP2_FLAG_PADDED		(0x08)
+#define HTTP2_FLAG_PRIORITY		(0x20)
+
+// settings parameters
+enum http2_settings_e {
+	HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	HTTP2_SETTINGS_ENABLE_PUSH,
+	HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+	HTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+	HTTP2_SETTINGS_MAX_FRAME_SIZE,
+	HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+// error codes
+enum http2_error_e {
+	HTTP2_NO_ERROR = 0,
+	HTTP2_PROTOCOL_ERROR,
+	HTTP2_INTERNAL_ERROR,
+	HTTP2_FLOW_CONTROL_ERROR,
+	HTTP2_SETTINGS_TIMEOUT,
+	HTTP2_STREAM_CLOSED,
+	HTTP2_FRAME_SIZE_ERROR,
+	HTTP2_REFUSED_STREAM,
+	HTTP2_CANCEL,
+	HTTP2_COMPRESSION_ERROR,
+	HTTP2_CONNECT_ERROR,
+	HTTP2_ENHANCE_YOUR_CALM,
+	HTTP2_INADEQUATE_SECURITY,
+	HTTP2_HTTP_1_1_REQUIRED
+};
+
+typedef struct http2session_t	http2session;
+typedef struct http2stream_t	http2stream;
+
+// HTTP/2 connection
+struct http2session_t {
+	connection*			conn;				// underlying connection
+	hpack*				decoder;			// request header decoding context
+	struct evbuffer*	headerblock;		// header block being received
+	uint32_t			headerstreamid;		// stream of headerblock, 0 when not in a block
+	bool				headerendstream;	// END_STREAM flag of the HEADERS frame
+	bool				prefacedone;		// client connection preface received
+	bool				goaway;				// no new streams are accepted
+	uint32_t			laststreamid;		// highest stream id opened by the client
+	uint32_t			maxstreams;			// concurrent streams we accept
+	size_t				numstreams;			// number of open streams
+	int64_t				sendwindow;			// connection flow-control window for sending
+	int64_t				recvwindow;			// connection flow-control window for receiving
+	int64_t				initialwindow;		// SETTINGS_INITIAL_WINDOW_SIZE of the client
+	uint32_t			maxframesize;		// SETTINGS_MAX_FRAME_SIZE of the client
+	http2stream*		streams;			// open streams
+	struct event*		flushev;			// deferred framing of pending stream output
+};
+
+// HTTP/2 stream, seen by hooks as a connection
+struct http2stream_t {
+	uint32_t			id;					// stream identifier
+	http2session*		session;			// connection the stream belongs to
+	connection*			conn;				// stream connection handed to hooks
+	struct evbuffer*	in;					// stays empty, request body is in http in-buff
+	struct evbuffer*	out;				// response body waiting to be framed
+	int64_t				sendwindow;			// stream flow-control window for sending
+	int64_t				recvwindow;			// stream flow-control window for receiving
+	char*				method;				// :method
+	char*				path;				// :path
+	bool				headerdone;			// request headers received
+	bool				malformed;			// request violates HTTP/2 message rules
+	bool				endremote;			// client sent END_STREAM
+	bool				endpending;			// response body is complete
+	bool				endlocal;			// we sent END_STREAM
+	bool				reset;				// RST_STREAM sent or received
+	bool				dispatching;		// hooks are running on the stream
+	http2stream*		next;
+};
+
+// public functions
+extern int		http2Handler(short event, connection* conn, void* userdata);
+extern size_t	http2SendHeader(http* ahttp, const void* block, size_t size);
+extern void		http2EndStream(http* ahttp);
+extern void		http2ResetStream(http* ahttp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
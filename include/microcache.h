@@ -0,0 +1,96 @@
+/**
+ * @abstruct response microcache library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __microcache_h__
+#define __microcache_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MICROCACHE_DEF_MAXBYTES		(64 * 1024 * 1024)	// total bytes of cached responses
+#define MICROCACHE_DEF_MAXENTRYSIZE	(1024 * 1024)		// bigger responses are not cached
+#define MICROCACHE_DEF_TTL			(1)					// seconds a response stays fresh
+#define MICROCACHE_MAX_VARY			(8)					// request headers the key can include
+
+enum microcache_state_e {
+	MICROCACHE_FILLING = 0,		// leader is running the handler, other requests wait
+	MICROCACHE_VALID,			// response is cached
+	MICROCACHE_PASS,			// response was not cacheable, requests go to the handler uncoalesced
+};
+
+typedef struct microcache_t			microcache;
+typedef struct microcacheEntry_t	microcacheEntry;
+typedef struct microcacheWaiter_t	microcacheWaiter;
+typedef struct microbuf_t			microbuf;
+
+// immutable refcounted buffer, referenced by out-buffers while being sent
+struct microbuf_t {
+	int		refcount;		// number of owners, freed on 0
+	size_t	size;			// data size
+	char	data[];			// data
+};
+
+// microcache structure
+struct microcache_t {
+	size_t				maxbytes;		// maximum total bytes
+	size_t				maxentrysize;	// maximum body size of a response to cache
+	int					ttl;			// seconds a response stays fresh
+	char*				vary[MICROCACHE_MAX_VARY];	// request headers included in the key
+	int					numvary;		// number of vary headers
+	size_t				numbytes;		// total bytes in cache
+	hashtable*			entries;		// key -> entry lookup
+	microcacheEntry*	first;			// most recently used entry
+	microcacheEntry*	last;			// least recently used entry
+	uint64_t			hits;			// responses served from cache
+	uint64_t			misses;			// requests that ran the handler to fill an entry
+	uint64_t			coalesced;		// requests that waited for another one to fill
+	uint64_t			passes;			// requests that bypassed the cache
+	uint64_t			evictions;		// entries dropped to make room
+};
+
+// cached response
+struct microcacheEntry_t {
+	char*				key;			// method, host, uri and vary header values
+	enum microcache_state_e state;		// entry state
+	time_t				expires;		// entry is stale from this time
+	size_t				numbytes;		// bytes accounted for this entry
+	int					code;			// response status code
+	microbuf*			header;			// prebuilt header lines for body
+	microbuf*			body;			// identity body
+	microbuf*			gzheader;		// prebuilt header lines for gzbody
+	microbuf*			gzbody;			// gzip body, NULL if not worth it
+	connection*			leader;			// connection filling the entry
+	struct evbuffer*	capture;		// body captured from the leader's response
+	microcacheWaiter*	waiters;		// connections waiting for the leader
+	microcacheEntry*	prev;			// LRU links, VALID and PASS entries only
+	microcacheEntry*	next;
+};
+
+// request parked until the leader is done
+struct microcacheWaiter_t {
+	connection*			conn;
+	microcacheWaiter*	next;
+};
+
+// public functions
+extern microcache*	microcacheNew(size_t maxbytes, int ttl);
+extern int			microcacheAddVary(microcache* cache, const char* name);
+extern void			microcacheSetMaxEntrySize(microcache* cache, size_t maxentrysize);
+extern void			microcacheFree(microcache* cache);
+extern int			microcacheHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,97 @@
+/**
+ * @abstruct streaming multipart/form-data parser
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __multipart_h__
+#define __multipart_h__
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MULTIPART_MAX_BOUNDARY		(70)				// RFC 2046
+#define MULTIPART_MAX_PART_HEADER	(8 * 1024)			// maximum size of part header
+#define MULTIPART_DEF_MAX_FIELD		(64 * 1024)			// bytes of a field kept in memory
+#define MULTIPART_DEF_MAX_FILE		(0)					// bytes of a file part, 0 for unlimited
+#define MULTIPART_DEF_MAX_PARTS		(256)				// parts in one form
+#define MULTIPART_DEF_TMPDIR		"/tmp"
+
+enum multipart_state_e {
+	MULTIPART_PREAMBLE = 0,		// looking for the first boundary
+	MULTIPART_BOUNDARY_END,		// after a boundary, "--" or CRLF follows
+	MULTIPART_HEADER,			// reading part header
+	MULTIPART_DATA,				// reading part data until the next boundary
+	MULTIPART_EPILOGUE,			// after the closing boundary
+};
+
+typedef struct multipart_t		multipart;
+typedef struct multipartForm_t	multipartForm;
+typedef struct multipartPart_t	multipartPart;
+
+/**
+* Receives the data of file parts instead of temp files. Called with every
+* piece of data as it arrives and once more with size 0 at the end of the part.
+*
+* @return 0 to go on, otherwise HTTP response code to reject the upload with.
+*/
+typedef int (*multipartFileCallback)(connection* conn, multipartPart* part, const void* data, size_t size, void* userdata);
+
+// multipart/form-data handler
+struct multipart_t {
+	char*					prefix;		// url prefix to parse forms for, NULL for every request
+	size_t					prefixlen;	// length of prefix
+	char*					tmpdir;		// directory of temp files
+	size_t					maxfieldsize;	// bytes of a field kept in memory
+	off_t					maxfilesize;	// bytes of a file part, 0 for unlimited
+	int						maxparts;	// parts in one form
+	multipartFileCallback	callback;	// file data goes here instead of temp files when set
+	void*					userdata;	// passed to callback
+};
+
+// form part
+struct multipartPart_t {
+	char*					name;		// field name
+	char*					filename;	// file name as sent by the client, NULL for a field
+	char*					contenttype;// Content-Type of the part, NULL if not given
+	char*					value;		// NUL terminated field value, NULL for a file
+	off_t					size;		// bytes of data
+	char*					filepath;	// temp file holding a file part, NULL with a callback
+	int						fd;			// temp file while it is written, -1 otherwise
+	multipartPart*			next;		// part list link
+};
+
+// form being parsed
+struct multipartForm_t {
+	multipart*				mp;			// handler parsing the form
+	connection*				conn;		// client connection
+	enum multipart_state_e	state;		// parser state
+	char					delimiter[MULTIPART_MAX_BOUNDARY + 5];	// CRLF "--" boundary
+	size_t					delimiterlen;	// length of delimiter
+	size_t					headerlen;	// bytes of the part header read so far
+	multipartPart*			parts;		// parts in the order they appear
+	multipartPart*			last;		// last part, the one being read in MULTIPART_DATA
+	int						numparts;	// number of parts
+	bool					done;		// parsing is over
+	int						result;		// hook result once done
+};
+
+// public functions
+extern multipart*		multipartNew(const char* prefix, const char* tmpdir);
+extern void				multipartSetLimits(multipart* mp, size_t maxfieldsize, off_t maxfilesize, int maxparts);
+extern void				multipartSetFileCallback(multipart* mp, multipartFileCallback callback, void* userdata);
+extern void				multipartFree(multipart* mp);
+extern int				multipartHandler(short event, connection* conn, void* userdata);
+extern multipartForm*	multipartGetForm(multipart* mp, connection* conn);
+extern multipartPart*	multipartGetPart(multipartForm* form, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,127 @@
+/**
+ * @abstruct reverse proxy library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __proxy_h__
+#define __proxy_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+#include "server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROXY_MAX_UPSTREAMS		(64)				// upstreams per proxy
+#define PROXY_DEF_MAX_IDLE		(32)				// idle connections kept per upstream
+#define PROXY_DEF_TIMEOUT		(60)				// seconds an upstream may stay silent during an exchange
+#define PROXY_DEF_IDLE_TIMEOUT	(30)				// seconds an idle connection is kept in the pool
+#define PROXY_DOWN_TIME			(10)				// seconds an upstream is skipped after a failed connect
+#define PROXY_MAX_BUFFERED		(256 * 1024)		// bytes queued towards one side before reading the other side stops
+#define PROXY_MAX_HEADER_SIZE	(64 * 1024)			// maximum size of upstream response header
+
+enum proxy_conn_state_e {
+	PROXY_CONN_IDLE = 0,		// in the pool
+	PROXY_CONN_STATUS,			// waiting for status line
+	PROXY_CONN_HEADERS,			// reading response header
+	PROXY_CONN_BODY,			// body with Content-Length
+	PROXY_CONN_CHUNK_SIZE,		// chunked body, size line
+	PROXY_CONN_CHUNK_DATA,		// chunked body, chunk data
+	PROXY_CONN_CHUNK_CRLF,		// chunked body, CRLF after chunk data
+	PROXY_CONN_TRAILER,			// chunked body, trailer section
+	PROXY_CONN_UNTIL_CLOSE,		// body ends when upstream closes
+};
+
+typedef struct proxy_t			proxy;
+typedef struct proxyUpstream_t	proxyUpstream;
+typedef struct proxyConn_t		proxyConn;
+typedef struct proxyRequest_t	proxyRequest;
+
+// reverse proxy
+struct proxy_t {
+	char*				prefix;			// url prefix to forward, NULL for every request
+	size_t				prefixlen;		// length of prefix
+	proxyUpstream*		upstreams[PROXY_MAX_UPSTREAMS];	// upstream servers
+	int					numupstreams;	// number of upstreams
+	int					nextupstream;	// where the next balancing round starts, breaks ties
+	int					maxidle;		// idle connections kept per upstream
+	int					timeout;		// seconds an upstream may stay silent, 0 for none
+	int					idletimeout;	// seconds an idle connection is kept, 0 for none
+	struct event_base*	evbase;			// loop the pooled connections are bound to
+	uint64_t			requests;		// requests forwarded
+	uint64_t			reuses;			// requests sent on a pooled connection
+	uint64_t			connects;		// upstream connections opened
+	uint64_t			retries;		// requests retried after a pooled connection went away
+	uint64_t			failures;		// exchanges that failed
+};
+
+// upstream server
+struct proxyUpstream_t {
+	char*					address;	// ex) 127.0.0.1:8080, [::1]:8080, unix:/tmp/app.sock
+	struct sockaddr_storage	addr;		// parsed address
+	int						addrlen;	// length of addr
+	int						outstanding;// requests in flight
+	proxyConn*				idle;		// pooled keep-alive connections, most recently used first
+	int						numidle;	// number of pooled connections
+	time_t					downuntil;	// skipped by balancing until this time
+};
+
+// upstream connection
+struct proxyConn_t {
+	proxy*					px;			// proxy the connection belongs to
+	proxyUpstream*			upstream;	// upstream the connection goes to
+	struct bufferevent*		buffer;		// socket
+	proxyRequest*			req;		// request in flight, NULL when idle
+	enum proxy_conn_state_e	state;		// response parser state
+	bool					connected;	// connect succeeded
+	bool					reused;		// taken from the pool for this request
+	bool					responded;	// got any response byte for this request
+	bool					keepalive;	// can go back to the pool after the response
+	bool					paused;		// reading stopped until the client drains
+	bool					chunked;	// response body is chunked
+	int						code;		// response status code
+	char*					reason;		// response reason phrase
+	off_t					contentlength;	// response Content-Length, -1 if not given
+	uint64_t				remaining;	// body or chunk bytes left
+	struct evbuffer*		header;		// response header lines to send to the client
+	proxyConn*				next;		// pool link
+};
+
+// request being forwarded
+struct proxyRequest_t {
+	proxy*					px;			// proxy handling the request
+	connection*				conn;		// client connection
+	proxyConn*				upconn;		// upstream connection, NULL when there is none
+	bool					head;		// HEAD request, response has no body
+	bool					bodyless;	// request had no body
+	bool					idempotent;	// method can be sent twice with the same effect, ex) GET
+	bool					chunked;	// request body is forwarded chunked
+	bool					requestdone;// whole request was queued to upstream
+	bool					headersent;	// response header went to the client
+	bool					paused;		// client reading stopped until upstream drains
+	bool					retried;	// already resent once
+	bool					inhook;		// called from proxyHandler, don't resume
+	bool					done;		// exchange is over
+	int						result;		// hook result once done
+};
+
+// public functions
+extern proxy*	proxyNew(const char* prefix);
+extern int		proxyAddUpstream(proxy* px, const char* address);
+extern void		proxySetMaxIdle(proxy* px, int maxidle);
+extern void		proxySetTimeout(proxy* px, int timeout, int idletimeout);
+extern void		proxyFree(proxy* px);
+extern int		proxyHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
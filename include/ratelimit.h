@@ -0,0 +1,87 @@
+/**
+ * @abstruct request rate limiting library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __ratelimit_h__
+#define __ratelimit_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "server.h"
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RATELIMIT_SHARDS		(16)		// independently locked parts of the bucket table
+#define RATELIMIT_WAYS			(8)			// buckets a key can land in, the least recently used one is evicted
+#define RATELIMIT_MAX_KEY		(64)		// longer keys are cut
+#define RATELIMIT_DEF_MAXKEYS	(65536)		// keys tracked at once
+#define RATELIMIT_STATS_TOP		(16)		// most limited keys put into stats
+#define RATELIMIT_DEF_V6PREFIX	(64)		// bits of an IPv6 client address it is keyed by
+
+typedef struct ratelimit_t			ratelimit;
+typedef struct ratelimitShard_t		ratelimitShard;
+typedef struct ratelimitBucket_t	ratelimitBucket;
+
+/**
+* Make the key a request is limited by.
+*
+* @param key buffer of RATELIMIT_MAX_KEY bytes to write the key to.
+*
+* @return true to limit the request by key, false to let it through unlimited.
+*/
+typedef bool (*ratelimitKeyCallback)(connection* conn, char* key, void* userdata);
+
+// token bucket of a key
+struct ratelimitBucket_t {
+	uint64_t			hash;					// hash of key, 0 for an empty bucket
+	char				key[RATELIMIT_MAX_KEY];
+	double				tokens;					// requests that can be made right now
+	uint64_t			updated;				// milliseconds the tokens were counted at, also the LRU age
+	uint32_t			allowed;				// requests let through
+	uint32_t			limited;				// requests answered with the limit code
+};
+
+// part of the bucket table with its own lock
+struct ratelimitShard_t {
+	pthread_mutex_t		lock;
+	ratelimitBucket*	buckets;				// numsets * RATELIMIT_WAYS buckets
+	size_t				numsets;
+};
+
+// rate limiter
+struct ratelimit_t {
+	double					rate;				// tokens added per second
+	double					burst;				// tokens a bucket holds at most
+	int						code;				// status code of limited requests
+	int						v6prefix;			// bits of an IPv6 client address it is keyed by
+	ratelimitKeyCallback	keycb;				// NULL to limit by client address
+	void*					keyuserdata;
+	ratelimitShard			shards[RATELIMIT_SHARDS];
+	char					top[RATELIMIT_STATS_TOP][RATELIMIT_MAX_KEY];	// keys last put into stats
+	int						numtop;
+	// counters are updated atomically, outside of shard locks
+	uint64_t				allowed;			// requests let through
+	uint64_t				limited;			// requests answered with the limit code
+	uint64_t				evictions;			// keys dropped to make room
+};
+
+// public functions
+extern ratelimit*	ratelimitNew(double rate, int burst, size_t maxkeys);
+extern void			ratelimitSetCode(ratelimit* rl, int code);
+extern void			ratelimitSetIPv6Prefix(ratelimit* rl, int bits);
+extern void			ratelimitSetKeyCallback(ratelimit* rl, ratelimitKeyCallback keycb, void* userdata);
+extern bool			ratelimitTake(ratelimit* rl, const char* key, int* retryafter);
+extern void			ratelimitUpdateStats(ratelimit* rl, hashtable* stats);
+extern void			ratelimitFree(ratelimit* rl);
+extern int			ratelimitHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
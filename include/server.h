@@ -6,6 +6,7 @@
 #ifndef __common_h__
 #define __common_h__
 
+#include <sys/socket.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -36,9 +37,87 @@ extern "C" {
 { "server.ssl_cert", "/usr/local/etc/server.crt" }, \
 { "server.ssl_pkey", "/usr/local/etc/server.key" }, \
 \
+/* Sessions kept in the server side TLS session cache. 0 disables the cache. */ \
+{ "server.ssl_session_cache", "20480" }, \
+\
+/* Seconds a TLS session or ticket can be resumed */ \
+{ "server.ssl_session_timeout", "3600" }, \
+\
+/* Seconds between session ticket key rotations. 0 disables tickets. */ \
+{ "server.ssl_ticket_rotation", "3600" }, \
+\
+/* Let the kernel encrypt TLS records (Linux kTLS), static files are then sent with SSL_sendfile() */ \
+{ "server.ssl_ktls", "0" }, \
+\
+/* Threads running TLS handshakes off the event loop. 0 runs them on the loop. */ \
+{ "server.ssl_handshake_threads", "0" }, \
+\
+/* Seconds a TLS handshake on the handshake threads can take */ \
+{ "server.ssl_handshake_timeout", "10" }, \
+\
+/* TLS handshakes on the handshake threads at once, new connections over it are dropped */ \
+{ "server.ssl_handshake_queue", "1024" }, \
+\
+/* TLS record payload at connection start and after idle, 0 leaves record sizes to OpenSSL */ \
+{ "server.ssl_record_size", "1400" }, \
+\
+/* Bytes sent in small TLS records before they grow to 16KB */ \
+{ "server.ssl_record_threshold", "65536" }, \
+\
+/* Milliseconds without writes after which TLS records are small again */ \
+{ "server.ssl_record_idle", "1000" }, \
+\
+/* Advertise HTTP/2 via ALPN on SSL connections */ \
+{ "server.http2", "0" }, \
+\
+/* Maximum number of concurrent HTTP/2 streams per connection */ \
+{ "server.http2_max_streams", "100" }, \
+\
+/* Compress responses with gzip or deflate when the client accepts it */ \
+{ "server.compression", "0" }, \
+\
+/* Responses with Content-Length smaller than this are sent as they are */ \
+{ "server.compression_min_size", "1024" }, \
+\
+/* zlib compression level, 1(fastest) to 9(smallest) */ \
+{ "server.compression_level", "6" }, \
+\
+/* Seconds a client has to send the request line and headers, from their first byte. 0 means no limit. */ \
+{ "server.header_timeout", "30" }, \
+\
+/* Bytes per second a request body must arrive at. 0 means no limit. */ \
+{ "server.body_min_rate", "1024" }, \
+\
+/* Bytes per second a client must take a pending response at. 0 means no limit. */ \
+{ "server.send_min_rate", "1024" }, \
+\
+/* Seconds over which body_min_rate and send_min_rate are measured */ \
+{ "server.rate_period", "10" }, \
+\
+/* Maximum size of request body in bytes. 0 means no limit. */ \
+{ "server.max_body_size", "0" }, \
+\
+/* Maximum size of request line in bytes, longer ones get 414. 0 means no limit. */ \
+{ "server.max_request_line", "8192" }, \
+\
+/* Maximum bytes of all request header lines, more get 431. 0 means no limit. */ \
+{ "server.max_header_size", "65536" }, \
+\
+/* Maximum number of request header lines, more get 431. 0 means no limit. */ \
+{ "server.max_headers", "100" }, \
+\
+/* Request bodies larger than this are spooled to a temp file instead of memory. 0 means never. */ \
+{ "server.body_spool_size", "1048576" }, \
+\
+/* Directory of request body temp files */ \
+{ "server.body_spool_dir", "/tmp" }, \
+\
 /* Enable or disable request pipelining, this change AD_DONE's behavior */ \
 { "server.request_pipelining", "1" }, \
 \
+/* Maximum number of pipelined requests dispatched in one read callback */ \
+{ "server.pipelining_batch", "64" }, \
+\
 /* Run server in a separate thread */ \
 { "server.thread", "0" }, \
 \
@@ -49,6 +128,16 @@ extern "C" {
 { "", "_END_" } \
 };
 
+// hooks keeping per-request state on a connection at once, see connectionSetHookData()
+#define CONN_MAX_HOOKDATA	(8)
+
+// request phases with a deadline of their own, see connectionSetPhase()
+enum connection_phase_e {
+	CONN_PHASE_IDLE = 0,	// between requests, only server.timeout applies
+	CONN_PHASE_HEADER,		// request line and headers, absolute deadline
+	CONN_PHASE_BODY,		// request body, minimum rate
+};
+
 // server structure
 struct server_t {
 	int 					errcode;
@@ -59,6 +148,15 @@ struct server_t {
 	struct evconnlistener*	listener;
 	struct event_base*		evbase;
 	SSL_CTX*				sslctx;
+	struct tlsSNI_t*		sni;				// certificates picked by server name, NULL if none
+	struct tlsHandshakePool_t*	handshakes;		// handshake threads, NULL if handshakes run on the loop
+	const struct timeval*	headertimeout;		// common timeout of the header deadline, NULL if none
+	const struct timeval*	rateperiod;			// common timeout of rate checks, NULL if none
+	size_t					bodyminrate;		// bytes per rate period, 0 if not enforced
+	size_t					sendminrate;		// bytes per rate period, 0 if not enforced
+	uint64_t				headertimeouts;		// connections that missed the header deadline
+	uint64_t				bodytimeouts;		// connections sending the body too slowly
+	uint64_t				sendtimeouts;		// connections taking the response too slowly
 	struct bufferevent*		notify_buffer;
 };
 
@@ -72,6 +170,29 @@ struct connection_t {
 	void*					userdata[2];
 	callback_free_userdata	userdata_free_cb[2];
 	char*					method;
+	connection*				parent;				// connection a multiplexed stream belongs to, NULL if not a stream
+	const char*				protocol;			// protocol that took over the connection ex) h2
+	void*					session;			// session of the protocol
+	callback_free_userdata	session_free_cb;
+	struct tlsRecordSizer_t*	records;		// dynamic TLS record sizing, NULL if not used
+	struct sockaddr_storage	peer;				// client address, streams have the one of their parent
+	socklen_t				peerlen;			// 0 if not known
+	enum connection_phase_e	phase;				// request phase the read deadline is for
+	struct event*			readdeadline;		// header deadline or body rate check, NULL if not enforced
+	struct event*			writedeadline;		// send rate check, NULL if not enforced
+	size_t					bytesin;			// bytes read, counted while a body rate is enforced
+	size_t					bytesout;			// bytes sent, counted while a send rate is enforced
+	size_t					inmark;				// bytesin at the start of the rate period
+	size_t					outmark;			// bytesout at the start of the rate period
+	bool					drained;			// out-buffer was emptied in the rate period
+	int						sendfd;				// file sent after the out-buffer, see connectionSendFile(). -1 if none
+	off_t					sendoffset;			// where the rest of the file starts
+	size_t					sendsize;			// bytes of the file left
+	struct event*			sendev;				// waits for the socket to take more of the file, NULL until used
+	struct {
+		const void*			owner;				// hook instance the data belongs to, NULL if the slot is free
+		void*				data;
+	} hookdata[CONN_MAX_HOOKDATA];				// per-request state of hooks, cleared between requests
 };
 
 // these flags are used for log_level();
@@ -120,6 +241,7 @@ extern int		serverGetOptionAsInt(server* webserver, const char* key);
 extern SSL_CTX*	serverSSLCTXCreateSimple(const char* certPath, const char* pkeyPath);
 extern void		serverSetSSLCTX(server* webserver, SSL_CTX* sslctx);
 extern SSL_CTX*	serverGetSSLCTX(server* webserver);
+extern int		serverAddSSLCert(server* webserver, const char* servername, const char* certPath, const char* pkeyPath);
 
 extern hashtable* serverGetStats(server* webserver, const char* key);
 
@@ -131,8 +253,21 @@ extern void*	connectionSetUserdata(connection* conn, const void* userdata, callb
 extern void*	connectionGetUserdata(connection* conn);
 extern void*	connectionSetExtra(connection* conn, const void* extra, callback_free_userdata free_cb);
 extern void*	connectionGetExtra(connection* conn);
+extern int		connectionSetHookData(connection* conn, const void* owner, void* data);
+extern void*	connectionGetHookData(connection* conn, const void* owner);
 
 extern char*	connectionSetMethod(connection* conn, char* method);
+extern const struct sockaddr*	connectionGetPeer(connection* conn, socklen_t* len);
+extern void		connectionSetPhase(connection* conn, enum connection_phase_e phase);
+
+extern connection*	connectionNewStream(connection* parent, struct evbuffer* in, struct evbuffer* out);
+extern void			connectionFreeStream(connection* conn);
+extern int			connectionCallHooks(connection* conn, short event);
+extern void			connectionSetProtocol(connection* conn, const char* protocol, void* session, callback_free_userdata free_cb);
+extern void*		connectionGetProtocol(connection* conn, const char* protocol);
+extern int			connectionSendFile(connection* conn, int fd, off_t offset, size_t size);
+extern int			connectionResume(connection* conn);
+extern void			connectionClose(connection* conn);
 
 #ifdef __cplusplus
 }
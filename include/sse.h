@@ -0,0 +1,81 @@
+/**
+ * @abstruct Server-Sent Events library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __sse_h__
+#define __sse_h__
+
+#include <stdbool.h>
+#include <event2/event.h>
+
+#include "server.h"
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SSE_PROTOCOL_NAME		"sse"
+#define SSE_CONTENT_TYPE		"text/event-stream"
+#define SSE_HEARTBEAT			": \n\n"			// comment line, ignored by EventSource
+#define SSE_DEF_MAX_BACKLOG		(1024 * 1024)		// out-buffer bytes a subscriber may lag behind
+#define SSE_DEF_HEARTBEAT		(15)				// seconds between heartbeats
+#define SSE_DEF_NUM_CHANNELS	(1024)				// hash range of channel table
+
+typedef struct sse_t			sse;
+typedef struct sseChannel_t		sseChannel;
+typedef struct sseSubscriber_t	sseSubscriber;
+typedef struct sseEvent_t		sseEvent;
+
+// event hub
+struct sse_t {
+	char*				prefix;			// url prefix, /prefix/name subscribes to channel "name". NULL to disable
+	size_t				prefixlen;		// length of prefix
+	size_t				maxbacklog;		// subscribers with more pending output are dropped
+	int					heartbeat;		// seconds between heartbeats, 0 to disable
+	hashtable*			channels;		// channel name -> sseChannel*
+	sseSubscriber*		subscribers;	// every subscriber of the hub
+	size_t				numsubscribers;	// number of subscribers
+	struct event*		heartbeatev;	// timer shared by all subscribers
+	struct event_base*	evbase;			// event base that heartbeatev is bound to
+};
+
+// named channel
+struct sseChannel_t {
+	char*				name;			// channel name
+	sseSubscriber*		first;			// subscribers of the channel
+	size_t				numsubscribers;	// number of subscribers
+};
+
+// subscribed connection
+struct sseSubscriber_t {
+	sse*				hub;			// hub the subscriber belongs to, NULL after sseFree()
+	sseChannel*			channel;		// subscribed channel, NULL once dropped
+	connection*			conn;			// connection carrying the event stream
+	bool				active;			// got an event since the last heartbeat
+	sseSubscriber*		prev;			// channel links
+	sseSubscriber*		next;
+	sseSubscriber*		hubprev;		// hub links
+	sseSubscriber*		hubnext;
+};
+
+// serialized event shared by the out-buffers of all subscribers
+struct sseEvent_t {
+	int					refcount;		// publisher plus one per out-buffer referencing data
+	size_t				size;			// length of data
+	char				data[];			// event in wire format
+};
+
+// public functions
+extern sse*		sseNew(const char* prefix, size_t maxbacklog, int heartbeat);
+extern void		sseFree(sse* hub);
+extern int		sseHandler(short event, connection* conn, void* userdata);
+extern int		sseSubscribe(sse* hub, connection* conn, const char* channel);
+extern int		ssePublish(sse* hub, const char* channel, const char* event, const char* id, const void* data, size_t size);
+extern size_t	sseGetNumSubscribers(sse* hub, const char* channel);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,76 @@
+/**
+ * @abstruct static file serving library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __staticfile_h__
+#define __staticfile_h__
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATICFILE_DEF_INDEX		"index.html"
+#define STATICFILE_DEF_MAXENTRIES	(1024)	// maximum number of cached open files
+#define STATICFILE_DEF_VALIDITY		(1)		// seconds to trust a cached stat() without inotify
+
+typedef struct staticfile_t			staticfile;
+typedef struct staticfileEntry_t	staticfileEntry;
+
+// static file mount structure
+struct staticfile_t {
+	char*				prefix;			// url prefix ex) /static
+	size_t				prefixlen;		// length of prefix
+	char*				docroot;		// directory mapped to the prefix ex) /var/www/static
+	char*				realroot;		// docroot with symbolic links resolved
+	int					rootfd;			// docroot to open files beneath, -1 if unavailable
+	char*				index;			// index file name for directory requests
+	size_t				maxentries;		// maximum number of cached entries
+	size_t				numentries;		// number of cached entries
+	hashtable*			entries;		// file path -> entry lookup
+	hashtable*			watches;		// inotify watch descriptor -> entry lookup
+	staticfileEntry*	first;			// most recently used entry
+	staticfileEntry*	last;			// least recently used entry
+	int					inotifyfd;		// inotify instance, -1 if unavailable
+	struct event*		inotifyev;		// read event of inotifyfd
+	struct event_base*	evbase;			// event base that inotifyev is bound to
+};
+
+// cached open file entry
+struct staticfileEntry_t {
+	char*							path;		// absolute file path
+	struct stat						st;			// cached stat() result
+	struct evbuffer_file_segment*	seg;		// whole file segment, owns the fd
+	int								fd;			// fd of seg, -1 if none
+	char							etag[48];	// entity tag
+	char							lastmodified[32];	// Last-Modified header value
+	const char*						mimetype;	// content type
+	int								wd;			// inotify watch descriptor, -1 if none
+	time_t							checked;	// last time st was validated
+	staticfileEntry*				prev;		// LRU links
+	staticfileEntry*				next;
+};
+
+// public functions
+extern staticfile*	staticFileNew(const char* prefix, const char* docroot, size_t maxentries);
+extern void			staticFileSetIndex(staticfile* sf, const char* index);
+extern void			staticFileFree(staticfile* sf);
+extern int			staticFileHandler(short event, connection* conn, void* userdata);
+extern bool			staticFileMatch(staticfile* sf, const char* path);
+extern int			staticFileMapPath(staticfile* sf, const char* path, char* filepath, size_t size);
+extern int			staticFileOpen(staticfile* sf, const char* path);
+extern const char*	staticFileGetMimetype(const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,184 @@
+/**
+ * @abstruct TLS context helpers
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __tls_h__
+#define __tls_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "hashtable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TLS_DEF_CIPHERS				"ECDHE+AESGCM:ECDHE+CHACHA20:!aNULL:!MD5:!DSS"	// TLS 1.2 ciphers, TLS 1.3 keeps OpenSSL defaults
+#define TLS_DEF_SESSION_CACHE		(20480)			// sessions kept in the server side cache
+#define TLS_DEF_SESSION_TIMEOUT		(3600)			// seconds a session or ticket can be resumed
+#define TLS_DEF_TICKET_ROTATION		(3600)			// seconds a ticket key encrypts new tickets
+#define TLS_TICKET_KEYS				(3)				// current ticket key plus retired ones still accepted
+#define TLS_TICKET_NAME_LEN			(16)
+#define TLS_TICKET_KEY_LEN			(32)
+#define TLS_MAX_SERVERNAME			(255)
+#define TLS_DEF_HANDSHAKE_TIMEOUT	(10)			// seconds a handshake on the pool can take
+#define TLS_DEF_HANDSHAKE_QUEUE		(1024)			// handshakes on the pool at once
+#define TLS_DEF_RECORD_SMALL		(1400)			// record payload fitting in one TCP segment
+#define TLS_DEF_RECORD_THRESHOLD	(65536)			// bytes sent in small records before growing them
+#define TLS_DEF_RECORD_IDLE			(1000)			// idle milliseconds after which records are small again
+#define TLS_MAX_RECORD				(16384)			// largest record payload TLS allows
+
+typedef struct tlsTicketKey_t	tlsTicketKey;
+typedef struct tlsTicketRing_t	tlsTicketRing;
+typedef struct tlsSNI_t			tlsSNI;
+typedef struct tlsCert_t		tlsCert;
+typedef struct tlsHandshake_t			tlsHandshake;
+typedef struct tlsHandshakeWorker_t		tlsHandshakeWorker;
+typedef struct tlsHandshakePool_t		tlsHandshakePool;
+typedef struct tlsRecordSizer_t			tlsRecordSizer;
+
+/**
+* Called on every context loaded for a server name, to set it up like the
+* default one ex) ALPN.
+*/
+typedef void (*tlsConfigureCallback)(SSL_CTX* sslctx, void* userdata);
+
+/**
+* Called on the loop thread with a connection whose handshake is over. The
+* callback owns ssl and socket from then on.
+*/
+typedef void (*tlsHandshakeCallback)(SSL* ssl, evutil_socket_t socket, void* userdata);
+
+// session ticket key
+struct tlsTicketKey_t {
+	unsigned char		name[TLS_TICKET_NAME_LEN];		// identifies the key a ticket was sealed with
+	unsigned char		aeskey[TLS_TICKET_KEY_LEN];		// AES-256-CBC key
+	unsigned char		hmackey[TLS_TICKET_KEY_LEN];	// HMAC-SHA256 key
+	time_t				created;						// when the key became current
+};
+
+// ticket keys shared by every context and loop of the process
+struct tlsTicketRing_t {
+	pthread_rwlock_t	lock;
+	tlsTicketKey		keys[TLS_TICKET_KEYS];	// keys[0] is current
+	int					numkeys;				// keys in use
+	int					rotation;				// seconds between rotations, 0 for never
+	// counters are updated atomically, outside of lock
+	uint64_t			rotations;				// keys replaced
+	uint64_t			issued;					// tickets sealed
+	uint64_t			renewed;				// tickets accepted with a retired key and reissued
+	uint64_t			rejected;				// tickets with an unknown or expired key
+};
+
+// certificate of a server name, loaded on first use
+struct tlsCert_t {
+	char*				servername;		// lowercased name or *.domain
+	char*				certpath;		// PEM encoded certificate chain
+	char*				pkeypath;		// PEM encoded private key
+	SSL_CTX*			sslctx;			// NULL until the first handshake asks for it
+	bool				failed;			// loading failed, not tried again until replaced
+	tlsCert*			next;			// certificate list link
+};
+
+// SNI certificate selection
+struct tlsSNI_t {
+	pthread_rwlock_t		lock;
+	hashtable*				certs;		// servername -> tlsCert
+	tlsCert*				first;		// every certificate, for release
+	tlsConfigureCallback	configure;	// sets up loaded contexts, may be NULL
+	void*					userdata;	// passed to configure
+	// counters are updated atomically, outside of lock
+	uint64_t				hits;		// handshakes that found a certificate
+	uint64_t				misses;		// handshakes that got the default certificate
+	uint64_t				loads;		// certificates loaded
+	uint64_t				failures;	// certificates that failed to load
+};
+
+// handshake running on the pool
+struct tlsHandshake_t {
+	SSL*				ssl;
+	evutil_socket_t		socket;
+	struct timespec		started;		// when the connection was accepted
+	short				events;			// poll events the handshake waits for
+	tlsHandshake*		next;			// queue link
+};
+
+// handshake thread, drives many handshakes with poll()
+struct tlsHandshakeWorker_t {
+	pthread_t			thread;
+	int					wakefd;			// eventfd signalled on new handshakes and stop
+	pthread_mutex_t		lock;
+	tlsHandshake*		incoming;		// handshakes not picked up yet, guarded by lock
+	tlsHandshakePool*	pool;
+};
+
+// handshakes off the event loop
+struct tlsHandshakePool_t {
+	struct event*			doneevent;		// fires on the loop when handshakes are over
+	int						donefd;			// eventfd behind doneevent
+	tlsHandshakeCallback	cb;
+	void*					userdata;
+	tlsHandshakeWorker*		workers;
+	int						numworkers;
+	int						nextworker;		// round robin, only used on the loop
+	int						timeout;		// seconds a handshake can take
+	int						maxqueue;		// handshakes on the pool at once
+	pthread_mutex_t			lock;
+	bool					stopping;		// guarded by lock
+	tlsHandshake*			done;			// established, not handed over yet, guarded by lock
+	// counters are updated atomically, outside of lock
+	uint64_t				queued;			// handshakes on the pool now
+	uint64_t				maxqueued;		// most handshakes on the pool at once
+	uint64_t				completed;		// handshakes established
+	uint64_t				failed;			// handshakes that failed or timed out
+	uint64_t				timeouts;		// handshakes that timed out
+	uint64_t				rejected;		// connections dropped on a full queue
+	uint64_t				latency;		// microseconds from accept to established, summed
+	uint64_t				maxlatency;		// slowest handshake established, in microseconds
+};
+
+// dynamic record sizing of a connection
+struct tlsRecordSizer_t {
+	SSL*						ssl;
+	struct evbuffer*			out;		// plaintext out-buffer the records are written from
+	struct evbuffer_cb_entry*	cbentry;	// watches out
+	size_t						small;		// record payload while small
+	size_t						threshold;	// bytes sent before growing to TLS_MAX_RECORD
+	int							idle;		// milliseconds without writes before going small again
+	size_t						sent;		// bytes sent since the connection started or went idle
+	bool						grown;		// records are TLS_MAX_RECORD
+	struct timespec				lastwrite;	// when out was last drained
+};
+
+// public functions
+extern SSL_CTX*	tlsContextNew(const char* certpath, const char* pkeypath);
+extern void		tlsSetSessionCache(SSL_CTX* sslctx, long size, long timeout);
+extern int		tlsSetTicketRotation(SSL_CTX* sslctx, int rotation);
+extern bool		tlsEnableKTLS(SSL_CTX* sslctx, bool enable);
+extern bool		tlsCanSendFile(SSL* ssl);
+extern ssize_t	tlsSendFile(SSL* ssl, int fd, off_t offset, size_t size);
+extern void		tlsUpdateStats(SSL_CTX* sslctx, hashtable* stats);
+extern tlsSNI*	tlsSNINew(tlsConfigureCallback configure, void* userdata);
+extern int		tlsSNIAddCert(tlsSNI* sni, const char* servername, const char* certpath, const char* pkeypath);
+extern void		tlsSNIAttach(tlsSNI* sni, SSL_CTX* sslctx);
+extern void		tlsSNIUpdateStats(tlsSNI* sni, hashtable* stats);
+extern void		tlsSNIFree(tlsSNI* sni);
+extern tlsHandshakePool*	tlsHandshakePoolNew(struct event_base* evbase, int numthreads, int timeout, int maxqueue, tlsHandshakeCallback cb, void* userdata);
+extern int					tlsHandshakeStart(tlsHandshakePool* pool, SSL* ssl, evutil_socket_t socket);
+extern void					tlsHandshakeUpdateStats(tlsHandshakePool* pool, hashtable* stats);
+extern void					tlsHandshakePoolFree(tlsHandshakePool* pool);
+extern tlsRecordSizer*		tlsRecordSizerNew(SSL* ssl, struct evbuffer* out, size_t small, size_t threshold, int idle);
+extern void					tlsRecordSizerFree(tlsRecordSizer* sizer);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,61 @@
+/**
+ * @abstruct virtual host routing library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __vhost_h__
+#define __vhost_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "server.h"
+#include "hashtable.h"
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VHOST_MAX_DOMAIN	(255)		// longest domain name looked up
+
+typedef struct vhost_t		vhost;
+typedef struct vhostSite_t	vhostSite;
+typedef struct vhostHook_t	vhostHook;
+
+// virtual host router
+struct vhost_t {
+	hashtable*		sites;			// lowercased domain or "*.domain" -> vhostSite
+	vhostSite*		defaultsite;	// site for requests no other site takes, NULL for none
+	vhostSite*		first;			// every site, for release
+	uint64_t		requests;		// requests routed to a site
+	uint64_t		misses;			// requests no site took
+};
+
+// site and its hook chain
+struct vhostSite_t {
+	char*			domain;			// ex) www.domain.com, *.domain.com, *
+	list*			hooks;			// vhostHook chain
+	vhostSite*		next;			// site list link
+};
+
+// hook of a site
+struct vhostHook_t {
+	char*			method;			// method to call the hook on, NULL for every method
+	callback		cb;
+	void*			userdata;
+};
+
+// public functions
+extern vhost*		vhostNew(void);
+extern vhostSite*	vhostAddSite(vhost* vh, const char* domain);
+extern void			vhostRegisterHook(vhostSite* site, callback cb, void* userdata);
+extern void			vhostRegisterHookOnMethod(vhostSite* site, const char* method, callback cb, void* userdata);
+extern vhostSite*	vhostLookup(vhost* vh, const char* domain);
+extern void			vhostFree(vhost* vh);
+extern int			vhostHandler(short event, connection* conn, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
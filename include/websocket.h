@@ -0,0 +1,120 @@
+/**
+ * @abstruct WebSocket library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __websocket_h__
+#define __websocket_h__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WEBSOCKET_PROTOCOL_NAME			"websocket"
+#define WEBSOCKET_VERSION				"13"
+#define WEBSOCKET_GUID					"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_MAX_HEADER_SIZE		(14)				// 2 + 8 bytes extended length + 4 bytes mask
+#define WEBSOCKET_MAX_CONTROL_SIZE		(125)				// payload limit of control frames
+#define WEBSOCKET_DEF_MAX_MESSAGE_SIZE	(1024 * 1024)		// default limit of a reassembled message
+
+// frame opcodes
+enum websocket_opcode_e {
+	WEBSOCKET_CONTINUATION	= 0x0,
+	WEBSOCKET_TEXT			= 0x1,
+	WEBSOCKET_BINARY		= 0x2,
+	WEBSOCKET_CLOSE			= 0x8,
+	WEBSOCKET_PING			= 0x9,
+	WEBSOCKET_PONG			= 0xa
+};
+
+// close status codes
+#define WEBSOCKET_CLOSE_NORMAL			(1000)
+#define WEBSOCKET_CLOSE_GOING_AWAY		(1001)
+#define WEBSOCKET_CLOSE_PROTOCOL_ERROR	(1002)
+#define WEBSOCKET_CLOSE_UNSUPPORTED		(1003)
+#define WEBSOCKET_CLOSE_NO_STATUS		(1005)		// never sent, reported when close frame had no code
+#define WEBSOCKET_CLOSE_ABNORMAL		(1006)		// never sent, reported when connection dropped
+#define WEBSOCKET_CLOSE_INVALID_DATA	(1007)
+#define WEBSOCKET_CLOSE_POLICY			(1008)
+#define WEBSOCKET_CLOSE_TOO_BIG			(1009)
+#define WEBSOCKET_CLOSE_INTERNAL_ERROR	(1011)
+
+// frame parser state
+enum websocket_state_e {
+	WEBSOCKET_FRAME_HEADER = 0,		// waiting for a complete frame header
+	WEBSOCKET_FRAME_PAYLOAD,		// moving payload of a data frame
+	WEBSOCKET_FRAME_CONTROL,		// waiting for complete payload of a control frame
+};
+
+typedef struct websocket_t			websocket;
+typedef struct websocketEndpoint_t	websocketEndpoint;
+
+/**
+* Called with every complete message. Text messages are NUL terminated and
+* valid UTF-8. data is only valid during the call.
+*
+* @return 0 to continue, otherwise the connection is closed.
+*/
+typedef int (*websocketMessageCallback)(websocket* ws, int opcode, const void* data, size_t size, void* userdata);
+
+/**
+* Called when a connection is opened and right before it is freed.
+*/
+typedef void (*websocketEventCallback)(websocket* ws, void* userdata);
+
+// url path accepting WebSocket connections
+struct websocketEndpoint_t {
+	char*						path;			// url path ex) /ws
+	size_t						maxmessagesize;	// limit of a reassembled message
+	websocketMessageCallback	onmessage;		// message handler
+	websocketEventCallback		onopen;			// connection opened, may be NULL
+	websocketEventCallback		onclose;		// connection closing, may be NULL
+	void*						userdata;		// passed to callbacks
+};
+
+// WebSocket connection
+struct websocket_t {
+	connection*					conn;			// underlying connection
+	websocketEndpoint*			endpoint;		// endpoint accepted the connection
+	void*						userdata;		// per-connection user data, initially endpoint userdata
+	// frame parser
+	enum websocket_state_e		state;			// parser state
+	uint8_t						opcode;			// opcode of current frame
+	bool						fin;			// FIN bit of current frame
+	uint8_t						mask[4];		// masking key of current frame
+	uint64_t					payloadlen;		// payload length of current frame
+	uint64_t					received;		// payload bytes of current frame processed
+	// message reassembly
+	uint8_t						msgopcode;		// TEXT or BINARY of message in progress, 0 if none
+	struct evbuffer*			message;		// unmasked payload of message in progress
+	size_t						messagesize;	// bytes in message
+	struct {
+		uint8_t					need;			// continuation bytes still expected
+		uint8_t					lo;				// valid range of next continuation byte
+		uint8_t					hi;
+	} utf8;
+	// closing handshake
+	bool						closesent;		// close frame sent, no more data frames
+	int							closecode;		// status code the connection closed with
+};
+
+// public functions
+extern websocketEndpoint*	websocketEndpointNew(const char* path, websocketMessageCallback onmessage, void* userdata);
+extern void					websocketEndpointSetCallbacks(websocketEndpoint* ep, websocketEventCallback onopen, websocketEventCallback onclose);
+extern void					websocketEndpointSetMaxMessageSize(websocketEndpoint* ep, size_t maxmessagesize);
+extern void					websocketEndpointFree(websocketEndpoint* ep);
+extern int					websocketHandler(short event, connection* conn, void* userdata);
+extern int					websocketSend(websocket* ws, int opcode, const void* data, size_t size);
+extern int					websocketSendRef(websocket* ws, int opcode, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata);
+extern int					websocketClose(websocket* ws, int code, const char* reason);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,727 @@
+/**
+ * @abstruct response microcache module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "compress.h"
+#include "microcache.h"
+
+// private functions
+static char*			buildKey(microcache* cache, connection* conn, http* ahttp);
+static microcacheEntry*	startEntry(microcache* cache, char* key, connection* conn, http* ahttp);
+static void				finishEntry(microcache* cache, microcacheEntry* entry, connection* conn);
+static bool				isCacheable(microcache* cache, connection* conn, http* ahttp);
+static int				storeEntry(microcache* cache, microcacheEntry* entry, connection* conn, http* ahttp);
+static int				serveEntry(microcache* cache, microcacheEntry* entry, connection* conn);
+static void				addWaiter(microcache* cache, microcacheEntry* entry, connection* conn);
+static void				removeWaiter(microcache* cache, microcacheEntry* entry, connection* conn);
+static void				wakeWaiters(microcache* cache, microcacheEntry* entry);
+static void				linkEntry(microcache* cache, microcacheEntry* entry);
+static void				evictEntry(microcache* cache, microcacheEntry* entry);
+static void				freeEntry(microcacheEntry* entry);
+static void				touchEntry(microcache* cache, microcacheEntry* entry);
+static microbuf*		newBuffer(size_t size);
+static void				unrefBuffer(microbuf* buf);
+static void				releaseBuffer(const void* data, size_t datalen, void* extra);
+static microbuf*		buildHeader(http* ahttp, const char* encoding, size_t size, const char* vary);
+static microbuf*		gzipBuffer(const microbuf* src);
+
+/**
+* Create a response microcache.
+*
+* Responses of GET requests are cached by method, host, uri and the vary
+* headers for a short time. While a response is being produced, identical
+* requests wait for it instead of running the handler again.
+*
+* @param maxbytes memory cap of the cache. 0 for default.
+* @param ttl seconds a response stays fresh. 0 for default.
+*
+* @code
+* microcache* cache = microcacheNew(0, 1);
+* microcacheAddVary(cache, "Accept-Language");
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, microcacheHandler, cache);
+* serverRegisterHook(webserver, myHandler, NULL);
+* @endcode
+*/
+microcache* microcacheNew(size_t maxbytes, int ttl) {
+
+	microcache* cache = NEW(microcache);
+
+	if (cache == NULL) return NULL;
+
+	cache->maxbytes		= (maxbytes > 0) ? maxbytes : MICROCACHE_DEF_MAXBYTES;
+	cache->maxentrysize	= MICROCACHE_DEF_MAXENTRYSIZE;
+	cache->ttl			= (ttl > 0) ? ttl : MICROCACHE_DEF_TTL;
+	cache->entries		= ahashtable(0, 0);
+
+	if (cache->entries == NULL) {
+		microcacheFree(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/**
+* Include a request header in the cache key. Responses that Vary on other
+* headers are not cached.
+*
+* @return 0 on success, -1 on error.
+*/
+int microcacheAddVary(microcache* cache, const char* name) {
+
+	if (cache->numvary >= MICROCACHE_MAX_VARY) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	if ((cache->vary[cache->numvary] = strdup(name)) == NULL) return -1;
+
+	cache->numvary++;
+
+	return 0;
+}
+
+void microcacheSetMaxEntrySize(microcache* cache, size_t maxentrysize) {
+
+	cache->maxentrysize = maxentrysize;
+}
+
+/**
+* Release the cache. Must not be called while requests are in flight.
+* Buffers still referenced by out-buffers are released when they are sent.
+*/
+void microcacheFree(microcache* cache) {
+
+	if (cache == NULL) return;
+
+	while (cache->first) evictEntry(cache, cache->first);
+
+	if (cache->entries)		cache->entries->free(cache->entries);
+
+	for (int i = 0; i < cache->numvary; i++) free(cache->vary[i]);
+
+	free(cache);
+}
+
+/**
+* Microcache hook.
+*
+* Serves fresh responses from memory. On a miss the request goes on to the
+* next hooks with its body captured, identical requests arriving meanwhile
+* are parked until it completes.
+*
+* @note
+* This hook must be registered after httpHandler and before the hooks whose
+* responses should be cached.
+*/
+int microcacheHandler(short event, connection* conn, void* userdata) {
+
+	microcache* cache = (microcache*) userdata;
+
+	// request is done. the leader fills its entry, a waiter leaves the queue.
+	if (event & EVENT_CLOSE) {
+
+		microcacheEntry* entry = (microcacheEntry*) connectionGetHookData(conn, cache);
+
+		if (entry != NULL) {
+			if (entry->leader == conn) finishEntry(cache, entry, conn);
+			else removeWaiter(cache, entry, conn);
+		}
+
+		return OK;
+	}
+
+	if (!(event & EVENT_READ) || conn->protocol != NULL || httpGetStatus(conn) != HTTP_REQ_DONE) {
+		return OK;
+	}
+
+	microcacheEntry* inflight = (microcacheEntry*) connectionGetHookData(conn, cache);
+
+	if (inflight != NULL) {
+
+		// leader keeps going through the hooks, waiters keep waiting.
+		return (inflight->leader == conn) ? OK : TAKEOVER;
+	}
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (strcmp(ahttp->request.method, "GET")) {
+		return OK;
+	}
+
+	// personalized requests, unless the key covers the cookie.
+	if (httpGetRequestHeader(conn, "Authorization") != NULL) {
+		cache->passes++;
+		return OK;
+	}
+
+	if (httpGetRequestHeader(conn, "Cookie") != NULL) {
+
+		bool keyed = false;
+
+		for (int i = 0; i < cache->numvary && !keyed; i++) {
+			keyed = !strcasecmp(cache->vary[i], "Cookie");
+		}
+
+		if (!keyed) {
+			cache->passes++;
+			return OK;
+		}
+	}
+
+	char* key = buildKey(cache, conn, ahttp);
+
+	if (key == NULL) return OK;
+
+	microcacheEntry** found	= (microcacheEntry**) cache->entries->get(cache->entries, key, NULL, false);
+	microcacheEntry* entry	= (found != NULL) ? *found : NULL;
+
+	if (entry != NULL && entry->state != MICROCACHE_FILLING && entry->expires <= time(NULL)) {
+		evictEntry(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry == NULL) {
+
+		// key is owned by the entry from here.
+		if (startEntry(cache, key, conn, ahttp) == NULL) free(key);
+
+		return OK;
+	}
+
+	free(key);
+
+	switch (entry->state) {
+		case MICROCACHE_VALID:
+			touchEntry(cache, entry);
+			cache->hits++;
+			return serveEntry(cache, entry, conn);
+
+		case MICROCACHE_PASS:
+			touchEntry(cache, entry);
+			cache->passes++;
+			return OK;
+
+		case MICROCACHE_FILLING:
+			// streams can't be parked, they run the handler on their own.
+			if (conn->parent != NULL) {
+				cache->passes++;
+				return OK;
+			}
+
+			addWaiter(cache, entry, conn);
+			cache->coalesced++;
+			return TAKEOVER;
+	}
+
+	return OK;
+}
+
+// private functions
+
+/**
+* @return malloced key, fields separated by LF which can't appear in them.
+*/
+static char* buildKey(microcache* cache, connection* conn, http* ahttp) {
+
+	const char* parts[3 + MICROCACHE_MAX_VARY];
+	int numparts = 0;
+
+	const char* host = httpGetRequestHeader(conn, "Host");
+
+	parts[numparts++] = ahttp->request.method;
+	parts[numparts++] = (host) ? host : "";
+	parts[numparts++] = ahttp->request.uri;
+
+	for (int i = 0; i < cache->numvary; i++) {
+		const char* value = httpGetRequestHeader(conn, cache->vary[i]);
+		parts[numparts++] = (value) ? value : "";
+	}
+
+	size_t len = 0;
+
+	for (int i = 0; i < numparts; i++) len += strlen(parts[i]) + 1;
+
+	char* key = (char*) malloc(len);
+
+	if (key == NULL) return NULL;
+
+	char* p = key;
+
+	for (int i = 0; i < numparts; i++) {
+
+		size_t partlen = strlen(parts[i]);
+
+		memcpy(p, parts[i], partlen);
+		p += partlen;
+		*p++ = '\n';
+	}
+
+	p[-1] = '\0';
+
+	return key;
+}
+
+/**
+* Make the connection the leader of a new entry and capture its response.
+*/
+static microcacheEntry* startEntry(microcache* cache, char* key, connection* conn, http* ahttp) {
+
+	microcacheEntry* entry = NEW(microcacheEntry);
+
+	if (entry == NULL) return NULL;
+
+	if ((entry->capture = evbuffer_new()) == NULL) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->key		= key;
+	entry->state	= MICROCACHE_FILLING;
+	entry->leader	= conn;
+
+	cache->entries->put(cache->entries, entry->key, &entry, sizeof(microcacheEntry*));
+	connectionSetHookData(conn, cache, entry);
+
+	ahttp->response.capture		= entry->capture;
+	ahttp->response.capturemax	= (cache->maxentrysize < cache->maxbytes / 2) ? cache->maxentrysize : cache->maxbytes / 2;
+
+	cache->misses++;
+
+	return entry;
+}
+
+/**
+* Turn the leader's response into a cached or a pass entry and let the
+* waiters retry.
+*/
+static void finishEntry(microcache* cache, microcacheEntry* entry, connection* conn) {
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	connectionSetHookData(conn, cache, NULL);
+	entry->leader = NULL;
+
+	bool complete	= (ahttp != NULL && ahttp->response.complete);
+	bool captured	= (complete && ahttp->response.capture == entry->capture);
+
+	if (ahttp != NULL) ahttp->response.capture = NULL;
+
+	// too large to cache, sent from a file or not cacheable.
+	if (complete && (!captured || !isCacheable(cache, conn, ahttp))) {
+
+		// remember for a while, so the next requests don't queue behind each other.
+		entry->state	= MICROCACHE_PASS;
+		entry->expires	= time(NULL) + cache->ttl;
+		entry->numbytes	= sizeof(microcacheEntry) + strlen(entry->key);
+		linkEntry(cache, entry);
+
+	} else if (captured && storeEntry(cache, entry, conn, ahttp) == 0) {
+
+		entry->state	= MICROCACHE_VALID;
+		entry->expires	= time(NULL) + cache->ttl;
+		linkEntry(cache, entry);
+
+		DEBUG("Cached response. %s (size:%zu, gzip:%zu, total:%zu)", ahttp->request.uri, entry->body->size,
+			(entry->gzbody) ? entry->gzbody->size : 0, cache->numbytes);
+
+	} else {
+
+		// nothing usable, the next waiter becomes the leader.
+		cache->entries->remove(cache->entries, entry->key);
+		wakeWaiters(cache, entry);
+		freeEntry(entry);
+		return;
+	}
+
+	evbuffer_free(entry->capture);
+	entry->capture = NULL;
+
+	wakeWaiters(cache, entry);
+}
+
+static bool isCacheable(microcache* cache, connection* conn, http* ahttp) {
+
+	int code = ahttp->response.code;
+
+	if (code != HTTP_CODE_OK && code != HTTP_CODE_MOVED_PERMANENTLY && code != HTTP_CODE_NOT_FOUND) {
+		return false;
+	}
+
+	if (httpGetResponseHeader(conn, "Set-Cookie") != NULL) return false;
+
+	const char* cachecontrol = httpGetResponseHeader(conn, "Cache-Control");
+
+	if (cachecontrol != NULL && (strcasestr(cachecontrol, "no-store") || strcasestr(cachecontrol, "no-cache") || strcasestr(cachecontrol, "private"))) {
+		return false;
+	}
+
+	const char* vary = httpGetResponseHeader(conn, "Vary");
+
+	if (vary == NULL) return true;
+
+	// every header the response varies on must be part of the key.
+	char* tokens = strdup(vary);
+
+	if (tokens == NULL) return false;
+
+	bool cacheable = true;
+	char* saveptr = NULL;
+
+	for (char* token = strtok_r(tokens, ", \t", &saveptr); token != NULL && cacheable; token = strtok_r(NULL, ", \t", &saveptr)) {
+
+		// the compression filter's variants are rebuilt by the cache.
+		if (ahttp->response.compressor != NULL && !strcasecmp(token, "Accept-Encoding")) continue;
+
+		bool keyed = false;
+
+		for (int i = 0; i < cache->numvary && !keyed; i++) {
+			keyed = !strcasecmp(cache->vary[i], token);
+		}
+
+		cacheable = keyed;
+	}
+
+	free(tokens);
+
+	return cacheable;
+}
+
+/**
+* Build the buffers of a cached response from the leader's response.
+*
+* @return 0 on success, -1 if the response can't be stored.
+*/
+static int storeEntry(microcache* cache, microcacheEntry* entry, connection* conn, http* ahttp) {
+
+	size_t size = evbuffer_get_length(entry->capture);
+
+	if (size > cache->maxentrysize || size > cache->maxbytes / 2) return -1;
+
+	if ((entry->body = newBuffer(size)) == NULL) return -1;
+
+	evbuffer_remove(entry->capture, entry->body->data, size);
+
+	// Content-Encoding set by the compression filter is ours to redo, one set by the handler belongs to the body.
+	bool ownencoding		= (ahttp->response.compressor != NULL);
+	const char* encoding	= (ownencoding) ? NULL : httpGetResponseHeader(conn, "Content-Encoding");
+	const char* vary		= httpGetResponseHeader(conn, "Vary");
+
+	if (encoding == NULL
+		&& serverGetOptionAsInt(conn->webserver, "server.compression")
+		&& size >= (size_t) serverGetOptionAsInt(conn->webserver, "server.compression_min_size")
+		&& compressIsCompressible(httpGetResponseHeader(conn, "Content-Type"))) {
+
+		// precompressed variant, kept only when it saves at least 10%.
+		entry->gzbody = gzipBuffer(entry->body);
+
+		if (entry->gzbody != NULL && entry->gzbody->size > entry->body->size / 10 * 9) {
+			unrefBuffer(entry->gzbody);
+			entry->gzbody = NULL;
+		}
+	}
+
+	char* newvary = NULL;
+
+	if (entry->gzbody != NULL && (vary == NULL || strcasestr(vary, "Accept-Encoding") == NULL)) {
+
+		if (vary == NULL) vary = "Accept-Encoding";
+		else if (asprintf(&newvary, "%s, Accept-Encoding", vary) > 0) vary = newvary;
+	}
+
+	entry->header = buildHeader(ahttp, encoding, entry->body->size, vary);
+
+	if (entry->gzbody != NULL) {
+		entry->gzheader = buildHeader(ahttp, "gzip", entry->gzbody->size, vary);
+	}
+
+	if (newvary) free(newvary);
+
+	if (entry->header == NULL || (entry->gzbody != NULL && entry->gzheader == NULL)) {
+		return -1;
+	}
+
+	entry->code		= ahttp->response.code;
+	entry->numbytes	= sizeof(microcacheEntry) + strlen(entry->key) + entry->body->size + entry->header->size
+		+ ((entry->gzbody) ? entry->gzbody->size + entry->gzheader->size : 0);
+
+	// make room
+	while (cache->last != NULL && cache->numbytes + entry->numbytes > cache->maxbytes) {
+		evictEntry(cache, cache->last);
+		cache->evictions++;
+	}
+
+	return 0;
+}
+
+static int serveEntry(microcache* cache, microcacheEntry* entry, connection* conn) {
+
+	// pick a variant
+	bool gzip				= (entry->gzbody != NULL && httpAcceptsEncoding(conn, "gzip"));
+	const microbuf* body	= (gzip) ? entry->gzbody : entry->body;
+	const microbuf* header	= (gzip) ? entry->gzheader : entry->header;
+
+	if (httpGetResponseHeader(conn, "Connection") == NULL) {
+
+		httpSetResponseHeader(conn, "Connection", (httpIsKeepaliveRequest(conn)) ? "Keep-Alive" : "close");
+	}
+
+	httpSetResponseCode(conn, entry->code, httpGetReason(entry->code));
+	httpSendHeaderBlock(conn, header->data, header->size, body->size);
+
+	if (body->size == 0) {
+
+		httpSendData(conn, NULL, 0);
+
+	} else {
+
+		// out-buffer holds a reference until the data is written out.
+		__sync_add_and_fetch(&((microbuf*) body)->refcount, 1);
+
+		if (httpSendDataRef(conn, body->data, body->size, releaseBuffer, (void*) body) == 0) {
+
+			ERROR("Failed to add cached response to out-buffer. (%s)", entry->key);
+			return CLOSE;
+		}
+	}
+
+	return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+}
+
+static void addWaiter(microcache* cache, microcacheEntry* entry, connection* conn) {
+
+	microcacheWaiter* waiter = NEW(microcacheWaiter);
+
+	if (waiter == NULL) return;
+
+	waiter->conn	= conn;
+	waiter->next	= entry->waiters;
+	entry->waiters	= waiter;
+
+	connectionSetHookData(conn, cache, entry);
+}
+
+static void removeWaiter(microcache* cache, microcacheEntry* entry, connection* conn) {
+
+	for (microcacheWaiter** p = &entry->waiters; *p != NULL; p = &(*p)->next) {
+
+		if ((*p)->conn == conn) {
+
+			microcacheWaiter* waiter = *p;
+
+			*p = waiter->next;
+			free(waiter);
+			break;
+		}
+	}
+
+	connectionSetHookData(conn, cache, NULL);
+}
+
+/**
+* Run the hooks of parked requests again on the next loop, they find the
+* entry filled or become a leader themselves.
+*/
+static void wakeWaiters(microcache* cache, microcacheEntry* entry) {
+
+	microcacheWaiter* waiter;
+
+	while ((waiter = entry->waiters) != NULL) {
+
+		entry->waiters = waiter->next;
+
+		connectionSetHookData(waiter->conn, cache, NULL);
+		connectionResume(waiter->conn);
+
+		free(waiter);
+	}
+}
+
+static void linkEntry(microcache* cache, microcacheEntry* entry) {
+
+	entry->prev = NULL;
+	entry->next = cache->first;
+
+	if (cache->first) cache->first->prev = entry;
+	else cache->last = entry;
+
+	cache->first	= entry;
+	cache->numbytes	+= entry->numbytes;
+}
+
+/**
+* Drop a VALID or PASS entry.
+*/
+static void evictEntry(microcache* cache, microcacheEntry* entry) {
+
+	cache->entries->remove(cache->entries, entry->key);
+
+	if (entry->prev) entry->prev->next = entry->next;
+	else cache->first = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->last = entry->prev;
+
+	cache->numbytes -= entry->numbytes;
+
+	freeEntry(entry);
+}
+
+static void freeEntry(microcacheEntry* entry) {
+
+	// buffers live on while out-buffers still reference them.
+	if (entry->body)		unrefBuffer(entry->body);
+
+	if (entry->header)		unrefBuffer(entry->header);
+
+	if (entry->gzbody)		unrefBuffer(entry->gzbody);
+
+	if (entry->gzheader)	unrefBuffer(entry->gzheader);
+
+	if (entry->capture)		evbuffer_free(entry->capture);
+
+	free(entry->key);
+	free(entry);
+}
+
+static void touchEntry(microcache* cache, microcacheEntry* entry) {
+
+	if (cache->first == entry) return;
+
+	entry->prev->next = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->last = entry->prev;
+
+	entry->prev			= NULL;
+	entry->next			= cache->first;
+	cache->first->prev	= entry;
+	cache->first		= entry;
+}
+
+static microbuf* newBuffer(size_t size) {
+
+	microbuf* buf = (microbuf*) malloc(sizeof(microbuf) + size);
+
+	if (buf == NULL) return NULL;
+
+	buf->refcount	= 1;
+	buf->size		= size;
+
+	return buf;
+}
+
+static void unrefBuffer(microbuf* buf) {
+
+	if (__sync_sub_and_fetch(&buf->refcount, 1) == 0) {
+		free(buf);
+	}
+}
+
+static void releaseBuffer(const void* data, size_t datalen, void* extra) {
+
+	unrefBuffer((microbuf*) extra);
+}
+
+/**
+* Serialize the leader's response headers for httpSendHeaderBlock().
+*
+* Connection and framing headers are per response and left out, so are
+* the encoding and vary headers that the variants set on their own.
+*/
+static microbuf* buildHeader(http* ahttp, const char* encoding, size_t size, const char* vary) {
+
+	struct evbuffer* block = evbuffer_new();
+
+	if (block == NULL) return NULL;
+
+	listtableObj obj;
+
+	bzero((void*) &obj, sizeof(obj));
+
+	listtable* tbl = ahttp->response.headers;
+
+	tbl->lock(tbl);
+
+	while (tbl->getnext(tbl, &obj, NULL, false)) {
+
+		const char* name = (const char*) obj.name;
+
+		if (!strcasecmp(name, "Connection") || !strcasecmp(name, "Keep-Alive")
+			|| !strcasecmp(name, "Content-Length") || !strcasecmp(name, "Transfer-Encoding")
+			|| !strcasecmp(name, "Content-Encoding") || !strcasecmp(name, "Vary")) {
+			continue;
+		}
+
+		evbuffer_add_printf(block, "%s: %s" HTTP_CRLF, name, (const char*) obj.data);
+	}
+
+	tbl->unlock(tbl);
+
+	evbuffer_add_printf(block, "Content-Length: %zu" HTTP_CRLF, size);
+
+	if (encoding) evbuffer_add_printf(block, "Content-Encoding: %s" HTTP_CRLF, encoding);
+
+	if (vary) evbuffer_add_printf(block, "Vary: %s" HTTP_CRLF, vary);
+
+	size_t len		= evbuffer_get_length(block);
+	microbuf* buf	= newBuffer(len);
+
+	if (buf != NULL) evbuffer_remove(block, buf->data, len);
+
+	evbuffer_free(block);
+
+	return buf;
+}
+
+static microbuf* gzipBuffer(const microbuf* src) {
+
+	z_stream zs;
+	bzero((void*) &zs, sizeof(zs));
+
+	// windowBits + 16 writes gzip wrapper instead of zlib.
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	microbuf* dst = newBuffer(deflateBound(&zs, src->size));
+
+	if (dst == NULL) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in		= (Bytef*) src->data;
+	zs.avail_in		= src->size;
+	zs.next_out		= (Bytef*) dst->data;
+	zs.avail_out	= dst->size;
+
+	int status = deflate(&zs, Z_FINISH);
+	dst->size = zs.total_out;
+	deflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		unrefBuffer(dst);
+		return NULL;
+	}
+
+	return dst;
+}
@@ -0,0 +1,646 @@
+/**
+ * @abstruct streaming multipart/form-data parser
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "multipart.h"
+
+// private functions
+static multipartForm*	newForm(multipart* mp, connection* conn, const char* contenttype);
+static void				freeForm(multipartForm* form);
+static int				failForm(multipartForm* form, int code);
+static int				parseForm(multipartForm* form, struct evbuffer* in);
+static int				addPart(multipartForm* form);
+static void				parsePartHeader(multipartPart* part, char* line);
+static int				openPart(multipartForm* form);
+static int				consumeData(multipartForm* form, struct evbuffer* in, size_t size);
+static int				closePart(multipartForm* form);
+static char*			getParam(const char* value, const char* param);
+
+/**
+* Create a multipart/form-data handler.
+*
+* Forms are parsed while the body arrives, the body never piles up in the
+* in-buffer. Fields are kept in memory, file parts go to temp files or to a
+* callback set with multipartSetFileCallback().
+*
+* @param prefix url prefix to parse forms for, ex) "/upload". NULL for every request.
+* @param tmpdir directory of temp files, NULL for /tmp.
+*
+* @code
+* multipart* mp = multipartNew("/upload", "/var/tmp");
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, multipartHandler, mp);
+* serverRegisterHook(webserver, uploadHandler, mp);
+*
+* int uploadHandler(short event, connection* conn, void* userdata) {
+*     multipartForm* form = multipartGetForm((multipart*) userdata, conn);
+*     multipartPart* part = multipartGetPart(form, "file");
+*     ...
+* }
+* @endcode
+*
+* @return handler or NULL on failure.
+*/
+multipart* multipartNew(const char* prefix, const char* tmpdir) {
+
+	multipart* mp = NEW(multipart);
+
+	if (mp == NULL) return NULL;
+
+	mp->maxfieldsize	= MULTIPART_DEF_MAX_FIELD;
+	mp->maxfilesize		= MULTIPART_DEF_MAX_FILE;
+	mp->maxparts		= MULTIPART_DEF_MAX_PARTS;
+	mp->tmpdir			= strdup((tmpdir) ? tmpdir : MULTIPART_DEF_TMPDIR);
+
+	if (prefix != NULL) {
+		mp->prefix		= strdup(prefix);
+		mp->prefixlen	= strlen(prefix);
+	}
+
+	if (mp->tmpdir == NULL || (prefix != NULL && mp->prefix == NULL)) {
+		multipartFree(mp);
+		return NULL;
+	}
+
+	return mp;
+}
+
+/**
+* @param maxfieldsize bytes of a field kept in memory.
+* @param maxfilesize bytes of a file part, 0 for unlimited.
+* @param maxparts parts in one form.
+*/
+void multipartSetLimits(multipart* mp, size_t maxfieldsize, off_t maxfilesize, int maxparts) {
+
+	mp->maxfieldsize	= maxfieldsize;
+	mp->maxfilesize		= maxfilesize;
+	mp->maxparts		= maxparts;
+}
+
+/**
+* Hand the data of file parts to callback instead of writing temp files.
+*/
+void multipartSetFileCallback(multipart* mp, multipartFileCallback callback, void* userdata) {
+
+	mp->callback	= callback;
+	mp->userdata	= userdata;
+}
+
+/**
+* Release the handler. Must not be called while forms are being parsed.
+*/
+void multipartFree(multipart* mp) {
+
+	if (mp == NULL) return;
+
+	if (mp->tmpdir) free(mp->tmpdir);
+
+	if (mp->prefix) free(mp->prefix);
+
+	free(mp);
+}
+
+/**
+* multipart/form-data hook.
+*
+* Parsing starts as soon as the request header is in. The hooks after this
+* one are called once the whole form is parsed, they find the parts with
+* multipartGetForm(). Temp files are removed when the request is over,
+* rename them to keep them.
+*
+* @note
+* This hook must be registered after httpHandler.
+*/
+int multipartHandler(short event, connection* conn, void* userdata) {
+
+	multipart* mp = (multipart*) userdata;
+
+	if (event & EVENT_CLOSE) {
+
+		multipartForm* form = (multipartForm*) connectionGetHookData(conn, mp);
+
+		if (form != NULL) freeForm(form);
+
+		return OK;
+	}
+
+	if (!(event & EVENT_READ) || conn->protocol != NULL) {
+		return OK;
+	}
+
+	enum http_request_status_e status	= httpGetStatus(conn);
+	multipartForm* form					= (multipartForm*) connectionGetHookData(conn, mp);
+
+	if (form == NULL) {
+
+		if (status != HTTP_REQ_HEADER_DONE && status != HTTP_REQ_DONE) {
+			return OK;
+		}
+
+		http* ahttp			= (http*) connectionGetExtra(conn);
+		const char* path	= ahttp->request.path;
+
+		if (mp->prefix != NULL && (path == NULL || strncmp(path, mp->prefix, mp->prefixlen)
+		|| (path[mp->prefixlen] != '/' && path[mp->prefixlen] != '\0'))) {
+			return OK;
+		}
+
+		const char* contenttype = httpGetRequestHeader(conn, "Content-Type");
+
+		if (contenttype == NULL || strncasecmp(contenttype, "multipart/form-data", STRLEN("multipart/form-data"))) {
+			return OK;
+		}
+
+		if ((form = newForm(mp, conn, contenttype)) == NULL) return CLOSE;
+
+		if (connectionSetHookData(conn, mp, form) < 0) {
+			freeForm(form);
+			return CLOSE;
+		}
+
+		if (form->delimiterlen == 0) return failForm(form, HTTP_CODE_BAD_REQUEST);
+
+		// the rest of the body comes through this hook as it arrives.
+		if (status != HTTP_REQ_DONE) httpSetBodyStreaming(conn, true);
+	}
+
+	if (form->done) return form->result;
+
+	int code = parseForm(form, httpGetInbuf(conn));
+
+	if (code != 0) return failForm(form, code);
+
+	// hold the hooks after this one back until the whole form is in.
+	if (status != HTTP_REQ_DONE) return TAKEOVER;
+
+	if (form->state != MULTIPART_EPILOGUE) return failForm(form, HTTP_CODE_BAD_REQUEST);
+
+	form->done		= true;
+	form->result	= OK;
+
+	return OK;
+}
+
+/**
+* @return parsed form, NULL if the request has none or it is not complete.
+*/
+multipartForm* multipartGetForm(multipart* mp, connection* conn) {
+
+	multipartForm* form = (multipartForm*) connectionGetHookData(conn, mp);
+
+	return (form != NULL && form->done && form->result == OK) ? form : NULL;
+}
+
+/**
+* @return first part with the name, NULL if there is none.
+*/
+multipartPart* multipartGetPart(multipartForm* form, const char* name) {
+
+	if (form == NULL) return NULL;
+
+	for (multipartPart* part = form->parts; part != NULL; part = part->next) {
+		if (!strcmp(part->name, name)) return part;
+	}
+
+	return NULL;
+}
+
+// private functions
+
+/**
+* @return form, its delimiterlen is 0 when the boundary is missing or invalid.
+*/
+static multipartForm* newForm(multipart* mp, connection* conn, const char* contenttype) {
+
+	multipartForm* form = NEW(multipartForm);
+
+	if (form == NULL) return NULL;
+
+	form->mp	= mp;
+	form->conn	= conn;
+	form->state	= MULTIPART_PREAMBLE;
+
+	char* boundary	= getParam(contenttype, "boundary");
+	size_t len		= (boundary) ? strlen(boundary) : 0;
+
+	if (len > 0 && len <= MULTIPART_MAX_BOUNDARY) {
+		form->delimiterlen = snprintf(form->delimiter, sizeof(form->delimiter), "\r\n--%s", boundary);
+	}
+
+	free(boundary);
+
+	return form;
+}
+
+static void freeForm(multipartForm* form) {
+
+	connectionSetHookData(form->conn, form->mp, NULL);
+
+	while (form->parts != NULL) {
+
+		multipartPart* part = form->parts;
+		form->parts = part->next;
+
+		if (part->fd >= 0) close(part->fd);
+
+		if (part->filepath) {
+			unlink(part->filepath);
+			free(part->filepath);
+		}
+
+		free(part->name);
+		free(part->filename);
+		free(part->contenttype);
+		free(part->value);
+		free(part);
+	}
+
+	free(form);
+}
+
+/**
+* Answer with an error. The connection is kept only when the whole body has
+* been read, the rest of it would be taken as the next request otherwise.
+*/
+static int failForm(multipartForm* form, int code) {
+
+	connection* conn = form->conn;
+
+	form->done		= true;
+	form->result	= (httpIsKeepaliveRequest(conn) && httpGetStatus(conn) == HTTP_REQ_DONE) ? DONE : CLOSE;
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", (form->result == DONE) ? "Keep-Alive" : "close");
+	}
+
+	const char* reason = httpGetReason(code);
+	httpResponse(conn, code, "text/plain", reason, strlen(reason));
+
+	return form->result;
+}
+
+/**
+* Consume what is in the in-buffer. Part data is handed on as it comes, only
+* a tail that may be the start of the delimiter stays in the buffer.
+*
+* @return 0 on success, otherwise HTTP response code to answer.
+*/
+static int parseForm(multipartForm* form, struct evbuffer* in) {
+
+	int code;
+
+	for (;;) {
+
+		size_t len = evbuffer_get_length(in);
+
+		switch (form->state) {
+
+			case MULTIPART_PREAMBLE: {
+
+				// the first delimiter has no CRLF in front of it.
+				const char* dash	= form->delimiter + STRLEN("\r\n");
+				size_t dashlen		= form->delimiterlen - STRLEN("\r\n");
+				struct evbuffer_ptr found = evbuffer_search(in, dash, dashlen, NULL);
+
+				if (found.pos < 0) {
+					if (len >= dashlen) evbuffer_drain(in, len - dashlen + 1);
+					return 0;
+				}
+
+				evbuffer_drain(in, found.pos + dashlen);
+				form->state = MULTIPART_BOUNDARY_END;
+				break;
+			}
+
+			case MULTIPART_BOUNDARY_END: {
+
+				if (len < 2) return 0;
+
+				const char* p = (const char*) evbuffer_pullup(in, 2);
+
+				// closing delimiter
+				if (p[0] == '-' && p[1] == '-') {
+					evbuffer_drain(in, len);
+					form->state = MULTIPART_EPILOGUE;
+					return 0;
+				}
+
+				size_t eollen;
+				struct evbuffer_ptr eol = evbuffer_search_eol(in, NULL, &eollen, EVBUFFER_EOL_CRLF);
+
+				if (eol.pos < 0) {
+					return (len > MULTIPART_MAX_PART_HEADER) ? HTTP_CODE_BAD_REQUEST : 0;
+				}
+
+				// nothing but transport padding may follow a delimiter.
+				p = (const char*) evbuffer_pullup(in, eol.pos);
+
+				for (ssize_t i = 0; i < eol.pos; i++) {
+					if (p[i] != ' ' && p[i] != '\t') return HTTP_CODE_BAD_REQUEST;
+				}
+
+				evbuffer_drain(in, eol.pos + eollen);
+
+				if ((code = addPart(form)) != 0) return code;
+
+				form->headerlen	= 0;
+				form->state		= MULTIPART_HEADER;
+				break;
+			}
+
+			case MULTIPART_HEADER: {
+
+				size_t linelen;
+				char* line = evbuffer_readln(in, &linelen, EVBUFFER_EOL_CRLF);
+
+				if (line == NULL) {
+					return (form->headerlen + len > MULTIPART_MAX_PART_HEADER) ? HTTP_CODE_BAD_REQUEST : 0;
+				}
+
+				form->headerlen += linelen + STRLEN("\r\n");
+
+				if (form->headerlen > MULTIPART_MAX_PART_HEADER) {
+					free(line);
+					return HTTP_CODE_BAD_REQUEST;
+				}
+
+				if (linelen > 0) {
+					parsePartHeader(form->last, line);
+					free(line);
+					break;
+				}
+
+				free(line);
+
+				if ((code = openPart(form)) != 0) return code;
+
+				form->state = MULTIPART_DATA;
+				break;
+			}
+
+			case MULTIPART_DATA: {
+
+				struct evbuffer_ptr found = evbuffer_search(in, form->delimiter, form->delimiterlen, NULL);
+
+				// without a delimiter, keep what could be its beginning.
+				size_t size = (found.pos >= 0) ? (size_t) found.pos
+					: ((len >= form->delimiterlen) ? len - form->delimiterlen + 1 : 0);
+
+				if (size > 0 && (code = consumeData(form, in, size)) != 0) return code;
+
+				if (found.pos < 0) return 0;
+
+				evbuffer_drain(in, form->delimiterlen);
+
+				if ((code = closePart(form)) != 0) return code;
+
+				form->state = MULTIPART_BOUNDARY_END;
+				break;
+			}
+
+			case MULTIPART_EPILOGUE:
+
+				evbuffer_drain(in, len);
+				return 0;
+		}
+	}
+}
+
+static int addPart(multipartForm* form) {
+
+	if (form->numparts >= form->mp->maxparts) return HTTP_CODE_REQUEST_ENTITY_TOO_LARGE;
+
+	multipartPart* part = NEW(multipartPart);
+
+	if (part == NULL) return HTTP_CODE_INTERNAL_SERVER_ERROR;
+
+	part->fd = -1;
+
+	if (form->last != NULL) {
+		form->last->next = part;
+	} else {
+		form->parts = part;
+	}
+
+	form->last = part;
+	form->numparts++;
+
+	return 0;
+}
+
+static void parsePartHeader(multipartPart* part, char* line) {
+
+	char* value = strchr(line, ':');
+
+	if (value == NULL) return;
+
+	*value++ = '\0';
+	value += strspn(value, " \t");
+
+	if (!strcasecmp(line, "Content-Disposition")) {
+
+		free(part->name);
+		free(part->filename);
+
+		part->name		= getParam(value, "name");
+		part->filename	= getParam(value, "filename");
+
+	} else if (!strcasecmp(line, "Content-Type")) {
+
+		free(part->contenttype);
+
+		part->contenttype = strdup(value);
+	}
+}
+
+/**
+* Part header is in, get ready for its data.
+*/
+static int openPart(multipartForm* form) {
+
+	multipart* mp		= form->mp;
+	multipartPart* part	= form->last;
+
+	if (part->name == NULL) return HTTP_CODE_BAD_REQUEST;
+
+	if (part->filename == NULL) {
+		part->value = strdup("");
+		return (part->value) ? 0 : HTTP_CODE_INTERNAL_SERVER_ERROR;
+	}
+
+	if (mp->callback != NULL) return 0;
+
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/upload.XXXXXX", mp->tmpdir) >= (int) sizeof(path)) {
+		return HTTP_CODE_INTERNAL_SERVER_ERROR;
+	}
+
+	if ((part->fd = mkstemp(path)) < 0) {
+		WARN("Failed to create temp file in %s. %s", mp->tmpdir, strerror(errno));
+		return HTTP_CODE_INTERNAL_SERVER_ERROR;
+	}
+
+	if ((part->filepath = strdup(path)) == NULL) {
+		unlink(path);
+		return HTTP_CODE_INTERNAL_SERVER_ERROR;
+	}
+
+	return 0;
+}
+
+/**
+* Hand size bytes of part data on and remove them from the in-buffer.
+*/
+static int consumeData(multipartForm* form, struct evbuffer* in, size_t size) {
+
+	multipart* mp		= form->mp;
+	multipartPart* part	= form->last;
+
+	if (part->filename == NULL) {
+
+		if (part->size + size > mp->maxfieldsize) return HTTP_CODE_REQUEST_ENTITY_TOO_LARGE;
+
+		char* value = realloc(part->value, part->size + size + 1);
+
+		if (value == NULL) return HTTP_CODE_INTERNAL_SERVER_ERROR;
+
+		part->value = value;
+		part->size += evbuffer_remove(in, value + part->size, size);
+		value[part->size] = '\0';
+
+		return 0;
+	}
+
+	if (mp->maxfilesize > 0 && part->size + (off_t) size > mp->maxfilesize) {
+		return HTTP_CODE_REQUEST_ENTITY_TOO_LARGE;
+	}
+
+	part->size += size;
+
+	if (mp->callback != NULL) {
+
+		struct evbuffer_iovec vec[16];
+
+		while (size > 0) {
+
+			int n = evbuffer_peek(in, size, NULL, vec, 16);
+			size_t consumed = 0;
+
+			for (int i = 0; i < n && i < 16 && consumed < size; i++) {
+
+				size_t piece	= (vec[i].iov_len < size - consumed) ? vec[i].iov_len : size - consumed;
+				int code		= mp->callback(form->conn, part, vec[i].iov_base, piece, mp->userdata);
+
+				if (code != 0) return code;
+
+				consumed += piece;
+			}
+
+			evbuffer_drain(in, consumed);
+			size -= consumed;
+		}
+
+		return 0;
+	}
+
+	// straight from the buffer chain to the file.
+	while (size > 0) {
+
+		int written = evbuffer_write_atmost(in, part->fd, size);
+
+		if (written < 0) {
+
+			if (errno == EINTR) continue;
+
+			WARN("Failed to write %s. %s", part->filepath, strerror(errno));
+			return HTTP_CODE_INTERNAL_SERVER_ERROR;
+		}
+
+		size -= written;
+	}
+
+	return 0;
+}
+
+static int closePart(multipartForm* form) {
+
+	multipart* mp		= form->mp;
+	multipartPart* part	= form->last;
+
+	if (part->filename == NULL) return 0;
+
+	if (mp->callback != NULL) return mp->callback(form->conn, part, NULL, 0, mp->userdata);
+
+	close(part->fd);
+	part->fd = -1;
+
+	return 0;
+}
+
+/**
+* Get a parameter of a header value, ex) boundary of Content-Type.
+*
+* @return malloced unquoted value, NULL if there is no such parameter.
+*/
+static char* getParam(const char* value, const char* param) {
+
+	size_t paramlen	= strlen(param);
+	const char* p	= strchr(value, ';');
+
+	while (p != NULL) {
+
+		p++;
+		p += strspn(p, " \t");
+
+		if (!strncasecmp(p, param, paramlen) && p[paramlen] == '=') {
+
+			p += paramlen + 1;
+
+			if (*p != '"') return strndup(p, strcspn(p, "; \t"));
+
+			char* unquoted = malloc(strlen(p));
+
+			if (unquoted == NULL) return NULL;
+
+			char* w = unquoted;
+
+			for (p++; *p != '\0' && *p != '"'; p++) {
+				if (*p == '\\' && p[1] != '\0') p++;
+				*w++ = *p;
+			}
+
+			*w = '\0';
+
+			return unquoted;
+		}
+
+		// skip to the next parameter, ';' may be quoted.
+		bool quoted = false;
+
+		for (; *p != '\0' && (quoted || *p != ';'); p++) {
+			if (*p == '"') quoted = !quoted;
+			else if (*p == '\\' && quoted && p[1] != '\0') p++;
+		}
+
+		p = (*p == ';') ? p : NULL;
+	}
+
+	return NULL;
+}
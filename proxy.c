@@ -0,0 +1,1152 @@
+/**
+ * @abstruct reverse proxy module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "http2.h"
+#include "proxy.h"
+
+// private functions
+static void				startRequest(proxyRequest* req, bool fresh);
+static void				finishRequest(proxyRequest* req);
+static void				failRequest(proxyRequest* req, int code);
+static void				freeRequest(proxyRequest* req);
+static void				sendRequestHeader(proxyRequest* req, proxyConn* upconn);
+static void				forwardBody(proxyRequest* req);
+static proxyUpstream*	pickUpstream(proxy* px);
+static proxyConn*		getConn(proxy* px, proxyUpstream* up, bool fresh);
+static proxyConn*		newConn(proxy* px, proxyUpstream* up);
+static void				attachConn(proxyConn* upconn, proxyRequest* req);
+static void				detachConn(proxyConn* upconn);
+static void				poolConn(proxyConn* upconn);
+static void				unpoolConn(proxyConn* upconn);
+static void				freeConn(proxyConn* upconn);
+static void				setTimeouts(proxyConn* upconn, int seconds);
+static void				failExchange(proxyConn* upconn, int code);
+static void				processResponse(proxyConn* upconn);
+static int				parseStatusLine(proxyConn* upconn, const char* line);
+static int				parseHeaderLine(proxyConn* upconn, char* line);
+static void				sendResponseHeader(proxyConn* upconn);
+static int				relayBody(proxyConn* upconn, size_t size);
+static void				finishResponse(proxyConn* upconn);
+static bool				isHopByHop(const char* name, const char* connection);
+static bool				hasToken(const char* list, const char* token);
+static bool				isKeepalive(connection* conn);
+static void				upstreamReadCallback(struct bufferevent* buffer, void* userdata);
+static void				upstreamWriteCallback(struct bufferevent* buffer, void* userdata);
+static void				upstreamEventCallback(struct bufferevent* buffer, short what, void* userdata);
+
+/**
+* Create a reverse proxy.
+*
+* Requests are forwarded to upstream HTTP/1.1 servers over pooled keep-alive
+* connections. Bodies are relayed in both directions as they arrive, so
+* payloads are never held in memory as a whole.
+*
+* @param prefix url prefix to forward, ex) "/api". NULL forwards every request.
+*
+* @code
+* proxy* px = proxyNew("/api");
+* proxyAddUpstream(px, "127.0.0.1:8080");
+* proxyAddUpstream(px, "unix:/run/app.sock");
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, proxyHandler, px);
+* @endcode
+*
+* @return proxy or NULL on failure.
+*/
+proxy* proxyNew(const char* prefix) {
+
+	proxy* px = NEW(proxy);
+
+	if (px == NULL) return NULL;
+
+	px->maxidle		= PROXY_DEF_MAX_IDLE;
+	px->timeout		= PROXY_DEF_TIMEOUT;
+	px->idletimeout	= PROXY_DEF_IDLE_TIMEOUT;
+
+	if (prefix != NULL) {
+		px->prefix		= strdup(prefix);
+		px->prefixlen	= strlen(prefix);
+	}
+
+	if (prefix != NULL && px->prefix == NULL) {
+		proxyFree(px);
+		return NULL;
+	}
+
+	return px;
+}
+
+/**
+* Add an upstream server.
+*
+* @param address numeric address with port, ex) "10.0.0.1:8080", "[::1]:8080",
+* or a unix domain socket path, ex) "unix:/run/app.sock". Host names are not
+* resolved.
+*
+* @return 0 on success, -1 on error.
+*/
+int proxyAddUpstream(proxy* px, const char* address) {
+
+	if (px->numupstreams >= PROXY_MAX_UPSTREAMS) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	proxyUpstream* up = NEW(proxyUpstream);
+
+	if (up == NULL) return -1;
+
+	if (!strncmp(address, "unix:", STRLEN("unix:"))) {
+
+		struct sockaddr_un* sun	= (struct sockaddr_un*) &up->addr;
+		const char* path		= address + STRLEN("unix:");
+
+		if (strlen(path) == 0 || strlen(path) >= sizeof(sun->sun_path)) {
+			free(up);
+			errno = EINVAL;
+			return -1;
+		}
+
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, path);
+		up->addrlen = sizeof(struct sockaddr_un);
+
+	} else {
+
+		up->addrlen = sizeof(up->addr);
+
+		if (evutil_parse_sockaddr_port(address, (struct sockaddr*) &up->addr, &up->addrlen)) {
+			WARN("Invalid upstream address. %s", address);
+			free(up);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if ((up->address = strdup(address)) == NULL) {
+		free(up);
+		return -1;
+	}
+
+	px->upstreams[px->numupstreams++] = up;
+
+	return 0;
+}
+
+void proxySetMaxIdle(proxy* px, int maxidle) {
+
+	px->maxidle = maxidle;
+}
+
+/**
+* @param timeout seconds an upstream may stay silent during an exchange, 0 for none.
+* @param idletimeout seconds an idle connection is kept in the pool, 0 for none.
+*/
+void proxySetTimeout(proxy* px, int timeout, int idletimeout) {
+
+	px->timeout		= timeout;
+	px->idletimeout	= idletimeout;
+}
+
+/**
+* Release the proxy. Must not be called while requests are in flight.
+*/
+void proxyFree(proxy* px) {
+
+	if (px == NULL) return;
+
+	for (int i = 0; i < px->numupstreams; i++) {
+
+		proxyUpstream* up = px->upstreams[i];
+
+		while (up->idle != NULL) {
+
+			proxyConn* upconn = up->idle;
+
+			unpoolConn(upconn);
+			freeConn(upconn);
+		}
+
+		free(up->address);
+		free(up);
+	}
+
+	if (px->prefix) free(px->prefix);
+
+	free(px);
+}
+
+/**
+* Reverse proxy hook.
+*
+* Forwarding starts as soon as the request header is in, the request body
+* follows piece by piece. The connection is taken over until the response
+* has been relayed.
+*
+* @note
+* This hook must be registered after httpHandler. Pooled connections are
+* bound to one event loop, use one proxy per server.
+*/
+int proxyHandler(short event, connection* conn, void* userdata) {
+
+	proxy* px = (proxy*) userdata;
+
+	if (event & EVENT_CLOSE) {
+
+		proxyRequest* req = (proxyRequest*) connectionGetHookData(conn, px);
+
+		if (req != NULL) freeRequest(req);
+
+		return OK;
+	}
+
+	proxyRequest* req = (proxyRequest*) connectionGetHookData(conn, px);
+
+	if (req != NULL) {
+
+		if (req->done) return req->result;
+
+		if (event & EVENT_WRITE) {
+
+			// client caught up, read the rest of the response.
+			proxyConn* upconn = req->upconn;
+
+			if (upconn != NULL && upconn->paused) {
+
+				upconn->paused = false;
+				bufferevent_enable(upconn->buffer, EV_READ);
+				processResponse(upconn);
+			}
+
+		} else if (event & EVENT_READ) {
+
+			forwardBody(req);
+		}
+
+		return (req->done) ? req->result : TAKEOVER;
+	}
+
+	if (!(event & EVENT_READ) || conn->protocol != NULL || px->numupstreams == 0) {
+		return OK;
+	}
+
+	enum http_request_status_e status = httpGetStatus(conn);
+
+	if (status != HTTP_REQ_HEADER_DONE && status != HTTP_REQ_DONE) {
+		return OK;
+	}
+
+	http* ahttp			= (http*) connectionGetExtra(conn);
+	const char* path	= ahttp->request.path;
+
+	if (px->prefix != NULL && (path == NULL || strncmp(path, px->prefix, px->prefixlen)
+	|| (path[px->prefixlen] != '/' && path[px->prefixlen] != '\0'))) {
+		return OK;
+	}
+
+	if ((req = NEW(proxyRequest)) == NULL) return CLOSE;
+
+	req->px		= px;
+	req->conn	= conn;
+	req->head	= !strcmp(ahttp->request.method, "HEAD");
+
+	req->idempotent = (req->head || !strcmp(ahttp->request.method, "GET") || !strcmp(ahttp->request.method, "OPTIONS")
+		|| !strcmp(ahttp->request.method, "TRACE") || !strcmp(ahttp->request.method, "PUT") || !strcmp(ahttp->request.method, "DELETE"));
+
+	if (connectionSetHookData(conn, px, req) < 0) {
+		free(req);
+		return CLOSE;
+	}
+
+	if (px->evbase == NULL) px->evbase = conn->webserver->evbase;
+
+	px->requests++;
+
+	// the rest of the body comes through this hook as it arrives.
+	if (status != HTTP_REQ_DONE) httpSetBodyStreaming(conn, true);
+
+	req->inhook = true;
+	startRequest(req, false);
+	req->inhook = false;
+
+	return (req->done) ? req->result : TAKEOVER;
+}
+
+// private functions
+
+/**
+* Send the request to the least busy upstream.
+*
+* @param fresh don't take a pooled connection.
+*/
+static void startRequest(proxyRequest* req, bool fresh) {
+
+	proxy* px			= req->px;
+	proxyUpstream* up	= pickUpstream(px);
+	proxyConn* upconn	= getConn(px, up, fresh);
+
+	if (upconn == NULL) {
+		px->failures++;
+		failRequest(req, HTTP_CODE_BAD_GATEWAY);
+		return;
+	}
+
+	attachConn(upconn, req);
+
+	if (upconn->reused) px->reuses++;
+
+	sendRequestHeader(req, upconn);
+	forwardBody(req);
+}
+
+/**
+* Exchange is over, let the hook chain finish the client request.
+*/
+static void finishRequest(proxyRequest* req) {
+
+	connection* conn = req->conn;
+
+	req->done	= true;
+	req->result	= isKeepalive(conn) ? DONE : CLOSE;
+
+	if (req->paused) {
+		req->paused = false;
+		bufferevent_enable(conn->buffer, EV_READ);
+	}
+
+	// streams are done when their body ends, only HTTP/1.x needs a nudge.
+	if (!req->inhook) connectionResume(conn);
+}
+
+/**
+* Answer with an error, or cut the response short if its header is out.
+*/
+static void failRequest(proxyRequest* req, int code) {
+
+	connection* conn = req->conn;
+
+	if (req->headersent) {
+
+		req->done	= true;
+		req->result	= CLOSE;
+
+		if (conn->parent != NULL) {
+			http2ResetStream((http*) connectionGetExtra(conn));
+		} else {
+			connectionClose(conn);
+		}
+
+		return;
+	}
+
+	const char* reason = httpGetReason(code);
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", isKeepalive(conn) ? "Keep-Alive" : "close");
+	}
+
+	httpResponse(conn, code, "text/plain", reason, strlen(reason));
+
+	finishRequest(req);
+}
+
+static void freeRequest(proxyRequest* req) {
+
+	connectionSetHookData(req->conn, req->px, NULL);
+
+	proxyConn* upconn = req->upconn;
+
+	// half-relayed exchange, the connection can't be reused.
+	if (upconn != NULL) {
+		detachConn(upconn);
+		freeConn(upconn);
+	}
+
+	free(req);
+}
+
+/**
+* Queue the request line and header to upstream.
+*
+* Hop-by-hop headers are dropped, the body is framed with Content-Length when
+* its size is known and chunked otherwise.
+*/
+static void sendRequestHeader(proxyRequest* req, proxyConn* upconn) {
+
+	connection* conn		= req->conn;
+	http* ahttp				= (http*) connectionGetExtra(conn);
+	struct evbuffer* out	= bufferevent_get_output(upconn->buffer);
+	listtable* tbl			= ahttp->request.headers;
+	const char* connhdr		= tbl->getstr(tbl, "Connection", false);
+	const char* forwarded	= NULL;
+
+	evbuffer_add_printf(out, "%s %s HTTP/1.1" HTTP_CRLF, ahttp->request.method, ahttp->request.uri);
+
+	listtableObj obj;
+
+	bzero((void*) &obj, sizeof(obj));
+
+	tbl->lock(tbl);
+
+	while (tbl->getnext(tbl, &obj, NULL, false)) {
+
+		const char* name = (const char*) obj.name;
+
+		if (!strcasecmp(name, "X-Forwarded-For")) {
+			forwarded = (const char*) obj.data;
+			continue;
+		}
+
+		if (isHopByHop(name, connhdr) || !strcasecmp(name, "Content-Length")
+		|| !strcasecmp(name, "Expect") || !strcasecmp(name, "X-Forwarded-Proto")) {
+			continue;
+		}
+
+		evbuffer_add_printf(out, "%s: %s" HTTP_CRLF, name, (const char*) obj.data);
+	}
+
+	tbl->unlock(tbl);
+
+	if (tbl->getstr(tbl, "Host", false) == NULL) {
+		evbuffer_add_printf(out, "Host: %s" HTTP_CRLF, (upconn->upstream->addr.ss_family == AF_UNIX) ? "localhost" : upconn->upstream->address);
+	}
+
+	// client address for X-Forwarded-For
+	struct sockaddr_storage peer;
+	socklen_t peerlen	= sizeof(peer);
+	connection* socket	= (conn->parent != NULL) ? conn->parent : conn;
+	char peerip[INET6_ADDRSTRLEN] = "";
+
+	if (getpeername(bufferevent_getfd(socket->buffer), (struct sockaddr*) &peer, &peerlen) == 0) {
+
+		if (peer.ss_family == AF_INET) {
+			inet_ntop(AF_INET, &((struct sockaddr_in*) &peer)->sin_addr, peerip, sizeof(peerip));
+		} else if (peer.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*) &peer)->sin6_addr, peerip, sizeof(peerip));
+		}
+	}
+
+	if (forwarded != NULL && peerip[0] != '\0') {
+		evbuffer_add_printf(out, "X-Forwarded-For: %s, %s" HTTP_CRLF, forwarded, peerip);
+	} else if (forwarded != NULL || peerip[0] != '\0') {
+		evbuffer_add_printf(out, "X-Forwarded-For: %s" HTTP_CRLF, (forwarded != NULL) ? forwarded : peerip);
+	}
+
+	evbuffer_add_printf(out, "X-Forwarded-Proto: %s" HTTP_CRLF, (conn->webserver->sslctx != NULL) ? "https" : "http");
+
+	size_t inlen = httpGetContentSize(conn);
+
+	if (httpGetStatus(conn) == HTTP_REQ_DONE) {
+
+		// whole body is in already, its size is known even if it came chunked.
+		if (inlen > 0 || ahttp->request.contentlength >= 0 || tbl->getstr(tbl, "Transfer-Encoding", false) != NULL) {
+			evbuffer_add_printf(out, "Content-Length: %zu" HTTP_CRLF, inlen);
+		}
+
+		req->bodyless = (inlen == 0);
+
+	} else if (ahttp->request.contentlength >= 0 && tbl->getstr(tbl, "Transfer-Encoding", false) == NULL) {
+
+		evbuffer_add_printf(out, "Content-Length: %jd" HTTP_CRLF, (intmax_t) ahttp->request.contentlength);
+
+	} else {
+
+		evbuffer_add(out, "Transfer-Encoding: chunked" HTTP_CRLF, STRLEN("Transfer-Encoding: chunked" HTTP_CRLF));
+		req->chunked = true;
+	}
+
+	evbuffer_add(out, HTTP_CRLF, STRLEN(HTTP_CRLF));
+}
+
+/**
+* Move request body received so far to upstream without copying.
+*/
+static void forwardBody(proxyRequest* req) {
+
+	proxyConn* upconn = req->upconn;
+
+	if (upconn == NULL || req->requestdone) return;
+
+	connection* conn		= req->conn;
+	struct evbuffer* in		= httpGetInbuf(conn);
+	struct evbuffer* out	= bufferevent_get_output(upconn->buffer);
+	size_t len				= evbuffer_get_length(in);
+
+	if (len > 0) {
+
+		if (req->chunked) evbuffer_add_printf(out, "%zx" HTTP_CRLF, len);
+
+		evbuffer_add_buffer(out, in);
+
+		if (req->chunked) evbuffer_add(out, HTTP_CRLF, STRLEN(HTTP_CRLF));
+	}
+
+	if (httpGetStatus(conn) == HTTP_REQ_DONE) {
+
+		if (req->chunked) evbuffer_add(out, "0" HTTP_CRLF HTTP_CRLF, STRLEN("0" HTTP_CRLF HTTP_CRLF));
+
+		req->requestdone = true;
+
+	} else if (!req->paused && conn->parent == NULL && evbuffer_get_length(out) > PROXY_MAX_BUFFERED) {
+
+		// upstream is slower than the client, stop reading until it catches up.
+		req->paused = true;
+		bufferevent_disable(conn->buffer, EV_READ);
+	}
+}
+
+/**
+* Least outstanding requests among the upstreams that are up. The starting
+* point rotates so ties are spread evenly.
+*/
+static proxyUpstream* pickUpstream(proxy* px) {
+
+	time_t now				= time(NULL);
+	proxyUpstream* best		= NULL;
+	proxyUpstream* soonest	= NULL;
+
+	for (int i = 0; i < px->numupstreams; i++) {
+
+		proxyUpstream* up = px->upstreams[(px->nextupstream + i) % px->numupstreams];
+
+		if (up->downuntil > now) {
+			if (soonest == NULL || up->downuntil < soonest->downuntil) soonest = up;
+			continue;
+		}
+
+		if (best == NULL || up->outstanding < best->outstanding) best = up;
+	}
+
+	px->nextupstream = (px->nextupstream + 1) % px->numupstreams;
+
+	// every upstream is down, try the one that comes back first.
+	return (best != NULL) ? best : soonest;
+}
+
+static proxyConn* getConn(proxy* px, proxyUpstream* up, bool fresh) {
+
+	if (!fresh && up->idle != NULL) {
+
+		proxyConn* upconn = up->idle;
+
+		unpoolConn(upconn);
+
+		upconn->reused = true;
+
+		return upconn;
+	}
+
+	return newConn(px, up);
+}
+
+static proxyConn* newConn(proxy* px, proxyUpstream* up) {
+
+	proxyConn* upconn = NEW(proxyConn);
+
+	if (upconn == NULL) return NULL;
+
+	upconn->px		= px;
+	upconn->upstream	= up;
+	upconn->header	= evbuffer_new();
+	upconn->buffer	= bufferevent_socket_new(px->evbase, -1, BEV_OPT_CLOSE_ON_FREE);
+
+	if (upconn->header == NULL || upconn->buffer == NULL) {
+		freeConn(upconn);
+		return NULL;
+	}
+
+	bufferevent_setcb(upconn->buffer, upstreamReadCallback, upstreamWriteCallback, upstreamEventCallback, upconn);
+
+	if (bufferevent_socket_connect(upconn->buffer, (struct sockaddr*) &up->addr, up->addrlen)) {
+
+		WARN("Failed to connect to upstream. %s", up->address);
+		up->downuntil = time(NULL) + PROXY_DOWN_TIME;
+		freeConn(upconn);
+		return NULL;
+	}
+
+	if (up->addr.ss_family != AF_UNIX) {
+		int on = 1;
+		setsockopt(bufferevent_getfd(upconn->buffer), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+
+	bufferevent_enable(upconn->buffer, EV_READ | EV_WRITE);
+
+	px->connects++;
+
+	return upconn;
+}
+
+static void attachConn(proxyConn* upconn, proxyRequest* req) {
+
+	upconn->req			= req;
+	upconn->state		= PROXY_CONN_STATUS;
+	upconn->responded	= false;
+	upconn->keepalive	= false;
+	upconn->paused		= false;
+	req->upconn			= upconn;
+
+	upconn->upstream->outstanding++;
+
+	setTimeouts(upconn, upconn->px->timeout);
+	bufferevent_enable(upconn->buffer, EV_READ | EV_WRITE);
+}
+
+static void detachConn(proxyConn* upconn) {
+
+	if (upconn->req == NULL) return;
+
+	upconn->req->upconn	= NULL;
+	upconn->req			= NULL;
+
+	upconn->upstream->outstanding--;
+}
+
+/**
+* Keep the connection for the next request, or close it if the pool is full.
+*/
+static void poolConn(proxyConn* upconn) {
+
+	proxyUpstream* up = upconn->upstream;
+
+	if (up->numidle >= upconn->px->maxidle) {
+		freeConn(upconn);
+		return;
+	}
+
+	upconn->state	= PROXY_CONN_IDLE;
+	upconn->reused	= false;
+
+	if (upconn->reason) FREE(upconn->reason);
+
+	evbuffer_drain(upconn->header, evbuffer_get_length(upconn->header));
+
+	// keep reading to notice upstream closing the connection.
+	setTimeouts(upconn, upconn->px->idletimeout);
+	bufferevent_enable(upconn->buffer, EV_READ);
+
+	upconn->next	= up->idle;
+	up->idle		= upconn;
+	up->numidle++;
+}
+
+static void unpoolConn(proxyConn* upconn) {
+
+	proxyUpstream* up = upconn->upstream;
+
+	for (proxyConn** p = &up->idle; *p != NULL; p = &(*p)->next) {
+
+		if (*p == upconn) {
+			*p				= upconn->next;
+			upconn->next	= NULL;
+			up->numidle--;
+			return;
+		}
+	}
+}
+
+static void freeConn(proxyConn* upconn) {
+
+	if (upconn->buffer) bufferevent_free(upconn->buffer);
+	if (upconn->header) evbuffer_free(upconn->header);
+	if (upconn->reason) free(upconn->reason);
+
+	free(upconn);
+}
+
+static void setTimeouts(proxyConn* upconn, int seconds) {
+
+	struct timeval tv = { seconds, 0 };
+
+	bufferevent_set_timeouts(upconn->buffer, (seconds > 0) ? &tv : NULL, (seconds > 0) ? &tv : NULL);
+}
+
+/**
+* Upstream connection failed during an exchange.
+*
+* A pooled connection may have been closed by upstream just before it was
+* reused, or the upstream may be down. If the request had no body and nothing
+* came back, it is resent once on a new connection, to another upstream if
+* the connect failed. A request sent on a reused connection may have reached
+* upstream anyway, so it's resent only if its method is idempotent.
+*/
+static void failExchange(proxyConn* upconn, int code) {
+
+	proxyRequest* req	= upconn->req;
+	proxy* px			= upconn->px;
+	bool resendable		= (!upconn->connected || (upconn->reused && req->idempotent));
+	bool retry			= (resendable && !upconn->responded && req->bodyless && !req->retried);
+
+	if (!upconn->connected) {
+		WARN("Failed to connect to upstream. %s", upconn->upstream->address);
+		upconn->upstream->downuntil = time(NULL) + PROXY_DOWN_TIME;
+	}
+
+	detachConn(upconn);
+	freeConn(upconn);
+
+	if (retry) {
+
+		req->retried = true;
+		px->retries++;
+
+		startRequest(req, true);
+		return;
+	}
+
+	px->failures++;
+
+	failRequest(req, code);
+}
+
+static void processResponse(proxyConn* upconn) {
+
+	struct evbuffer* in = bufferevent_get_input(upconn->buffer);
+
+	while (upconn->req != NULL && !upconn->paused) {
+
+		size_t len = evbuffer_get_length(in);
+
+		switch (upconn->state) {
+
+			case PROXY_CONN_IDLE:
+				return;
+
+			case PROXY_CONN_STATUS:
+			case PROXY_CONN_HEADERS:
+			case PROXY_CONN_CHUNK_SIZE:
+			case PROXY_CONN_TRAILER: {
+
+				if (len > 0) upconn->responded = true;
+
+				size_t linelen	= 0;
+				char* line		= evbuffer_readln(in, &linelen, EVBUFFER_EOL_CRLF);
+
+				if (line == NULL) {
+
+					if (len > PROXY_MAX_HEADER_SIZE) failExchange(upconn, HTTP_CODE_BAD_GATEWAY);
+					return;
+				}
+
+				int status = 0;
+
+				if (upconn->state == PROXY_CONN_STATUS) {
+
+					status = parseStatusLine(upconn, line);
+
+				} else if (upconn->state == PROXY_CONN_HEADERS) {
+
+					status = parseHeaderLine(upconn, line);
+
+				} else if (upconn->state == PROXY_CONN_CHUNK_SIZE) {
+
+					char* end				= NULL;
+					unsigned long long size	= strtoull(line, &end, 16);
+
+					if (end == line || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t')) {
+						status = -1;
+					} else if (size == 0) {
+						upconn->state = PROXY_CONN_TRAILER;
+					} else {
+						upconn->remaining	= size;
+						upconn->state		= PROXY_CONN_CHUNK_DATA;
+					}
+
+				} else if (linelen == 0) {
+
+					// trailers are dropped, the client side frames its own last chunk.
+					free(line);
+					finishResponse(upconn);
+					return;
+				}
+
+				free(line);
+
+				if (status) {
+					failExchange(upconn, HTTP_CODE_BAD_GATEWAY);
+					return;
+				}
+
+				break;
+			}
+
+			case PROXY_CONN_BODY:
+			case PROXY_CONN_CHUNK_DATA: {
+
+				if (upconn->state == PROXY_CONN_BODY && upconn->remaining == 0) {
+					finishResponse(upconn);
+					return;
+				}
+
+				if (len == 0) return;
+
+				size_t size = (upconn->remaining < len) ? upconn->remaining : len;
+
+				if (relayBody(upconn, size)) return;
+
+				upconn->remaining -= size;
+
+				if (upconn->state == PROXY_CONN_CHUNK_DATA && upconn->remaining == 0) {
+					upconn->state = PROXY_CONN_CHUNK_CRLF;
+				}
+
+				break;
+			}
+
+			case PROXY_CONN_CHUNK_CRLF: {
+
+				if (len < STRLEN(HTTP_CRLF)) return;
+
+				char crlf[2];
+				evbuffer_remove(in, crlf, sizeof(crlf));
+
+				if (crlf[0] != '\r' || crlf[1] != '\n') {
+					failExchange(upconn, HTTP_CODE_BAD_GATEWAY);
+					return;
+				}
+
+				upconn->state = PROXY_CONN_CHUNK_SIZE;
+				break;
+			}
+
+			case PROXY_CONN_UNTIL_CLOSE:
+				if (len == 0) return;
+
+				if (relayBody(upconn, len)) return;
+				break;
+		}
+	}
+}
+
+static int parseStatusLine(proxyConn* upconn, const char* line) {
+
+	int minor	= 0;
+	int code	= 0;
+	int offset	= 0;
+
+	if (sscanf(line, "HTTP/1.%d %3d%n", &minor, &code, &offset) < 2 || code < 100 || code > 999) {
+		WARN("Invalid status line from upstream. %s", upconn->upstream->address);
+		return -1;
+	}
+
+	const char* reason = line + offset;
+	while (*reason == ' ') reason++;
+
+	if (upconn->reason) free(upconn->reason);
+
+	upconn->code			= code;
+	upconn->reason		= strdup((*reason != '\0') ? reason : httpGetReason(code));
+	upconn->keepalive		= (minor >= 1);
+	upconn->chunked		= false;
+	upconn->contentlength	= -1;
+	upconn->state			= PROXY_CONN_HEADERS;
+
+	evbuffer_drain(upconn->header, evbuffer_get_length(upconn->header));
+
+	return (upconn->reason == NULL) ? -1 : 0;
+}
+
+static int parseHeaderLine(proxyConn* upconn, char* line) {
+
+	// end of header. interim responses are skipped, the client gets the final one.
+	if (line[0] == '\0') {
+
+		if (upconn->code < HTTP_CODE_OK) {
+			upconn->state = PROXY_CONN_STATUS;
+		} else {
+			sendResponseHeader(upconn);
+		}
+
+		return 0;
+	}
+
+	char* colon = strchr(line, ':');
+
+	if (colon == NULL || colon == line) return -1;
+
+	char* value = colon + 1;
+
+	*colon = '\0';
+	while (*value == ' ' || *value == '\t') value++;
+
+	if (!strcasecmp(line, "Content-Length")) {
+
+		// digits only, a length off by any byte would desync the pooled connection.
+		if (!isdigit((unsigned char) *value)) return -1;
+
+		char* end = NULL;
+		errno = 0;
+		long long contentlength = strtoll(value, &end, 10);
+
+		while (*end == ' ' || *end == '\t') end++;
+
+		if (*end != '\0' || errno == ERANGE) return -1;
+		if (upconn->contentlength >= 0 && upconn->contentlength != contentlength) return -1;
+
+		upconn->contentlength = contentlength;
+
+		return 0;
+	}
+
+	if (!strcasecmp(line, "Transfer-Encoding")) {
+
+		upconn->chunked = hasToken(value, "chunked");
+		return 0;
+	}
+
+	if (!strcasecmp(line, "Connection")) {
+
+		if (hasToken(value, "close")) upconn->keepalive = false;
+		else if (hasToken(value, "keep-alive")) upconn->keepalive = true;
+
+		return 0;
+	}
+
+	if (isHopByHop(line, NULL)) return 0;
+
+	if (evbuffer_get_length(upconn->header) > PROXY_MAX_HEADER_SIZE) return -1;
+
+	evbuffer_add_printf(upconn->header, "%s: %s" HTTP_CRLF, line, value);
+
+	return 0;
+}
+
+/**
+* Pass the upstream response header to the client and pick how the body is
+* read. Without a usable length, the body goes to the client chunked.
+*/
+static void sendResponseHeader(proxyConn* upconn) {
+
+	proxyRequest* req	= upconn->req;
+	connection* conn	= req->conn;
+	int code			= upconn->code;
+	bool nobody			= (req->head || code == HTTP_CODE_NO_CONTENT || code == HTTP_CODE_NOT_MODIFIED);
+	off_t contentlength	= -1;
+
+	if (nobody) {
+
+		contentlength		= 0;
+		upconn->remaining	= 0;
+		upconn->state		= PROXY_CONN_BODY;
+
+	} else if (upconn->chunked) {
+
+		upconn->state = PROXY_CONN_CHUNK_SIZE;
+
+	} else if (upconn->contentlength >= 0) {
+
+		contentlength		= upconn->contentlength;
+		upconn->remaining	= upconn->contentlength;
+		upconn->state		= PROXY_CONN_BODY;
+
+	} else {
+
+		upconn->keepalive	= false;
+		upconn->state		= PROXY_CONN_UNTIL_CLOSE;
+	}
+
+	if (upconn->contentlength >= 0 && !upconn->chunked) {
+		evbuffer_add_printf(upconn->header, "Content-Length: %jd" HTTP_CRLF, (intmax_t) upconn->contentlength);
+	} else if (!nobody) {
+		evbuffer_add(upconn->header, "Transfer-Encoding: chunked" HTTP_CRLF, STRLEN("Transfer-Encoding: chunked" HTTP_CRLF));
+	}
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", isKeepalive(conn) ? "Keep-Alive" : "close");
+	}
+
+	httpSetResponseCode(conn, code, upconn->reason);
+
+	size_t size = evbuffer_get_length(upconn->header);
+
+	httpSendHeaderBlock(conn, evbuffer_pullup(upconn->header, size), size, contentlength);
+
+	req->headersent = true;
+
+	// empty body is complete right away, the parser finishes the exchange.
+	if (contentlength == 0) httpSendData(conn, NULL, 0);
+}
+
+/**
+* Move response body from upstream to the client without copying.
+*
+* @return 0 on success, -1 if the exchange is over or reading paused.
+*/
+static int relayBody(proxyConn* upconn, size_t size) {
+
+	connection* conn	= upconn->req->conn;
+	struct evbuffer* in	= bufferevent_get_input(upconn->buffer);
+
+	if (httpSendBuffer(conn, in, size) != size) {
+		failExchange(upconn, HTTP_CODE_BAD_GATEWAY);
+		return -1;
+	}
+
+	// client is slower than upstream, stop reading until it catches up.
+	if (conn->parent == NULL && evbuffer_get_length(conn->out) > PROXY_MAX_BUFFERED) {
+		upconn->paused = true;
+		bufferevent_disable(upconn->buffer, EV_READ);
+	}
+
+	return 0;
+}
+
+static void finishResponse(proxyConn* upconn) {
+
+	proxyRequest* req	= upconn->req;
+	connection* conn	= req->conn;
+	http* ahttp			= (http*) connectionGetExtra(conn);
+
+	// ends a chunked body, or the stream carrying it.
+	if (ahttp->response.contentlength < 0) httpSendChunk(conn, NULL, 0);
+
+	bool reusable = (upconn->keepalive && req->requestdone && evbuffer_get_length(bufferevent_get_input(upconn->buffer)) == 0);
+
+	detachConn(upconn);
+
+	if (reusable) {
+		poolConn(upconn);
+	} else {
+		freeConn(upconn);
+	}
+
+	finishRequest(req);
+}
+
+static bool isHopByHop(const char* name, const char* connection) {
+
+	static const char* hopbyhop[] = {
+		"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+		"Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade", NULL
+	};
+
+	for (int i = 0; hopbyhop[i] != NULL; i++) {
+		if (!strcasecmp(name, hopbyhop[i])) return true;
+	}
+
+	// headers listed in Connection are hop-by-hop as well.
+	return (connection != NULL && hasToken(connection, name));
+}
+
+/**
+* check if a comma separated list contains the token. case insensitive.
+*/
+static bool hasToken(const char* list, const char* token) {
+
+	size_t tokenlen = strlen(token);
+
+	for (const char* p = list; *p != '\0';) {
+
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+
+		const char* end = p;
+		while (*end != '\0' && *end != ',') end++;
+
+		const char* last = end;
+		while (last > p && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+		if ((size_t) (last - p) == tokenlen && !strncasecmp(p, token, tokenlen)) return true;
+
+		p = end;
+	}
+
+	return false;
+}
+
+/**
+* the client connection can take the next request once the response is out.
+* Not when part of the request body is still unread.
+*/
+static bool isKeepalive(connection* conn) {
+
+	return httpIsKeepaliveRequest(conn) && httpGetStatus(conn) == HTTP_REQ_DONE;
+}
+
+static void upstreamReadCallback(struct bufferevent* buffer, void* userdata) {
+
+	proxyConn* upconn = (proxyConn*) userdata;
+
+	// idle connections are not supposed to talk.
+	if (upconn->req == NULL) {
+		unpoolConn(upconn);
+		freeConn(upconn);
+		return;
+	}
+
+	processResponse(upconn);
+}
+
+static void upstreamWriteCallback(struct bufferevent* buffer, void* userdata) {
+
+	proxyConn* upconn	= (proxyConn*) userdata;
+	proxyRequest* req	= upconn->req;
+
+	// upstream caught up, read more of the request body.
+	if (req != NULL && req->paused) {
+		req->paused = false;
+		bufferevent_enable(req->conn->buffer, EV_READ);
+	}
+}
+
+static void upstreamEventCallback(struct bufferevent* buffer, short what, void* userdata) {
+
+	proxyConn* upconn = (proxyConn*) userdata;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		upconn->connected = true;
+		return;
+	}
+
+	// pooled connection closed or timed out.
+	if (upconn->req == NULL) {
+		unpoolConn(upconn);
+		freeConn(upconn);
+		return;
+	}
+
+	// body delimited by close, relay what is left regardless of backpressure.
+	if ((what & BEV_EVENT_EOF) && upconn->state == PROXY_CONN_UNTIL_CLOSE) {
+
+		struct evbuffer* in	= bufferevent_get_input(buffer);
+		size_t len			= evbuffer_get_length(in);
+
+		if (len > 0 && httpSendBuffer(upconn->req->conn, in, len) != len) {
+			failExchange(upconn, HTTP_CODE_BAD_GATEWAY);
+		} else {
+			finishResponse(upconn);
+		}
+
+		return;
+	}
+
+	DEBUG("Upstream connection failed. (what:0x%x, state:%d)", what, upconn->state);
+
+	failExchange(upconn, (what & BEV_EVENT_TIMEOUT) ? HTTP_CODE_GATEWAY_TIME_OUT : HTTP_CODE_BAD_GATEWAY);
+}
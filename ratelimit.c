@@ -0,0 +1,407 @@
+/**
+ * @abstruct request rate limiting module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "ratelimit.h"
+
+// private functions
+static uint64_t		hashKey(const char* key, size_t len);
+static uint64_t		nowMsec(void);
+static bool			peerKey(ratelimit* rl, connection* conn, char* key);
+static int			rejectRequest(ratelimit* rl, connection* conn, int retryafter);
+
+/**
+* Create a rate limiter.
+*
+* Every key, the client address unless a key callback is set, has a token
+* bucket refilled at rate tokens per second up to burst, and each request
+* takes a token. Buckets live in a fixed size table split into separately
+* locked shards, a new key takes the place of the least recently used one it
+* can land in, so memory doesn't grow with the number of clients.
+*
+* Requests are answered with 429, or the code set with ratelimitSetCode(),
+* as soon as their header is in, before the body is read.
+*
+* @param rate requests per second a key can make in the long run.
+* @param burst requests a key can make at once.
+* @param maxkeys keys tracked at once. 0 for default.
+*
+* @code
+* ratelimit* rl = ratelimitNew(10, 20, 0);
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, ratelimitHandler, rl);
+* serverRegisterHook(webserver, myHandler, NULL);
+* @endcode
+*
+* @return limiter or NULL on failure.
+*/
+ratelimit* ratelimitNew(double rate, int burst, size_t maxkeys) {
+
+	if (rate <= 0 || burst < 1) return NULL;
+
+	ratelimit* rl = NEW(ratelimit);
+
+	if (rl == NULL) return NULL;
+
+	rl->rate		= rate;
+	rl->burst		= burst;
+	rl->code		= HTTP_CODE_TOO_MANY_REQUESTS;
+	rl->v6prefix	= RATELIMIT_DEF_V6PREFIX;
+
+	if (maxkeys == 0) maxkeys = RATELIMIT_DEF_MAXKEYS;
+
+	size_t numsets = (maxkeys + RATELIMIT_SHARDS * RATELIMIT_WAYS - 1) / (RATELIMIT_SHARDS * RATELIMIT_WAYS);
+
+	for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+
+		ratelimitShard* shard = &rl->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+
+		shard->numsets = numsets;
+		shard->buckets = calloc(numsets * RATELIMIT_WAYS, sizeof(ratelimitBucket));
+
+		if (shard->buckets == NULL) {
+			ratelimitFree(rl);
+			return NULL;
+		}
+	}
+
+	return rl;
+}
+
+/**
+* Set the status code of limited requests, ex) HTTP_CODE_SERVICE_UNAVAILABLE.
+*/
+void ratelimitSetCode(ratelimit* rl, int code) {
+
+	rl->code = code;
+}
+
+/**
+* Set the prefix length IPv6 clients are keyed by. A client usually gets a
+* whole /64 or more, so keying by the full address would let it take a new
+* bucket for each request. 128 to key by the full address.
+*/
+void ratelimitSetIPv6Prefix(ratelimit* rl, int bits) {
+
+	rl->v6prefix = (bits < 0) ? 0 : (bits > 128) ? 128 : bits;
+}
+
+/**
+* Limit requests by a key of your own, ex) an API key header, instead of the
+* client address.
+*/
+void ratelimitSetKeyCallback(ratelimit* rl, ratelimitKeyCallback keycb, void* userdata) {
+
+	rl->keycb		= keycb;
+	rl->keyuserdata	= userdata;
+}
+
+/**
+* Take a token of the key.
+*
+* The bucket is refilled for the time passed since it was last used, there is
+* no timer. Safe to call from multiple threads.
+*
+* @param key keys longer than RATELIMIT_MAX_KEY - 1 are cut.
+* @param retryafter seconds until a token is available is stored here when
+* there is none, may be NULL.
+*
+* @return true if the request can go on, false if it is over the limit.
+*/
+bool ratelimitTake(ratelimit* rl, const char* key, int* retryafter) {
+
+	size_t len		= strnlen(key, RATELIMIT_MAX_KEY - 1);
+	uint64_t hash	= hashKey(key, len);
+	uint64_t now	= nowMsec();
+
+	ratelimitShard* shard	= &rl->shards[hash % RATELIMIT_SHARDS];
+	size_t set				= (hash / RATELIMIT_SHARDS) % shard->numsets;
+
+	pthread_mutex_lock(&shard->lock);
+
+	ratelimitBucket* buckets	= &shard->buckets[set * RATELIMIT_WAYS];
+	ratelimitBucket* bucket		= NULL;
+	ratelimitBucket* victim		= &buckets[0];
+
+	for (int i = 0; i < RATELIMIT_WAYS; i++) {
+
+		ratelimitBucket* b = &buckets[i];
+
+		if (b->hash == hash && !strncmp(b->key, key, len) && b->key[len] == '\0') {
+			bucket = b;
+			break;
+		}
+
+		// empty buckets first, then the one unused for longest.
+		if (victim->hash != 0 && (b->hash == 0 || b->updated < victim->updated)) victim = b;
+	}
+
+	if (bucket == NULL) {
+
+		if (victim->hash != 0) __atomic_add_fetch(&rl->evictions, 1, __ATOMIC_RELAXED);
+
+		bucket = victim;
+		bzero((void*) bucket, sizeof(ratelimitBucket));
+
+		bucket->hash	= hash;
+		bucket->tokens	= rl->burst;
+		bucket->updated	= now;
+		memcpy(bucket->key, key, len);
+	}
+
+	if (now > bucket->updated) {
+		bucket->tokens	= fmin(rl->burst, bucket->tokens + (now - bucket->updated) * rl->rate / 1000);
+		bucket->updated	= now;
+	}
+
+	bool allowed = (bucket->tokens >= 1);
+
+	if (allowed) {
+		bucket->tokens -= 1;
+		bucket->allowed++;
+	} else {
+		bucket->limited++;
+		if (retryafter) *retryafter = (int) ceil((1 - bucket->tokens) / rl->rate);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	__atomic_add_fetch((allowed) ? &rl->allowed : &rl->limited, 1, __ATOMIC_RELAXED);
+
+	return allowed;
+}
+
+/**
+* Put counters into the stats table, along with the RATELIMIT_STATS_TOP most
+* limited keys as ratelimit.key.<key>.limited and .allowed. Keys that dropped
+* out of the top are taken out of the table.
+*/
+void ratelimitUpdateStats(ratelimit* rl, hashtable* stats) {
+
+	ratelimitBucket top[RATELIMIT_STATS_TOP];
+	int numtop		= 0;
+	int64_t numkeys	= 0;
+
+	for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+
+		ratelimitShard* shard = &rl->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+
+		for (size_t j = 0; j < shard->numsets * RATELIMIT_WAYS; j++) {
+
+			ratelimitBucket* b = &shard->buckets[j];
+
+			if (b->hash == 0) continue;
+
+			numkeys++;
+
+			if (b->limited == 0) continue;
+
+			// keep top sorted by limited, most first.
+			if (numtop == RATELIMIT_STATS_TOP && top[numtop - 1].limited >= b->limited) continue;
+
+			int k = (numtop < RATELIMIT_STATS_TOP) ? numtop++ : RATELIMIT_STATS_TOP - 1;
+
+			for (; k > 0 && top[k - 1].limited < b->limited; k--) top[k] = top[k - 1];
+
+			top[k] = *b;
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	stats->putint(stats, "ratelimit.allowed", __atomic_load_n(&rl->allowed, __ATOMIC_RELAXED));
+	stats->putint(stats, "ratelimit.limited", __atomic_load_n(&rl->limited, __ATOMIC_RELAXED));
+	stats->putint(stats, "ratelimit.evictions", __atomic_load_n(&rl->evictions, __ATOMIC_RELAXED));
+	stats->putint(stats, "ratelimit.keys", numkeys);
+
+	char name[RATELIMIT_MAX_KEY + 32];
+
+	for (int i = 0; i < rl->numtop; i++) {
+
+		snprintf(name, sizeof(name), "ratelimit.key.%s.limited", rl->top[i]);
+		stats->remove(stats, name);
+		snprintf(name, sizeof(name), "ratelimit.key.%s.allowed", rl->top[i]);
+		stats->remove(stats, name);
+	}
+
+	for (int i = 0; i < numtop; i++) {
+
+		snprintf(name, sizeof(name), "ratelimit.key.%s.limited", top[i].key);
+		stats->putint(stats, name, top[i].limited);
+		snprintf(name, sizeof(name), "ratelimit.key.%s.allowed", top[i].key);
+		stats->putint(stats, name, top[i].allowed);
+
+		memcpy(rl->top[i], top[i].key, RATELIMIT_MAX_KEY);
+	}
+
+	rl->numtop = numtop;
+}
+
+/**
+* Release the limiter.
+*/
+void ratelimitFree(ratelimit* rl) {
+
+	if (rl == NULL) return;
+
+	for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+
+		if (rl->shards[i].buckets == NULL) continue;
+
+		pthread_mutex_destroy(&rl->shards[i].lock);
+		free(rl->shards[i].buckets);
+	}
+
+	free(rl);
+}
+
+/**
+* Rate limit hook.
+*
+* Each request takes a token of its key once its header is in, requests over
+* the limit get the limit code with Retry-After and the connection is closed
+* unless the whole request has been read.
+*
+* @note
+* This hook must be registered after httpHandler and before the hooks it
+* protects. Connections over Unix sockets are not limited by address.
+*/
+int ratelimitHandler(short event, connection* conn, void* userdata) {
+
+	ratelimit* rl = (ratelimit*) userdata;
+
+	if (!(event & EVENT_READ)) return OK;
+
+	enum http_request_status_e status = httpGetStatus(conn);
+
+	if (status != HTTP_REQ_HEADER_DONE && status != HTTP_REQ_DONE) return OK;
+
+	// a request is counted once, however many reads its body takes. the slot only marks it.
+	if (connectionGetHookData(conn, rl) != NULL) return OK;
+
+	connectionSetHookData(conn, rl, rl);
+
+	char key[RATELIMIT_MAX_KEY];
+	bool limit = (rl->keycb) ? rl->keycb(conn, key, rl->keyuserdata) : peerKey(rl, conn, key);
+
+	if (!limit) return OK;
+
+	key[RATELIMIT_MAX_KEY - 1] = '\0';
+
+	int retryafter = 1;
+
+	if (ratelimitTake(rl, key, &retryafter)) return OK;
+
+	DEBUG("Rate limited %s, retry after %d seconds.", key, retryafter);
+
+	return rejectRequest(rl, conn, retryafter);
+}
+
+// private functions
+
+// FNV-1a, never 0 which marks an empty bucket.
+static uint64_t hashKey(const char* key, size_t len) {
+
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash != 0) ? hash : 1;
+}
+
+static uint64_t nowMsec(void) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+* Client address of the connection as the key, IPv6 addresses cut to the
+* prefix so a client can't get around its limit by changing addresses.
+*/
+static bool peerKey(ratelimit* rl, connection* conn, char* key) {
+
+	const struct sockaddr* peer = connectionGetPeer(conn, NULL);
+
+	if (peer == NULL) return false;
+
+	if (peer->sa_family == AF_INET) {
+		return (inet_ntop(AF_INET, &((const struct sockaddr_in*) peer)->sin_addr, key, RATELIMIT_MAX_KEY) != NULL);
+	}
+
+	if (peer->sa_family == AF_INET6) {
+
+		struct in6_addr addr = ((const struct sockaddr_in6*) peer)->sin6_addr;
+
+		// an IPv4 client on a dual stack socket
+		if (IN6_IS_ADDR_V4MAPPED(&addr)) {
+			return (inet_ntop(AF_INET, &addr.s6_addr[12], key, RATELIMIT_MAX_KEY) != NULL);
+		}
+
+		for (int i = 0; i < 16; i++) {
+
+			int bits = rl->v6prefix - i * 8;
+
+			if (bits <= 0) addr.s6_addr[i] = 0;
+			else if (bits < 8) addr.s6_addr[i] &= (uint8_t) (0xff << (8 - bits));
+		}
+
+		if (inet_ntop(AF_INET6, &addr, key, RATELIMIT_MAX_KEY) == NULL) return false;
+
+		if (rl->v6prefix < 128) {
+			size_t len = strlen(key);
+			snprintf(key + len, RATELIMIT_MAX_KEY - len, "/%d", rl->v6prefix);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+* Answer with the limit code. The connection is kept only when the whole
+* request has been read.
+*/
+static int rejectRequest(ratelimit* rl, connection* conn, int retryafter) {
+
+	int result = (httpIsKeepaliveRequest(conn) && httpGetStatus(conn) == HTTP_REQ_DONE) ? DONE : CLOSE;
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", (result == DONE) ? "Keep-Alive" : "close");
+	}
+
+	char value[16];
+	snprintf(value, sizeof(value), "%d", (retryafter > 0) ? retryafter : 1);
+	httpSetResponseHeader(conn, "Retry-After", value);
+
+	const char* reason = httpGetReason(rl->code);
+	httpResponse(conn, rl->code, "text/plain", reason, strlen(reason));
+
+	return result;
+}
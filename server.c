@@ -6,6 +6,8 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
 #include <sys/un.h>
 #include <sys/socket.h>
@@ -20,6 +22,7 @@
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
+#include "tls.h"
 
 struct hook_t {
 	char* method;
@@ -36,14 +39,26 @@ static void		closeServer(server* aserver);
 static void		libeventLogCallback(int severity, const char* msg);
 static int		setUndefinedOptions(server* webserver);
 static SSL_CTX* initSSL(const char* certPath, const char* pkeyPath);
+static void		configureSSLCTX(SSL_CTX* sslctx, void* userdata);
+static int		alpnSelectCallback(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* userdata);
 static void		listenerCallback(struct evconnlistener* listener, evutil_socket_t evsocket, struct sockaddr* sockaddr, int socklen, void* userdata);
-static connection* connectionNew(server* aserver, struct bufferevent* buffer);
+static void		handshakeCallback(SSL* ssl, evutil_socket_t socket, void* userdata);
+static connection* acceptConnection(server* webserver, struct bufferevent* buffer, struct sockaddr* sockaddr, socklen_t socklen);
+static connection* connectionNew(server* aserver, struct bufferevent* buffer, struct sockaddr* sockaddr, socklen_t socklen);
 static void		connectionReset(connection* conn);
 static void		connectionFree(connection* conn);
 static void		connectionReadCallback(struct bufferevent* buffer, void* userdata);
 static void		connectionWriteCallback(struct bufferevent* buffer, void* userdata);
 static void		connectionEventCallback(struct bufferevent* buffer, short what, void* userdata);
 static void		connectionCallback(connection* conn, int event);
+static void		readDeadlineCallback(evutil_socket_t fd, short what, void* userdata);
+static void		writeDeadlineCallback(evutil_socket_t fd, short what, void* userdata);
+static void		inbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata);
+static void		outbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata);
+static void		expireConnection(connection* conn, uint64_t* counter);
+static void		sendFile(connection* conn);
+static void		sendFileCallback(evutil_socket_t fd, short what, void* userdata);
+static void		releaseFile(connection* conn);
 static int		callHooks(short event, connection* conn);
 static void*	setUserData(connection* conn, int index, const void* userdata, callback_free_userdata free_cb);
 static void*	getUserData(connection* conn, int index);
@@ -173,9 +188,32 @@ int serverStart(server* webserver) {
 			return -1;
 		}
 
+		tlsSetSessionCache(
+			webserver->sslctx,
+			serverGetOptionAsInt(webserver, "server.ssl_session_cache"),
+			serverGetOptionAsInt(webserver, "server.ssl_session_timeout")
+		);
+
+		if (tlsSetTicketRotation(webserver->sslctx, serverGetOptionAsInt(webserver, "server.ssl_ticket_rotation"))) {
+			ERROR("Couldn't set up session tickets.");
+			return -1;
+		}
+
+		if (!tlsEnableKTLS(webserver->sslctx, serverGetOptionAsInt(webserver, "server.ssl_ktls"))) {
+			WARN("Kernel TLS is not supported by this OpenSSL build.");
+		}
+
 		DEBUG("SSL Initialized.");
 	}
 
+	if (webserver->sslctx) {
+
+		configureSSLCTX(webserver->sslctx, webserver);
+
+		// certificates of other names are loaded by the handshakes asking for them.
+		if (webserver->sni) tlsSNIAttach(webserver->sni, webserver->sslctx);
+	}
+
 	// Bind
 	if (!webserver->evbase) {
 		webserver->evbase = event_base_new();
@@ -185,6 +223,43 @@ int serverStart(server* webserver) {
 		}
 	}
 
+	// Deadlines of the same length share a queue instead of the timer heap,
+	// so a deadline per connection costs next to nothing.
+	struct timeval tv;
+	bzero((void*) &tv, sizeof(struct timeval));
+
+	if ((tv.tv_sec = serverGetOptionAsInt(webserver, "server.header_timeout")) > 0) {
+		webserver->headertimeout = event_base_init_common_timeout(webserver->evbase, &tv);
+	}
+
+	if ((tv.tv_sec = serverGetOptionAsInt(webserver, "server.rate_period")) > 0) {
+
+		webserver->bodyminrate = (size_t) serverGetOptionAsInt(webserver, "server.body_min_rate") * tv.tv_sec;
+		webserver->sendminrate = (size_t) serverGetOptionAsInt(webserver, "server.send_min_rate") * tv.tv_sec;
+
+		if (webserver->bodyminrate > 0 || webserver->sendminrate > 0) {
+			webserver->rateperiod = event_base_init_common_timeout(webserver->evbase, &tv);
+		}
+	}
+
+	// Handshakes of new connections run on their own threads, connections join the loop once established.
+	int handshakethreads = serverGetOptionAsInt(webserver, "server.ssl_handshake_threads");
+
+	if (webserver->sslctx && handshakethreads > 0 && !webserver->handshakes) {
+
+		webserver->handshakes = tlsHandshakePoolNew(
+			webserver->evbase, handshakethreads,
+			serverGetOptionAsInt(webserver, "server.ssl_handshake_timeout"),
+			serverGetOptionAsInt(webserver, "server.ssl_handshake_queue"),
+			handshakeCallback, webserver
+		);
+
+		if (!webserver->handshakes) {
+			ERROR("Failed to start TLS handshake threads.");
+			return -1;
+		}
+	}
+
 	// Create a eventfd for notification channel.
 	int notifyfd = eventfd(0, 0);
 	webserver->notify_buffer = bufferevent_socket_new(webserver->evbase, notifyfd, BEV_OPT_CLOSE_ON_FREE);
@@ -271,10 +346,18 @@ void serverFree(server* webserver) {
 		closeServer(webserver);
 	}
 
+	if (webserver->handshakes) {
+		tlsHandshakePoolFree(webserver->handshakes);
+	}
+
 	if (webserver->evbase) {
 		event_base_free(webserver->evbase);
 	}
 
+	if (webserver->sni) {
+		tlsSNIFree(webserver->sni);
+	}
+
 	if (webserver->sslctx) {
 		SSL_CTX_free(webserver->sslctx);
 		ERR_clear_error();
@@ -352,25 +435,24 @@ int serverGetOptionAsInt(server* webserver, const char* key) {
 }
 
 /**
-* Helper method for creating minimal OpenSSL SSL_CTX object.
+* Helper method for creating OpenSSL SSL_CTX object.
 *
-* @param cert_path path to a PEM encoded certificate file
+* @param cert_path path to a PEM encoded certificate chain file
 * @param pkey_path path to a PEM encoded private key file
 *
 * @return newly allocated SSL_CTX object or NULL on failure
 *
 * @note
-* This function initializes SSL_CTX with minimum default with
-* "SSLv23_server_method" which will make the server understand
-* SSLv2, SSLv3, and TLSv1 protocol.
+* This function initializes SSL_CTX with TLS 1.2 and 1.3 only, modern
+* ciphers, a server side session cache and rotating session tickets.
 *
+* @see tlsContextNew()
 * @see ad_server_set_ssl_ctx()
 */
 SSL_CTX* serverSSLCTXCreateSimple(const char *cert_path, const char *pkey_path) {
-	SSL_CTX* sslctx = SSL_CTX_new(SSLv23_server_method());
+	SSL_CTX* sslctx = tlsContextNew(cert_path, pkey_path);
 
-	if (! SSL_CTX_use_certificate_file(sslctx, cert_path, SSL_FILETYPE_PEM) ||
-	! SSL_CTX_use_PrivateKey_file(sslctx, pkey_path, SSL_FILETYPE_PEM)) {
+	if (sslctx == NULL) {
 
 		ERROR(
 			"Couldn't load certificate file(%s) or private key file(%s).",
@@ -404,6 +486,10 @@ void serverSetSSLCTX(server* webserver, SSL_CTX* sslctx) {
 	}
 
 	webserver->sslctx = sslctx;
+
+	if (sslctx && webserver->sni) {
+		tlsSNIAttach(webserver->sni, sslctx);
+	}
 }
 
 /**
@@ -422,10 +508,47 @@ SSL_CTX* serverGetSSLCTX(server* webserver) {
 	return webserver->sslctx;
 }
 
+/**
+* Add a certificate for a server name (SNI), or replace the one it has.
+*
+* The certificate is loaded by the first handshake asking for the name, the
+* one of "server.ssl_cert" is used for other names. Can be called while the
+* server is running, replacing a certificate doesn't drop the listener or
+* connections using the old one.
+*
+* @param servername ex) "www.domain.com", "*.domain.com"
+*
+* @return 0 on success, -1 on error.
+*/
+int serverAddSSLCert(server* webserver, const char* servername, const char* certPath, const char* pkeyPath) {
+
+	if (webserver->sni == NULL) {
+
+		if ((webserver->sni = tlsSNINew(configureSSLCTX, webserver)) == NULL) return -1;
+
+		if (webserver->sslctx) tlsSNIAttach(webserver->sni, webserver->sslctx);
+	}
+
+	return tlsSNIAddCert(webserver->sni, servername, certPath, pkeyPath);
+}
+
 /**
 * return internal statistic counter map.
+*
+* TLS counters are refreshed on every call, ex) tls.resumption_rate.
 */
 hashtable* serverGetStats(server* webserver, const char* key) {
+
+	if (webserver->sslctx) tlsUpdateStats(webserver->sslctx, webserver->stats);
+
+	if (webserver->handshakes) tlsHandshakeUpdateStats(webserver->handshakes, webserver->stats);
+
+	webserver->stats->putint(webserver->stats, "server.header_timeouts", webserver->headertimeouts);
+	webserver->stats->putint(webserver->stats, "server.body_timeouts", webserver->bodytimeouts);
+	webserver->stats->putint(webserver->stats, "server.send_timeouts", webserver->sendtimeouts);
+
+	if (webserver->sni) tlsSNIUpdateStats(webserver->sni, webserver->stats);
+
 	return webserver->stats;
 }
 
@@ -493,6 +616,61 @@ void* connectionGetExtra(connection* conn) {
 	return getUserData(conn, 1);
 }
 
+/**
+* Keep per-request state of a hook on the connection.
+*
+* Unlike userdata, every hook instance gets a slot of its own, found by a
+* short scan instead of a lookup table. Slots are cleared between requests,
+* hooks release what data points to on EVENT_CLOSE.
+*
+* @param owner hook instance the data belongs to, usually its userdata.
+* @param data state of the request, NULL to drop it.
+*
+* @return 0 on success, -1 if every slot is taken.
+*/
+int connectionSetHookData(connection* conn, const void* owner, void* data) {
+
+	int freeslot = -1;
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) {
+
+			if (data == NULL) conn->hookdata[i].owner = NULL;
+
+			conn->hookdata[i].data = data;
+			return 0;
+		}
+
+		if (freeslot < 0 && conn->hookdata[i].owner == NULL) freeslot = i;
+	}
+
+	if (data == NULL) return 0;
+
+	if (freeslot < 0) {
+		WARN("No hook data slot left. (max:%d)", CONN_MAX_HOOKDATA);
+		return -1;
+	}
+
+	conn->hookdata[freeslot].owner	= owner;
+	conn->hookdata[freeslot].data	= data;
+
+	return 0;
+}
+
+/**
+* @return state the hook instance kept on the connection, NULL if none.
+*/
+void* connectionGetHookData(connection* conn, const void* owner) {
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) return conn->hookdata[i].data;
+	}
+
+	return NULL;
+}
+
 /**
 * Set method name on this connection.
 *
@@ -514,6 +692,212 @@ char* connectionSetMethod(connection* conn, char* method) {
 	return prev;
 }
 
+/**
+* Get the client address, as accepted from the listener.
+*
+* @param len length of the address is stored here if not NULL.
+*
+* @return address or NULL if not known.
+*/
+const struct sockaddr* connectionGetPeer(connection* conn, socklen_t* len) {
+
+	if (len) *len = conn->peerlen;
+
+	return (conn->peerlen > 0) ? (const struct sockaddr*) &conn->peer : NULL;
+}
+
+/**
+* Tell the server which phase of a request the connection is in, so the
+* deadline of the phase is enforced.
+*
+* The header phase must be over within "server.header_timeout" seconds of
+* its start, however the bytes trickle in. In the body phase at least
+* "server.body_min_rate" bytes per second must come in over every
+* "server.rate_period", unless reading is paused. Connections missing a
+* deadline are closed, hooks get EVENT_CLOSE | EVENT_TIMEOUT.
+*
+* Protocol hooks call this, ex) httpHandler. Streams are not supported.
+*/
+void connectionSetPhase(connection* conn, enum connection_phase_e phase) {
+
+	if (conn->parent != NULL || conn->phase == phase) return;
+
+	conn->phase = phase;
+
+	if (conn->readdeadline == NULL) return;
+
+	server* webserver = conn->webserver;
+
+	evtimer_del(conn->readdeadline);
+
+	if (phase == CONN_PHASE_HEADER && webserver->headertimeout) {
+
+		evtimer_add(conn->readdeadline, webserver->headertimeout);
+
+	} else if (phase == CONN_PHASE_BODY && webserver->bodyminrate > 0) {
+
+		conn->inmark = conn->bytesin;
+		evtimer_add(conn->readdeadline, webserver->rateperiod);
+	}
+}
+
+/**
+* Create a connection for a stream multiplexed over the parent connection.
+*
+* The stream shares the server and bufferevent of the parent but has its own
+* in/out buffers and userdata, so hooks handle it like any other connection.
+* Hooks are not called here, the protocol runs them with connectionCallHooks().
+*
+* @return stream connection or NULL on failure.
+*/
+connection* connectionNewStream(connection* parent, struct evbuffer* in, struct evbuffer* out) {
+
+	connection* conn = NEW(connection);
+
+	if (conn == NULL) return NULL;
+
+	conn->webserver	= parent->webserver;
+	conn->buffer	= parent->buffer;
+	conn->in		= in;
+	conn->out		= out;
+	conn->parent	= parent;
+	conn->peer		= parent->peer;
+	conn->peerlen	= parent->peerlen;
+	conn->sendfd	= -1;
+
+	connectionReset(conn);
+
+	return conn;
+}
+
+/**
+* Close a stream connection, hooks are called with EVENT_CLOSE.
+*/
+void connectionFreeStream(connection* conn) {
+
+	if (conn == NULL) return;
+
+	callHooks(EVENT_CLOSE, conn);
+	connectionReset(conn);
+
+	if (conn->session && conn->session_free_cb) {
+		conn->session_free_cb(conn, conn->session);
+	}
+
+	free(conn);
+}
+
+/**
+* Run the hook chain on the connection.
+*
+* @return status returned by the hook chain.
+*/
+int connectionCallHooks(connection* conn, short event) {
+
+	return callHooks(event, conn);
+}
+
+/**
+* Hand the connection over to another protocol such as HTTP/2.
+*
+* Unlike userdata, the session lives until the connection is closed and is
+* not released between requests.
+*/
+void connectionSetProtocol(connection* conn, const char* protocol, void* session, callback_free_userdata free_cb) {
+
+	conn->protocol			= protocol;
+	conn->session			= session;
+	conn->session_free_cb	= free_cb;
+}
+
+/**
+* @return session of the protocol, NULL if the connection doesn't speak it.
+*/
+void* connectionGetProtocol(connection* conn, const char* protocol) {
+
+	if (conn->protocol == NULL || strcmp(conn->protocol, protocol)) return NULL;
+
+	return conn->session;
+}
+
+/**
+* Send a range of file once the out-buffer is out, with SSL_sendfile() so the
+* content is never read into user space.
+*
+* Only TLS connections where the kernel encrypts records (server.ssl_ktls)
+* take it, plain ones already get sendfile() from libevent for file segments
+* in the out-buffer. The connection reads no more requests until the file is
+* out, so nothing else gets in between.
+*
+* @param fd file to send, duplicated so the caller can close it.
+*
+* @return 0 if the file is taken, -1 if it has to go through the out-buffer.
+*/
+int connectionSendFile(connection* conn, int fd, off_t offset, size_t size) {
+
+	if (conn->parent != NULL || conn->status == CLOSE || conn->sendfd >= 0 || size == 0) return -1;
+
+	if (!conn->webserver->sslctx || !tlsCanSendFile(bufferevent_openssl_get_ssl(conn->buffer))) return -1;
+
+	if (conn->sendev == NULL) {
+
+		conn->sendev = event_new(conn->webserver->evbase, bufferevent_getfd(conn->buffer), EV_WRITE, sendFileCallback, conn);
+		if (conn->sendev == NULL) return -1;
+	}
+
+	if ((conn->sendfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) return -1;
+
+	conn->sendoffset	= offset;
+	conn->sendsize		= size;
+
+	bufferevent_disable(conn->buffer, EV_READ);
+
+	// the write callback starts the file once the out-buffer is empty.
+	if (evbuffer_get_length(conn->out) == 0) {
+		bufferevent_trigger(conn->buffer, EV_WRITE, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	return 0;
+}
+
+/**
+* Run the hook chain again with EVENT_READ on the next loop.
+*
+* For hooks that parked a request by returning TAKEOVER and need to pick it
+* up later, ex) once a shared result is ready. Streams are not supported.
+*
+* @return 0 on success, -1 on error.
+*/
+int connectionResume(connection* conn) {
+
+	if (conn->parent != NULL || conn->status == CLOSE) return -1;
+
+	bufferevent_trigger(conn->buffer, EV_READ, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+
+	return 0;
+}
+
+/**
+* Close the connection from outside of its hook chain, ex) from a timer.
+*
+* Pending output is discarded. Hooks are called with EVENT_CLOSE and the
+* connection is freed on the next loop, so it's safe to call while walking
+* a list of connections. Streams are closed by their protocol instead.
+*/
+void connectionClose(connection* conn) {
+
+	if (conn->parent != NULL || conn->status == CLOSE) return;
+
+	conn->status = CLOSE;
+
+	releaseFile(conn);
+	evbuffer_drain(conn->out, evbuffer_get_length(conn->out));
+	bufferevent_disable(conn->buffer, EV_READ);
+
+	// write callback sees CLOSE with empty out-buffer and frees the connection.
+	bufferevent_trigger(conn->buffer, EV_WRITE, BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+}
+
 
 
 
@@ -544,14 +928,33 @@ static int setUndefinedOptions(server* webserver) {
 
 static SSL_CTX* initSSL(const char* cert_path, const char* pkey_path) {
 
-	SSL_CTX* sslctx = SSL_CTX_new(SSLv23_server_method());
+	return tlsContextNew(cert_path, pkey_path);
+}
 
-	if (!SSL_CTX_use_certificate_file(sslctx, cert_path, SSL_FILETYPE_PEM) ||
-	!SSL_CTX_use_PrivateKey_file(sslctx, pkey_path, SSL_FILETYPE_PEM)) {
-		return NULL;
+/**
+* Settings every context of the server gets, the default one and the ones
+* loaded for server names.
+*/
+static void configureSSLCTX(SSL_CTX* sslctx, void* userdata) {
+
+	server* webserver = (server*) userdata;
+
+	// Let clients pick HTTP/2 in the handshake.
+	if (serverGetOptionAsInt(webserver, "server.http2")) {
+		SSL_CTX_set_alpn_select_cb(sslctx, alpnSelectCallback, NULL);
 	}
+}
 
-	return sslctx;
+// prefer h2, fall back to http/1.1 or no ALPN at all.
+static int alpnSelectCallback(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* userdata) {
+
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+	if (SSL_select_next_proto((unsigned char**) out, outlen, protocols, sizeof(protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+
+	return SSL_TLSEXT_ERR_OK;
 }
 
 static void listenerCallback(struct evconnlistener* listener, evutil_socket_t socket,
@@ -560,6 +963,20 @@ struct sockaddr* sockaddr, int socklen, void* userdata) {
 	DEBUG("New connection.");
 	server* webserver = (server*) userdata;
 
+	// the connection is created once the handshake threads are done with it.
+	if (webserver->handshakes) {
+
+		SSL* ssl = SSL_new(webserver->sslctx);
+
+		if (ssl == NULL || tlsHandshakeStart(webserver->handshakes, ssl, socket) != 0) {
+			DEBUG("Dropping connection, TLS handshake queue is full.");
+			if (ssl) SSL_free(ssl);
+			evutil_closesocket(socket);
+		}
+
+		return;
+	}
+
 	// create a new buffer
 	struct bufferevent* buffer = NULL;
 
@@ -574,18 +991,8 @@ struct sockaddr* sockaddr, int socklen, void* userdata) {
 
 	if (buffer == NULL) goto error;
 
-	// set read timeout
-	int timeout = serverGetOptionAsInt(webserver, "server.timeout");
-
-	if (timeout > 0) {
-		struct timeval tm;
-		bzero((void *)&tm, sizeof(struct timeval));
-		tm.tv_sec = timeout;
-		bufferevent_set_timeouts(buffer, &tm, NULL);
-	}
-
 	// create a connection
-	void* conn = connectionNew(webserver, buffer);
+	void* conn = acceptConnection(webserver, buffer, sockaddr, socklen);
 
 	if (!conn) goto error;
 
@@ -598,7 +1005,50 @@ struct sockaddr* sockaddr, int socklen, void* userdata) {
 		webserver->errcode = ENOMEM;
 }
 
-static connection* connectionNew(server* webserver, struct bufferevent* buffer) {
+// connection established on the handshake threads joins the loop.
+static void handshakeCallback(SSL* ssl, evutil_socket_t socket, void* userdata) {
+
+	server* webserver = (server*) userdata;
+
+	struct bufferevent* buffer = bufferevent_openssl_socket_new(webserver->evbase, socket,
+	ssl,
+	BUFFEREVENT_SSL_OPEN,
+	BEV_OPT_CLOSE_ON_FREE);
+
+	if (buffer == NULL) {
+		ERROR("Failed to create a connection handler.");
+		SSL_free(ssl);
+		evutil_closesocket(socket);
+		return;
+	}
+
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+
+	if (getpeername(socket, (struct sockaddr*) &peer, &peerlen) != 0) peerlen = 0;
+
+	if (!acceptConnection(webserver, buffer, (struct sockaddr*) &peer, peerlen)) {
+		ERROR("Failed to create a connection handler.");
+		bufferevent_free(buffer);
+	}
+}
+
+static connection* acceptConnection(server* webserver, struct bufferevent* buffer, struct sockaddr* sockaddr, socklen_t socklen) {
+
+	// set read timeout
+	int timeout = serverGetOptionAsInt(webserver, "server.timeout");
+
+	if (timeout > 0) {
+		struct timeval tm;
+		bzero((void *)&tm, sizeof(struct timeval));
+		tm.tv_sec = timeout;
+		bufferevent_set_timeouts(buffer, &tm, NULL);
+	}
+
+	return connectionNew(webserver, buffer, sockaddr, socklen);
+}
+
+static connection* connectionNew(server* webserver, struct bufferevent* buffer, struct sockaddr* sockaddr, socklen_t socklen) {
 
 	if (server == NULL || buffer == NULL) {
 		return NULL;
@@ -614,6 +1064,53 @@ static connection* connectionNew(server* webserver, struct bufferevent* buffer)
 	conn->buffer	= buffer;
 	conn->in		= bufferevent_get_input(buffer);
 	conn->out		= bufferevent_get_output(buffer);
+	conn->sendfd	= -1;
+
+	if (sockaddr != NULL && socklen > 0 && (size_t) socklen <= sizeof(conn->peer)) {
+		memcpy(&conn->peer, sockaddr, socklen);
+		conn->peerlen = socklen;
+	}
+
+	// small records for the first bytes, full ones for bulk transfers.
+	int recordsize = serverGetOptionAsInt(webserver, "server.ssl_record_size");
+
+	if (webserver->sslctx && recordsize > 0) {
+
+		conn->records = tlsRecordSizerNew(
+			bufferevent_openssl_get_ssl(buffer), conn->out, recordsize,
+			serverGetOptionAsInt(webserver, "server.ssl_record_threshold"),
+			serverGetOptionAsInt(webserver, "server.ssl_record_idle")
+		);
+
+		if (conn->records == NULL) WARN("Invalid server.ssl_record_size %d, record sizes are left to OpenSSL.", recordsize);
+	}
+
+	// deadlines against clients holding on to the connection by being slow.
+	if (webserver->headertimeout || webserver->bodyminrate > 0) {
+
+		if ((conn->readdeadline = evtimer_new(webserver->evbase, readDeadlineCallback, conn)) == NULL) {
+			tlsRecordSizerFree(conn->records);
+			free(conn);
+			return NULL;
+		}
+
+		if (webserver->bodyminrate > 0) evbuffer_add_cb(conn->in, inbufCallback, conn);
+	}
+
+	if (webserver->sendminrate > 0) {
+
+		if ((conn->writedeadline = evtimer_new(webserver->evbase, writeDeadlineCallback, conn)) == NULL) {
+			if (conn->readdeadline) {
+				evbuffer_remove_cb(conn->in, inbufCallback, conn);
+				event_free(conn->readdeadline);
+			}
+			tlsRecordSizerFree(conn->records);
+			free(conn);
+			return NULL;
+		}
+
+		evbuffer_add_cb(conn->out, outbufCallback, conn);
+	}
 
 	connectionReset(conn);
 
@@ -649,6 +1146,10 @@ static void connectionReset(connection* conn) {
 		free(conn->method);
 		conn->method = NULL;
 	}
+
+	memset(conn->hookdata, 0, sizeof(conn->hookdata));
+
+	connectionSetPhase(conn, CONN_PHASE_IDLE);
 }
 
 static void connectionFree(connection* conn) {
@@ -660,6 +1161,26 @@ static void connectionFree(connection* conn) {
 
 		connectionReset(conn);
 
+		if (conn->session && conn->session_free_cb) {
+			conn->session_free_cb(conn, conn->session);
+		}
+
+		// stop watching the buffers before they go.
+		tlsRecordSizerFree(conn->records);
+
+		if (conn->readdeadline) {
+			evbuffer_remove_cb(conn->in, inbufCallback, conn);
+			event_free(conn->readdeadline);
+		}
+
+		if (conn->writedeadline) {
+			evbuffer_remove_cb(conn->out, outbufCallback, conn);
+			event_free(conn->writedeadline);
+		}
+
+		releaseFile(conn);
+		if (conn->sendev) event_free(conn->sendev);
+
 		if (conn->buffer) {
 			if (conn->webserver->sslctx) {
 				int sslerr = bufferevent_get_openssl_error(conn->buffer);
@@ -689,6 +1210,13 @@ static void connectionWriteCallback(struct bufferevent* buffer, void* userdata)
 	DEBUG("write_cb");
 	connection* conn = userdata;
 
+	// the out-buffer is out, the file goes next.
+	if (conn->sendfd >= 0) {
+
+		if (evbuffer_get_length(conn->out) == 0 && !event_pending(conn->sendev, EV_WRITE, NULL)) sendFile(conn);
+		return;
+	}
+
 	connectionCallback(conn, EVENT_WRITE);
 }
 
@@ -700,6 +1228,7 @@ static void connectionEventCallback(struct bufferevent* buffer, short what, void
 
 	if (what & BEV_EVENT_EOF || what & BEV_EVENT_ERROR || what & BEV_EVENT_TIMEOUT) {
 		conn->status = CLOSE;
+		releaseFile(conn);
 		connectionCallback(conn, EVENT_CLOSE | ((what & BEV_EVENT_TIMEOUT) ? EVENT_TIMEOUT : 0));
 	}
 }
@@ -708,38 +1237,212 @@ static void connectionCallback(connection* conn, int event) {
 
 	DEBUG("conn_cb: status:0x%x, event:0x%x", conn->status, event);
 
-	if(conn->status == OK || conn->status == TAKEOVER) {
-		int status = callHooks(event, conn);
-		// update status only when it's higher then before
-		if (! (conn->status == CLOSE || (conn->status == DONE && conn->status >= status))) {
-			conn->status = status;
+	int numrequests = 0;
+
+	for (;;) {
+
+		if(conn->status == OK || conn->status == TAKEOVER) {
+			int status = callHooks(event, conn);
+			// update status only when it's higher then before
+			if (! (conn->status == CLOSE || (conn->status == DONE && conn->status >= status))) {
+				conn->status = status;
+			}
 		}
-	}
 
-	if(conn->status == DONE) {
-		if (serverGetOptionAsInt(conn->webserver, "server.request_pipelining")) {
-			callHooks(EVENT_CLOSE , conn);
-			connectionReset(conn);
-			callHooks(EVENT_INIT , conn);
-		} else {
+		if(conn->status == DONE) {
+			if (serverGetOptionAsInt(conn->webserver, "server.request_pipelining")) {
+				callHooks(EVENT_CLOSE , conn);
+				connectionReset(conn);
+				callHooks(EVENT_INIT , conn);
+
+				// the rest waits for the file being sent, see sendFile().
+				if (conn->sendfd >= 0) return;
+
+				// Dispatch pipelined requests already in the in-buffer within this callback.
+				// Responses pile up in order in the out-buffer and bufferevent writes them
+				// out together once we return to the loop.
+				if ((event & EVENT_READ) && evbuffer_get_length(conn->in) > 0) {
+
+					if (++numrequests < serverGetOptionAsInt(conn->webserver, "server.pipelining_batch")) {
+						continue;
+					}
+
+					// give other connections a chance, pick up the rest on the next loop.
+					DEBUG("Pipelining batch limit reached. %d requests", numrequests);
+					bufferevent_trigger(conn->buffer, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+				}
+			} else {
 
-			// do nothing but drain input buffer.
-			if (event == EVENT_READ) {
-				DEBUG("Draining in-buffer. %d", conn->status);
-				DRAIN_EVBUFFER(conn->in);
+				// do nothing but drain input buffer.
+				if (event == EVENT_READ) {
+					DEBUG("Draining in-buffer. %d", conn->status);
+					DRAIN_EVBUFFER(conn->in);
+				}
+			}
+
+			return;
+		} else if(conn->status == CLOSE) {
+			if (evbuffer_get_length(conn->out) <= 0 && conn->sendfd < 0) {
+				int newevent = (event & EVENT_CLOSE) ? event : EVENT_CLOSE;
+				callHooks(newevent, conn);
+				connectionFree(conn);
+				DEBUG("Connection closed.");
+				return;
 			}
 		}
 
 		return;
-	} else if(conn->status == CLOSE) {
-		if (evbuffer_get_length(conn->out) <= 0) {
-			int newevent = (event & EVENT_CLOSE) ? event : EVENT_CLOSE;
-			callHooks(newevent, conn);
-			connectionFree(conn);
-			DEBUG("Connection closed.");
+	}
+}
+
+static void readDeadlineCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	connection* conn	= (connection*) userdata;
+	server* webserver	= conn->webserver;
+
+	if (conn->phase == CONN_PHASE_HEADER) {
+		expireConnection(conn, &webserver->headertimeouts);
+		return;
+	}
+
+	if (conn->phase != CONN_PHASE_BODY) return;
+
+	// hooks pausing the read for backpressure don't count against the client.
+	bool paused = !(bufferevent_get_enabled(conn->buffer) & EV_READ);
+
+	if (!paused && conn->bytesin - conn->inmark < webserver->bodyminrate) {
+		expireConnection(conn, &webserver->bodytimeouts);
+		return;
+	}
+
+	conn->inmark = conn->bytesin;
+	evtimer_add(conn->readdeadline, webserver->rateperiod);
+}
+
+static void writeDeadlineCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	connection* conn	= (connection*) userdata;
+	server* webserver	= conn->webserver;
+
+	// nothing pending, the next response arms the check again.
+	if (evbuffer_get_length(conn->out) == 0 && conn->sendfd < 0) return;
+
+	if (!conn->drained && conn->bytesout - conn->outmark < webserver->sendminrate) {
+		expireConnection(conn, &webserver->sendtimeouts);
+		return;
+	}
+
+	conn->outmark	= conn->bytesout;
+	conn->drained	= false;
+	evtimer_add(conn->writedeadline, webserver->rateperiod);
+}
+
+static void inbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata) {
+
+	connection* conn = (connection*) userdata;
+
+	conn->bytesin += info->n_added;
+}
+
+// the send rate is checked only while a response is pending.
+static void outbufCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata) {
+
+	connection* conn = (connection*) userdata;
+
+	if (info->n_deleted > 0) {
+
+		conn->bytesout += info->n_deleted;
+
+		if (evbuffer_get_length(buffer) == 0) conn->drained = true;
+	}
+
+	if (info->n_added > 0 && info->orig_size == 0 && !evtimer_pending(conn->writedeadline, NULL)) {
+
+		conn->outmark	= conn->bytesout;
+		conn->drained	= false;
+		evtimer_add(conn->writedeadline, conn->webserver->rateperiod);
+	}
+}
+
+/**
+* Close a connection that missed a deadline, same as a read timeout. Pending
+* output is discarded.
+*/
+static void expireConnection(connection* conn, uint64_t* counter) {
+
+	DEBUG("Connection missed its deadline. (phase:%d)", conn->phase);
+
+	(*counter)++;
+
+	conn->status = CLOSE;
+	releaseFile(conn);
+	evbuffer_drain(conn->out, evbuffer_get_length(conn->out));
+
+	connectionCallback(conn, EVENT_CLOSE | EVENT_TIMEOUT);
+}
+
+/**
+* Send as much of the file as the socket takes. Once it's all out the
+* connection goes on as if the out-buffer just drained.
+*/
+static void sendFile(connection* conn) {
+
+	SSL* ssl = bufferevent_openssl_get_ssl(conn->buffer);
+
+	while (conn->sendsize > 0) {
+
+		ssize_t sent = tlsSendFile(ssl, conn->sendfd, conn->sendoffset, conn->sendsize);
+
+		if (sent == 0) {
+			event_add(conn->sendev, NULL);
 			return;
 		}
+
+		if (sent < 0) {
+
+			ERROR("Failed to send file. (%s)", strerror(errno));
+
+			conn->status = CLOSE;
+			releaseFile(conn);
+			evbuffer_drain(conn->out, evbuffer_get_length(conn->out));
+
+			connectionCallback(conn, EVENT_CLOSE);
+			return;
+		}
+
+		conn->sendoffset	+= sent;
+		conn->sendsize		-= sent;
+		conn->bytesout		+= sent;
+	}
+
+	releaseFile(conn);
+
+	// pick up the requests that came in meanwhile.
+	if (conn->status != CLOSE) {
+
+		bufferevent_enable(conn->buffer, EV_READ);
+
+		if (evbuffer_get_length(conn->in) > 0) bufferevent_trigger(conn->buffer, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
 	}
+
+	connectionCallback(conn, EVENT_WRITE);
+}
+
+static void sendFileCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	sendFile((connection*) userdata);
+}
+
+static void releaseFile(connection* conn) {
+
+	if (conn->sendfd < 0) return;
+
+	if (conn->sendev) event_del(conn->sendev);
+
+	close(conn->sendfd);
+
+	conn->sendfd	= -1;
+	conn->sendsize	= 0;
 }
 
 static int callHooks(short event, connection *conn) {
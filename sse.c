@@ -0,0 +1,463 @@
+/**
+ * @abstruct Server-Sent Events library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "sse.h"
+
+// private functions
+static sseChannel*	getChannel(sse* hub, const char* name, bool create);
+static sseEvent*	newEvent(const char* event, const char* id, const char* data, size_t size);
+static void			releaseEvent(const void* data, size_t size, void* userdata);
+static void			unlinkSubscriber(sseSubscriber* sub);
+static void			dropSubscriber(sseSubscriber* sub);
+static void			freeSubscriber(connection* conn, void* userdata);
+static void			heartbeatCallback(evutil_socket_t fd, short what, void* userdata);
+
+/**
+* Create an event hub.
+*
+* @param prefix url prefix serving channels through sseHandler(), NULL to
+* subscribe connections only with sseSubscribe().
+* @param maxbacklog subscribers with more output pending are dropped, 0 for
+* default.
+* @param heartbeat seconds between heartbeats, 0 to disable.
+*
+* @return hub or NULL on failure.
+*/
+sse* sseNew(const char* prefix, size_t maxbacklog, int heartbeat) {
+
+	sse* hub = NEW(sse);
+
+	if (hub == NULL) return NULL;
+
+	hub->maxbacklog	= (maxbacklog > 0) ? maxbacklog : SSE_DEF_MAX_BACKLOG;
+	hub->heartbeat	= (heartbeat > 0) ? heartbeat : 0;
+	hub->channels	= ahashtable(SSE_DEF_NUM_CHANNELS, 0);
+
+	if (hub->channels == NULL) {
+		sseFree(hub);
+		return NULL;
+	}
+
+	if (prefix != NULL) {
+
+		if ((hub->prefix = strdup(prefix)) == NULL) {
+			sseFree(hub);
+			return NULL;
+		}
+
+		// "/events/" and "/events" are the same prefix.
+		hub->prefixlen = strlen(hub->prefix);
+		if (hub->prefixlen > 0 && hub->prefix[hub->prefixlen - 1] == '/') hub->prefix[--hub->prefixlen] = '\0';
+	}
+
+	return hub;
+}
+
+/**
+* Free the hub. Remaining subscribers are disconnected.
+*/
+void sseFree(sse* hub) {
+
+	if (hub == NULL) return;
+
+	while (hub->subscribers) {
+
+		sseSubscriber* sub = hub->subscribers;
+
+		dropSubscriber(sub);
+		sub->hub = NULL;
+	}
+
+	if (hub->heartbeatev)	event_free(hub->heartbeatev);
+
+	if (hub->channels)		hub->channels->free(hub->channels);
+
+	if (hub->prefix)		free(hub->prefix);
+
+	free(hub);
+}
+
+/**
+* Server-Sent Events hook.
+*
+* GET /prefix/name subscribes the connection to channel "name". Subscribed
+* connections are held here, whatever the client sends is discarded.
+*
+* @note
+* Register right after the HTTP handler, hooks in between would see the
+* subscribed connection as a finished request.
+*
+* @code
+* sse* hub = sseNew("/events", 0, SSE_DEF_HEARTBEAT);
+* serverRegisterHook(server, httpHandler, NULL);
+* serverRegisterHook(server, sseHandler, hub);
+* ...
+* ssePublish(hub, "news", "update", NULL, json, jsonlen);
+* @endcode
+*/
+int sseHandler(short event, connection* conn, void* userdata) {
+
+	sse* hub			= (sse*) userdata;
+	sseSubscriber* sub	= (sseSubscriber*) connectionGetProtocol(conn, SSE_PROTOCOL_NAME);
+
+	if (sub != NULL) {
+
+		if (sub->hub != hub) return OK;
+
+		if (event & EVENT_READ) {
+			evbuffer_drain(conn->in, evbuffer_get_length(conn->in));
+			return TAKEOVER;
+		}
+
+		return OK;
+	}
+
+	if (!(event & EVENT_READ) || hub->prefix == NULL || conn->protocol != NULL || httpGetStatus(conn) != HTTP_REQ_DONE) {
+		return OK;
+	}
+
+	http* ahttp			= (http*) connectionGetExtra(conn);
+	const char* path	= ahttp->request.path;
+
+	if (path == NULL || strncmp(path, hub->prefix, hub->prefixlen) || path[hub->prefixlen] != '/' || path[hub->prefixlen + 1] == '\0') {
+		return OK;
+	}
+
+	if (strcmp(ahttp->request.method, "GET")) {
+
+		const char* reason = httpGetReason(HTTP_CODE_METHOD_NOT_ALLOWED);
+
+		httpSetResponseHeader(conn, "Allow", "GET");
+		httpResponse(conn, HTTP_CODE_METHOD_NOT_ALLOWED, "text/plain", reason, strlen(reason));
+
+		return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+	}
+
+	if (sseSubscribe(hub, conn, path + hub->prefixlen + 1)) return CLOSE;
+
+	return TAKEOVER;
+}
+
+/**
+* Turn the request into an event stream of the channel.
+*
+* Sends the response header and hands the connection over to the hub. The
+* calling hook should return TAKEOVER.
+*
+* @return 0 on success, -1 on error.
+*/
+int sseSubscribe(sse* hub, connection* conn, const char* channel) {
+
+	if (conn->protocol != NULL) return -1;
+
+	// bind heartbeat timer to the loop on first use.
+	if (hub->heartbeat > 0 && hub->heartbeatev == NULL) {
+
+		struct timeval tv = { hub->heartbeat, 0 };
+
+		hub->evbase			= conn->webserver->evbase;
+		hub->heartbeatev	= event_new(hub->evbase, -1, EV_PERSIST, heartbeatCallback, hub);
+
+		if (hub->heartbeatev == NULL || event_add(hub->heartbeatev, &tv)) {
+			WARN("Failed to start SSE heartbeat timer.");
+		}
+	}
+
+	sseSubscriber* sub = NEW(sseSubscriber);
+
+	if (sub == NULL) return -1;
+
+	sseChannel* ch = getChannel(hub, channel, true);
+
+	if (ch == NULL) {
+		free(sub);
+		return -1;
+	}
+
+	sub->hub		= hub;
+	sub->channel	= ch;
+	sub->conn		= conn;
+
+	sub->next = ch->first;
+	if (ch->first) ch->first->prev = sub;
+	ch->first = sub;
+	ch->numsubscribers++;
+
+	sub->hubnext = hub->subscribers;
+	if (hub->subscribers) hub->subscribers->hubprev = sub;
+	hub->subscribers = sub;
+	hub->numsubscribers++;
+
+	connectionSetProtocol(conn, SSE_PROTOCOL_NAME, sub, freeSubscriber);
+
+	// no compression, every subscriber references the same event bytes.
+	httpSetResponseCode(conn, HTTP_CODE_OK, httpGetReason(HTTP_CODE_OK));
+	httpSetResponseContent(conn, SSE_CONTENT_TYPE, -1);
+	httpSetResponseHeader(conn, "Cache-Control", "no-cache");
+	httpSetResponseHeader(conn, "X-Accel-Buffering", "no");
+	httpSendHeaderBlock(conn, NULL, 0, -1);
+
+	// subscribers stay quiet, read timeout would drop them.
+	if (conn->parent == NULL) bufferevent_set_timeouts(conn->buffer, NULL, NULL);
+
+	DEBUG("SSE subscribed to %s. %zu subscribers", ch->name, ch->numsubscribers);
+
+	return 0;
+}
+
+/**
+* Publish an event to every subscriber of the channel.
+*
+* The event is serialized once, then referenced from the out-buffer of each
+* subscriber. Subscribers lagging behind more than the backlog limit are
+* dropped, EventSource reconnects them.
+*
+* @param event event type, NULL for default "message".
+* @param id event id, may be NULL.
+* @param data event data, multiple lines are sent as multiple data fields.
+*
+* @return number of subscribers the event was queued for, -1 on error.
+*/
+int ssePublish(sse* hub, const char* channel, const char* event, const char* id, const void* data, size_t size) {
+
+	sseChannel* ch = getChannel(hub, channel, false);
+
+	if (ch == NULL) return 0;
+
+	sseEvent* ev = newEvent(event, id, (const char*) data, size);
+
+	if (ev == NULL) return -1;
+
+	int count = 0;
+	sseSubscriber* next;
+
+	for (sseSubscriber* sub = ch->first; sub != NULL; sub = next) {
+
+		next = sub->next;
+
+		if (evbuffer_get_length(sub->conn->out) > hub->maxbacklog) {
+			WARN("SSE subscriber of %s is too slow, dropping it.", channel);
+			dropSubscriber(sub);
+			continue;
+		}
+
+		// released by the out-buffer, also when queueing fails.
+		ev->refcount++;
+
+		if (httpSendChunkRef(sub->conn, ev->data, ev->size, releaseEvent, ev) == 0) continue;
+
+		sub->active = true;
+		count++;
+	}
+
+	releaseEvent(ev->data, ev->size, ev);
+
+	return count;
+}
+
+/**
+* @return number of subscribers of the channel.
+*/
+size_t sseGetNumSubscribers(sse* hub, const char* channel) {
+
+	sseChannel* ch = getChannel(hub, channel, false);
+
+	return (ch != NULL) ? ch->numsubscribers : 0;
+}
+
+// private functions
+
+static sseChannel* getChannel(sse* hub, const char* name, bool create) {
+
+	sseChannel** found = (sseChannel**) hub->channels->get(hub->channels, name, NULL, false);
+
+	if (found != NULL) return *found;
+
+	if (!create) return NULL;
+
+	sseChannel* ch = NEW(sseChannel);
+
+	if (ch == NULL) return NULL;
+
+	if ((ch->name = strdup(name)) == NULL || !hub->channels->put(hub->channels, name, &ch, sizeof(sseChannel*))) {
+		if (ch->name) free(ch->name);
+		free(ch);
+		return NULL;
+	}
+
+	return ch;
+}
+
+/**
+* Serialize an event in text/event-stream format.
+*
+* @return event with one reference held by the caller, NULL on failure.
+*/
+static sseEvent* newEvent(const char* event, const char* id, const char* data, size_t size) {
+
+	// line breaks would inject fields.
+	if ((event && strpbrk(event, "\r\n")) || (id && strpbrk(id, "\r\n"))) return NULL;
+
+	size_t numlines = 1;
+
+	for (size_t i = 0; i < size; i++) {
+		if (data[i] == '\n') numlines++;
+	}
+
+	size_t total = numlines * STRLEN("data: \n") + size + STRLEN("\n");
+
+	if (id)		total += STRLEN("id: \n") + strlen(id);
+	if (event)	total += STRLEN("event: \n") + strlen(event);
+
+	sseEvent* ev = (sseEvent*) malloc(sizeof(sseEvent) + total);
+
+	if (ev == NULL) return NULL;
+
+	char* p = ev->data;
+
+	if (id)		p += sprintf(p, "id: %s\n", id);
+	if (event)	p += sprintf(p, "event: %s\n", event);
+
+	const char* line	= data;
+	const char* end		= data + size;
+
+	for (;;) {
+
+		const char* eol	= (line < end) ? memchr(line, '\n', end - line) : NULL;
+		size_t len		= (eol ? eol : end) - line;
+
+		// CRLF in data is a single line break too.
+		size_t textlen = (len > 0 && line[len - 1] == '\r') ? len - 1 : len;
+
+		memcpy(p, "data: ", STRLEN("data: "));
+		p += STRLEN("data: ");
+		if (textlen > 0) memcpy(p, line, textlen);
+		p += textlen;
+		*p++ = '\n';
+
+		if (eol == NULL) break;
+
+		line = eol + 1;
+	}
+
+	*p++ = '\n';
+
+	ev->refcount	= 1;
+	ev->size		= p - ev->data;
+
+	return ev;
+}
+
+static void releaseEvent(const void* data, size_t size, void* userdata) {
+
+	sseEvent* ev = (sseEvent*) userdata;
+
+	if (--ev->refcount == 0) free(ev);
+}
+
+/**
+* Detach the subscriber from its channel and the hub, the subscriber itself
+* is freed with the connection.
+*/
+static void unlinkSubscriber(sseSubscriber* sub) {
+
+	sseChannel* ch = sub->channel;
+
+	if (ch == NULL) return;
+
+	if (sub->prev) sub->prev->next = sub->next;
+	else ch->first = sub->next;
+
+	if (sub->next) sub->next->prev = sub->prev;
+
+	sse* hub = sub->hub;
+
+	if (sub->hubprev) sub->hubprev->hubnext = sub->hubnext;
+	else hub->subscribers = sub->hubnext;
+
+	if (sub->hubnext) sub->hubnext->hubprev = sub->hubprev;
+
+	hub->numsubscribers--;
+
+	sub->channel	= NULL;
+	sub->prev		= sub->next		= NULL;
+	sub->hubprev	= sub->hubnext	= NULL;
+
+	// channels live as long as they have subscribers.
+	if (--ch->numsubscribers == 0) {
+		hub->channels->remove(hub->channels, ch->name);
+		free(ch->name);
+		free(ch);
+	}
+}
+
+/**
+* Unsubscribe and disconnect without waiting for the pending output.
+*/
+static void dropSubscriber(sseSubscriber* sub) {
+
+	connection* conn = sub->conn;
+
+	unlinkSubscriber(sub);
+
+	if (conn->parent != NULL) {
+
+		// HTTP/2 stream, discard the backlog and end the stream.
+		evbuffer_drain(conn->out, evbuffer_get_length(conn->out));
+		httpSendChunk(conn, NULL, 0);
+
+	} else {
+
+		connectionClose(conn);
+	}
+}
+
+static void freeSubscriber(connection* conn, void* userdata) {
+
+	sseSubscriber* sub = (sseSubscriber*) userdata;
+
+	unlinkSubscriber(sub);
+
+	free(sub);
+}
+
+/**
+* Send heartbeats to subscribers that got no event since the last tick and
+* drop the ones that stopped reading.
+*/
+static void heartbeatCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	sse* hub = (sse*) userdata;
+	sseSubscriber* next;
+
+	for (sseSubscriber* sub = hub->subscribers; sub != NULL; sub = next) {
+
+		next = sub->hubnext;
+
+		if (evbuffer_get_length(sub->conn->out) > hub->maxbacklog) {
+			WARN("SSE subscriber of %s is too slow, dropping it.", sub->channel->name);
+			dropSubscriber(sub);
+			continue;
+		}
+
+		if (sub->active) {
+			sub->active = false;
+			continue;
+		}
+
+		httpSendChunkRef(sub->conn, SSE_HEARTBEAT, STRLEN(SSE_HEARTBEAT), NULL, NULL);
+	}
+}
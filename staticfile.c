@@ -0,0 +1,766 @@
+/**
+ * @abstruct static file serving module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+#include "http.h"
+#include "staticfile.h"
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#define INOTIFY_MASK		(IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static const struct {
+	const char* ext;
+	const char* mimetype;
+} mimetypes[] = {
+	{ "html",	"text/html" },
+	{ "htm",	"text/html" },
+	{ "css",	"text/css" },
+	{ "js",		"application/javascript" },
+	{ "json",	"application/json" },
+	{ "xml",	"application/xml" },
+	{ "txt",	"text/plain" },
+	{ "csv",	"text/csv" },
+	{ "png",	"image/png" },
+	{ "jpg",	"image/jpeg" },
+	{ "jpeg",	"image/jpeg" },
+	{ "gif",	"image/gif" },
+	{ "svg",	"image/svg+xml" },
+	{ "ico",	"image/x-icon" },
+	{ "webp",	"image/webp" },
+	{ "woff",	"font/woff" },
+	{ "woff2",	"font/woff2" },
+	{ "ttf",	"font/ttf" },
+	{ "pdf",	"application/pdf" },
+	{ "zip",	"application/zip" },
+	{ "gz",		"application/gzip" },
+	{ "mp4",	"video/mp4" },
+	{ "mp3",	"audio/mpeg" },
+	{ "wasm",	"application/wasm" },
+	{ NULL,		NULL }
+};
+
+// private functions
+static staticfileEntry*	lookupEntry(staticfile* sf, const char* path);
+static staticfileEntry*	loadEntry(staticfile* sf, const char* path);
+static void				evictEntry(staticfile* sf, staticfileEntry* entry);
+static void				touchEntry(staticfile* sf, staticfileEntry* entry);
+static void				inotifyCallback(evutil_socket_t fd, short what, void* userdata);
+static bool				hasDotSegment(const char* path);
+static bool				isNotModified(connection* conn, staticfileEntry* entry);
+static int				parseRange(const char* value, off_t size, off_t* start, off_t* end);
+static int				sendError(connection* conn, int code);
+
+/**
+* Create a static file mount.
+*
+* @param prefix url prefix to be served. ex) /static
+* @param docroot directory that prefix is mapped to. ex) /var/www/static
+* @param maxentries maximum number of open files to keep. 0 for default.
+*
+* @return newly allocated staticfile object or NULL on failure.
+*
+* @code
+* staticfile* sf = staticFileNew("/static", "/var/www/static", 0);
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, staticFileHandler, sf);
+* @endcode
+*/
+staticfile* staticFileNew(const char* prefix, const char* docroot, size_t maxentries) {
+
+	if (prefix == NULL || docroot == NULL || prefix[0] != '/') {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	staticfile* sf = NEW(staticfile);
+
+	if (sf == NULL) return NULL;
+
+	sf->prefix		= strdup(prefix);
+	sf->docroot		= strdup(docroot);
+	sf->index		= strdup(STATICFILE_DEF_INDEX);
+	sf->maxentries	= (maxentries > 0) ? maxentries : STATICFILE_DEF_MAXENTRIES;
+	sf->entries		= ahashtable(sf->maxentries, 0);
+	sf->watches		= ahashtable(sf->maxentries, 0);
+	sf->inotifyfd	= -1;
+	sf->rootfd		= -1;
+
+	if (sf->prefix == NULL || sf->docroot == NULL || sf->index == NULL || sf->entries == NULL || sf->watches == NULL) {
+		staticFileFree(sf);
+		return NULL;
+	}
+
+	// "/static/" and "/static" are the same mount, "/" becomes empty prefix.
+	sf->prefixlen = strlen(sf->prefix);
+	if (sf->prefix[sf->prefixlen - 1] == '/') sf->prefix[--sf->prefixlen] = '\0';
+
+	size_t rootlen = strlen(sf->docroot);
+	while (rootlen > 1 && sf->docroot[rootlen - 1] == '/') sf->docroot[--rootlen] = '\0';
+
+	// files are opened beneath the docroot, see staticFileOpen().
+	char realroot[PATH_MAX];
+
+	sf->realroot	= strdup((realpath(sf->docroot, realroot) != NULL) ? realroot : sf->docroot);
+	sf->rootfd		= open(sf->docroot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	if (sf->realroot == NULL) {
+		staticFileFree(sf);
+		return NULL;
+	}
+
+	// inotify is optional, without it cached stat() is revalidated periodically.
+	sf->inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (sf->inotifyfd < 0) {
+		WARN("inotify is not available, falling back to periodic stat(). (errno:%d)", errno);
+	}
+
+	return sf;
+}
+
+/**
+* Set index file name served on directory requests. NULL disables it.
+*/
+void staticFileSetIndex(staticfile* sf, const char* index) {
+
+	if (sf->index) free(sf->index);
+
+	sf->index = (index) ? strdup(index) : NULL;
+}
+
+/**
+* Release static file mount and close all the cached files.
+*
+* @note
+* Files still being sent are closed when libevent drops its last reference.
+*/
+void staticFileFree(staticfile* sf) {
+
+	if (sf == NULL) return;
+
+	while (sf->first) evictEntry(sf, sf->first);
+
+	if (sf->inotifyev)	event_free(sf->inotifyev);
+
+	if (sf->inotifyfd >= 0) close(sf->inotifyfd);
+
+	if (sf->rootfd >= 0)	close(sf->rootfd);
+
+	if (sf->entries)	sf->entries->free(sf->entries);
+
+	if (sf->watches)	sf->watches->free(sf->watches);
+
+	if (sf->prefix)		free(sf->prefix);
+
+	if (sf->docroot)	free(sf->docroot);
+
+	if (sf->realroot)	free(sf->realroot);
+
+	if (sf->index)		free(sf->index);
+
+	free(sf);
+}
+
+/**
+* Static file hook.
+*
+* Serves GET and HEAD requests under the mounted prefix. Requests outside of
+* the prefix are escalated to the next hook.
+*
+* @note
+* This hook must be registered after httpHandler.
+*/
+int staticFileHandler(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) {
+		return OK;
+	}
+
+	staticfile* sf	= (staticfile*) userdata;
+	http* ahttp		= (http*) connectionGetExtra(conn);
+	const char* uri	= ahttp->request.path;
+
+	if (!staticFileMatch(sf, uri)) {
+		return OK;
+	}
+
+	bool head = !strcmp(ahttp->request.method, "HEAD");
+
+	if (!head && strcmp(ahttp->request.method, "GET")) {
+
+		httpSetResponseHeader(conn, "Allow", "GET, HEAD");
+		return sendError(conn, HTTP_CODE_METHOD_NOT_ALLOWED);
+	}
+
+	// bind inotify to the loop on first use.
+	if (sf->inotifyfd >= 0 && sf->inotifyev == NULL) {
+
+		sf->evbase		= conn->webserver->evbase;
+		sf->inotifyev	= event_new(sf->evbase, sf->inotifyfd, EV_READ | EV_PERSIST, inotifyCallback, sf);
+
+		if (sf->inotifyev == NULL || event_add(sf->inotifyev, NULL)) {
+			WARN("Failed to watch inotify events, falling back to periodic stat().");
+			close(sf->inotifyfd);
+			sf->inotifyfd = -1;
+		}
+	}
+
+	char filepath[PATH_MAX + 1];
+	int mapstatus = staticFileMapPath(sf, uri, filepath, sizeof(filepath));
+
+	if (mapstatus != 0) {
+		return sendError(conn, mapstatus);
+	}
+
+	staticfileEntry* entry = lookupEntry(sf, filepath);
+
+	if (entry == NULL && errno == EISDIR && sf->index != NULL) {
+
+		int pathlen = snprintf(filepath + strlen(filepath), sizeof(filepath) - strlen(filepath), "/%s", sf->index);
+
+		if (pathlen < 0 || strlen(filepath) >= PATH_MAX) {
+			return sendError(conn, HTTP_CODE_REQUEST_URI_TOO_LONG);
+		}
+
+		entry = lookupEntry(sf, filepath);
+	}
+
+	if (entry == NULL) {
+
+		switch (errno) {
+			case ENOENT:
+			case ENOTDIR:
+				return sendError(conn, HTTP_CODE_NOT_FOUND);
+
+			case EACCES:
+			case EISDIR:
+				return sendError(conn, HTTP_CODE_FORBIDDEN);
+
+			default:
+				return sendError(conn, HTTP_CODE_INTERNAL_SERVER_ERROR);
+		}
+	}
+
+	// common response headers
+	if (httpGetResponseHeader(conn, "Connection") == NULL) {
+
+		httpSetResponseHeader(conn, "Connection", (httpIsKeepaliveRequest(conn)) ? "Keep-Alive" : "close");
+	}
+
+	httpSetResponseHeader(conn, "Last-Modified", entry->lastmodified);
+	httpSetResponseHeader(conn, "ETag", entry->etag);
+	httpSetResponseHeader(conn, "Accept-Ranges", "bytes");
+
+	// conditional request
+	if (isNotModified(conn, entry)) {
+
+		httpSetResponseCode(conn, HTTP_CODE_NOT_MODIFIED, httpGetReason(HTTP_CODE_NOT_MODIFIED));
+		httpSendHeader(conn);
+
+		return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+	}
+
+	// range request
+	off_t size	= entry->st.st_size;
+	off_t start	= 0;
+	off_t end	= size - 1;
+	int code	= HTTP_CODE_OK;
+
+	const char* range	= httpGetRequestHeader(conn, "Range");
+	const char* ifrange	= httpGetRequestHeader(conn, "If-Range");
+
+	if (range != NULL && (ifrange == NULL || !strcmp(ifrange, entry->etag) || !strcmp(ifrange, entry->lastmodified))) {
+
+		int rangestatus = parseRange(range, size, &start, &end);
+
+		if (rangestatus < 0) {
+
+			char contentrange[64];
+			snprintf(contentrange, sizeof(contentrange), "bytes */%jd", (intmax_t) size);
+			httpSetResponseHeader(conn, "Content-Range", contentrange);
+
+			return sendError(conn, HTTP_CODE_RANGE_NOT_SATISFIABLE);
+
+		} else if (rangestatus > 0) {
+
+			char contentrange[64];
+			snprintf(contentrange, sizeof(contentrange), "bytes %jd-%jd/%jd", (intmax_t) start, (intmax_t) end, (intmax_t) size);
+			httpSetResponseHeader(conn, "Content-Range", contentrange);
+
+			code = HTTP_CODE_PARTIAL_CONTENT;
+		}
+	}
+
+	off_t length = (size > 0) ? (end - start + 1) : 0;
+
+	httpSetResponseCode(conn, code, httpGetReason(code));
+	httpSetResponseContent(conn, entry->mimetype, length);
+
+	if (head || length == 0) {
+
+		httpSendHeader(conn);
+
+	} else if (httpSendFileSegment(conn, entry->seg, entry->fd, start, length) == 0) {
+
+		ERROR("Failed to add file to out-buffer. (%s)", entry->path);
+		return CLOSE;
+	}
+
+	return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+}
+
+/**
+* Check whether the path is under the mounted prefix.
+*/
+bool staticFileMatch(staticfile* sf, const char* path) {
+
+	return (!strncmp(path, sf->prefix, sf->prefixlen) && (path[sf->prefixlen] == '\0' || path[sf->prefixlen] == '/'));
+}
+
+/**
+* Map the request path to the file path under docroot.
+*
+* @param path decoded request path under the prefix.
+* @param filepath buffer to store the file path.
+*
+* @return 0 on success, otherwise HTTP response code to answer.
+*/
+int staticFileMapPath(staticfile* sf, const char* path, char* filepath, size_t size) {
+
+	// path is decoded and corrected already.
+	const char* relpath = path + sf->prefixlen;
+
+	if (relpath[0] != '\0' && (isValidPathname(relpath) == false || hasDotSegment(relpath))) {
+		return HTTP_CODE_FORBIDDEN;
+	}
+
+	int pathlen = snprintf(filepath, size, "%s%s", sf->docroot, relpath);
+
+	if (pathlen < 0 || pathlen >= PATH_MAX || (size_t) pathlen >= size) {
+		return HTTP_CODE_REQUEST_URI_TOO_LONG;
+	}
+
+	correctPathname(filepath);
+
+	return 0;
+}
+
+/**
+* Open a file mapped by staticFileMapPath() for reading.
+*
+* Symbolic links are followed only if they stay in the docroot, whatever
+* component of the path they are. The kernel resolves the path beneath the
+* docroot with openat2(). Absolute links, which openat2() refuses even into
+* the docroot, and kernels without it get every component resolved and
+* checked with realpath().
+*
+* @return file descriptor, -1 on error with errno set, EACCES for paths
+* leading out of the docroot.
+*/
+int staticFileOpen(staticfile* sf, const char* path) {
+
+	size_t rootlen = strlen(sf->docroot);
+
+	if (strncmp(path, sf->docroot, rootlen) || (path[rootlen] != '/' && path[rootlen] != '\0' && rootlen > 1)) {
+		errno = EACCES;
+		return -1;
+	}
+
+#ifdef SYS_openat2
+	if (sf->rootfd >= 0) {
+
+		const char* relpath = path + rootlen;
+
+		while (*relpath == '/') relpath++;
+
+		struct open_how how;
+		bzero((void*) &how, sizeof(how));
+		how.flags	= O_RDONLY | O_CLOEXEC;
+		how.resolve	= RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+		int fd = syscall(SYS_openat2, sf->rootfd, (*relpath != '\0') ? relpath : ".", &how, sizeof(how));
+
+		if (fd >= 0) return fd;
+
+		if (errno == ELOOP) errno = EACCES;
+
+		if (errno != ENOSYS && errno != EXDEV) return -1;
+	}
+#endif
+
+	char realpathbuf[PATH_MAX];
+	size_t reallen = strlen(sf->realroot);
+
+	if (realpath(path, realpathbuf) == NULL) return -1;
+
+	if (strncmp(realpathbuf, sf->realroot, reallen)
+	|| (realpathbuf[reallen] != '/' && realpathbuf[reallen] != '\0' && reallen > 1)) {
+		errno = EACCES;
+		return -1;
+	}
+
+	return open(realpathbuf, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+}
+
+/**
+* Guess content type from the file extension.
+*
+* @return mime type string, HTTP_DEF_CONTENT_TYPE if unknown.
+*/
+const char* staticFileGetMimetype(const char* path) {
+
+	const char* ext = strrchr(path, '.');
+
+	if (ext == NULL || strchr(ext, '/') != NULL) return HTTP_DEF_CONTENT_TYPE;
+
+	ext++;
+
+	for (int i = 0; mimetypes[i].ext != NULL; i++) {
+		if (!strcasecmp(ext, mimetypes[i].ext)) return mimetypes[i].mimetype;
+	}
+
+	return HTTP_DEF_CONTENT_TYPE;
+}
+
+// private functions
+
+/**
+* Find cached entry or open the file.
+*
+* @return entry or NULL with errno set. EISDIR for directories.
+*/
+static staticfileEntry* lookupEntry(staticfile* sf, const char* path) {
+
+	staticfileEntry** found = (staticfileEntry**) sf->entries->get(sf->entries, path, NULL, false);
+
+	if (found != NULL) {
+
+		staticfileEntry* entry = *found;
+
+		// entries without a watch trust their stat() only for a while.
+		time_t now = time(NULL);
+
+		if (entry->wd < 0 && now - entry->checked >= STATICFILE_DEF_VALIDITY) {
+
+			struct stat st;
+
+			if (stat(path, &st) != 0 || st.st_ino != entry->st.st_ino || st.st_size != entry->st.st_size
+			|| st.st_mtime != entry->st.st_mtime) {
+
+				DEBUG("Stale static file entry. %s", path);
+				evictEntry(sf, entry);
+				return loadEntry(sf, path);
+			}
+
+			entry->checked = now;
+		}
+
+		touchEntry(sf, entry);
+
+		return entry;
+	}
+
+	return loadEntry(sf, path);
+}
+
+static staticfileEntry* loadEntry(staticfile* sf, const char* path) {
+
+	int fd = staticFileOpen(sf, path);
+
+	if (fd < 0) return NULL;
+
+	staticfileEntry* entry = NEW(staticfileEntry);
+
+	if (entry == NULL) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	entry->wd = -1;
+	entry->fd = -1;
+
+	if (fstat(fd, &entry->st) != 0) goto error;
+
+	if (S_ISDIR(entry->st.st_mode)) {
+		errno = EISDIR;
+		goto error;
+	}
+
+	if (!S_ISREG(entry->st.st_mode)) {
+		errno = EACCES;
+		goto error;
+	}
+
+	entry->path = strdup(path);
+	if (entry->path == NULL) goto error;
+
+	// the segment owns fd from here, and closes it after the last send is done.
+	if (entry->st.st_size > 0) {
+
+		entry->seg = evbuffer_file_segment_new(fd, 0, entry->st.st_size, EVBUF_FS_CLOSE_ON_FREE | EVBUF_FS_DISABLE_LOCKING);
+		if (entry->seg == NULL) goto error;
+
+		entry->fd = fd;
+
+	} else {
+
+		close(fd);
+	}
+
+	fd = -1;
+
+	struct tm tm;
+	gmtime_r(&entry->st.st_mtime, &tm);
+	strftime(entry->lastmodified, sizeof(entry->lastmodified), HTTP_DATE_FORMAT, &tm);
+
+	snprintf(entry->etag, sizeof(entry->etag), "\"%jx-%jx-%jx\"",
+		(uintmax_t) entry->st.st_ino, (uintmax_t) entry->st.st_mtime, (uintmax_t) entry->st.st_size);
+
+	entry->mimetype	= staticFileGetMimetype(path);
+	entry->checked	= time(NULL);
+
+	// watch the file, two paths to the same inode share a watch so only the first one gets it.
+	if (sf->inotifyev != NULL) {
+
+		int wd = inotify_add_watch(sf->inotifyfd, path, INOTIFY_MASK);
+
+		if (wd >= 0) {
+
+			char wdkey[16];
+			snprintf(wdkey, sizeof(wdkey), "%d", wd);
+
+			if (sf->watches->get(sf->watches, wdkey, NULL, false) == NULL) {
+				sf->watches->put(sf->watches, wdkey, &entry, sizeof(staticfileEntry*));
+				entry->wd = wd;
+			}
+		}
+	}
+
+	sf->entries->put(sf->entries, path, &entry, sizeof(staticfileEntry*));
+
+	// link at the head of LRU
+	entry->prev = NULL;
+	entry->next = sf->first;
+
+	if (sf->first) sf->first->prev = entry;
+	else sf->last = entry;
+
+	sf->first = entry;
+	sf->numentries++;
+
+	while (sf->numentries > sf->maxentries && sf->last != entry) {
+		evictEntry(sf, sf->last);
+	}
+
+	DEBUG("Cached static file. %s (size:%jd, wd:%d)", path, (intmax_t) entry->st.st_size, entry->wd);
+
+	return entry;
+
+	error:
+		if (fd >= 0) close(fd);
+		if (entry->path) free(entry->path);
+		free(entry);
+		return NULL;
+}
+
+static void evictEntry(staticfile* sf, staticfileEntry* entry) {
+
+	if (entry->wd >= 0) {
+
+		char wdkey[16];
+		snprintf(wdkey, sizeof(wdkey), "%d", entry->wd);
+		sf->watches->remove(sf->watches, wdkey);
+		inotify_rm_watch(sf->inotifyfd, entry->wd);
+	}
+
+	sf->entries->remove(sf->entries, entry->path);
+
+	if (entry->prev) entry->prev->next = entry->next;
+	else sf->first = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else sf->last = entry->prev;
+
+	sf->numentries--;
+
+	if (entry->seg) evbuffer_file_segment_free(entry->seg);
+
+	free(entry->path);
+	free(entry);
+}
+
+static void touchEntry(staticfile* sf, staticfileEntry* entry) {
+
+	if (sf->first == entry) return;
+
+	// unlink
+	entry->prev->next = entry->next;
+
+	if (entry->next) entry->next->prev = entry->prev;
+	else sf->last = entry->prev;
+
+	// link at the head
+	entry->prev			= NULL;
+	entry->next			= sf->first;
+	sf->first->prev		= entry;
+	sf->first			= entry;
+}
+
+static void inotifyCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	staticfile* sf = (staticfile*) userdata;
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+
+		for (char* ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*) ptr)->len) {
+
+			const struct inotify_event* ev = (const struct inotify_event*) ptr;
+
+			char wdkey[16];
+			snprintf(wdkey, sizeof(wdkey), "%d", ev->wd);
+
+			staticfileEntry** found = (staticfileEntry**) sf->watches->get(sf->watches, wdkey, NULL, false);
+
+			if (found != NULL) {
+				DEBUG("Static file changed. %s (mask:0x%x)", (*found)->path, ev->mask);
+				evictEntry(sf, *found);
+			}
+		}
+	}
+}
+
+/**
+* check ".." segments which isValidPathname() lets through.
+*/
+static bool hasDotSegment(const char* path) {
+
+	for (const char* seg = path; seg != NULL; seg = strchr(seg + 1, '/')) {
+
+		const char* name = (*seg == '/') ? seg + 1 : seg;
+
+		if (name[0] == '.' && name[1] == '.' && (name[2] == '/' || name[2] == '\0')) return true;
+	}
+
+	return false;
+}
+
+/**
+* Evaluate If-None-Match and If-Modified-Since.
+*/
+static bool isNotModified(connection* conn, staticfileEntry* entry) {
+
+	const char* ifnonematch = httpGetRequestHeader(conn, "If-None-Match");
+
+	// If-None-Match takes precedence over If-Modified-Since.
+	if (ifnonematch != NULL) {
+
+		if (!strcmp(ifnonematch, "*")) return true;
+
+		size_t etaglen = strlen(entry->etag);
+
+		for (const char* tag = strstr(ifnonematch, entry->etag); tag != NULL; tag = strstr(tag + 1, entry->etag)) {
+
+			// weak comparison, W/"..." matches as well.
+			char next = tag[etaglen];
+
+			if (next == '\0' || next == ',' || next == ' ' || next == '\t') return true;
+		}
+
+		return false;
+	}
+
+	const char* ifmodifiedsince = httpGetRequestHeader(conn, "If-Modified-Since");
+
+	if (ifmodifiedsince != NULL) {
+
+		struct tm tm;
+		bzero((void*) &tm, sizeof(tm));
+
+		if (strptime(ifmodifiedsince, HTTP_DATE_FORMAT, &tm) == NULL) return false;
+
+		return (entry->st.st_mtime <= timegm(&tm));
+	}
+
+	return false;
+}
+
+/**
+* Parse single byte range. Multiple ranges are served as a whole.
+*
+* @return 1 if range is set, 0 to ignore Range header, -1 if not satisfiable.
+*/
+static int parseRange(const char* value, off_t size, off_t* start, off_t* end) {
+
+	if (strncasecmp(value, "bytes=", STRLEN("bytes=")) || strchr(value, ',') != NULL) return 0;
+
+	const char* spec = value + STRLEN("bytes=");
+	char* tmp;
+
+	if (*spec == '-') { // suffix range ex) bytes=-500
+
+		long long suffix = strtoll(spec + 1, &tmp, 10);
+		if (tmp == spec + 1 || *tmp != '\0' || suffix < 0) return 0;
+		if (suffix == 0 || size == 0) return -1;
+
+		*start	= (suffix < size) ? size - suffix : 0;
+		*end	= size - 1;
+
+		return 1;
+	}
+
+	long long first = strtoll(spec, &tmp, 10);
+	if (tmp == spec || *tmp != '-' || first < 0) return 0;
+
+	spec = tmp + 1;
+
+	long long last = size - 1;
+
+	if (*spec != '\0') {
+		last = strtoll(spec, &tmp, 10);
+		if (tmp == spec || *tmp != '\0' || last < first) return 0;
+	}
+
+	if (first >= size) return -1;
+
+	*start	= first;
+	*end	= (last < size) ? last : size - 1;
+
+	return 1;
+}
+
+static int sendError(connection* conn, int code) {
+
+	const char* reason = httpGetReason(code);
+	httpResponse(conn, code, "text/plain", reason, strlen(reason));
+
+	return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+}
@@ -0,0 +1,381 @@
+/**
+ * @abstruct server module double for tests
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * Stands in for server.c so protocol modules can be tested without sockets
+ * or a running loop. A connection is one end of a bufferevent pair, the test
+ * plays the client on the other end. Data moves between the ends right away
+ * as long as the connection reads, so a module pausing the read holds the
+ * client back as a socket would. Hooks run in the order they were
+ * registered, like the real hook chain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "common.h"
+#include "hashtable.h"
+#include "server.h"
+#include "double_server.h"
+
+#define TEST_MAX_HOOKS	(16)
+
+int g_log_level = 0;
+
+static struct {
+	callback	cb;
+	void*		userdata;
+} hooks[TEST_MAX_HOOKS];
+
+static int numhooks = 0;
+
+// private functions
+static int		callHooks(short event, connection* conn);
+static void		resetConnection(connection* conn);
+
+server* serverNew(void) {
+
+	server* webserver = NEW(server);
+
+	if (webserver == NULL) return NULL;
+
+	webserver->evbase	= event_base_new();
+	webserver->options	= ahashtable(0, 0);
+
+	const char* options[][2] = SERVER_OPTIONS;
+
+	for (int i = 0; options[i][0][0] != '\0'; i++) {
+		webserver->options->putstr(webserver->options, options[i][0], options[i][1]);
+	}
+
+	numhooks = 0;
+
+	return webserver;
+}
+
+void serverFree(server* webserver) {
+
+	webserver->options->free(webserver->options);
+	event_base_free(webserver->evbase);
+	free(webserver);
+}
+
+void serverSetOption(server* webserver, const char* key, const char* value) {
+
+	webserver->options->putstr(webserver->options, key, value);
+}
+
+char* serverGetOptionAsString(server* webserver, const char* key) {
+
+	return webserver->options->getstr(webserver->options, key, false);
+}
+
+int serverGetOptionAsInt(server* webserver, const char* key) {
+
+	char* value = serverGetOptionAsString(webserver, key);
+	return (value) ? atoi(value) : 0;
+}
+
+void serverRegisterHook(server* webserver, callback cb, void* userdata) {
+
+	if (numhooks == TEST_MAX_HOOKS) abort();
+
+	hooks[numhooks].cb			= cb;
+	hooks[numhooks].userdata	= userdata;
+	numhooks++;
+}
+
+void* connectionSetUserdata(connection* conn, const void* userdata, callback_free_userdata free_cb) {
+
+	void* prev = conn->userdata[0];
+
+	conn->userdata[0]			= (void*) userdata;
+	conn->userdata_free_cb[0]	= free_cb;
+
+	return prev;
+}
+
+void* connectionGetUserdata(connection* conn) {
+
+	return conn->userdata[0];
+}
+
+void* connectionSetExtra(connection* conn, const void* extra, callback_free_userdata free_cb) {
+
+	void* prev = conn->userdata[1];
+
+	conn->userdata[1]			= (void*) extra;
+	conn->userdata_free_cb[1]	= free_cb;
+
+	return prev;
+}
+
+void* connectionGetExtra(connection* conn) {
+
+	return conn->userdata[1];
+}
+
+int connectionSetHookData(connection* conn, const void* owner, void* data) {
+
+	int freeslot = -1;
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) {
+
+			if (data == NULL) conn->hookdata[i].owner = NULL;
+
+			conn->hookdata[i].data = data;
+			return 0;
+		}
+
+		if (freeslot < 0 && conn->hookdata[i].owner == NULL) freeslot = i;
+	}
+
+	if (data == NULL) return 0;
+	if (freeslot < 0) return -1;
+
+	conn->hookdata[freeslot].owner	= owner;
+	conn->hookdata[freeslot].data	= data;
+
+	return 0;
+}
+
+void* connectionGetHookData(connection* conn, const void* owner) {
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) return conn->hookdata[i].data;
+	}
+
+	return NULL;
+}
+
+char* connectionSetMethod(connection* conn, char* method) {
+
+	char* prev = conn->method;
+
+	conn->method = (method) ? strdup(method) : NULL;
+
+	return prev;
+}
+
+const struct sockaddr* connectionGetPeer(connection* conn, socklen_t* len) {
+
+	if (conn->peerlen == 0) return NULL;
+
+	if (len) *len = conn->peerlen;
+
+	return (const struct sockaddr*) &conn->peer;
+}
+
+void connectionSetPhase(connection* conn, enum connection_phase_e phase) {
+
+	conn->phase = phase;
+}
+
+connection* connectionNewStream(connection* parent, struct evbuffer* in, struct evbuffer* out) {
+
+	connection* conn = NEW(connection);
+
+	if (conn == NULL) return NULL;
+
+	conn->webserver	= parent->webserver;
+	conn->buffer	= parent->buffer;
+	conn->in		= in;
+	conn->out		= out;
+	conn->parent	= parent;
+	conn->peer		= parent->peer;
+	conn->peerlen	= parent->peerlen;
+	conn->sendfd	= -1;
+
+	return conn;
+}
+
+void connectionFreeStream(connection* conn) {
+
+	if (conn == NULL) return;
+
+	callHooks(EVENT_CLOSE, conn);
+	resetConnection(conn);
+
+	if (conn->session && conn->session_free_cb) {
+		conn->session_free_cb(conn, conn->session);
+	}
+
+	free(conn);
+}
+
+int connectionCallHooks(connection* conn, short event) {
+
+	return callHooks(event, conn);
+}
+
+void connectionSetProtocol(connection* conn, const char* protocol, void* session, callback_free_userdata free_cb) {
+
+	conn->protocol			= protocol;
+	conn->session			= session;
+	conn->session_free_cb	= free_cb;
+}
+
+void* connectionGetProtocol(connection* conn, const char* protocol) {
+
+	if (conn->protocol == NULL || strcmp(conn->protocol, protocol)) return NULL;
+
+	return conn->session;
+}
+
+int connectionSendFile(connection* conn, int fd, off_t offset, size_t size) {
+
+	return -1;
+}
+
+int connectionResume(connection* conn) {
+
+	return (conn->parent != NULL || conn->status == CLOSE) ? -1 : 0;
+}
+
+void connectionClose(connection* conn) {
+
+	conn->status = CLOSE;
+}
+
+/**
+* Create a connection of the server, hooks are called with EVENT_INIT.
+*/
+connection* testConnectionNew(server* webserver) {
+
+	struct bufferevent* pair[2];
+
+	if (bufferevent_pair_new(webserver->evbase, 0, pair) != 0) return NULL;
+
+	bufferevent_enable(pair[0], EV_READ);
+
+	connection* conn = NEW(connection);
+
+	if (conn == NULL) abort();
+
+	conn->webserver	= webserver;
+	conn->buffer	= pair[0];
+	conn->in		= bufferevent_get_input(pair[0]);
+	conn->out		= bufferevent_get_output(pair[0]);
+	conn->sendfd	= -1;
+
+	conn->status = callHooks(EVENT_INIT, conn);
+
+	return conn;
+}
+
+/**
+* Send data from the client and run the hooks with EVENT_READ.
+*
+* @return status of the hook chain.
+*/
+int testConnectionRead(connection* conn, const void* data, size_t size) {
+
+	if (size > 0) bufferevent_write(bufferevent_pair_get_partner(conn->buffer), data, size);
+
+	return callHooks(EVENT_READ, conn);
+}
+
+/**
+* Take what was written to the connection so far.
+*
+* @return nul terminated copy of the output, free it after use.
+*/
+char* testConnectionOutput(connection* conn) {
+
+	struct evbuffer* buf = evbuffer_new();
+
+	if (buf == NULL) abort();
+
+	size_t size = testConnectionOutputBuffer(conn, buf);
+	char* out = malloc(size + 1);
+
+	if (out == NULL) abort();
+
+	evbuffer_remove(buf, out, size);
+	out[size] = '\0';
+
+	evbuffer_free(buf);
+
+	return out;
+}
+
+/**
+* Move what was written to the connection so far to a buffer, for binary
+* protocols.
+*
+* @return bytes moved.
+*/
+size_t testConnectionOutputBuffer(connection* conn, struct evbuffer* buf) {
+
+	struct bufferevent* partner = bufferevent_pair_get_partner(conn->buffer);
+
+	bufferevent_enable(partner, EV_READ);
+	bufferevent_disable(partner, EV_READ);
+
+	struct evbuffer* in = bufferevent_get_input(partner);
+	size_t size = evbuffer_get_length(in);
+
+	evbuffer_remove_buffer(in, buf, size);
+
+	return size;
+}
+
+/**
+* Close the connection, hooks are called with EVENT_CLOSE.
+*/
+void testConnectionFree(connection* conn) {
+
+	callHooks(EVENT_CLOSE, conn);
+	resetConnection(conn);
+
+	if (conn->session && conn->session_free_cb) {
+		conn->session_free_cb(conn, conn->session);
+	}
+
+	struct bufferevent* partner = bufferevent_pair_get_partner(conn->buffer);
+
+	bufferevent_free(conn->buffer);
+	if (partner) bufferevent_free(partner);
+
+	free(conn);
+}
+
+// private functions
+
+static int callHooks(short event, connection* conn) {
+
+	for (int i = 0; i < numhooks; i++) {
+
+		int status = hooks[i].cb(event, conn, hooks[i].userdata);
+		if (status != OK) return status;
+	}
+
+	return OK;
+}
+
+static void resetConnection(connection* conn) {
+
+	for (int i = 0; i < NUM_USER_DATA; i++) {
+
+		if (conn->userdata[i] && conn->userdata_free_cb[i]) {
+			conn->userdata_free_cb[i](conn, conn->userdata[i]);
+		}
+
+		conn->userdata[i] = NULL;
+	}
+
+	if (conn->method) {
+		free(conn->method);
+		conn->method = NULL;
+	}
+
+	memset(conn->hookdata, 0, sizeof(conn->hookdata));
+}
@@ -0,0 +1,28 @@
+/**
+ * @abstruct server module double for tests
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#ifndef __double_server_h__
+#define __double_server_h__
+
+#include <stddef.h>
+#include <event2/buffer.h>
+
+#include "server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// public functions
+extern connection*	testConnectionNew(server* webserver);
+extern int			testConnectionRead(connection* conn, const void* data, size_t size);
+extern char*		testConnectionOutput(connection* conn);
+extern size_t		testConnectionOutputBuffer(connection* conn, struct evbuffer* buf);
+extern void			testConnectionFree(connection* conn);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,37 @@
+/**
+ * @abstruct minimal test helpers
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * Each test is a program of its own, built from the repository root with
+ * the modules it covers, ex)
+ * gcc -std=gnu11 -iquote include -o test_vhost test/test_vhost.c vhost.c hashtable.c list.c
+ * Modules running on connections link test/double_server.c in place of
+ * server.c, see the build line at the top of each test.
+ * It prints the failed checks and exits with 1 if any.
+ */
+
+#ifndef __test_h__
+#define __test_h__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static int g_test_failures = 0;
+
+#define CHECK(c) do { \
+		if (!(c)) { \
+			fprintf(stderr, "[FAIL] %s:%d: %s\n", __FILE__, __LINE__, #c); \
+			g_test_failures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT() ((g_test_failures == 0) ? (printf("[PASS] %s\n", __FILE__), 0) : 1)
+
+#ifdef __cplusplus
+}
+#endif
+#endif
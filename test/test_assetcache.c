@@ -0,0 +1,143 @@
+/**
+ * @abstruct asset cache path escape test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_assetcache test/test_assetcache.c test/double_server.c \
+ *     assetcache.c staticfile.c http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "staticfile.h"
+#include "assetcache.h"
+#include "test.h"
+#include "double_server.h"
+
+static char base[PATH_MAX];
+
+static void makePath(const char* name, const char* content, const char* target) {
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	if (target != NULL) {
+		if (symlink(target, path) != 0) abort();
+		return;
+	}
+
+	if (content == NULL) {
+		if (mkdir(path, 0700) != 0) abort();
+		return;
+	}
+
+	FILE* fp = fopen(path, "w");
+
+	if (fp == NULL) abort();
+
+	fputs(content, fp);
+	fclose(fp);
+}
+
+// status code of a GET request, the body is stored in body if given.
+static int get(server* webserver, const char* uri, char* body, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	char request[PATH_MAX + 64];
+	int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: test\r\n\r\n", uri);
+
+	testConnectionRead(conn, request, len);
+
+	char* out = testConnectionOutput(conn);
+	char* content = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (body != NULL) snprintf(body, size, "%s", (content) ? content + 4 : "");
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+int main(void) {
+
+	char tmpl[] = "/tmp/test_assetcache.XXXXXX";
+
+	if (mkdtemp(tmpl) == NULL) abort();
+
+	snprintf(base, sizeof(base), "%s", tmpl);
+
+	char target[PATH_MAX];
+
+	makePath("root", NULL, NULL);
+	makePath("outside", NULL, NULL);
+	makePath("root/in.txt", "in", NULL);
+	makePath("outside/secret.txt", "secret", NULL);
+	makePath("outside/index.html", "secret", NULL);
+	makePath("root/rel", NULL, "in.txt");
+	makePath("root/out.txt", NULL, "../outside/secret.txt");
+	makePath("root/up", NULL, "..");
+	snprintf(target, sizeof(target), "%s/outside", base);
+	makePath("root/abs", NULL, target);
+
+	char docroot[PATH_MAX];
+	snprintf(docroot, sizeof(docroot), "%s/root", base);
+
+	staticfile* sf = staticFileNew("/assets", docroot, 0);
+	staticFileSetIndex(sf, "index.html");
+
+	assetcache* cache = assetCacheNew(sf, 0, 0);
+	CHECK(cache != NULL);
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, assetCacheHandler, cache);
+	serverRegisterHook(webserver, staticFileHandler, sf);
+
+	char body[64];
+
+	// files and links in the docroot are cached.
+	CHECK(get(webserver, "/assets/in.txt", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "in"));
+	CHECK(get(webserver, "/assets/rel", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "in"));
+	CHECK(cache->misses == 2);
+
+	CHECK(get(webserver, "/assets/in.txt", NULL, 0) == HTTP_CODE_OK);
+	CHECK(cache->hits == 1);
+
+	// links leading out are left to staticfile, which refuses them too.
+	CHECK(get(webserver, "/assets/out.txt", body, sizeof(body)) == HTTP_CODE_FORBIDDEN);
+	CHECK(strstr(body, "secret") == NULL);
+	CHECK(get(webserver, "/assets/up/outside/secret.txt", body, sizeof(body)) == HTTP_CODE_FORBIDDEN);
+	CHECK(strstr(body, "secret") == NULL);
+
+	// so is a directory index behind one.
+	CHECK(get(webserver, "/assets/abs/", body, sizeof(body)) == HTTP_CODE_FORBIDDEN);
+	CHECK(strstr(body, "secret") == NULL);
+
+	CHECK(cache->misses == 2);
+	CHECK(cache->entries->size(cache->entries) == 2);
+
+	assetCacheFree(cache);
+	staticFileFree(sf);
+	serverFree(webserver);
+
+	char command[PATH_MAX + 16];
+	snprintf(command, sizeof(command), "rm -rf %s", base);
+	if (system(command) != 0) fprintf(stderr, "Failed to remove %s\n", base);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,151 @@
+/**
+ * @abstruct chunked request body decoder test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_chunked test/test_chunked.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "test.h"
+#include "double_server.h"
+
+#define CHUNKED_HEADER	"POST / HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n"
+
+// answers complete requests with "body|X-Sum|Host".
+static int echoHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	size_t size = 0;
+	char* content = httpGetContent(conn, 0, &size);
+
+	const char* sum		= httpGetRequestHeader(conn, "X-Sum");
+	const char* host	= httpGetRequestHeader(conn, "Host");
+
+	char echo[256];
+	int len = snprintf(echo, sizeof(echo), "%.*s|%s|%s", (int) size, (content) ? content : "", (sum) ? sum : "", (host) ? host : "");
+
+	free(content);
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", echo, len);
+
+	return DONE;
+}
+
+/**
+* send the body after a chunked request header, all at once or one byte at a time.
+*
+* @return status code the request is answered with, 0 if none. -1 if the
+* connection was closed without an answer.
+*/
+static int post(server* webserver, const char* body, bool bytewise, char* echo, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	int status = testConnectionRead(conn, CHUNKED_HEADER, strlen(CHUNKED_HEADER));
+
+	if (bytewise) {
+		for (const char* p = body; *p != '\0' && status != CLOSE && status != DONE; p++) {
+			status = testConnectionRead(conn, p, 1);
+		}
+	} else {
+		status = testConnectionRead(conn, body, strlen(body));
+	}
+
+	char* out = testConnectionOutput(conn);
+	char* content = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (echo != NULL) snprintf(echo, size, "%s", (content) ? content + 4 : "");
+
+	if (code == 0 && status == CLOSE) code = -1;
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+int main(void) {
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, echoHook, NULL);
+
+	char echo[256];
+
+	// chunks are joined, whether they come at once or byte by byte.
+	const char* body = "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+
+	CHECK(post(webserver, body, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "hello world||test"));
+	CHECK(post(webserver, body, true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "hello world||test"));
+
+	// hex sizes in either case, extensions and whitespace before them are skipped.
+	body = "a;name=value\r\n0123456789\r\nA \t;ext\r\nabcdefghij\r\n0;last\r\n\r\n";
+
+	CHECK(post(webserver, body, true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "0123456789abcdefghij||test"));
+
+	// bare LF line endings are tolerated.
+	CHECK(post(webserver, "3\nabc\n0\n\r\n", true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "abc||test"));
+
+	// trailer fields are merged into the headers, framing and routing ones are not.
+	body = "3\r\nabc\r\n0\r\nX-Sum: 42\r\nHost: evil\r\nContent-Length: 99\r\nTransfer-Encoding: identity\r\n\r\n";
+
+	CHECK(post(webserver, body, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "abc|42|test"));
+	CHECK(post(webserver, body, true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "abc|42|test"));
+
+	// malformed framing closes the connection.
+	CHECK(post(webserver, "x\r\nhello\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, ";ext\r\nhello\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "5 x\r\nhello\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "5\rxhello\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "5\r\nhelloX\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "5\r\nhello\rX0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "3\r\nabc\r\n0\r\nno-colon\r\n\r\n", true, NULL, 0) == -1);
+
+	// sizes that don't fit in 64 bits.
+	CHECK(post(webserver, "10000000000000000\r\nhello\r\n0\r\n\r\n", true, NULL, 0) == -1);
+	CHECK(post(webserver, "ffffffffffffffff0\r\nhello\r\n0\r\n\r\n", false, NULL, 0) == -1);
+
+	// extensions and trailers are bounded.
+	size_t hugelen = HTTP_CHUNK_MAX_TRAILERSIZE + HTTP_CHUNK_MAX_EXTSIZE + 64;
+	char* huge = malloc(hugelen + 1);
+
+	if (huge == NULL) abort();
+
+	memset(huge, 'a', hugelen);
+	memcpy(huge, "5;", 2);
+	huge[hugelen] = '\0';
+	CHECK(post(webserver, huge, false, NULL, 0) == -1);
+
+	memcpy(huge, "0\r\nX-Long: ", 11);
+	CHECK(post(webserver, huge, false, NULL, 0) == -1);
+
+	free(huge);
+
+	// the body limit is checked against the declared chunk size.
+	serverSetOption(webserver, "server.max_body_size", "8");
+	CHECK(post(webserver, "4\r\nabcd\r\n4\r\nefgh\r\n0\r\n\r\n", true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "abcdefgh||test"));
+	CHECK(post(webserver, "4\r\nabcd\r\n5\r\n", false, NULL, 0) == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,159 @@
+/**
+ * @abstruct Expect: 100-continue handling test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_continue test/test_continue.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "test.h"
+#include "double_server.h"
+
+#define CONTINUE	"HTTP/1.1 100 Continue\r\n\r\n"
+
+/**
+* Refuses requests for /deny from their header alone, answers complete
+* requests with their body.
+*/
+static int echoHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ)) return OK;
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (httpGetStatus(conn) == HTTP_REQ_HEADER_DONE && !strcmp(ahttp->request.path, "/deny")) {
+		httpResponse(conn, HTTP_CODE_FORBIDDEN, "text/plain", "no", 2);
+		return DONE;
+	}
+
+	if (httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	size_t size = 0;
+	char* body = httpGetContent(conn, 0, &size);
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", (body) ? body : "", size);
+	free(body);
+
+	return DONE;
+}
+
+/**
+* Send the header, give the server the next loop, then send the body as a
+* client waiting for 100 Continue would.
+*
+* @return output of the server, free it after use.
+*/
+static char* exchange(server* webserver, const char* header, const char* body, int* status) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	int chain = testConnectionRead(conn, header, strlen(header));
+
+	// the loop after the header went through the hooks
+	if (chain != DONE && chain != CLOSE) chain = testConnectionRead(conn, NULL, 0);
+
+	if (chain != DONE && chain != CLOSE && body != NULL) chain = testConnectionRead(conn, body, strlen(body));
+
+	char* out = testConnectionOutput(conn);
+
+	if (status != NULL) *status = (conn->status == CLOSE) ? CLOSE : chain;
+
+	testConnectionFree(conn);
+
+	return out;
+}
+
+// output starts with expected
+static bool answers(server* webserver, const char* header, const char* body, const char* expected) {
+
+	char* out = exchange(webserver, header, body, NULL);
+	bool match = (strstr(out, expected) == out);
+
+	free(out);
+
+	return match;
+}
+
+static int countOf(const char* str, const char* sub) {
+
+	int count = 0;
+
+	for (const char* p = strstr(str, sub); p != NULL; p = strstr(p + 1, sub)) count++;
+
+	return count;
+}
+
+int main(void) {
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, echoHook, NULL);
+
+	int status;
+	char* out;
+
+	// 100 Continue once the hooks took the header, then the body is read.
+	out = exchange(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n", "hello", &status);
+	CHECK(strstr(out, CONTINUE "HTTP/1.1 200 ") == out);
+	CHECK(countOf(out, "100 Continue") == 1);
+	CHECK(strstr(out, "Connection: Keep-Alive") != NULL);
+	CHECK(strstr(out, "\r\n\r\nhello") != NULL);
+	CHECK(status == DONE);
+	free(out);
+
+	// token is case insensitive, chunked bodies wait too.
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-Continue\r\nContent-Length: 5\r\n\r\n", "hello", CONTINUE "HTTP/1.1 200 "));
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nTransfer-Encoding: chunked\r\n\r\n",
+		"5\r\nhello\r\n0\r\n\r\n", CONTINUE "HTTP/1.1 200 "));
+
+	// nothing goes out with the header, a body sent without waiting is read after 100 Continue.
+	connection* conn = testConnectionNew(webserver);
+	const char* request = "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n";
+	CHECK(testConnectionRead(conn, request, strlen(request)) == OK);
+	out = testConnectionOutput(conn);
+	CHECK(out[0] == '\0');
+	free(out);
+	CHECK(testConnectionRead(conn, "hello", 5) == DONE);
+	out = testConnectionOutput(conn);
+	CHECK(strstr(out, CONTINUE "HTTP/1.1 200 ") == out && strstr(out, "\r\n\r\nhello") != NULL);
+	free(out);
+	testConnectionFree(conn);
+
+	// no 100 Continue without a body, for HTTP/1.0, or when the body came with the header.
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 0\r\n\r\n", NULL, "HTTP/1.1 200 "));
+	CHECK(answers(webserver, "POST / HTTP/1.0\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n", "hello", "HTTP/1.0 200 "));
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\nhello", NULL, "HTTP/1.1 200 "));
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: something\r\nContent-Length: 5\r\n\r\n", "hello", "HTTP/1.1 200 "));
+
+	// refused by a hook from the header, the body is never asked for.
+	out = exchange(webserver, "POST /deny HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n", "hello", &status);
+	CHECK(strstr(out, "HTTP/1.1 403 ") == out);
+	CHECK(strstr(out, "100 Continue") == NULL);
+	CHECK(strstr(out, "Connection: close") != NULL);
+	CHECK(status == CLOSE);
+	free(out);
+
+	// a body over the limit is refused before it's asked for.
+	serverSetOption(webserver, "server.max_body_size", "4");
+	out = exchange(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 5\r\n\r\n", "hello", &status);
+	CHECK(strstr(out, "HTTP/1.1 413 ") == out);
+	CHECK(strstr(out, "100 Continue") == NULL);
+	CHECK(strstr(out, "Connection: close") != NULL);
+	CHECK(status == CLOSE);
+	free(out);
+
+	CHECK(answers(webserver, "POST / HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: 4\r\n\r\n", "hell", CONTINUE "HTTP/1.1 200 "));
+	serverSetOption(webserver, "server.max_body_size", "0");
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
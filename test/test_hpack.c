@@ -0,0 +1,155 @@
+/**
+ * @abstruct HPACK header compression test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_hpack test/test_hpack.c hpack.c -levent -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <event2/buffer.h>
+
+#include "hpack.h"
+#include "test.h"
+
+// decoded fields, one "name: value" per line.
+static char fields[1024];
+
+static int addField(const char* name, size_t namelen, const char* value, size_t valuelen, void* userdata) {
+
+	size_t len = strlen(fields);
+
+	if (strlen(name) != namelen || strlen(value) != valuelen) return -1;
+
+	snprintf(fields + len, sizeof(fields) - len, "%s: %s\n", name, value);
+
+	return 0;
+}
+
+// decode a block given in hex, the fields go to fields.
+static int decodeHex(hpack* ctx, const char* hex) {
+
+	uint8_t block[512];
+	size_t size = 0;
+
+	for (const char* p = hex; *p != '\0'; ) {
+
+		if (*p == ' ') {
+			p++;
+			continue;
+		}
+
+		unsigned int byte;
+
+		if (sscanf(p, "%2x", &byte) != 1 || size == sizeof(block)) abort();
+
+		block[size++] = byte;
+		p += 2;
+	}
+
+	fields[0] = '\0';
+
+	return hpackDecode(ctx, block, size, addField, NULL);
+}
+
+static int decodeBuffer(hpack* ctx, struct evbuffer* buf) {
+
+	size_t size = evbuffer_get_length(buf);
+
+	fields[0] = '\0';
+
+	return hpackDecode(ctx, evbuffer_pullup(buf, size), size, addField, NULL);
+}
+
+int main(void) {
+
+	// RFC 7541 C.3, requests without Huffman coding.
+	hpack* ctx = hpackNew(HPACK_DEF_TABLE_SIZE);
+
+	CHECK(decodeHex(ctx, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+	CHECK(ctx->numentries == 1 && ctx->size == 57);
+
+	CHECK(decodeHex(ctx, "8286 84be 5808 6e6f 2d63 6163 6865") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+	CHECK(ctx->numentries == 2 && ctx->size == 110);
+
+	CHECK(decodeHex(ctx, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	CHECK(ctx->numentries == 3 && ctx->size == 164);
+
+	hpackFree(ctx);
+
+	// RFC 7541 C.4, the same requests with Huffman coding.
+	ctx = hpackNew(HPACK_DEF_TABLE_SIZE);
+
+	CHECK(decodeHex(ctx, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+
+	CHECK(decodeHex(ctx, "8286 84be 5886 a8eb 1064 9cbf") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+
+	CHECK(decodeHex(ctx, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf") == 0);
+	CHECK(!strcmp(fields, ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	CHECK(ctx->numentries == 3 && ctx->size == 164);
+
+	hpackFree(ctx);
+
+	// RFC 7541 C.5, responses evicting from a 256 byte table.
+	ctx = hpackNew(256);
+
+	CHECK(decodeHex(ctx, "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d") == 0);
+	CHECK(!strcmp(fields, ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"));
+	CHECK(ctx->numentries == 4 && ctx->size == 222);
+
+	CHECK(decodeHex(ctx, "4803 3330 37c1 c0bf") == 0);
+	CHECK(!strcmp(fields, ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n"));
+	CHECK(ctx->numentries == 4 && ctx->size == 222);
+
+	// table size updates only at the start of a block and within the advertised limit.
+	CHECK(decodeHex(ctx, "3f e2 01") != 0);
+	CHECK(decodeHex(ctx, "82 20") != 0);
+	CHECK(decodeHex(ctx, "20 82") == 0);
+	CHECK(ctx->numentries == 0 && ctx->size == 0);
+
+	hpackFree(ctx);
+
+	// malformed blocks
+	ctx = hpackNew(HPACK_DEF_TABLE_SIZE);
+
+	CHECK(decodeHex(ctx, "80") != 0);						// index 0
+	CHECK(decodeHex(ctx, "be") != 0);						// empty dynamic table
+	CHECK(decodeHex(ctx, "ff") != 0);						// truncated integer
+	CHECK(decodeHex(ctx, "ff ff ff ff ff ff 7f") != 0);		// integer overflow
+	CHECK(decodeHex(ctx, "40 05 61 62") != 0);				// string past the block
+	CHECK(decodeHex(ctx, "00 81 ff 00") != 0);				// Huffman padding longer than 7 bits
+	CHECK(decodeHex(ctx, "00 81 00 00") != 0);				// Huffman padding not all ones
+	CHECK(decodeHex(ctx, "00 84 ff ff ff ff 00") != 0);		// EOS in a Huffman string
+
+	hpackFree(ctx);
+
+	// what we encode decodes to the same fields.
+	struct evbuffer* buf = evbuffer_new();
+	ctx = hpackNew(HPACK_DEF_TABLE_SIZE);
+
+	CHECK(hpackEncodeStatus(buf, 200) == 0);
+	CHECK(hpackEncodeStatus(buf, 418) == 0);
+	CHECK(hpackEncodeHeader(buf, "Content-Type", "text/html") == 0);
+	CHECK(hpackEncodeHeader(buf, "accept-encoding", "gzip, deflate") == 0);
+	CHECK(hpackEncodeHeader(buf, "X-Custom-Header", "a value that is long enough to use more than one length byte, over 127 bytes long. a value that is long enough") == 0);
+	CHECK(hpackEncodeHeader(buf, "X-Empty", "") == 0);
+
+	CHECK(decodeBuffer(ctx, buf) == 0);
+	CHECK(!strcmp(fields, ":status: 200\n:status: 418\ncontent-type: text/html\naccept-encoding: gzip, deflate\n"
+		"x-custom-header: a value that is long enough to use more than one length byte, over 127 bytes long. a value that is long enough\n"
+		"x-empty: \n"));
+
+	// responses never touch the dynamic table.
+	CHECK(ctx->numentries == 0);
+
+	evbuffer_free(buf);
+	hpackFree(ctx);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,234 @@
+/**
+ * @abstruct HTTP/2 request body limits and flow control test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_http2 test/test_http2.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "http2.h"
+#include "hpack.h"
+#include "test.h"
+#include "double_server.h"
+
+// what the server sent on stream 1 and the connection.
+typedef struct {
+	int			status;			// :status of the response, 0 if none
+	char		body[64];		// response body
+	int			rststream;		// RST_STREAM error code, -1 if none
+	int			goaway;			// GOAWAY error code, -1 if none
+	uint32_t	connwindow;		// WINDOW_UPDATE increments of the connection
+	uint32_t	streamwindow;	// WINDOW_UPDATE increments of stream 1
+} reply;
+
+// answers complete requests with the body size.
+static int sizeHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	char size[32];
+	snprintf(size, sizeof(size), "%zu", httpGetContentSize(conn));
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", size, strlen(size));
+
+	return DONE;
+}
+
+static void addFrame(struct evbuffer* buf, uint8_t type, uint8_t flags, uint32_t streamid, const void* payload, uint32_t length) {
+
+	uint8_t header[HTTP2_FRAME_HEADER_SIZE] = {
+		length >> 16, length >> 8, length,
+		type, flags,
+		streamid >> 24, streamid >> 16, streamid >> 8, streamid
+	};
+
+	evbuffer_add(buf, header, sizeof(header));
+	if (length > 0) evbuffer_add(buf, payload, length);
+}
+
+// preface and a POST on stream 1 declaring contentlength unless it's NULL.
+static struct evbuffer* newRequest(const char* contentlength) {
+
+	struct evbuffer* buf	= evbuffer_new();
+	struct evbuffer* block	= evbuffer_new();
+
+	evbuffer_add(buf, HTTP2_PREFACE, STRLEN(HTTP2_PREFACE));
+	addFrame(buf, HTTP2_SETTINGS, 0, 0, NULL, 0);
+
+	hpackEncodeHeader(block, ":method", "POST");
+	hpackEncodeHeader(block, ":scheme", "http");
+	hpackEncodeHeader(block, ":path", "/");
+	hpackEncodeHeader(block, ":authority", "test");
+	if (contentlength) hpackEncodeHeader(block, "content-length", contentlength);
+
+	size_t len = evbuffer_get_length(block);
+	addFrame(buf, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS, 1, evbuffer_pullup(block, len), len);
+
+	evbuffer_free(block);
+
+	return buf;
+}
+
+// body of size bytes in DATA frames on stream 1 as large as allowed.
+static void addData(struct evbuffer* buf, size_t size, bool endstream) {
+
+	static uint8_t data[HTTP2_DEF_MAX_FRAME_SIZE];
+
+	memset(data, 'a', sizeof(data));
+
+	do {
+		uint32_t n = (size < sizeof(data)) ? size : sizeof(data);
+
+		size -= n;
+		addFrame(buf, HTTP2_DATA, (endstream && size == 0) ? HTTP2_FLAG_END_STREAM : 0, 1, data, n);
+	} while (size > 0);
+}
+
+static int getStatus(const char* name, size_t namelen, const char* value, size_t valuelen, void* userdata) {
+
+	if (!strcmp(name, ":status")) *(int*) userdata = atoi(value);
+
+	return 0;
+}
+
+// send the request and read the frames coming back.
+static void exchange(server* webserver, struct evbuffer* request, reply* r) {
+
+	memset(r, 0, sizeof(reply));
+	r->rststream	= -1;
+	r->goaway		= -1;
+
+	connection* conn = testConnectionNew(webserver);
+
+	size_t len = evbuffer_get_length(request);
+	testConnectionRead(conn, evbuffer_pullup(request, len), len);
+	evbuffer_free(request);
+
+	// deferred framing
+	event_base_loop(webserver->evbase, EVLOOP_NONBLOCK);
+
+	struct evbuffer* frames = evbuffer_new();
+	testConnectionOutputBuffer(conn, frames);
+
+	hpack* decoder = hpackNew(HPACK_DEF_TABLE_SIZE);
+	uint8_t header[HTTP2_FRAME_HEADER_SIZE];
+
+	while (evbuffer_remove(frames, header, sizeof(header)) == sizeof(header)) {
+
+		uint32_t length		= ((uint32_t) header[0] << 16) | (header[1] << 8) | header[2];
+		uint32_t streamid	= ((uint32_t)(header[5] & 0x7f) << 24) | (header[6] << 16) | (header[7] << 8) | header[8];
+		uint8_t* payload	= evbuffer_pullup(frames, length);
+
+		if (header[3] == HTTP2_HEADERS && streamid == 1) {
+			hpackDecode(decoder, payload, length, getStatus, &r->status);
+		} else if (header[3] == HTTP2_DATA && streamid == 1) {
+			snprintf(r->body + strlen(r->body), sizeof(r->body) - strlen(r->body), "%.*s", (int) length, payload);
+		} else if (header[3] == HTTP2_RST_STREAM && streamid == 1 && length == 4) {
+			r->rststream = ((uint32_t) payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+		} else if (header[3] == HTTP2_GOAWAY && length >= 8) {
+			r->goaway = ((uint32_t) payload[4] << 24) | (payload[5] << 16) | (payload[6] << 8) | payload[7];
+		} else if (header[3] == HTTP2_WINDOW_UPDATE && length == 4) {
+			uint32_t increment = ((uint32_t)(payload[0] & 0x7f) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+			if (streamid == 0) r->connwindow += increment;
+			else if (streamid == 1) r->streamwindow += increment;
+		}
+
+		evbuffer_drain(frames, length);
+	}
+
+	hpackFree(decoder);
+	evbuffer_free(frames);
+	testConnectionFree(conn);
+}
+
+int main(void) {
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, http2Handler, NULL);
+	serverRegisterHook(webserver, sizeHook, NULL);
+
+	reply r;
+	struct evbuffer* request;
+
+	// a body matching Content-Length
+	request = newRequest("5");
+	addData(request, 5, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == HTTP_CODE_OK && !strcmp(r.body, "5"));
+	CHECK(r.rststream == -1 && r.goaway == -1);
+
+	// more or less than declared is a malformed request.
+	request = newRequest("5");
+	addData(request, 6, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == 0 && r.rststream == HTTP2_PROTOCOL_ERROR && r.goaway == -1);
+
+	request = newRequest("5");
+	addData(request, 3, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == 0 && r.rststream == HTTP2_PROTOCOL_ERROR && r.goaway == -1);
+
+	// a body over the initial windows completes, every frame is credited back.
+	request = newRequest(NULL);
+	addData(request, 4 * HTTP2_DEF_WINDOW_SIZE, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == HTTP_CODE_OK && r.body[0] != '\0' && (size_t) atoll(r.body) == 4 * HTTP2_DEF_WINDOW_SIZE);
+	CHECK(r.goaway == -1);
+	CHECK(r.connwindow == 4 * HTTP2_DEF_WINDOW_SIZE);
+
+	// same with the body spooled to a file.
+	serverSetOption(webserver, "server.body_spool_size", "1024");
+	request = newRequest(NULL);
+	addData(request, 4 * HTTP2_DEF_WINDOW_SIZE, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == HTTP_CODE_OK && (size_t) atoll(r.body) == 4 * HTTP2_DEF_WINDOW_SIZE);
+	CHECK(r.connwindow == 4 * HTTP2_DEF_WINDOW_SIZE);
+	serverSetOption(webserver, "server.body_spool_size", "1048576");
+
+	// frames that don't end the stream are credited to the stream too.
+	request = newRequest(NULL);
+	addData(request, 100, false);
+	exchange(webserver, request, &r);
+	CHECK(r.status == 0 && r.streamwindow == 100);
+
+	// the body limit resets the stream, the connection goes on.
+	serverSetOption(webserver, "server.max_body_size", "4");
+	request = newRequest(NULL);
+	addData(request, 5, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == 0 && r.rststream == HTTP2_CANCEL && r.goaway == -1);
+	CHECK(r.connwindow == 5);
+
+	request = newRequest(NULL);
+	addData(request, 4, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == HTTP_CODE_OK && !strcmp(r.body, "4"));
+	serverSetOption(webserver, "server.max_body_size", "0");
+
+	// DATA after END_STREAM
+	request = newRequest("1");
+	addData(request, 1, true);
+	addData(request, 1, true);
+	exchange(webserver, request, &r);
+	CHECK(r.status == HTTP_CODE_OK && r.goaway == -1);
+
+	// DATA on an idle stream is a connection error.
+	request = newRequest(NULL);
+	addFrame(request, HTTP2_DATA, 0, 3, "a", 1);
+	exchange(webserver, request, &r);
+	CHECK(r.goaway == HTTP2_PROTOCOL_ERROR);
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
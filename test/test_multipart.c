@@ -0,0 +1,213 @@
+/**
+ * @abstruct multipart/form-data parser test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_multipart test/test_multipart.c test/double_server.c \
+ *     multipart.c http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "multipart.h"
+#include "test.h"
+#include "double_server.h"
+
+#define FORM_TYPE	"multipart/form-data; boundary=XyZ"
+#define FORM_BODY \
+	"preamble is ignored\r\n" \
+	"--XyZ\r\n" \
+	"Content-Disposition: form-data; name=\"title\"\r\n" \
+	"\r\n" \
+	"hello\r\n" \
+	"--XyZ \t\r\n" \
+	"Content-Disposition: form-data; name=\"file\"; filename=\"a;b.txt\"\r\n" \
+	"Content-Type: text/plain\r\n" \
+	"\r\n" \
+	"line1\r\n--XyA\r\n--Xy\r\nline2\r\n" \
+	"--XyZ\r\n" \
+	"content-disposition: form-data; name=empty\r\n" \
+	"\r\n" \
+	"\r\n" \
+	"--XyZ--\r\n" \
+	"epilogue is ignored"
+
+static char lastfilepath[PATH_MAX];		// temp file of the last file part seen by the hook
+
+// callback data
+static char received[256];
+static int numcalls = 0;
+static int callbackcode = 0;
+
+// answers complete forms with their parts, "none" if there is no form.
+static int formHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	multipartForm* form = multipartGetForm((multipart*) userdata, conn);
+	char echo[1024] = "none";
+
+	if (form != NULL) {
+
+		echo[0] = '\0';
+
+		for (multipartPart* part = form->parts; part != NULL; part = part->next) {
+
+			size_t len = strlen(echo);
+
+			if (part->filename == NULL) {
+				snprintf(echo + len, sizeof(echo) - len, "%s=%s|", part->name, part->value);
+				continue;
+			}
+
+			char data[256] = "";
+
+			if (part->filepath != NULL) {
+
+				snprintf(lastfilepath, sizeof(lastfilepath), "%s", part->filepath);
+
+				FILE* fp = fopen(part->filepath, "r");
+
+				if (fp != NULL) {
+					data[fread(data, 1, sizeof(data) - 1, fp)] = '\0';
+					fclose(fp);
+				}
+			}
+
+			snprintf(echo + len, sizeof(echo) - len, "%s:%s:%s:%jd:%s|", part->name, part->filename,
+				(part->contenttype) ? part->contenttype : "", (intmax_t) part->size, data);
+		}
+	}
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", echo, strlen(echo));
+
+	return DONE;
+}
+
+static int fileCallback(connection* conn, multipartPart* part, const void* data, size_t size, void* userdata) {
+
+	size_t len = strlen(received);
+
+	numcalls++;
+
+	if (size == 0) snprintf(received + len, sizeof(received) - len, "<end>");
+	else snprintf(received + len, sizeof(received) - len, "%.*s", (int) size, (const char*) data);
+
+	return callbackcode;
+}
+
+/**
+* POST a form, the body at once or one byte at a time.
+*
+* @return status code the request is answered with, the body goes to echo.
+*/
+static int post(server* webserver, const char* uri, const char* contenttype, const char* body, bool bytewise, char* echo, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	char header[256];
+	int len = snprintf(header, sizeof(header), "POST %s HTTP/1.1\r\nHost: test\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+		uri, contenttype, strlen(body));
+
+	int status = testConnectionRead(conn, header, len);
+
+	if (bytewise) {
+		for (const char* p = body; *p != '\0' && status != CLOSE && status != DONE; p++) {
+			status = testConnectionRead(conn, p, 1);
+		}
+	} else {
+		testConnectionRead(conn, body, strlen(body));
+	}
+
+	char* out = testConnectionOutput(conn);
+	char* content = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (echo != NULL) snprintf(echo, size, "%s", (content) ? content + 4 : "");
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+static int postForm(server* webserver, const char* body) {
+
+	return post(webserver, "/upload", FORM_TYPE, body, false, NULL, 0);
+}
+
+int main(void) {
+
+	multipart* mp = multipartNew("/upload", NULL);
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, multipartHandler, mp);
+	serverRegisterHook(webserver, formHook, mp);
+
+	char echo[1024];
+	const char* expected = "title=hello|file:a;b.txt:text/plain:25:line1\r\n--XyA\r\n--Xy\r\nline2|empty=|";
+
+	// parts come out the same whether the body is in at once or streamed.
+	CHECK(post(webserver, "/upload", FORM_TYPE, FORM_BODY, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, expected));
+	CHECK(access(lastfilepath, F_OK) != 0);
+
+	CHECK(post(webserver, "/upload/sub", FORM_TYPE, FORM_BODY, true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, expected));
+	CHECK(access(lastfilepath, F_OK) != 0);
+
+	// quoted boundary
+	CHECK(post(webserver, "/upload", "multipart/form-data; charset=utf-8; boundary=\"XyZ\"", FORM_BODY, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, expected));
+
+	// other paths and content types are left alone.
+	CHECK(post(webserver, "/uploads", FORM_TYPE, FORM_BODY, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "none"));
+	CHECK(post(webserver, "/upload", "text/plain", FORM_BODY, false, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "none"));
+
+	// malformed forms
+	CHECK(post(webserver, "/upload", "multipart/form-data", FORM_BODY, false, NULL, 0) == HTTP_CODE_BAD_REQUEST);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data\r\n\r\nx\r\n--XyZ--") == HTTP_CODE_BAD_REQUEST);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data; name=a\r\n\r\nx\r\n") == HTTP_CODE_BAD_REQUEST);
+	CHECK(postForm(webserver, "--XyZjunk\r\nContent-Disposition: form-data; name=a\r\n\r\nx\r\n--XyZ--") == HTTP_CODE_BAD_REQUEST);
+	CHECK(postForm(webserver, "no delimiter at all") == HTTP_CODE_BAD_REQUEST);
+
+	// limits
+	multipartSetLimits(mp, 4, 8, 2);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data; name=a\r\n\r\nabcd\r\n--XyZ--") == HTTP_CODE_OK);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data; name=a\r\n\r\nabcde\r\n--XyZ--") == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data; name=a; filename=f\r\n\r\n123456789\r\n--XyZ--") == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+	CHECK(postForm(webserver, "--XyZ\r\nContent-Disposition: form-data; name=a\r\n\r\n\r\n--XyZ\r\n"
+		"Content-Disposition: form-data; name=b\r\n\r\n\r\n--XyZ\r\nContent-Disposition: form-data; name=c\r\n\r\n\r\n--XyZ--") == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+	multipartSetLimits(mp, MULTIPART_DEF_MAX_FIELD, MULTIPART_DEF_MAX_FILE, MULTIPART_DEF_MAX_PARTS);
+
+	// file data through the callback, no temp file.
+	multipartSetFileCallback(mp, fileCallback, NULL);
+	lastfilepath[0] = '\0';
+
+	CHECK(post(webserver, "/upload", FORM_TYPE, FORM_BODY, true, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(!strcmp(echo, "title=hello|file:a;b.txt:text/plain:25:|empty=|"));
+	CHECK(!strcmp(received, "line1\r\n--XyA\r\n--Xy\r\nline2<end>"));
+	CHECK(numcalls > 2);
+	CHECK(lastfilepath[0] == '\0');
+
+	// the callback may refuse the upload.
+	callbackcode = HTTP_CODE_FORBIDDEN;
+	CHECK(postForm(webserver, FORM_BODY) == HTTP_CODE_FORBIDDEN);
+
+	serverFree(webserver);
+	multipartFree(mp);
+
+	return TEST_RESULT();
+}
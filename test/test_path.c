@@ -0,0 +1,204 @@
+/**
+ * @abstruct request path decoding and normalization test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_path test/test_path.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "coder.h"
+#include "test.h"
+#include "double_server.h"
+
+// normalized path, or NULL if it's refused.
+static const char* normalize(const char* path) {
+
+	static char buf[PATH_MAX * 2];
+
+	snprintf(buf, sizeof(buf), "%s", path);
+
+	int len = urlNormalizePath(buf);
+
+	if (len < 0) return NULL;
+
+	CHECK((size_t) len == strlen(buf));
+
+	return buf;
+}
+
+static bool normalizesTo(const char* path, const char* expected) {
+
+	const char* normalized = normalize(path);
+
+	if (expected == NULL || normalized == NULL) return (expected == normalized);
+
+	return !strcmp(normalized, expected);
+}
+
+static const char* decode(const char* str) {
+
+	static char buf[256];
+
+	snprintf(buf, sizeof(buf), "%s", str);
+
+	CHECK(urlDecode(buf) == strlen(buf));
+
+	return buf;
+}
+
+// answers complete requests with "path?query".
+static int pathHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	char echo[PATH_MAX + 64];
+	int len = snprintf(echo, sizeof(echo), "%s?%s", ahttp->request.path, ahttp->request.query);
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", echo, len);
+
+	return DONE;
+}
+
+/**
+* send a GET request for the uri.
+*
+* @return status code the request is answered with, the body goes to body.
+* -1 if the connection was closed without an answer.
+*/
+static int get(server* webserver, const char* uri, char* body, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	char request[PATH_MAX + 64];
+	int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: test\r\n\r\n", uri);
+
+	int status = testConnectionRead(conn, request, len);
+
+	char* out = testConnectionOutput(conn);
+	char* content = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	snprintf(body, size, "%s", (content) ? content + 4 : "");
+
+	if (code == 0 && status == CLOSE) code = -1;
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+int main(void) {
+
+	// slashes and dot segments
+	CHECK(normalizesTo("/", "/"));
+	CHECK(normalizesTo("/a/b", "/a/b"));
+	CHECK(normalizesTo("//a///b//", "/a/b"));
+	CHECK(normalizesTo("/a/", "/a"));
+	CHECK(normalizesTo("/a/./b/.", "/a/b"));
+	CHECK(normalizesTo("/a/b/../c", "/a/c"));
+	CHECK(normalizesTo("/a/b/..", "/a"));
+	CHECK(normalizesTo("/a/b/./../../..", "/"));
+
+	// ".." never climbs above the root.
+	CHECK(normalizesTo("/..", "/"));
+	CHECK(normalizesTo("/../../etc/passwd", "/etc/passwd"));
+	CHECK(normalizesTo("/a/../../b", "/b"));
+
+	// names that only look like dot segments
+	CHECK(normalizesTo("/...", "/..."));
+	CHECK(normalizesTo("/a/.hidden", "/a/.hidden"));
+	CHECK(normalizesTo("/a/..b/c..", "/a/..b/c.."));
+
+	// escapes are decoded before segments are resolved.
+	CHECK(normalizesTo("/%41%62c", "/Abc"));
+	CHECK(normalizesTo("/a%20b", "/a b"));
+	CHECK(normalizesTo("/a+b", "/a+b"));
+	CHECK(normalizesTo("/a/%2e%2e/b", "/b"));
+	CHECK(normalizesTo("/a/%2E%2e%2fb", "/b"));
+	CHECK(normalizesTo("/a/..%2f..%2f/b", "/b"));
+	CHECK(normalizesTo("/a%2f%2fb", "/a/b"));
+	CHECK(normalizesTo("/a/%2e/b", "/a/b"));
+
+	// runs longer than a vector
+	CHECK(normalizesTo("/abcdefghijklmnopqrstuvwxyz0123456789/../x", "/x"));
+	CHECK(normalizesTo("/abcdefghijklmnopqrstuvwxyz//0123456789abcdefghij/./y", "/abcdefghijklmnopqrstuvwxyz/0123456789abcdefghij/y"));
+	CHECK(normalizesTo("/abcdefghijklmnopqrstuvwxyz%2F0123456789abcdefghij%2e%2E/y", "/abcdefghijklmnopqrstuvwxyz/0123456789abcdefghij../y"));
+
+	// refused
+	CHECK(normalizesTo("", NULL));
+	CHECK(normalizesTo("a/b", NULL));
+	CHECK(normalizesTo("%2fa", NULL));
+	CHECK(normalizesTo("/a%2", NULL));
+	CHECK(normalizesTo("/a%zz", NULL));
+	CHECK(normalizesTo("/a%00b", NULL));
+	CHECK(normalizesTo("/a\x01", NULL));
+	CHECK(normalizesTo("/a%7f", NULL));
+	CHECK(normalizesTo("/a%5c..%5cb", NULL));
+	CHECK(normalizesTo("/a:b", NULL));
+	CHECK(normalizesTo("/a%3Fb", NULL));
+	CHECK(normalizesTo("/abcdefghijklmnopqrstuvwxyz0123456789|", NULL));
+
+	// path length
+	char longpath[PATH_MAX + 8];
+	for (int i = 0; i < PATH_MAX; i += 2) memcpy(longpath + i, "/a", 2);
+	longpath[PATH_MAX] = '\0';
+	CHECK(normalizesTo(longpath, NULL));
+	longpath[PATH_MAX - 2] = '\0';
+	CHECK(normalize(longpath) != NULL);
+
+	// query strings and form values
+	CHECK(!strcmp(decode("a%20b+c"), "a b c"));
+	CHECK(!strcmp(decode("%41%4a%4A"), "AJJ"));
+	CHECK(!strcmp(decode("plain"), "plain"));
+	CHECK(!strcmp(decode("100%"), "100%"));
+	CHECK(!strcmp(decode("%zz%4"), "%zz%4"));
+
+	// static file paths
+	CHECK(isValidPathname("/a/b"));
+	CHECK(!isValidPathname(NULL));
+	CHECK(!isValidPathname(""));
+	CHECK(!isValidPathname("a/b"));
+	CHECK(!isValidPathname("/a:b"));
+
+	char path[64] = " //a//b/ ";
+	correctPathname(path);
+	CHECK(!strcmp(path, "/a/b"));
+
+	// request line
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, pathHook, NULL);
+
+	char body[PATH_MAX + 64];
+
+	CHECK(get(webserver, "/a/%2e%2e/b?x=%2e%2e/1", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "/b?x=%2e%2e/1"));
+	CHECK(get(webserver, "/..%2f..%2fetc/passwd", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "/etc/passwd?"));
+	CHECK(get(webserver, "http://test/a/../b/", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "/b?"));
+	CHECK(get(webserver, "http://test", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "/?"));
+
+	CHECK(get(webserver, "/a%00.txt", body, sizeof(body)) == -1);
+	CHECK(get(webserver, "/a%5c..%5c..%5cb", body, sizeof(body)) == -1);
+	CHECK(get(webserver, "a/b", body, sizeof(body)) == -1);
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,246 @@
+/**
+ * @abstruct request rate limiter test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_ratelimit test/test_ratelimit.c test/double_server.c \
+ *     ratelimit.c http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz -lm -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "hashtable.h"
+#include "ratelimit.h"
+#include "test.h"
+#include "double_server.h"
+
+// answers every complete request with 200.
+static int okHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", "ok", 2);
+
+	return DONE;
+}
+
+static bool apiKey(connection* conn, char* key, void* userdata) {
+
+	const char* value = httpGetRequestHeader(conn, "X-Api-Key");
+
+	if (value == NULL) return false;
+
+	snprintf(key, RATELIMIT_MAX_KEY, "%s", value);
+
+	return true;
+}
+
+// set the client address of the connection, NULL for a Unix socket.
+static void setPeer(connection* conn, const char* addr) {
+
+	memset(&conn->peer, 0, sizeof(conn->peer));
+	conn->peerlen = 0;
+
+	if (addr == NULL) return;
+
+	struct sockaddr_in* in4		= (struct sockaddr_in*) &conn->peer;
+	struct sockaddr_in6* in6	= (struct sockaddr_in6*) &conn->peer;
+
+	if (inet_pton(AF_INET, addr, &in4->sin_addr) == 1) {
+		in4->sin_family	= AF_INET;
+		conn->peerlen	= sizeof(struct sockaddr_in);
+	} else if (inet_pton(AF_INET6, addr, &in6->sin6_addr) == 1) {
+		in6->sin6_family	= AF_INET6;
+		conn->peerlen		= sizeof(struct sockaddr_in6);
+	} else {
+		abort();
+	}
+}
+
+/**
+* send a request from the address, the body in pieces of chunk bytes.
+*
+* @return status code the request is answered with, the response goes to out.
+*/
+static int requestFrom(server* webserver, const char* addr, const char* request, size_t chunk, char* out, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	setPeer(conn, addr);
+
+	size_t len = strlen(request);
+
+	for (size_t i = 0; i < len; i += chunk) {
+		testConnectionRead(conn, request + i, (len - i < chunk) ? len - i : chunk);
+	}
+
+	char* response = testConnectionOutput(conn);
+	int code = 0;
+
+	sscanf(response, "HTTP/1.1 %d", &code);
+
+	if (out != NULL) snprintf(out, size, "%s", response);
+
+	free(response);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+static int get(server* webserver, const char* addr) {
+
+	return requestFrom(webserver, addr, "GET / HTTP/1.1\r\nHost: test\r\n\r\n", SIZE_MAX, NULL, 0);
+}
+
+int main(void) {
+
+	// burst, then nothing until the bucket refills.
+	ratelimit* rl = ratelimitNew(1, 3, 0);
+	int retryafter = 0;
+
+	CHECK(ratelimitTake(rl, "a", &retryafter));
+	CHECK(ratelimitTake(rl, "a", &retryafter));
+	CHECK(ratelimitTake(rl, "a", &retryafter));
+	CHECK(!ratelimitTake(rl, "a", &retryafter));
+	CHECK(retryafter == 1);
+
+	// keys have buckets of their own.
+	CHECK(ratelimitTake(rl, "b", NULL));
+
+	// keys are cut at the maximum length.
+	char longkey[RATELIMIT_MAX_KEY * 2];
+	memset(longkey, 'k', sizeof(longkey) - 1);
+	longkey[sizeof(longkey) - 1] = '\0';
+	CHECK(ratelimitTake(rl, longkey, NULL));
+	longkey[RATELIMIT_MAX_KEY] = '\0';
+	CHECK(ratelimitTake(rl, longkey, NULL));
+	CHECK(ratelimitTake(rl, longkey, NULL));
+	CHECK(!ratelimitTake(rl, longkey, NULL));
+
+	CHECK(rl->allowed == 7 && rl->limited == 2);
+
+	// stats list the most limited keys.
+	hashtable* stats = ahashtable(0, 0);
+	ratelimitUpdateStats(rl, stats);
+	CHECK(stats->getint(stats, "ratelimit.allowed") == 7);
+	CHECK(stats->getint(stats, "ratelimit.limited") == 2);
+	CHECK(stats->getint(stats, "ratelimit.keys") == 3);
+	CHECK(stats->getint(stats, "ratelimit.key.a.limited") == 1);
+	CHECK(stats->getint(stats, "ratelimit.key.a.allowed") == 3);
+	CHECK(stats->getint(stats, "ratelimit.key.b.limited") == 0);
+	stats->free(stats);
+
+	ratelimitFree(rl);
+
+	// refill over time, never above the burst.
+	rl = ratelimitNew(100, 2, 0);
+
+	CHECK(ratelimitTake(rl, "a", NULL));
+	CHECK(ratelimitTake(rl, "a", NULL));
+	CHECK(!ratelimitTake(rl, "a", NULL));
+	usleep(50 * 1000);
+	CHECK(ratelimitTake(rl, "a", NULL));
+	CHECK(ratelimitTake(rl, "a", NULL));
+	CHECK(!ratelimitTake(rl, "a", NULL));
+
+	ratelimitFree(rl);
+
+	// slow rates tell the client to wait longer.
+	rl = ratelimitNew(0.25, 1, 0);
+	CHECK(ratelimitTake(rl, "a", &retryafter));
+	CHECK(!ratelimitTake(rl, "a", &retryafter));
+	CHECK(retryafter == 4);
+	ratelimitFree(rl);
+
+	CHECK(ratelimitNew(0, 1, 0) == NULL);
+	CHECK(ratelimitNew(1, 0, 0) == NULL);
+
+	// the table doesn't grow past its size, old keys are evicted.
+	rl = ratelimitNew(1, 1, 1);
+
+	char key[32];
+	for (int i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		CHECK(ratelimitTake(rl, key, NULL));
+	}
+
+	CHECK(rl->evictions >= 1000 - RATELIMIT_SHARDS * RATELIMIT_WAYS);
+	CHECK(ratelimitTake(rl, "key0", NULL));
+
+	ratelimitFree(rl);
+
+	// through the hook, by client address
+	rl = ratelimitNew(0.001, 2, 0);
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, ratelimitHandler, rl);
+	serverRegisterHook(webserver, okHook, NULL);
+
+	char out[1024];
+
+	CHECK(get(webserver, "192.0.2.1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "192.0.2.1") == HTTP_CODE_OK);
+	CHECK(requestFrom(webserver, "192.0.2.1", "GET / HTTP/1.1\r\nHost: test\r\n\r\n", SIZE_MAX, out, sizeof(out)) == HTTP_CODE_TOO_MANY_REQUESTS);
+	CHECK(strstr(out, "Retry-After: ") != NULL);
+	CHECK(strstr(out, "Connection: Keep-Alive") != NULL);
+	CHECK(get(webserver, "192.0.2.2") == HTTP_CODE_OK);
+
+	// an IPv4 client on a dual stack socket is the same client.
+	CHECK(get(webserver, "::ffff:192.0.2.2") == HTTP_CODE_OK);
+	CHECK(get(webserver, "::ffff:192.0.2.2") == HTTP_CODE_TOO_MANY_REQUESTS);
+
+	// IPv6 clients are keyed by their /64.
+	CHECK(get(webserver, "2001:db8:1:2::1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:1:2:ffff:ffff:ffff:ffff") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:1:2:abcd::") == HTTP_CODE_TOO_MANY_REQUESTS);
+	CHECK(get(webserver, "2001:db8:1:3::1") == HTTP_CODE_OK);
+
+	ratelimitSetIPv6Prefix(rl, 48);
+	CHECK(get(webserver, "2001:db8:2:1::1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:2:2::1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:2:ffff::1") == HTTP_CODE_TOO_MANY_REQUESTS);
+
+	ratelimitSetIPv6Prefix(rl, 128);
+	CHECK(get(webserver, "2001:db8:3::1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:3::1") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:3::2") == HTTP_CODE_OK);
+	CHECK(get(webserver, "2001:db8:3::1") == HTTP_CODE_TOO_MANY_REQUESTS);
+
+	// Unix socket clients are not limited by address.
+	for (int i = 0; i < 5; i++) CHECK(get(webserver, NULL) == HTTP_CODE_OK);
+
+	// a request takes one token however many reads its body takes.
+	const char* post = "POST / HTTP/1.1\r\nHost: test\r\nContent-Length: 10\r\n\r\n0123456789";
+
+	CHECK(requestFrom(webserver, "198.51.100.1", post, 1, NULL, 0) == HTTP_CODE_OK);
+	CHECK(requestFrom(webserver, "198.51.100.1", post, 3, NULL, 0) == HTTP_CODE_OK);
+
+	// limited before the body is read, the connection can't be kept.
+	CHECK(requestFrom(webserver, "198.51.100.1", "POST / HTTP/1.1\r\nHost: test\r\nContent-Length: 10\r\n\r\n", SIZE_MAX, out, sizeof(out)) == HTTP_CODE_TOO_MANY_REQUESTS);
+	CHECK(strstr(out, "Connection: close") != NULL);
+
+	// by a key of our own, requests without one go through.
+	ratelimitSetKeyCallback(rl, apiKey, NULL);
+	ratelimitSetCode(rl, HTTP_CODE_SERVICE_UNAVAILABLE);
+
+	const char* keyed = "GET / HTTP/1.1\r\nHost: test\r\nX-Api-Key: secret\r\n\r\n";
+
+	CHECK(requestFrom(webserver, "192.0.2.10", keyed, SIZE_MAX, NULL, 0) == HTTP_CODE_OK);
+	CHECK(requestFrom(webserver, "192.0.2.11", keyed, SIZE_MAX, NULL, 0) == HTTP_CODE_OK);
+	CHECK(requestFrom(webserver, "192.0.2.12", keyed, SIZE_MAX, NULL, 0) == HTTP_CODE_SERVICE_UNAVAILABLE);
+	CHECK(get(webserver, "192.0.2.1") == HTTP_CODE_OK);
+
+	serverFree(webserver);
+	ratelimitFree(rl);
+
+	return TEST_RESULT();
+}
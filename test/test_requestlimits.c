@@ -0,0 +1,116 @@
+/**
+ * @abstruct request size limits and Content-Length validation test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_requestlimits test/test_requestlimits.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "test.h"
+#include "double_server.h"
+
+// answers complete requests with the body size.
+static int sizeHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ) || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	char size[32];
+	snprintf(size, sizeof(size), "%zu", httpGetContentSize(conn));
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", size, strlen(size));
+
+	return DONE;
+}
+
+// status code the request is answered with, 0 if none. The body goes to body if given.
+static int request(server* webserver, const char* data, char* body, size_t size) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	testConnectionRead(conn, data, strlen(data));
+
+	char* out = testConnectionOutput(conn);
+	char* content = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (body != NULL) snprintf(body, size, "%s", (content) ? content + 4 : "");
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+static int post(server* webserver, const char* headers, const char* body) {
+
+	char data[1024];
+	snprintf(data, sizeof(data), "POST / HTTP/1.1\r\nHost: test\r\n%s\r\n%s", headers, body);
+
+	return request(webserver, data, NULL, 0);
+}
+
+int main(void) {
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, sizeHook, NULL);
+
+	char body[64];
+
+	// Content-Length
+	CHECK(request(webserver, "POST / HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\n\r\nhello", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "5"));
+	CHECK(request(webserver, "GET / HTTP/1.1\r\nHost: test\r\n\r\n", body, sizeof(body)) == HTTP_CODE_OK);
+	CHECK(!strcmp(body, "0"));
+
+	CHECK(post(webserver, "Content-Length: +5\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: -5\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: 5x\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: 5, 5\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: 0x5\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: \r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+	CHECK(post(webserver, "Content-Length: 99999999999999999999\r\n", "hello") == HTTP_CODE_BAD_REQUEST);
+
+	// repeated ones must agree.
+	CHECK(post(webserver, "Content-Length: 5\r\nContent-Length: 5\r\n", "hello") == HTTP_CODE_OK);
+	CHECK(post(webserver, "Content-Length: 5\r\nContent-Length: 6\r\n", "hello!") == HTTP_CODE_BAD_REQUEST);
+
+	// never along with Transfer-Encoding, a proxy could frame it the other way.
+	CHECK(post(webserver, "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n", "5\r\nhello\r\n0\r\n\r\n") == HTTP_CODE_BAD_REQUEST);
+
+	// limits
+	serverSetOption(webserver, "server.max_request_line", "32");
+	CHECK(request(webserver, "GET /a-path-well-over-thirty-two-bytes HTTP/1.1\r\n\r\n", NULL, 0) == HTTP_CODE_REQUEST_URI_TOO_LONG);
+	CHECK(request(webserver, "GET /a-path-well-over-thirty-two-bytes", NULL, 0) == HTTP_CODE_REQUEST_URI_TOO_LONG);
+	CHECK(request(webserver, "GET /short HTTP/1.1\r\n\r\n", NULL, 0) == HTTP_CODE_OK);
+
+	serverSetOption(webserver, "server.max_headers", "2");
+	CHECK(request(webserver, "GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\n\r\n", NULL, 0) == HTTP_CODE_OK);
+	CHECK(request(webserver, "GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\nC: 3\r\n\r\n", NULL, 0) == HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE);
+	serverSetOption(webserver, "server.max_headers", "0");
+
+	serverSetOption(webserver, "server.max_header_size", "32");
+	CHECK(request(webserver, "GET / HTTP/1.1\r\nA: a-value-well-over-thirty-two-bytes\r\n\r\n", NULL, 0) == HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE);
+	CHECK(request(webserver, "GET / HTTP/1.1\r\nA: a-value-well-over-thirty-two-bytes", NULL, 0) == HTTP_CODE_REQUEST_HEADER_FIELDS_TOO_LARGE);
+	serverSetOption(webserver, "server.max_header_size", "0");
+
+	// a declared body over the limit is refused before it is read.
+	serverSetOption(webserver, "server.max_body_size", "4");
+	CHECK(post(webserver, "Content-Length: 5\r\n", "") == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+	CHECK(post(webserver, "Content-Length: 4\r\n", "four") == HTTP_CODE_OK);
+	CHECK(post(webserver, "Transfer-Encoding: chunked\r\n", "5\r\nhello\r\n0\r\n\r\n") == HTTP_CODE_REQUEST_ENTITY_TOO_LARGE);
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,224 @@
+/**
+ * @abstruct request body spooling test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_spool test/test_spool.c test/double_server.c \
+ *     http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "coder.h"
+#include "test.h"
+#include "double_server.h"
+
+#define BODY_SIZE	(600 * 1024)	// over a few spool writes
+
+// how the hook takes the body
+enum {
+	TAKE_CONTENT,		// httpGetContent() in pieces
+	TAKE_MAP,			// httpMapContent()
+	TAKE_MIXED,			// httpGetContent() for the start, httpMapContent() for the rest
+	TAKE_INBUF,			// httpGetInbuf()
+	TAKE_FORM			// httpGetFormParams()
+};
+
+static int take = TAKE_CONTENT;
+static char body[BODY_SIZE];
+
+// what the hook saw
+static bool spooled		= false;	// body was in a file when the request was done
+static bool mappedearly	= false;	// httpMapContent() gave something before the body was complete
+
+// answers complete requests with the size of the body taken if it matches body, "mismatch" if not.
+static int spoolHook(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ)) return OK;
+
+	if (httpGetStatus(conn) == HTTP_REQ_HEADER_DONE) {
+		size_t size = 0;
+		if (httpMapContent(conn, &size) != NULL || size > 0) mappedearly = true;
+		return OK;
+	}
+
+	if (httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+	spooled = (ahttp->request.spool.fd >= 0);
+
+	size_t total		= httpGetContentSize(conn);
+	size_t size			= 0;
+	bool match			= true;
+	char* data;
+	const char* view;
+
+	switch (take) {
+	case TAKE_CONTENT:
+		while ((data = httpGetContent(conn, 10000, &size)) != NULL) {
+			if (size > 10000 || memcmp(data, body + (total - httpGetContentSize(conn) - size), size)) match = false;
+			free(data);
+		}
+		size = total - httpGetContentSize(conn);
+		break;
+
+	case TAKE_MIXED:
+		data = httpGetContent(conn, 100, &size);
+		if (data == NULL || size != 100 || memcmp(data, body, 100)) match = false;
+		free(data);
+		view = httpMapContent(conn, &size);
+		if (view == NULL || memcmp(view, body + 100, size)) match = false;
+		size += 100;
+		break;
+
+	case TAKE_MAP:
+		view = httpMapContent(conn, &size);
+		if (view == NULL || memcmp(view, body, size)) match = false;
+		// mapped once, the same view comes back.
+		if (httpMapContent(conn, NULL) != view) match = false;
+		break;
+
+	case TAKE_INBUF: {
+		struct evbuffer* inbuf = httpGetInbuf(conn);
+		size = evbuffer_get_length(inbuf);
+		data = malloc(size);
+		if (data == NULL || evbuffer_remove(inbuf, data, size) != (int) size || memcmp(data, body, size)) match = false;
+		free(data);
+		break;
+	}
+
+	case TAKE_FORM: {
+		paramview* params = httpGetFormParams(conn);
+		data = (params) ? paramViewGet(params, "b", 0) : NULL;
+		size = (data) ? strlen(data) : 0;
+		if (data == NULL || strspn(data, "x") != size) match = false;
+		free(data);
+		// the rest of the body is the "a" field.
+		total = size;
+		data = (params) ? paramViewGet(params, "a", 0) : NULL;
+		if (data == NULL || strcmp(data, "1")) match = false;
+		free(data);
+		break;
+	}
+	}
+
+	if (httpGetStatus(conn) == HTTP_ERROR) return CLOSE;
+
+	char echo[64];
+	int len = snprintf(echo, sizeof(echo), "%zu", size);
+
+	if (!match || size != total) len = snprintf(echo, sizeof(echo), "mismatch");
+
+	httpResponse(conn, HTTP_CODE_OK, "text/plain", echo, len);
+
+	return DONE;
+}
+
+/**
+* POST size bytes of body, the header first then the body in pieces of
+* chunk bytes.
+*
+* @return status code the request is answered with, the body goes to echo.
+*/
+static int post(server* webserver, const char* contenttype, const char* content, size_t size, size_t chunk, char* echo, size_t echosize) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	char header[256];
+	int len = snprintf(header, sizeof(header), "POST / HTTP/1.1\r\nHost: test\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+		contenttype, size);
+
+	spooled		= false;
+	mappedearly	= false;
+
+	testConnectionRead(conn, header, len);
+
+	for (size_t i = 0; i < size; i += chunk) {
+		testConnectionRead(conn, content + i, (size - i < chunk) ? size - i : chunk);
+	}
+
+	char* out = testConnectionOutput(conn);
+	char* response = strstr(out, "\r\n\r\n");
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (echo != NULL) snprintf(echo, echosize, "%s", (response) ? response + 4 : "");
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+static bool sendsBack(server* webserver, size_t size, size_t chunk) {
+
+	char echo[64];
+	char expected[64];
+
+	snprintf(expected, sizeof(expected), "%zu", size);
+
+	return (post(webserver, "application/octet-stream", body, size, chunk, echo, sizeof(echo)) == HTTP_CODE_OK && !strcmp(echo, expected));
+}
+
+int main(void) {
+
+	for (size_t i = 0; i < sizeof(body); i++) body[i] = 'a' + (i * 7) % 23;
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, spoolHook, NULL);
+
+	serverSetOption(webserver, "server.body_spool_size", "1024");
+
+	// every way of taking the body gets it back from the file.
+	int ways[] = { TAKE_CONTENT, TAKE_MAP, TAKE_MIXED, TAKE_INBUF };
+
+	for (size_t i = 0; i < sizeof(ways) / sizeof(ways[0]); i++) {
+
+		take = ways[i];
+
+		CHECK(sendsBack(webserver, BODY_SIZE, 4096));
+		CHECK(spooled && !mappedearly);
+		CHECK(sendsBack(webserver, BODY_SIZE, BODY_SIZE));
+		CHECK(spooled);
+		CHECK(sendsBack(webserver, 3000, 7));
+		CHECK(spooled && !mappedearly);
+
+		// at the threshold it stays in memory.
+		CHECK(sendsBack(webserver, 1024, 100));
+		CHECK(!spooled);
+	}
+
+	// form parameters of a spooled body
+	take = TAKE_FORM;
+
+	char form[4096] = "a=1&b=";
+	memset(form + 6, 'x', 3000);
+
+	char echo[64];
+	CHECK(post(webserver, "application/x-www-form-urlencoded", form, strlen(form), 512, echo, sizeof(echo)) == HTTP_CODE_OK);
+	CHECK(spooled && !strcmp(echo, "3000"));
+
+	// 0 keeps every body in memory.
+	take = TAKE_MAP;
+	serverSetOption(webserver, "server.body_spool_size", "0");
+	CHECK(sendsBack(webserver, BODY_SIZE, 4096));
+	CHECK(!spooled && !mappedearly);
+
+	// nowhere to spool to
+	serverSetOption(webserver, "server.body_spool_size", "1024");
+	serverSetOption(webserver, "server.body_spool_dir", "/nonexistent/spool");
+	CHECK(post(webserver, "application/octet-stream", body, 3000, 500, NULL, 0) == HTTP_CODE_INTERNAL_SERVER_ERROR);
+	CHECK(sendsBack(webserver, 1000, 500));
+
+	serverFree(webserver);
+
+	return TEST_RESULT();
+}
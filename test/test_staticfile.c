@@ -0,0 +1,167 @@
+/**
+ * @abstruct static file path escape test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_staticfile test/test_staticfile.c test/double_server.c \
+ *     staticfile.c http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "staticfile.h"
+#include "test.h"
+#include "double_server.h"
+
+static char base[PATH_MAX];
+
+static void makeDir(const char* name) {
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	if (mkdir(path, 0700) != 0) abort();
+}
+
+static void makeFile(const char* name, const char* content) {
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	FILE* fp = fopen(path, "w");
+
+	if (fp == NULL) abort();
+
+	fputs(content, fp);
+	fclose(fp);
+}
+
+static void makeLink(const char* target, const char* name) {
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	if (symlink(target, path) != 0) abort();
+}
+
+// errno of opening a path under docroot, 0 if it opened.
+static int openError(staticfile* sf, const char* name) {
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	int fd = staticFileOpen(sf, path);
+
+	if (fd < 0) return errno;
+
+	close(fd);
+	return 0;
+}
+
+// status code of a GET request.
+static int get(server* webserver, const char* uri) {
+
+	connection* conn = testConnectionNew(webserver);
+
+	char request[PATH_MAX + 64];
+	int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: test\r\n\r\n", uri);
+
+	testConnectionRead(conn, request, len);
+
+	char* out = testConnectionOutput(conn);
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	free(out);
+	testConnectionFree(conn);
+
+	return code;
+}
+
+int main(void) {
+
+	char tmpl[] = "/tmp/test_staticfile.XXXXXX";
+
+	if (mkdtemp(tmpl) == NULL) abort();
+
+	snprintf(base, sizeof(base), "%s", tmpl);
+
+	makeDir("root");
+	makeDir("root/sub");
+	makeDir("outside");
+	makeDir("rootx");
+
+	makeFile("root/in.txt", "in");
+	makeFile("outside/secret.txt", "secret");
+	makeFile("rootx/secret.txt", "secret");
+
+	char target[PATH_MAX];
+
+	makeLink("in.txt", "root/rel");
+	makeLink("sub/../in.txt", "root/subrel");
+	snprintf(target, sizeof(target), "%s/root/in.txt", base);
+	makeLink(target, "root/absin");
+	makeLink("..", "root/up");
+	snprintf(target, sizeof(target), "%s/outside", base);
+	makeLink(target, "root/abs");
+	makeLink("../outside/secret.txt", "root/out.txt");
+	makeLink("../up/outside", "root/sub/chain");
+
+	char docroot[PATH_MAX];
+	snprintf(docroot, sizeof(docroot), "%s/root", base);
+
+	staticfile* sf = staticFileNew("/static", docroot, 0);
+	CHECK(sf != NULL);
+
+	// links that stay in the docroot are followed.
+	CHECK(openError(sf, "root/in.txt") == 0);
+	CHECK(openError(sf, "root/rel") == 0);
+	CHECK(openError(sf, "root/subrel") == 0);
+	CHECK(openError(sf, "root/absin") == 0);
+
+	// any component leading out is refused, not only the last one.
+	CHECK(openError(sf, "root/out.txt") == EACCES);
+	CHECK(openError(sf, "root/up/outside/secret.txt") == EACCES);
+	CHECK(openError(sf, "root/abs/secret.txt") == EACCES);
+	CHECK(openError(sf, "root/sub/chain/secret.txt") == EACCES);
+	CHECK(openError(sf, "root/../outside/secret.txt") == EACCES);
+
+	// a sibling sharing the docroot as a name prefix is not under it.
+	CHECK(openError(sf, "rootx/secret.txt") == EACCES);
+
+	// dot segments never reach the file system.
+	char filepath[PATH_MAX + 1];
+	CHECK(staticFileMapPath(sf, "/static/../outside/secret.txt", filepath, sizeof(filepath)) == HTTP_CODE_FORBIDDEN);
+	CHECK(staticFileMapPath(sf, "/static/sub/./../in.txt", filepath, sizeof(filepath)) == HTTP_CODE_FORBIDDEN);
+	CHECK(staticFileMapPath(sf, "/static/in.txt", filepath, sizeof(filepath)) == 0);
+
+	// through the hook
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, staticFileHandler, sf);
+
+	CHECK(get(webserver, "/static/in.txt") == HTTP_CODE_OK);
+	CHECK(get(webserver, "/static/rel") == HTTP_CODE_OK);
+	CHECK(get(webserver, "/static/out.txt") == HTTP_CODE_FORBIDDEN);
+	CHECK(get(webserver, "/static/up/outside/secret.txt") == HTTP_CODE_FORBIDDEN);
+	CHECK(get(webserver, "/static/missing.txt") == HTTP_CODE_NOT_FOUND);
+
+	staticFileFree(sf);
+	serverFree(webserver);
+
+	char command[PATH_MAX + 16];
+	snprintf(command, sizeof(command), "rm -rf %s", base);
+	if (system(command) != 0) fprintf(stderr, "Failed to remove %s\n", base);
+
+	return TEST_RESULT();
+}
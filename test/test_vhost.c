@@ -0,0 +1,147 @@
+/**
+ * @abstruct virtual host routing test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -o test_vhost test/test_vhost.c vhost.c hashtable.c list.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "vhost.h"
+#include "test.h"
+
+int g_log_level = 0;
+
+// stubs of the server and http modules, the router only needs these.
+static int responded = 0;
+
+void* connectionGetExtra(connection* conn) {
+
+	return conn->userdata[1];
+}
+
+int connectionSetHookData(connection* conn, const void* owner, void* data) {
+
+	int freeslot = -1;
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) {
+
+			if (data == NULL) conn->hookdata[i].owner = NULL;
+
+			conn->hookdata[i].data = data;
+			return 0;
+		}
+
+		if (freeslot < 0 && conn->hookdata[i].owner == NULL) freeslot = i;
+	}
+
+	if (data == NULL) return 0;
+	if (freeslot < 0) return -1;
+
+	conn->hookdata[freeslot].owner	= owner;
+	conn->hookdata[freeslot].data	= data;
+
+	return 0;
+}
+
+void* connectionGetHookData(connection* conn, const void* owner) {
+
+	for (int i = 0; i < CONN_MAX_HOOKDATA; i++) {
+
+		if (conn->hookdata[i].owner == owner) return conn->hookdata[i].data;
+	}
+
+	return NULL;
+}
+
+int httpIsKeepaliveRequest(connection* conn) {
+
+	return 1;
+}
+
+enum http_request_status_e httpGetStatus(connection* conn) {
+
+	return ((http*) conn->userdata[1])->request.status;
+}
+
+int httpSetResponseHeader(connection* conn, const char* name, const char* value) {
+
+	return 0;
+}
+
+const char* httpGetReason(int code) {
+
+	return "Not Found";
+}
+
+size_t httpResponse(connection* conn, int code, const char* contenttype, const void* data, off_t size) {
+
+	responded = code;
+	return 0;
+}
+
+// site hook recording the events it sees.
+static short seen = 0;
+
+static int siteHook(short event, connection* conn, void* userdata) {
+
+	seen |= event;
+	return OK;
+}
+
+static void newRequest(connection* conn, http* ahttp, char* domain, enum http_request_status_e status) {
+
+	memset(conn, 0, sizeof(connection));
+	memset(ahttp, 0, sizeof(http));
+	ahttp->request.domain	= domain;
+	ahttp->request.status	= status;
+	conn->userdata[1]		= ahttp;
+	seen					= 0;
+	responded				= 0;
+}
+
+int main(void) {
+
+	vhost* vh = vhostNew();
+	vhostSite* site = vhostAddSite(vh, "*.domain.com");
+	vhostRegisterHook(site, siteHook, NULL);
+
+	CHECK(vhostLookup(vh, "www.domain.com") == site);
+	CHECK(vhostLookup(vh, "a.b.domain.com") == site);
+	CHECK(vhostLookup(vh, "domain.com") == NULL);
+
+	connection conn;
+	http ahttp;
+
+	// a site that took the request sees its close even after an error.
+	newRequest(&conn, &ahttp, "www.domain.com", HTTP_REQ_HEADER_DONE);
+	CHECK(vhostHandler(EVENT_READ, &conn, vh) == OK);
+	CHECK(seen == EVENT_READ);
+	ahttp.request.status = HTTP_ERROR;
+	CHECK(vhostHandler(EVENT_CLOSE, &conn, vh) == OK);
+	CHECK(seen & EVENT_CLOSE);
+	CHECK(connectionGetHookData(&conn, vh) == NULL);
+
+	// a request closed before its header was in belongs to no site.
+	newRequest(&conn, &ahttp, NULL, HTTP_REQ_REQUESTLINE_DONE);
+	CHECK(vhostHandler(EVENT_CLOSE, &conn, vh) == OK);
+	CHECK(seen == 0);
+
+	// requests no site takes get 404.
+	newRequest(&conn, &ahttp, "other.com", HTTP_REQ_DONE);
+	vhostHandler(EVENT_READ, &conn, vh);
+	CHECK(responded == HTTP_CODE_NOT_FOUND);
+	CHECK(seen == 0);
+	CHECK(vh->misses == 1);
+
+	vhostFree(vh);
+
+	return TEST_RESULT();
+}
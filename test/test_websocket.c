@@ -0,0 +1,351 @@
+/**
+ * @abstruct WebSocket framing and UTF-8 validation test
+ * @author rockmetoo <rockmetoo@gmail.com>
+ *
+ * gcc -std=gnu11 -iquote include -iquote test -o test_websocket test/test_websocket.c test/double_server.c \
+ *     websocket.c http.c http2.c hpack.c compress.c coder.c string.c hashtable.c list.c listtable.c \
+ *     -levent -levent_openssl -lssl -lcrypto -lz
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <event2/buffer.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "websocket.h"
+#include "test.h"
+#include "double_server.h"
+
+#define HANDSHAKE \
+	"GET /ws HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n" \
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+
+// last message delivered to the endpoint
+static struct {
+	int		count;
+	int		opcode;
+	size_t	size;
+	char	data[80000];
+} message;
+
+static int closecode = 0;
+
+static int onMessage(websocket* ws, int opcode, const void* data, size_t size, void* userdata) {
+
+	message.count++;
+	message.opcode	= opcode;
+	message.size	= size;
+
+	if (size < sizeof(message.data)) memcpy(message.data, data, size);
+
+	return 0;
+}
+
+static void onClose(websocket* ws, void* userdata) {
+
+	closecode = ws->closecode;
+}
+
+// status code of the handshake ended by rest, the connection is returned in connp on 101.
+static int handshake(server* webserver, const char* rest, connection** connp) {
+
+	char request[512];
+	snprintf(request, sizeof(request), HANDSHAKE "%s", rest);
+
+	connection* conn = testConnectionNew(webserver);
+
+	testConnectionRead(conn, request, strlen(request));
+
+	char* out = testConnectionOutput(conn);
+	int code = 0;
+
+	sscanf(out, "HTTP/1.1 %d", &code);
+
+	if (code == HTTP_CODE_SWITCHING_PROTOCOLS) {
+		CHECK(strstr(out, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != NULL);
+	}
+
+	free(out);
+
+	if (connp != NULL && code == HTTP_CODE_SWITCHING_PROTOCOLS) {
+		*connp = conn;
+	} else {
+		testConnectionFree(conn);
+	}
+
+	return code;
+}
+
+static connection* openConnection(server* webserver) {
+
+	connection* conn = NULL;
+
+	if (handshake(webserver, "\r\n", &conn) != HTTP_CODE_SWITCHING_PROTOCOLS) abort();
+
+	memset(&message, 0, sizeof(message));
+	closecode = 0;
+
+	return conn;
+}
+
+/**
+* send a masked client frame, byte by byte if bytewise.
+*
+* @return status of the hook chain.
+*/
+static int sendFrame(connection* conn, bool fin, int opcode, const void* payload, size_t size, bool bytewise) {
+
+	static const uint8_t mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+	struct evbuffer* buf = evbuffer_new();
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	size_t headerlen = 2;
+
+	header[0] = ((fin) ? 0x80 : 0x00) | opcode;
+
+	if (size < 126) {
+		header[1] = 0x80 | size;
+	} else if (size <= 0xffff) {
+		header[1] = 0x80 | 126;
+		header[2] = size >> 8;
+		header[3] = size;
+		headerlen += 2;
+	} else {
+		header[1] = 0x80 | 127;
+		for (int i = 0; i < 8; i++) header[2 + i] = (uint64_t) size >> (56 - i * 8);
+		headerlen += 8;
+	}
+
+	memcpy(header + headerlen, mask, 4);
+	evbuffer_add(buf, header, headerlen + 4);
+
+	for (size_t i = 0; i < size; i++) {
+		uint8_t c = ((const uint8_t*) payload)[i] ^ mask[i % 4];
+		evbuffer_add(buf, &c, 1);
+	}
+
+	size_t len = evbuffer_get_length(buf);
+	const uint8_t* data = evbuffer_pullup(buf, len);
+	int status = OK;
+
+	if (bytewise) {
+		for (size_t i = 0; i < len && status != CLOSE; i++) status = testConnectionRead(conn, data + i, 1);
+	} else {
+		status = testConnectionRead(conn, data, len);
+	}
+
+	evbuffer_free(buf);
+
+	return status;
+}
+
+static int sendText(connection* conn, const char* text) {
+
+	return sendFrame(conn, true, WEBSOCKET_TEXT, text, strlen(text), false);
+}
+
+/**
+* first frame the server sent since the last call, the payload goes to
+* payload if given.
+*
+* @return opcode, -1 if nothing was sent.
+*/
+static int readFrame(connection* conn, char* payload, size_t size) {
+
+	struct evbuffer* buf = evbuffer_new();
+	size_t len = testConnectionOutputBuffer(conn, buf);
+	int opcode = -1;
+
+	if (len >= 2) {
+
+		uint8_t* p = evbuffer_pullup(buf, len);
+
+		// server frames are never masked, control frames are short.
+		opcode = p[0] & 0x0f;
+
+		if (payload != NULL) snprintf(payload, size, "%.*s", (int) p[1], p + 2);
+	}
+
+	evbuffer_free(buf);
+
+	return opcode;
+}
+
+// status code of the close frame the server sent, -1 if none.
+static int readCloseCode(connection* conn) {
+
+	char payload[128];
+
+	if (readFrame(conn, payload, sizeof(payload)) != WEBSOCKET_CLOSE) return -1;
+
+	return ((uint8_t) payload[0] << 8) | (uint8_t) payload[1];
+}
+
+// send a single frame on a new connection, return the code the server closed with.
+static int failWith(server* webserver, bool fin, int opcode, const void* payload, size_t size) {
+
+	connection* conn = openConnection(webserver);
+
+	int status = sendFrame(conn, fin, opcode, payload, size, false);
+	int code = readCloseCode(conn);
+
+	testConnectionFree(conn);
+
+	CHECK(status == CLOSE);
+	CHECK(closecode == code);
+
+	return code;
+}
+
+// send a text message in two fragments split at the offset, the second one byte by byte.
+static int sendFragments(connection* conn, const char* text, size_t textlen, size_t split) {
+
+	int status = sendFrame(conn, false, WEBSOCKET_TEXT, text, split, false);
+
+	if (status == CLOSE) return status;
+
+	return sendFrame(conn, true, WEBSOCKET_CONTINUATION, text + split, textlen - split, true);
+}
+
+int main(void) {
+
+	websocketEndpoint* ep = websocketEndpointNew("/ws", onMessage, NULL);
+	websocketEndpointSetCallbacks(ep, NULL, onClose);
+
+	server* webserver = serverNew();
+	serverRegisterHook(webserver, httpHandler, NULL);
+	serverRegisterHook(webserver, websocketHandler, ep);
+
+	// opening handshake
+	CHECK(handshake(webserver, "\r\n", NULL) == HTTP_CODE_SWITCHING_PROTOCOLS);
+
+	// missing or bad handshake headers
+	const char* nokey = "GET /ws HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	connection* conn = testConnectionNew(webserver);
+	testConnectionRead(conn, nokey, strlen(nokey));
+	char* out = testConnectionOutput(conn);
+	CHECK(!strncmp(out, "HTTP/1.1 400", 12));
+	free(out);
+	testConnectionFree(conn);
+
+	const char* noversion = "GET /ws HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+	conn = testConnectionNew(webserver);
+	testConnectionRead(conn, noversion, strlen(noversion));
+	out = testConnectionOutput(conn);
+	CHECK(!strncmp(out, "HTTP/1.1 426", 12));
+	free(out);
+	testConnectionFree(conn);
+
+	CHECK(handshake(webserver, "Content-Length: 5\r\n\r\nhello", NULL) == HTTP_CODE_BAD_REQUEST);
+
+	// a text message
+	conn = openConnection(webserver);
+	CHECK(sendText(conn, "Hello") == TAKEOVER);
+	CHECK(message.count == 1 && message.opcode == WEBSOCKET_TEXT && message.size == 5 && !strcmp(message.data, "Hello"));
+
+	// fragments are joined, control frames may come between them.
+	CHECK(sendFrame(conn, false, WEBSOCKET_TEXT, "Hel", 3, false) == TAKEOVER);
+	CHECK(sendFrame(conn, true, WEBSOCKET_PING, "ping", 4, true) == TAKEOVER);
+	CHECK(message.count == 1);
+
+	char payload[128];
+	CHECK(readFrame(conn, payload, sizeof(payload)) == WEBSOCKET_PONG && !strcmp(payload, "ping"));
+
+	CHECK(sendFrame(conn, true, WEBSOCKET_CONTINUATION, "lo", 2, false) == TAKEOVER);
+	CHECK(message.count == 2 && !strcmp(message.data, "Hello"));
+
+	// 16 and 64 bit payload lengths
+	static uint8_t binary[70000];
+	for (size_t i = 0; i < sizeof(binary); i++) binary[i] = i;
+
+	CHECK(sendFrame(conn, true, WEBSOCKET_BINARY, binary, 300, true) == TAKEOVER);
+	CHECK(message.count == 3 && message.opcode == WEBSOCKET_BINARY && message.size == 300 && !memcmp(message.data, binary, 300));
+
+	CHECK(sendFrame(conn, true, WEBSOCKET_BINARY, binary, sizeof(binary), false) == TAKEOVER);
+	CHECK(message.count == 4 && message.size == sizeof(binary) && !memcmp(message.data, binary, sizeof(binary)));
+
+	// the closing handshake echoes the status code.
+	CHECK(sendFrame(conn, true, WEBSOCKET_CLOSE, "\x03\xe8" "bye", 5, false) == CLOSE);
+	CHECK(readCloseCode(conn) == WEBSOCKET_CLOSE_NORMAL);
+	testConnectionFree(conn);
+	CHECK(closecode == WEBSOCKET_CLOSE_NORMAL);
+
+	// UTF-8 split anywhere, also in the middle of a character.
+	const char* greek = "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5 and a long ASCII run \xf0\x9f\x98\x80";
+	size_t greeklen = strlen(greek);
+
+	for (size_t split = 0; split <= greeklen; split++) {
+
+		conn = openConnection(webserver);
+		CHECK(sendFragments(conn, greek, greeklen, split) == TAKEOVER);
+		CHECK(message.count == 1 && !strcmp(message.data, greek));
+		testConnectionFree(conn);
+	}
+
+	// invalid UTF-8 fails the connection with 1007.
+	const char* invalid[] = {
+		"\xc0\x80",						// overlong NUL
+		"\xe0\x80\xaf",					// overlong slash
+		"\xed\xa0\x80",					// surrogate
+		"\xf4\x90\x80\x80",				// above U+10FFFF
+		"\xf5\x80\x80\x80",				// invalid lead byte
+		"\x80",							// lone continuation byte
+		"\xe2\x82",						// ends in the middle of a character
+		"ascii run of eight bytes \xff",	// invalid byte after the fast path
+		NULL
+	};
+
+	for (int i = 0; invalid[i] != NULL; i++) {
+		CHECK(failWith(webserver, true, WEBSOCKET_TEXT, invalid[i], strlen(invalid[i])) == WEBSOCKET_CLOSE_INVALID_DATA);
+	}
+
+	// binary messages are not text.
+	conn = openConnection(webserver);
+	CHECK(sendFrame(conn, true, WEBSOCKET_BINARY, "\xff\xfe", 2, false) == TAKEOVER);
+	CHECK(message.count == 1);
+	testConnectionFree(conn);
+
+	// close reasons are checked too.
+	CHECK(failWith(webserver, true, WEBSOCKET_CLOSE, "\x03\xe8\xff", 3) == WEBSOCKET_CLOSE_INVALID_DATA);
+
+	// framing errors fail the connection with 1002.
+	CHECK(failWith(webserver, true, WEBSOCKET_CONTINUATION, "a", 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, false, WEBSOCKET_PING, "a", 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, true, WEBSOCKET_PING, binary, WEBSOCKET_MAX_CONTROL_SIZE + 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, true, 0x3, "a", 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, true, 0x40 | WEBSOCKET_TEXT, "a", 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, true, WEBSOCKET_CLOSE, "\x03", 1) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	CHECK(failWith(webserver, true, WEBSOCKET_CLOSE, "\x03\xed", 2) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+	// a new message before the last one ended
+	conn = openConnection(webserver);
+	CHECK(sendFrame(conn, false, WEBSOCKET_TEXT, "a", 1, false) == TAKEOVER);
+	CHECK(sendFrame(conn, true, WEBSOCKET_TEXT, "b", 1, false) == CLOSE);
+	CHECK(readCloseCode(conn) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	testConnectionFree(conn);
+
+	// client frames must be masked, four bytes stand where the key would be.
+	conn = openConnection(webserver);
+	CHECK(testConnectionRead(conn, "\x81\x01" "abcd", 6) == CLOSE);
+	CHECK(readCloseCode(conn) == WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	testConnectionFree(conn);
+
+	// messages over the limit, counted across fragments.
+	websocketEndpointSetMaxMessageSize(ep, 4);
+	CHECK(failWith(webserver, true, WEBSOCKET_TEXT, "abcde", 5) == WEBSOCKET_CLOSE_TOO_BIG);
+
+	conn = openConnection(webserver);
+	CHECK(sendFrame(conn, false, WEBSOCKET_TEXT, "abc", 3, false) == TAKEOVER);
+	CHECK(sendFrame(conn, true, WEBSOCKET_CONTINUATION, "de", 2, false) == CLOSE);
+	CHECK(readCloseCode(conn) == WEBSOCKET_CLOSE_TOO_BIG);
+	CHECK(message.count == 0);
+	testConnectionFree(conn);
+
+	serverFree(webserver);
+	websocketEndpointFree(ep);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,1099 @@
+/**
+ * @abstruct TLS context helpers
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+
+#include "common.h"
+#include "tls.h"
+
+// every context and loop shares one set of ticket keys, so a ticket sealed
+// by any of them opens in all.
+static tlsTicketRing ticketring = {
+	.lock		= PTHREAD_RWLOCK_INITIALIZER,
+	.rotation	= TLS_DEF_TICKET_ROTATION,
+};
+
+// private functions
+static bool		getTicketKey(const unsigned char* name, tlsTicketKey* key, int* index);
+static bool		rotateTicketKeys(time_t now);
+static int		ticketKeyCallback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc);
+static tlsCert*	findCert(tlsSNI* sni, const char* servername);
+static SSL_CTX*	loadCert(tlsSNI* sni, tlsCert* cert);
+static void		freeCert(tlsCert* cert);
+static int		servernameCallback(SSL* ssl, int* alert, void* userdata);
+static void*	handshakeWorker(void* userdata);
+static int		driveHandshake(tlsHandshake* hs);
+static void		finishHandshake(tlsHandshakePool* pool, tlsHandshake* hs, bool established, bool timedout);
+static void		freeHandshakes(tlsHandshakePool* pool, tlsHandshake* hs);
+static void		handshakeDoneCallback(evutil_socket_t fd, short what, void* userdata);
+static void		recordSizerCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata);
+static bool		setRecordSize(SSL* ssl, size_t size);
+static uint64_t	elapsedUsec(const struct timespec* since);
+
+/**
+* Create a server context with modern defaults.
+*
+* TLS 1.2 and 1.3 only, forward secret AEAD ciphers, no compression or
+* renegotiation. Sessions can be resumed from the server side cache and with
+* tickets sealed by keys that rotate on their own.
+*
+* @param certpath PEM encoded certificate chain, leaf first.
+* @param pkeypath PEM encoded private key.
+*
+* @return context or NULL on failure.
+*/
+SSL_CTX* tlsContextNew(const char* certpath, const char* pkeypath) {
+
+	SSL_CTX* sslctx = SSL_CTX_new(TLS_server_method());
+
+	if (sslctx == NULL) return NULL;
+
+	SSL_CTX_set_min_proto_version(sslctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(sslctx, SSL_OP_NO_COMPRESSION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_mode(sslctx, SSL_MODE_RELEASE_BUFFERS);
+
+	if (!SSL_CTX_set_cipher_list(sslctx, TLS_DEF_CIPHERS)
+	|| !SSL_CTX_use_certificate_chain_file(sslctx, certpath)
+	|| !SSL_CTX_use_PrivateKey_file(sslctx, pkeypath, SSL_FILETYPE_PEM)
+	|| !SSL_CTX_check_private_key(sslctx)) {
+
+		SSL_CTX_free(sslctx);
+		return NULL;
+	}
+
+	tlsSetSessionCache(sslctx, TLS_DEF_SESSION_CACHE, TLS_DEF_SESSION_TIMEOUT);
+
+	if (tlsSetTicketRotation(sslctx, ticketring.rotation) != 0) {
+		SSL_CTX_free(sslctx);
+		return NULL;
+	}
+
+	return sslctx;
+}
+
+/**
+* @param size sessions kept in the server side cache, 0 to disable it.
+* @param timeout seconds a session or ticket can be resumed.
+*/
+void tlsSetSessionCache(SSL_CTX* sslctx, long size, long timeout) {
+
+	static const unsigned char sidctx[] = "server";
+
+	SSL_CTX_set_session_id_context(sslctx, sidctx, sizeof(sidctx) - 1);
+	SSL_CTX_set_timeout(sslctx, timeout);
+
+	if (size <= 0) {
+		SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_OFF);
+		return;
+	}
+
+	SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(sslctx, size);
+}
+
+/**
+* Seal session tickets with the shared rotating keys.
+*
+* A key seals new tickets for rotation seconds, then it is only accepted for
+* TLS_TICKET_KEYS - 1 more rotations and tickets it opens are reissued.
+* Rotation happens on the first ticket sealed after it is due, no timer is
+* needed. The interval is shared by every context.
+*
+* @param rotation seconds between rotations, 0 to disable tickets.
+*
+* @return 0 on success, -1 on error.
+*/
+int tlsSetTicketRotation(SSL_CTX* sslctx, int rotation) {
+
+	if (rotation <= 0) {
+		SSL_CTX_set_options(sslctx, SSL_OP_NO_TICKET);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&ticketring.lock);
+	ticketring.rotation = rotation;
+	bool ready = (ticketring.numkeys > 0 || rotateTicketKeys(time(NULL)));
+	pthread_rwlock_unlock(&ticketring.lock);
+
+	if (!ready) return -1;
+
+	SSL_CTX_clear_options(sslctx, SSL_OP_NO_TICKET);
+
+	return (SSL_CTX_set_tlsext_ticket_key_evp_cb(sslctx, ticketKeyCallback) == 1) ? 0 : -1;
+}
+
+/**
+* Let the kernel encrypt records once the handshake is over (Linux kTLS).
+*
+* Sockets where the kernel can't take the negotiated cipher stay in user
+* space quietly. On the others files are sent with tlsSendFile() without
+* being read into user space.
+*
+* @return false if this OpenSSL build has no kTLS support.
+*/
+bool tlsEnableKTLS(SSL_CTX* sslctx, bool enable) {
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (enable) {
+		SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+	} else {
+		SSL_CTX_clear_options(sslctx, SSL_OP_ENABLE_KTLS);
+	}
+
+	return true;
+#else
+	return !enable;
+#endif
+}
+
+/**
+* Check whether the kernel encrypts what is sent on the connection, so files
+* can go out with tlsSendFile().
+*/
+bool tlsCanSendFile(SSL* ssl) {
+
+#ifdef SSL_OP_ENABLE_KTLS
+	return (ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl)));
+#else
+	return false;
+#endif
+}
+
+/**
+* Send a range of file straight from the page cache with SSL_sendfile().
+*
+* Only once tlsCanSendFile() is true, and with nothing else pending in the
+* SSL object.
+*
+* @return bytes sent, 0 if the socket can't take more now, -1 on error.
+*/
+ssize_t tlsSendFile(SSL* ssl, int fd, off_t offset, size_t size) {
+
+#ifdef SSL_OP_ENABLE_KTLS
+	ERR_clear_error();
+
+	ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, size, 0);
+
+	if (sent > 0) return sent;
+
+	return (SSL_get_error(ssl, (int) sent) == SSL_ERROR_WANT_WRITE) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+/**
+* Put handshake, resumption and ticket counters into the stats table.
+*
+* OpenSSL keeps the handshake counters anyway, they are copied over only
+* when stats are asked for.
+*/
+void tlsUpdateStats(SSL_CTX* sslctx, hashtable* stats) {
+
+	long handshakes	= SSL_CTX_sess_accept_good(sslctx);
+	long resumed	= SSL_CTX_sess_hits(sslctx);
+
+	stats->putint(stats, "tls.handshakes", handshakes);
+	stats->putint(stats, "tls.handshakes_full", handshakes - resumed);
+	stats->putint(stats, "tls.handshakes_resumed", resumed);
+	stats->putint(stats, "tls.resumption_rate", (handshakes > 0) ? resumed * 100 / handshakes : 0);
+	stats->putint(stats, "tls.session_cache_size", SSL_CTX_sess_number(sslctx));
+	stats->putint(stats, "tls.session_cache_full", SSL_CTX_sess_cache_full(sslctx));
+	stats->putint(stats, "tls.session_timeouts", SSL_CTX_sess_timeouts(sslctx));
+
+	stats->putint(stats, "tls.ticket_rotations", __atomic_load_n(&ticketring.rotations, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.tickets_issued", __atomic_load_n(&ticketring.issued, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.tickets_renewed", __atomic_load_n(&ticketring.renewed, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.tickets_rejected", __atomic_load_n(&ticketring.rejected, __ATOMIC_RELAXED));
+}
+
+/**
+* Create SNI certificate selection.
+*
+* Certificates are only registered up front, each is loaded by the first
+* handshake asking for its name and kept from then on. A large number of
+* certificates costs nothing at startup.
+*
+* @param configure called on every loaded context, NULL for none.
+*
+* @return selection or NULL on failure.
+*/
+tlsSNI* tlsSNINew(tlsConfigureCallback configure, void* userdata) {
+
+	tlsSNI* sni = NEW(tlsSNI);
+
+	if (sni == NULL) return NULL;
+
+	if (pthread_rwlock_init(&sni->lock, NULL) != 0) {
+		free(sni);
+		return NULL;
+	}
+
+	if ((sni->certs = ahashtable(0, 0)) == NULL) {
+		tlsSNIFree(sni);
+		return NULL;
+	}
+
+	sni->configure	= configure;
+	sni->userdata	= userdata;
+
+	return sni;
+}
+
+/**
+* Register the certificate of a server name, or replace it.
+*
+* A replaced certificate is loaded again by the next handshake, connections
+* that already use the old one keep it until they close. Safe to call while
+* the server is running.
+*
+* @param servername ex) "www.domain.com", or "*.domain.com" for one level of
+* subdomains as wildcard certificates cover. Case does not matter.
+*
+* @return 0 on success, -1 on error.
+*/
+int tlsSNIAddCert(tlsSNI* sni, const char* servername, const char* certpath, const char* pkeypath) {
+
+	size_t len = strlen(servername);
+
+	if (len == 0 || len > TLS_MAX_SERVERNAME) return -1;
+
+	tlsCert* cert = NEW(tlsCert);
+
+	if (cert == NULL) return -1;
+
+	cert->servername	= strdup(servername);
+	cert->certpath		= strdup(certpath);
+	cert->pkeypath		= strdup(pkeypath);
+
+	if (cert->servername == NULL || cert->certpath == NULL || cert->pkeypath == NULL) {
+		freeCert(cert);
+		return -1;
+	}
+
+	for (char* p = cert->servername; *p != '\0'; p++) *p = tolower((unsigned char) *p);
+
+	pthread_rwlock_wrlock(&sni->lock);
+
+	// unlink the one being replaced
+	for (tlsCert** link = &sni->first; *link != NULL; link = &(*link)->next) {
+
+		if (strcmp((*link)->servername, cert->servername)) continue;
+
+		tlsCert* old = *link;
+		*link = old->next;
+		freeCert(old);
+		break;
+	}
+
+	cert->next = sni->first;
+	sni->first = cert;
+
+	sni->certs->put(sni->certs, cert->servername, &cert, sizeof(tlsCert*));
+
+	pthread_rwlock_unlock(&sni->lock);
+
+	return 0;
+}
+
+/**
+* Pick certificates by server name on handshakes of the context. Clients
+* without SNI or with an unknown name get the certificate of the context.
+*/
+void tlsSNIAttach(tlsSNI* sni, SSL_CTX* sslctx) {
+
+	SSL_CTX_set_tlsext_servername_callback(sslctx, servernameCallback);
+	SSL_CTX_set_tlsext_servername_arg(sslctx, sni);
+}
+
+void tlsSNIUpdateStats(tlsSNI* sni, hashtable* stats) {
+
+	stats->putint(stats, "tls.sni_hits", __atomic_load_n(&sni->hits, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.sni_misses", __atomic_load_n(&sni->misses, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.sni_loads", __atomic_load_n(&sni->loads, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.sni_failures", __atomic_load_n(&sni->failures, __ATOMIC_RELAXED));
+}
+
+/**
+* Release the selection. Contexts in use by connections stay until they close.
+*/
+void tlsSNIFree(tlsSNI* sni) {
+
+	if (sni == NULL) return;
+
+	while (sni->first != NULL) {
+
+		tlsCert* cert = sni->first;
+		sni->first = cert->next;
+
+		freeCert(cert);
+	}
+
+	if (sni->certs) sni->certs->free(sni->certs);
+
+	pthread_rwlock_destroy(&sni->lock);
+
+	free(sni);
+}
+
+/**
+* Create a pool of threads running handshakes off the event loop.
+*
+* Accepted sockets are handed to the pool with tlsHandshakeStart(), each
+* thread polls many of them and does the handshake crypto, so a burst of new
+* clients doesn't hold up requests in flight on the loop. Connections come
+* back through cb on the loop once established, ready for a bufferevent with
+* BUFFEREVENT_SSL_OPEN.
+*
+* @param numthreads handshake threads.
+* @param timeout seconds a handshake can take, 0 for TLS_DEF_HANDSHAKE_TIMEOUT.
+* @param maxqueue handshakes on the pool at once, connections over it are
+* dropped. 0 for TLS_DEF_HANDSHAKE_QUEUE.
+*
+* @return pool or NULL on failure.
+*/
+tlsHandshakePool* tlsHandshakePoolNew(struct event_base* evbase, int numthreads, int timeout, int maxqueue, tlsHandshakeCallback cb, void* userdata) {
+
+	if (numthreads <= 0) return NULL;
+
+	tlsHandshakePool* pool = NEW(tlsHandshakePool);
+
+	if (pool == NULL) return NULL;
+
+	pool->cb		= cb;
+	pool->userdata	= userdata;
+	pool->timeout	= (timeout > 0) ? timeout : TLS_DEF_HANDSHAKE_TIMEOUT;
+	pool->maxqueue	= (maxqueue > 0) ? maxqueue : TLS_DEF_HANDSHAKE_QUEUE;
+	pool->donefd	= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	if (pool->donefd < 0
+	|| (pool->doneevent = event_new(evbase, pool->donefd, EV_READ | EV_PERSIST, handshakeDoneCallback, pool)) == NULL
+	|| event_add(pool->doneevent, NULL) != 0
+	|| (pool->workers = calloc(numthreads, sizeof(tlsHandshakeWorker))) == NULL) {
+		tlsHandshakePoolFree(pool);
+		return NULL;
+	}
+
+	for (; pool->numworkers < numthreads; pool->numworkers++) {
+
+		tlsHandshakeWorker* worker = &pool->workers[pool->numworkers];
+
+		worker->pool	= pool;
+		worker->wakefd	= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		pthread_mutex_init(&worker->lock, NULL);
+
+		if (worker->wakefd < 0 || pthread_create(&worker->thread, NULL, handshakeWorker, worker) != 0) {
+
+			if (worker->wakefd >= 0) close(worker->wakefd);
+			pthread_mutex_destroy(&worker->lock);
+
+			tlsHandshakePoolFree(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/**
+* Hand an accepted socket to the pool. Call on the loop thread.
+*
+* @param ssl new server side SSL object, its socket is set here.
+*
+* @return 0 on success, -1 if the queue is full or on error. The caller
+* still owns ssl and socket on failure.
+*/
+int tlsHandshakeStart(tlsHandshakePool* pool, SSL* ssl, evutil_socket_t socket) {
+
+	uint64_t queued = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+
+	if (queued >= (uint64_t) pool->maxqueue) {
+		__atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	tlsHandshake* hs = NEW(tlsHandshake);
+
+	if (hs == NULL) return -1;
+
+	if (SSL_set_fd(ssl, socket) != 1) {
+		free(hs);
+		return -1;
+	}
+
+	SSL_set_accept_state(ssl);
+
+	hs->ssl		= ssl;
+	hs->socket	= socket;
+	hs->events	= POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &hs->started);
+
+	queued = __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+	if (queued > pool->maxqueued) pool->maxqueued = queued;
+
+	tlsHandshakeWorker* worker = &pool->workers[pool->nextworker];
+	pool->nextworker = (pool->nextworker + 1) % pool->numworkers;
+
+	pthread_mutex_lock(&worker->lock);
+	hs->next			= worker->incoming;
+	worker->incoming	= hs;
+	pthread_mutex_unlock(&worker->lock);
+
+	uint64_t one = 1;
+	if (write(worker->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		WARN("Failed to wake handshake thread. (errno:%d)", errno);
+	}
+
+	return 0;
+}
+
+/**
+* Put handshake queue depth and latency into the stats table.
+*/
+void tlsHandshakeUpdateStats(tlsHandshakePool* pool, hashtable* stats) {
+
+	uint64_t completed	= __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+	uint64_t latency	= __atomic_load_n(&pool->latency, __ATOMIC_RELAXED);
+
+	stats->putint(stats, "tls.handshake_queue", __atomic_load_n(&pool->queued, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.handshake_queue_max", pool->maxqueued);
+	stats->putint(stats, "tls.handshakes_offloaded", completed);
+	stats->putint(stats, "tls.handshake_failures", __atomic_load_n(&pool->failed, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.handshake_timeouts", __atomic_load_n(&pool->timeouts, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.handshakes_rejected", __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED));
+	stats->putint(stats, "tls.handshake_latency_avg_us", (completed > 0) ? latency / completed : 0);
+	stats->putint(stats, "tls.handshake_latency_max_us", __atomic_load_n(&pool->maxlatency, __ATOMIC_RELAXED));
+}
+
+/**
+* Stop the threads and release the pool. Handshakes still running are
+* dropped. Call on the loop thread, before the event base is freed.
+*/
+void tlsHandshakePoolFree(tlsHandshakePool* pool) {
+
+	if (pool == NULL) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->numworkers; i++) {
+
+		tlsHandshakeWorker* worker = &pool->workers[i];
+
+		uint64_t one = 1;
+		if (write(worker->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			WARN("Failed to wake handshake thread. (errno:%d)", errno);
+		}
+
+		pthread_join(worker->thread, NULL);
+
+		close(worker->wakefd);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	freeHandshakes(pool, pool->done);
+
+	if (pool->doneevent) event_free(pool->doneevent);
+	if (pool->donefd >= 0) close(pool->donefd);
+
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->workers);
+	free(pool);
+}
+
+/**
+* Size the TLS records of a connection by how it is being used.
+*
+* Records start small, so the first bytes of a response can be decrypted as
+* soon as one TCP segment is in. Once threshold bytes went out records grow to
+* TLS_MAX_RECORD for throughput, and after idle milliseconds without writes
+* they are small again. Works on any SSL object, whatever its context is.
+*
+* OpenSSL reads the size once per SSL_write(), and bufferevent writes a chunk
+* of the out-buffer at a time, so a new size applies from the next chunk.
+*
+* @param out plaintext buffer the connection writes from, its drains are
+* what counts as sent.
+* @param small record payload at start, 512 to TLS_MAX_RECORD.
+*
+* @return sizer or NULL on failure. Free it before the buffer.
+*/
+tlsRecordSizer* tlsRecordSizerNew(SSL* ssl, struct evbuffer* out, size_t small, size_t threshold, int idle) {
+
+	if (ssl == NULL || small < 512 || small > TLS_MAX_RECORD) return NULL;
+
+	tlsRecordSizer* sizer = NEW(tlsRecordSizer);
+
+	if (sizer == NULL) return NULL;
+
+	sizer->ssl			= ssl;
+	sizer->out			= out;
+	sizer->small		= small;
+	sizer->threshold	= threshold;
+	sizer->idle			= idle;
+	clock_gettime(CLOCK_MONOTONIC, &sizer->lastwrite);
+
+	if (!setRecordSize(ssl, small)
+	|| (sizer->cbentry = evbuffer_add_cb(out, recordSizerCallback, sizer)) == NULL) {
+		free(sizer);
+		return NULL;
+	}
+
+	return sizer;
+}
+
+void tlsRecordSizerFree(tlsRecordSizer* sizer) {
+
+	if (sizer == NULL) return;
+
+	evbuffer_remove_cb_entry(sizer->out, sizer->cbentry);
+
+	free(sizer);
+}
+
+// private functions
+
+/**
+* Copy the current key when name is NULL, otherwise the key with the name.
+* Rotates first if the current key is due.
+*
+* @param index position of the key is stored here, 0 is current.
+*/
+static bool getTicketKey(const unsigned char* name, tlsTicketKey* key, int* index) {
+
+	time_t now = time(NULL);
+
+	pthread_rwlock_rdlock(&ticketring.lock);
+
+	bool due = (name == NULL && ticketring.rotation > 0 && now - ticketring.keys[0].created >= ticketring.rotation);
+
+	if (due) {
+
+		pthread_rwlock_unlock(&ticketring.lock);
+		pthread_rwlock_wrlock(&ticketring.lock);
+
+		// another thread may have rotated in between.
+		if (now - ticketring.keys[0].created >= ticketring.rotation) rotateTicketKeys(now);
+	}
+
+	bool found = false;
+
+	for (int i = 0; i < ticketring.numkeys && !found; i++) {
+
+		if (name != NULL && memcmp(ticketring.keys[i].name, name, TLS_TICKET_NAME_LEN)) continue;
+
+		// retired keys expire too, a ticket can't outlive its rotations.
+		if (ticketring.rotation > 0 && now - ticketring.keys[i].created >= (time_t) ticketring.rotation * TLS_TICKET_KEYS) break;
+
+		*key	= ticketring.keys[i];
+		*index	= i;
+		found	= true;
+	}
+
+	pthread_rwlock_unlock(&ticketring.lock);
+
+	return found;
+}
+
+/**
+* Make a new current key, the oldest one drops out. Call with the write lock held.
+*/
+static bool rotateTicketKeys(time_t now) {
+
+	tlsTicketKey key;
+
+	if (RAND_bytes(key.name, sizeof(key.name)) != 1
+	|| RAND_bytes(key.aeskey, sizeof(key.aeskey)) != 1
+	|| RAND_bytes(key.hmackey, sizeof(key.hmackey)) != 1) {
+		WARN("Failed to generate session ticket key.");
+		return false;
+	}
+
+	key.created = now;
+
+	memmove(&ticketring.keys[1], &ticketring.keys[0], sizeof(tlsTicketKey) * (TLS_TICKET_KEYS - 1));
+	ticketring.keys[0] = key;
+
+	if (ticketring.numkeys < TLS_TICKET_KEYS) ticketring.numkeys++;
+
+	__atomic_add_fetch(&ticketring.rotations, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/**
+* Seal (enc=1) or open a session ticket.
+*
+* @return 1 to go on, 2 to go on and reissue the ticket, 0 to ignore the
+* ticket and do a full handshake, -1 on error.
+*/
+static int ticketKeyCallback(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* cctx, EVP_MAC_CTX* hctx, int enc) {
+
+	tlsTicketKey key;
+	int index;
+
+	if (!getTicketKey((enc) ? NULL : name, &key, &index)) {
+
+		if (enc) return -1;
+
+		__atomic_add_fetch(&ticketring.rejected, 1, __ATOMIC_RELAXED);
+
+		return 0;
+	}
+
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmackey, sizeof(key.hmackey)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end(),
+	};
+
+	if (enc) {
+
+		memcpy(name, key.name, TLS_TICKET_NAME_LEN);
+
+		if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1
+		|| !EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv)
+		|| !EVP_MAC_CTX_set_params(hctx, params)) {
+			return -1;
+		}
+
+	} else if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv)
+	|| !EVP_MAC_CTX_set_params(hctx, params)) {
+		return -1;
+	}
+
+	if (enc) {
+		__atomic_add_fetch(&ticketring.issued, 1, __ATOMIC_RELAXED);
+	} else if (index > 0) {
+		__atomic_add_fetch(&ticketring.renewed, 1, __ATOMIC_RELAXED);
+	}
+
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return (enc || index == 0) ? 1 : 2;
+}
+
+/**
+* Find the certificate of a server name, the exact name first, then the
+* wildcard of its parent. Call with the lock held.
+*/
+static tlsCert* findCert(tlsSNI* sni, const char* servername) {
+
+	tlsCert** found = (tlsCert**) sni->certs->get(sni->certs, servername, NULL, false);
+
+	if (found != NULL) return *found;
+
+	const char* dot = strchr(servername, '.');
+
+	if (dot == NULL) return NULL;
+
+	char key[TLS_MAX_SERVERNAME + 2];
+	snprintf(key, sizeof(key), "*%s", dot);
+
+	found = (tlsCert**) sni->certs->get(sni->certs, key, NULL, false);
+
+	return (found != NULL) ? *found : NULL;
+}
+
+/**
+* Load the certificate if it is not yet. Call with the write lock held.
+*
+* @return context, NULL if loading failed.
+*/
+static SSL_CTX* loadCert(tlsSNI* sni, tlsCert* cert) {
+
+	if (cert->sslctx != NULL || cert->failed) return cert->sslctx;
+
+	if ((cert->sslctx = tlsContextNew(cert->certpath, cert->pkeypath)) == NULL) {
+
+		WARN("Couldn't load certificate file(%s) or private key file(%s).", cert->certpath, cert->pkeypath);
+
+		cert->failed = true;
+		__atomic_add_fetch(&sni->failures, 1, __ATOMIC_RELAXED);
+
+		return NULL;
+	}
+
+	if (sni->configure) sni->configure(cert->sslctx, sni->userdata);
+
+	__atomic_add_fetch(&sni->loads, 1, __ATOMIC_RELAXED);
+
+	return cert->sslctx;
+}
+
+static void freeCert(tlsCert* cert) {
+
+	// connections using the context hold their own reference.
+	if (cert->sslctx) SSL_CTX_free(cert->sslctx);
+
+	free(cert->servername);
+	free(cert->certpath);
+	free(cert->pkeypath);
+	free(cert);
+}
+
+/**
+* Switch the connection to the context of the requested server name.
+*
+* Session cache and tickets stay with the context the connection started on,
+* so resumption works across all names.
+*/
+static int servernameCallback(SSL* ssl, int* alert, void* userdata) {
+
+	tlsSNI* sni				= (tlsSNI*) userdata;
+	const char* servername	= SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	size_t len				= (servername) ? strlen(servername) : 0;
+
+	if (len == 0 || len > TLS_MAX_SERVERNAME) {
+		__atomic_add_fetch(&sni->misses, 1, __ATOMIC_RELAXED);
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+	char name[TLS_MAX_SERVERNAME + 1];
+
+	for (size_t i = 0; i <= len; i++) name[i] = tolower((unsigned char) servername[i]);
+
+	pthread_rwlock_rdlock(&sni->lock);
+
+	tlsCert* cert		= findCert(sni, name);
+	SSL_CTX* sslctx		= (cert) ? cert->sslctx : NULL;
+	bool load			= (cert != NULL && sslctx == NULL && !cert->failed);
+
+	// SSL_set_SSL_CTX() takes its own reference, the context may be replaced right after.
+	if (sslctx != NULL) SSL_set_SSL_CTX(ssl, sslctx);
+
+	pthread_rwlock_unlock(&sni->lock);
+
+	if (load) {
+
+		pthread_rwlock_wrlock(&sni->lock);
+
+		// may have been loaded or replaced in between.
+		if ((cert = findCert(sni, name)) != NULL && (sslctx = loadCert(sni, cert)) != NULL) {
+			SSL_set_SSL_CTX(ssl, sslctx);
+		}
+
+		pthread_rwlock_unlock(&sni->lock);
+	}
+
+	__atomic_add_fetch((sslctx != NULL) ? &sni->hits : &sni->misses, 1, __ATOMIC_RELAXED);
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+* Handshake thread. New handshakes are tried right away, a ClientHello is
+* usually in already, the rest wait in poll() until their socket is ready or
+* the timeout is over.
+*/
+static void* handshakeWorker(void* userdata) {
+
+	tlsHandshakeWorker* worker	= (tlsHandshakeWorker*) userdata;
+	tlsHandshakePool* pool		= worker->pool;
+
+	tlsHandshake* pending	= NULL;		// handshakes waiting for their socket
+	struct pollfd* fds		= NULL;
+	size_t numfds			= 0;
+	int timeoutms			= pool->timeout * 1000;
+
+	for (;;) {
+
+		pthread_mutex_lock(&pool->lock);
+		bool stopping = pool->stopping;
+		pthread_mutex_unlock(&pool->lock);
+
+		pthread_mutex_lock(&worker->lock);
+		tlsHandshake* incoming = worker->incoming;
+		worker->incoming = NULL;
+		pthread_mutex_unlock(&worker->lock);
+
+		if (stopping) {
+			freeHandshakes(pool, incoming);
+			break;
+		}
+
+		while (incoming != NULL) {
+
+			tlsHandshake* hs	= incoming;
+			incoming			= hs->next;
+
+			int result = driveHandshake(hs);
+
+			if (result != 0) {
+				finishHandshake(pool, hs, (result > 0), false);
+				continue;
+			}
+
+			hs->next	= pending;
+			pending		= hs;
+		}
+
+		// wakefd first, then the sockets in list order.
+		size_t count = 1;
+
+		for (tlsHandshake* hs = pending; hs != NULL; hs = hs->next) count++;
+
+		if (count > numfds) {
+
+			struct pollfd* newfds = realloc(fds, sizeof(struct pollfd) * count * 2);
+
+			if (newfds == NULL) {
+				WARN("Failed to grow handshake poll set.");
+				freeHandshakes(pool, pending);
+				pending = NULL;
+				continue;
+			}
+
+			fds		= newfds;
+			numfds	= count * 2;
+		}
+
+		fds[0].fd		= worker->wakefd;
+		fds[0].events	= POLLIN;
+
+		// the oldest handshake decides how long to wait.
+		int waitms = -1;
+		size_t i = 1;
+
+		for (tlsHandshake* hs = pending; hs != NULL; hs = hs->next, i++) {
+
+			fds[i].fd		= hs->socket;
+			fds[i].events	= hs->events;
+
+			int leftms = timeoutms - (int) (elapsedUsec(&hs->started) / 1000);
+
+			if (leftms < 0) leftms = 0;
+			if (waitms < 0 || leftms < waitms) waitms = leftms;
+		}
+
+		if (poll(fds, count, waitms) < 0 && errno != EINTR) {
+			WARN("Handshake poll failed. (errno:%d)", errno);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			uint64_t value;
+			if (read(worker->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+				WARN("Failed to read handshake wakeup. (errno:%d)", errno);
+			}
+		}
+
+		tlsHandshake** link = &pending;
+		i = 1;
+
+		for (tlsHandshake* hs = pending; hs != NULL; hs = *link, i++) {
+
+			int result		= 0;
+			bool timedout	= false;
+
+			if (fds[i].revents != 0) {
+				result = driveHandshake(hs);
+			}
+
+			if (result == 0 && elapsedUsec(&hs->started) >= (uint64_t) timeoutms * 1000) {
+				result		= -1;
+				timedout	= true;
+			}
+
+			if (result == 0) {
+				link = &hs->next;
+				continue;
+			}
+
+			*link = hs->next;
+			finishHandshake(pool, hs, (result > 0), timedout);
+		}
+	}
+
+	freeHandshakes(pool, pending);
+	free(fds);
+
+	return NULL;
+}
+
+/**
+* @return 1 when established, 0 when waiting for the socket, -1 on failure.
+*/
+static int driveHandshake(tlsHandshake* hs) {
+
+	ERR_clear_error();
+
+	int result = SSL_do_handshake(hs->ssl);
+
+	if (result == 1) return 1;
+
+	switch (SSL_get_error(hs->ssl, result)) {
+
+		case SSL_ERROR_WANT_READ : {
+			hs->events = POLLIN;
+			return 0;
+		}
+
+		case SSL_ERROR_WANT_WRITE : {
+			hs->events = POLLOUT;
+			return 0;
+		}
+
+		default : {
+			return -1;
+		}
+	}
+}
+
+/**
+* Queue an established handshake for the loop, drop a failed one. Called on
+* the handshake thread.
+*/
+static void finishHandshake(tlsHandshakePool* pool, tlsHandshake* hs, bool established, bool timedout) {
+
+	if (!established) {
+
+		__atomic_add_fetch(&pool->failed, 1, __ATOMIC_RELAXED);
+		if (timedout) __atomic_add_fetch(&pool->timeouts, 1, __ATOMIC_RELAXED);
+
+		hs->next = NULL;
+		freeHandshakes(pool, hs);
+
+		return;
+	}
+
+	uint64_t usec	= elapsedUsec(&hs->started);
+	uint64_t max	= __atomic_load_n(&pool->maxlatency, __ATOMIC_RELAXED);
+
+	while (usec > max && !__atomic_compare_exchange_n(&pool->maxlatency, &max, usec, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	__atomic_add_fetch(&pool->latency, usec, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->completed, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&pool->lock);
+	hs->next	= pool->done;
+	pool->done	= hs;
+	pthread_mutex_unlock(&pool->lock);
+
+	uint64_t one = 1;
+	if (write(pool->donefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		WARN("Failed to signal finished handshake. (errno:%d)", errno);
+	}
+}
+
+/**
+* Release handshakes of a list along with their connections.
+*/
+static void freeHandshakes(tlsHandshakePool* pool, tlsHandshake* hs) {
+
+	while (hs != NULL) {
+
+		tlsHandshake* next = hs->next;
+
+		SSL_free(hs->ssl);
+		evutil_closesocket(hs->socket);
+		free(hs);
+
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+		hs = next;
+	}
+}
+
+/**
+* Hand established connections over on the loop thread.
+*/
+static void handshakeDoneCallback(evutil_socket_t fd, short what, void* userdata) {
+
+	tlsHandshakePool* pool = (tlsHandshakePool*) userdata;
+
+	uint64_t value;
+	if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+		WARN("Failed to read handshake notification. (errno:%d)", errno);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	tlsHandshake* hs = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	while (hs != NULL) {
+
+		tlsHandshake* next = hs->next;
+
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+		pool->cb(hs->ssl, hs->socket, pool->userdata);
+		free(hs);
+
+		hs = next;
+	}
+}
+
+/**
+* Runs before bufferevent writes what was added and after it drained what
+* SSL_write() took.
+*/
+static void recordSizerCallback(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* userdata) {
+
+	tlsRecordSizer* sizer = (tlsRecordSizer*) userdata;
+
+	// a response after a pause starts over with small records.
+	if (info->n_added > 0 && info->orig_size == 0 && elapsedUsec(&sizer->lastwrite) >= (uint64_t) sizer->idle * 1000) {
+
+		sizer->sent = 0;
+
+		if (sizer->grown) {
+			sizer->grown = false;
+			setRecordSize(sizer->ssl, sizer->small);
+		}
+	}
+
+	if (info->n_deleted > 0) {
+
+		clock_gettime(CLOCK_MONOTONIC, &sizer->lastwrite);
+
+		sizer->sent += info->n_deleted;
+
+		if (!sizer->grown && sizer->sent >= sizer->threshold) {
+			sizer->grown = true;
+			setRecordSize(sizer->ssl, TLS_MAX_RECORD);
+		}
+	}
+}
+
+/**
+* Lowering the max fragment lowers the split fragment too, which doesn't come
+* back up on its own.
+*/
+static bool setRecordSize(SSL* ssl, size_t size) {
+
+	return (SSL_set_max_send_fragment(ssl, size) == 1 && SSL_set_split_send_fragment(ssl, size) == 1);
+}
+
+static uint64_t elapsedUsec(const struct timespec* since) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
@@ -0,0 +1,291 @@
+/**
+ * @abstruct virtual host routing module
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "server.h"
+#include "http.h"
+#include "vhost.h"
+
+// private functions
+static vhostSite*	getSite(vhost* vh, const char* key);
+static void			freeSite(vhostSite* site);
+static int			callSiteHooks(vhostSite* site, short event, connection* conn);
+static int			rejectRequest(connection* conn);
+
+/**
+* Create a virtual host router.
+*
+* Each site has its own hook chain, the site of a request is found with a
+* hash lookup on the domain of its Host header.
+*
+* @code
+* vhost* vh = vhostNew();
+* vhostSite* blog = vhostAddSite(vh, "blog.domain.com");
+* vhostRegisterHook(blog, staticFileHandler, sf);
+* vhostSite* apps = vhostAddSite(vh, "*.apps.domain.com");
+* vhostRegisterHook(apps, proxyHandler, px);
+* serverRegisterHook(webserver, httpHandler, NULL);
+* serverRegisterHook(webserver, vhostHandler, vh);
+* @endcode
+*
+* @return router or NULL on failure.
+*/
+vhost* vhostNew(void) {
+
+	vhost* vh = NEW(vhost);
+
+	if (vh == NULL) return NULL;
+
+	if ((vh->sites = ahashtable(0, 0)) == NULL) {
+		free(vh);
+		return NULL;
+	}
+
+	return vh;
+}
+
+/**
+* Add a site, or get the one the domain already has.
+*
+* @param domain exact domain ex) "www.domain.com", wildcard ex) "*.domain.com"
+* which takes every subdomain at any depth but not domain.com itself, or "*"
+* for requests no other site takes. Case does not matter.
+*
+* @return site to register hooks on, NULL on failure.
+*/
+vhostSite* vhostAddSite(vhost* vh, const char* domain) {
+
+	size_t len = strlen(domain);
+
+	if (len == 0 || len > VHOST_MAX_DOMAIN + 1) return NULL;
+
+	char key[VHOST_MAX_DOMAIN + 2];
+
+	for (size_t i = 0; i <= len; i++) key[i] = tolower((unsigned char) domain[i]);
+
+	vhostSite* site = (!strcmp(key, "*")) ? vh->defaultsite : getSite(vh, key);
+
+	if (site != NULL) return site;
+
+	if ((site = NEW(vhostSite)) == NULL) return NULL;
+
+	site->domain	= strdup(key);
+	site->hooks		= alist(0);
+
+	if (site->domain == NULL || site->hooks == NULL) {
+		freeSite(site);
+		return NULL;
+	}
+
+	if (!strcmp(key, "*")) {
+		vh->defaultsite = site;
+	} else {
+		vh->sites->put(vh->sites, key, &site, sizeof(vhostSite*));
+	}
+
+	site->next	= vh->first;
+	vh->first	= site;
+
+	return site;
+}
+
+/**
+* Register hook on the site.
+*/
+void vhostRegisterHook(vhostSite* site, callback cb, void* userdata) {
+
+	vhostRegisterHookOnMethod(site, NULL, cb, userdata);
+}
+
+/**
+* Register hook on the site, called only for requests with the method.
+*/
+void vhostRegisterHookOnMethod(vhostSite* site, const char* method, callback cb, void* userdata) {
+
+	vhostHook ahook;
+	bzero((void*) &ahook, sizeof(vhostHook));
+	ahook.method	= (method) ? strdup(method) : NULL;
+	ahook.cb		= cb;
+	ahook.userdata	= userdata;
+	site->hooks->addlast(site->hooks, (void*) &ahook, sizeof(vhostHook));
+}
+
+/**
+* Find the site of a domain. The exact domain is tried first, then wildcards
+* from the closest parent up, then the default site.
+*
+* @param domain lowercased domain without port, as in request.domain.
+*
+* @return site, NULL if none takes the domain.
+*/
+vhostSite* vhostLookup(vhost* vh, const char* domain) {
+
+	if (domain == NULL) return vh->defaultsite;
+
+	vhostSite* site = getSite(vh, domain);
+
+	if (site != NULL) return site;
+
+	char key[VHOST_MAX_DOMAIN + 2];
+
+	for (const char* dot = strchr(domain, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+
+		if (strlen(dot) > VHOST_MAX_DOMAIN) continue;
+
+		snprintf(key, sizeof(key), "*%s", dot);
+
+		if ((site = getSite(vh, key)) != NULL) return site;
+	}
+
+	return vh->defaultsite;
+}
+
+/**
+* Release the router and its sites.
+*/
+void vhostFree(vhost* vh) {
+
+	if (vh == NULL) return;
+
+	while (vh->first != NULL) {
+
+		vhostSite* site = vh->first;
+		vh->first = site->next;
+
+		freeSite(site);
+	}
+
+	if (vh->sites) vh->sites->free(vh->sites);
+
+	free(vh);
+}
+
+/**
+* Virtual host hook.
+*
+* Events of a request go through the hook chain of its site. When every hook
+* of the site returns OK, the hooks registered after this one are called as
+* usual. Requests no site takes get 404.
+*
+* @note
+* This hook must be registered after httpHandler. Site hooks don't see
+* EVENT_INIT, the site is not known until the request header is in. Once a
+* site took a request it sees every later event of it, EVENT_CLOSE included,
+* even when the request ends in HTTP_ERROR.
+*/
+int vhostHandler(short event, connection* conn, void* userdata) {
+
+	vhost* vh	= (vhost*) userdata;
+	http* ahttp	= (http*) connectionGetExtra(conn);
+
+	if ((event & EVENT_INIT) || ahttp == NULL) return OK;
+
+	enum http_request_status_e status = ahttp->request.status;
+
+	vhostSite* site = (vhostSite*) connectionGetHookData(conn, vh);
+
+	if (site == NULL) {
+
+		// a request closed before its header was in belongs to no site.
+		if (status != HTTP_REQ_HEADER_DONE && status != HTTP_REQ_DONE) return OK;
+
+		if ((site = vhostLookup(vh, ahttp->request.domain)) == NULL) {
+
+			if (!(event & EVENT_READ)) return OK;
+
+			vh->misses++;
+
+			return rejectRequest(conn);
+		}
+
+		// site hooks may keep state until EVENT_CLOSE, which must reach them.
+		if (connectionSetHookData(conn, vh, site) < 0) return CLOSE;
+	}
+
+	if ((event & EVENT_READ) && status == HTTP_REQ_DONE) vh->requests++;
+
+	int result = callSiteHooks(site, event, conn);
+
+	if (event & EVENT_CLOSE) connectionSetHookData(conn, vh, NULL);
+
+	return result;
+}
+
+// private functions
+
+static vhostSite* getSite(vhost* vh, const char* key) {
+
+	vhostSite** found = (vhostSite**) vh->sites->get(vh->sites, key, NULL, false);
+
+	return (found != NULL) ? *found : NULL;
+}
+
+static void freeSite(vhostSite* site) {
+
+	if (site->hooks) {
+
+		vhostHook* ahook;
+
+		while ((ahook = site->hooks->popfirst(site->hooks, NULL))) {
+			if (ahook->method) free(ahook->method);
+			free(ahook);
+		}
+
+		site->hooks->free(site->hooks);
+	}
+
+	if (site->domain) free(site->domain);
+
+	free(site);
+}
+
+/**
+* Same as the server hook chain, stops at the first hook that doesn't return OK.
+*/
+static int callSiteHooks(vhostSite* site, short event, connection* conn) {
+
+	listObj obj;
+	bzero((void*) &obj, sizeof(listObj));
+
+	while (site->hooks->getnext(site->hooks, &obj, false) == true) {
+
+		vhostHook* ahook = (vhostHook*) obj.data;
+
+		if (ahook->cb == NULL) continue;
+
+		if (ahook->method && conn->method && strcmp(ahook->method, conn->method)) continue;
+
+		int status = ahook->cb(event, conn, ahook->userdata);
+
+		if (status != OK) return status;
+	}
+
+	return OK;
+}
+
+/**
+* Answer 404. The connection is kept only when the whole body has been read.
+*/
+static int rejectRequest(connection* conn) {
+
+	int result = (httpIsKeepaliveRequest(conn) && httpGetStatus(conn) == HTTP_REQ_DONE) ? DONE : CLOSE;
+
+	if (conn->parent == NULL) {
+		httpSetResponseHeader(conn, "Connection", (result == DONE) ? "Keep-Alive" : "close");
+	}
+
+	const char* reason = httpGetReason(HTTP_CODE_NOT_FOUND);
+	httpResponse(conn, HTTP_CODE_NOT_FOUND, "text/plain", reason, strlen(reason));
+
+	return result;
+}
@@ -0,0 +1,826 @@
+/**
+ * @abstruct WebSocket library
+ * @author rockmetoo <rockmetoo@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <openssl/sha.h>
+#include <event2/buffer.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "coder.h"
+#include "http.h"
+#include "websocket.h"
+
+// private functions
+static int		acceptConnection(websocketEndpoint* ep, connection* conn, http* ahttp);
+static int		validateHandshake(connection* conn, http* ahttp);
+static bool		hasToken(const char* value, const char* token);
+static int		processFrames(websocket* ws, struct evbuffer* in);
+static int		parseHeader(websocket* ws, struct evbuffer* in);
+static int		moveDataPayload(websocket* ws, struct evbuffer* in);
+static int		processControlFrame(websocket* ws, struct evbuffer* in);
+static int		deliverMessage(websocket* ws);
+static int		failConnection(websocket* ws, int code);
+static size_t	formatHeader(uint8_t* buf, int opcode, size_t size);
+static void		unmask(uint8_t* data, size_t size, const uint8_t mask[4], size_t offset);
+static bool		validateUtf8(websocket* ws, const uint8_t* data, size_t size);
+static bool		isValidCloseCode(int code);
+static void		freeSession(connection* conn, void* userdata);
+
+/**
+* Create an endpoint accepting WebSocket connections on the url path.
+*
+* @return endpoint or NULL on failure.
+*/
+websocketEndpoint* websocketEndpointNew(const char* path, websocketMessageCallback onmessage, void* userdata) {
+
+	if (path == NULL || onmessage == NULL) return NULL;
+
+	websocketEndpoint* ep = NEW(websocketEndpoint);
+
+	if (ep == NULL) return NULL;
+
+	if ((ep->path = strdup(path)) == NULL) {
+		free(ep);
+		return NULL;
+	}
+
+	ep->maxmessagesize	= WEBSOCKET_DEF_MAX_MESSAGE_SIZE;
+	ep->onmessage		= onmessage;
+	ep->userdata		= userdata;
+
+	return ep;
+}
+
+void websocketEndpointSetCallbacks(websocketEndpoint* ep, websocketEventCallback onopen, websocketEventCallback onclose) {
+
+	ep->onopen	= onopen;
+	ep->onclose	= onclose;
+}
+
+/**
+* Set the limit of a reassembled message. Bigger messages close the
+* connection with 1009.
+*/
+void websocketEndpointSetMaxMessageSize(websocketEndpoint* ep, size_t maxmessagesize) {
+
+	ep->maxmessagesize = maxmessagesize;
+}
+
+/**
+* Free the endpoint. Must not be called while its connections are alive.
+*/
+void websocketEndpointFree(websocketEndpoint* ep) {
+
+	if (ep == NULL) return;
+
+	free(ep->path);
+	free(ep);
+}
+
+/**
+* WebSocket hook.
+*
+* Upgrades requests on the endpoint path, then parses frames of upgraded
+* connections right from the in-buffer.
+*
+* @note
+* Register right after the HTTP handler, hooks in between would see the
+* upgraded connection as a finished request.
+*
+* @code
+* websocketEndpoint* ep = websocketEndpointNew("/ws", onMessage, NULL);
+* serverRegisterHook(server, httpHandler, NULL);
+* serverRegisterHook(server, websocketHandler, ep);
+* @endcode
+*/
+int websocketHandler(short event, connection* conn, void* userdata) {
+
+	if (!(event & EVENT_READ)) return OK;
+
+	websocketEndpoint* ep	= (websocketEndpoint*) userdata;
+	websocket* ws			= (websocket*) connectionGetProtocol(conn, WEBSOCKET_PROTOCOL_NAME);
+
+	if (ws != NULL) {
+
+		// connection of another endpoint.
+		if (ws->endpoint != ep) return OK;
+
+		return processFrames(ws, conn->in);
+	}
+
+	if (conn->protocol != NULL || httpGetStatus(conn) != HTTP_REQ_DONE) return OK;
+
+	http* ahttp = (http*) connectionGetExtra(conn);
+
+	if (ahttp->request.path == NULL || strcmp(ahttp->request.path, ep->path)) return OK;
+
+	return acceptConnection(ep, conn, ahttp);
+}
+
+/**
+* Send a message in a single frame.
+*
+* Frame header and payload are written into one space reserved in the
+* out-buffer.
+*
+* @param opcode WEBSOCKET_TEXT, WEBSOCKET_BINARY or a control opcode.
+*
+* @return 0 on success, -1 on error.
+*/
+int websocketSend(websocket* ws, int opcode, const void* data, size_t size) {
+
+	if (ws->closesent) return -1;
+
+	if ((opcode & 0x08) && size > WEBSOCKET_MAX_CONTROL_SIZE) return -1;
+
+	struct evbuffer_iovec vec;
+
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	size_t headerlen = formatHeader(header, opcode, size);
+
+	if (evbuffer_reserve_space(ws->conn->out, headerlen + size, &vec, 1) < 1) return -1;
+
+	memcpy(vec.iov_base, header, headerlen);
+	if (size > 0) memcpy((char*) vec.iov_base + headerlen, data, size);
+
+	vec.iov_len = headerlen + size;
+
+	return (evbuffer_commit_space(ws->conn->out, &vec, 1)) ? -1 : 0;
+}
+
+/**
+* Send a message in a single frame without copying the payload.
+*
+* The payload is referenced from the out-buffer and release is called once
+* it has been written out. release is called in every case, also when the
+* frame couldn't be queued.
+*
+* @return 0 on success, -1 on error.
+*/
+int websocketSendRef(websocket* ws, int opcode, const void* data, size_t size, evbuffer_ref_cleanup_cb release, void* userdata) {
+
+	if (ws->closesent || ((opcode & 0x08) && size > WEBSOCKET_MAX_CONTROL_SIZE)) {
+		if (release) release(data, size, userdata);
+		return -1;
+	}
+
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+	size_t headerlen = formatHeader(header, opcode, size);
+
+	if (evbuffer_add(ws->conn->out, header, headerlen)) {
+		if (release) release(data, size, userdata);
+		return -1;
+	}
+
+	if (size == 0) {
+		if (release) release(data, size, userdata);
+		return 0;
+	}
+
+	if (evbuffer_add_reference(ws->conn->out, data, size, release, userdata)) {
+		if (release) release(data, size, userdata);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+* Start the closing handshake. No more messages can be sent afterwards.
+*
+* @param reason UTF-8 text, may be NULL.
+*
+* @return 0 on success, -1 on error.
+*/
+int websocketClose(websocket* ws, int code, const char* reason) {
+
+	if (ws->closesent) return -1;
+
+	uint8_t payload[WEBSOCKET_MAX_CONTROL_SIZE];
+	size_t size = 0;
+
+	// 1005 and 1006 are reserved for reporting, they send an empty close frame.
+	if (code != WEBSOCKET_CLOSE_NO_STATUS && code != WEBSOCKET_CLOSE_ABNORMAL) {
+
+		payload[0]	= (uint8_t) (code >> 8);
+		payload[1]	= (uint8_t) code;
+		size		= 2;
+
+		if (reason != NULL) {
+
+			size_t reasonlen = strlen(reason);
+
+			if (reasonlen > sizeof(payload) - size) reasonlen = sizeof(payload) - size;
+
+			memcpy(payload + size, reason, reasonlen);
+			size += reasonlen;
+		}
+	}
+
+	int status = websocketSend(ws, WEBSOCKET_CLOSE, payload, size);
+
+	ws->closesent = true;
+	if (ws->closecode == 0) ws->closecode = code;
+
+	return status;
+}
+
+// private functions
+
+static int acceptConnection(websocketEndpoint* ep, connection* conn, http* ahttp) {
+
+	int code = validateHandshake(conn, ahttp);
+
+	if (code != HTTP_CODE_SWITCHING_PROTOCOLS) {
+
+		if (code == HTTP_CODE_UPGRADE_REQUIRED) {
+			httpSetResponseHeader(conn, "Sec-WebSocket-Version", WEBSOCKET_VERSION);
+			httpSetResponseHeader(conn, "Upgrade", WEBSOCKET_PROTOCOL_NAME);
+		}
+
+		const char* reason = httpGetReason(code);
+		httpResponse(conn, code, "text/plain", reason, strlen(reason));
+
+		return httpIsKeepaliveRequest(conn) ? DONE : CLOSE;
+	}
+
+	// Sec-WebSocket-Accept = base64(SHA1(key + GUID))
+	const char* key = httpGetRequestHeader(conn, "Sec-WebSocket-Key");
+
+	char keyguid[24 + sizeof(WEBSOCKET_GUID)];
+	snprintf(keyguid, sizeof(keyguid), "%s%s", key, WEBSOCKET_GUID);
+
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*) keyguid, strlen(keyguid), digest);
+
+	char* accept = base64Encode(digest, sizeof(digest));
+
+	if (accept == NULL) return CLOSE;
+
+	websocket* ws = NEW(websocket);
+
+	if (ws == NULL || (ws->message = evbuffer_new()) == NULL) {
+		if (ws) free(ws);
+		free(accept);
+		return CLOSE;
+	}
+
+	ws->conn		= conn;
+	ws->endpoint	= ep;
+	ws->userdata	= ep->userdata;
+
+	httpSetResponseHeader(conn, "Upgrade", WEBSOCKET_PROTOCOL_NAME);
+	httpSetResponseHeader(conn, "Connection", "Upgrade");
+	httpSetResponseHeader(conn, "Sec-WebSocket-Accept", accept);
+	httpSetResponseCode(conn, HTTP_CODE_SWITCHING_PROTOCOLS, httpGetReason(HTTP_CODE_SWITCHING_PROTOCOLS));
+	httpSendHeaderBlock(conn, NULL, 0, 0);
+
+	free(accept);
+
+	connectionSetProtocol(conn, WEBSOCKET_PROTOCOL_NAME, ws, freeSession);
+
+	DEBUG("WebSocket connection opened on %s", ep->path);
+
+	if (ep->onopen) ep->onopen(ws, ws->userdata);
+
+	if (ws->closesent) return CLOSE;
+
+	// frames may have arrived right behind the request.
+	if (evbuffer_get_length(conn->in) > 0) return processFrames(ws, conn->in);
+
+	return TAKEOVER;
+}
+
+/**
+* @return 101 if the request is a valid opening handshake, otherwise the
+* status code to reject it with.
+*/
+static int validateHandshake(connection* conn, http* ahttp) {
+
+	// RFC 8441 extended CONNECT is not supported on HTTP/2 streams.
+	if (conn->parent != NULL) return HTTP_CODE_BAD_REQUEST;
+
+	if (strcmp(ahttp->request.method, "GET") || strcmp(ahttp->request.httpver, HTTP_PROTOCOL_11)) {
+		return HTTP_CODE_BAD_REQUEST;
+	}
+
+	if (!hasToken(httpGetRequestHeader(conn, "Upgrade"), WEBSOCKET_PROTOCOL_NAME)
+		|| !hasToken(httpGetRequestHeader(conn, "Connection"), "Upgrade")) {
+		return HTTP_CODE_UPGRADE_REQUIRED;
+	}
+
+	const char* version = httpGetRequestHeader(conn, "Sec-WebSocket-Version");
+
+	if (version == NULL || strcmp(version, WEBSOCKET_VERSION)) return HTTP_CODE_UPGRADE_REQUIRED;
+
+	// base64 of 16 random bytes
+	const char* key = httpGetRequestHeader(conn, "Sec-WebSocket-Key");
+
+	if (key == NULL || strlen(key) != 24 || strcmp(key + 22, "==")) return HTTP_CODE_BAD_REQUEST;
+
+	// no body is allowed, there is no way to tell it from frames.
+	if (ahttp->request.contentlength > 0 || httpGetContentSize(conn) > 0) return HTTP_CODE_BAD_REQUEST;
+
+	return HTTP_CODE_SWITCHING_PROTOCOLS;
+}
+
+/**
+* Find a token in a comma separated header value, case-insensitively.
+*/
+static bool hasToken(const char* value, const char* token) {
+
+	if (value == NULL) return false;
+
+	size_t tokenlen = strlen(token);
+
+	while (*value != '\0') {
+
+		value += strspn(value, " \t,");
+
+		size_t len = strcspn(value, ",");
+
+		// trim trailing spaces of the element
+		size_t end = len;
+		while (end > 0 && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+
+		if (end == tokenlen && !strncasecmp(value, token, tokenlen)) return true;
+
+		value += len;
+	}
+
+	return false;
+}
+
+/**
+* Process as many frames as the in-buffer holds.
+*
+* @return TAKEOVER to keep the connection, CLOSE to close it.
+*/
+static int processFrames(websocket* ws, struct evbuffer* in) {
+
+	for (;;) {
+
+		int status;
+
+		switch (ws->state) {
+			case WEBSOCKET_FRAME_HEADER:
+				status = parseHeader(ws, in);
+				break;
+
+			case WEBSOCKET_FRAME_PAYLOAD:
+				status = moveDataPayload(ws, in);
+				break;
+
+			case WEBSOCKET_FRAME_CONTROL:
+				status = processControlFrame(ws, in);
+				break;
+
+			default:
+				return failConnection(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+		}
+
+		// 0: need more data, 1: progressed
+		if (status == 0) return TAKEOVER;
+		if (status < 0) return CLOSE;
+	}
+}
+
+/**
+* @return 1 if a frame header was consumed, 0 if more data is needed, -1 on
+* error.
+*/
+static int parseHeader(websocket* ws, struct evbuffer* in) {
+
+	uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+
+	size_t avail = evbuffer_get_length(in);
+
+	if (avail < 2) return 0;
+
+	evbuffer_copyout(in, header, 2);
+
+	uint8_t len7		= header[1] & 0x7f;
+	size_t headerlen	= 2 + ((len7 == 126) ? 2 : (len7 == 127) ? 8 : 0) + 4;
+
+	if (avail < headerlen) return 0;
+
+	evbuffer_remove(in, header, headerlen);
+
+	ws->fin		= (header[0] & 0x80) != 0;
+	ws->opcode	= header[0] & 0x0f;
+
+	// no extension is negotiated, so RSV bits must be clear.
+	if (header[0] & 0x70) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+	// client frames are always masked.
+	if (!(header[1] & 0x80)) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+	uint64_t payloadlen = len7;
+
+	if (len7 == 126) {
+		payloadlen = ((uint64_t) header[2] << 8) | header[3];
+	} else if (len7 == 127) {
+		payloadlen = 0;
+		for (int i = 0; i < 8; i++) payloadlen = (payloadlen << 8) | header[2 + i];
+		if (payloadlen >> 63) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	}
+
+	memcpy(ws->mask, header + headerlen - 4, 4);
+
+	ws->payloadlen	= payloadlen;
+	ws->received	= 0;
+
+	switch (ws->opcode) {
+		case WEBSOCKET_CLOSE:
+		case WEBSOCKET_PING:
+		case WEBSOCKET_PONG:
+			if (!ws->fin || payloadlen > WEBSOCKET_MAX_CONTROL_SIZE) {
+				return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+			}
+
+			ws->state = WEBSOCKET_FRAME_CONTROL;
+			return 1;
+
+		case WEBSOCKET_TEXT:
+		case WEBSOCKET_BINARY:
+			if (ws->msgopcode != 0) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+			ws->msgopcode	= ws->opcode;
+			ws->utf8.need	= 0;
+			break;
+
+		case WEBSOCKET_CONTINUATION:
+			if (ws->msgopcode == 0) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+			break;
+
+		default:
+			return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	}
+
+	if (payloadlen > ws->endpoint->maxmessagesize - ws->messagesize) {
+		return failConnection(ws, WEBSOCKET_CLOSE_TOO_BIG);
+	}
+
+	ws->state = WEBSOCKET_FRAME_PAYLOAD;
+
+	return 1;
+}
+
+/**
+* Unmask data frame payload in place in the in-buffer and move it to the
+* message being reassembled.
+*
+* @return 1 if the frame is complete, 0 if more data is needed, -1 on
+* error.
+*/
+static int moveDataPayload(websocket* ws, struct evbuffer* in) {
+
+	uint64_t remaining	= ws->payloadlen - ws->received;
+	size_t avail		= evbuffer_get_length(in);
+	size_t len			= (avail < remaining) ? avail : (size_t) remaining;
+
+	if (len > 0) {
+
+		int n = evbuffer_peek(in, len, NULL, NULL, 0);
+
+		struct evbuffer_iovec vecs[n];
+
+		evbuffer_peek(in, len, NULL, vecs, n);
+
+		size_t left = len;
+
+		for (int i = 0; i < n && left > 0; i++) {
+
+			size_t seglen = (vecs[i].iov_len < left) ? vecs[i].iov_len : left;
+
+			unmask(vecs[i].iov_base, seglen, ws->mask, ws->received);
+
+			if (ws->msgopcode == WEBSOCKET_TEXT && !validateUtf8(ws, vecs[i].iov_base, seglen)) {
+				return failConnection(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+			}
+
+			ws->received	+= seglen;
+			left			-= seglen;
+		}
+
+		// moves whole chains, only partial chains at the edges are copied.
+		if (evbuffer_remove_buffer(in, ws->message, len) != (int) len) {
+			return failConnection(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+		}
+
+		ws->messagesize += len;
+	}
+
+	if (ws->received < ws->payloadlen) return 0;
+
+	ws->state = WEBSOCKET_FRAME_HEADER;
+
+	if (!ws->fin) return 1;
+
+	return deliverMessage(ws);
+}
+
+/**
+* Control frames may be interleaved with fragments of a message, their
+* small payload is handled on its own.
+*
+* @return 1 if the frame was processed, 0 if more data is needed, -1 to
+* close the connection.
+*/
+static int processControlFrame(websocket* ws, struct evbuffer* in) {
+
+	if (evbuffer_get_length(in) < ws->payloadlen) return 0;
+
+	uint8_t payload[WEBSOCKET_MAX_CONTROL_SIZE];
+	size_t size = (size_t) ws->payloadlen;
+
+	evbuffer_remove(in, payload, size);
+	unmask(payload, size, ws->mask, 0);
+
+	ws->state = WEBSOCKET_FRAME_HEADER;
+
+	switch (ws->opcode) {
+		case WEBSOCKET_PING:
+			if (!ws->closesent) websocketSend(ws, WEBSOCKET_PONG, payload, size);
+			return 1;
+
+		case WEBSOCKET_PONG:
+			return 1;
+
+		case WEBSOCKET_CLOSE:
+			break;
+
+		default:
+			return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	}
+
+	int code = WEBSOCKET_CLOSE_NO_STATUS;
+
+	if (size == 1) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+	if (size >= 2) {
+
+		code = (payload[0] << 8) | payload[1];
+
+		if (!isValidCloseCode(code)) return failConnection(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+		// reason is UTF-8 text on its own, not part of a message.
+		ws->utf8.need = 0;
+		if (!validateUtf8(ws, payload + 2, size - 2) || ws->utf8.need != 0) {
+			return failConnection(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+		}
+	}
+
+	DEBUG("WebSocket close received. code:%d", code);
+
+	if (ws->closecode == 0) ws->closecode = code;
+
+	// echo the status code back unless we initiated the closing handshake.
+	if (!ws->closesent) websocketClose(ws, code, NULL);
+
+	return -1;
+}
+
+/**
+* Hand a complete message to the endpoint.
+*
+* @return 1 to continue, -1 to close the connection.
+*/
+static int deliverMessage(websocket* ws) {
+
+	uint8_t opcode = ws->msgopcode;
+
+	if (opcode == WEBSOCKET_TEXT) {
+
+		// a message must not end in the middle of a character.
+		if (ws->utf8.need != 0) return failConnection(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+
+		evbuffer_add(ws->message, "", 1);
+	}
+
+	size_t size		= ws->messagesize;
+	void* data		= evbuffer_pullup(ws->message, -1);
+
+	ws->msgopcode	= 0;
+	ws->messagesize	= 0;
+
+	int status = ws->endpoint->onmessage(ws, opcode, data, size, ws->userdata);
+
+	evbuffer_drain(ws->message, evbuffer_get_length(ws->message));
+
+	if (status != 0) {
+
+		if (!ws->closesent) websocketClose(ws, WEBSOCKET_CLOSE_NORMAL, NULL);
+
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+* Send a close frame with the status code and give up on the connection.
+*
+* @return -1
+*/
+static int failConnection(websocket* ws, int code) {
+
+	WARN("WebSocket connection failed. code:%d", code);
+
+	ws->closecode = code;
+
+	if (!ws->closesent) websocketClose(ws, code, NULL);
+
+	return -1;
+}
+
+/**
+* Write an unmasked server frame header.
+*
+* @return length of the header.
+*/
+static size_t formatHeader(uint8_t* buf, int opcode, size_t size) {
+
+	buf[0] = 0x80 | (opcode & 0x0f);
+
+	if (size < 126) {
+		buf[1] = (uint8_t) size;
+		return 2;
+	}
+
+	if (size <= 0xffff) {
+		buf[1] = 126;
+		buf[2] = (uint8_t) (size >> 8);
+		buf[3] = (uint8_t) size;
+		return 4;
+	}
+
+	buf[1] = 127;
+
+	for (int i = 0; i < 8; i++) {
+		buf[2 + i] = (uint8_t) ((uint64_t) size >> (56 - 8 * i));
+	}
+
+	return 10;
+}
+
+/**
+* XOR data with the masking key.
+*
+* @param offset position of data within the payload, selects the key byte
+* the data starts with.
+*/
+static void unmask(uint8_t* data, size_t size, const uint8_t mask[4], size_t offset) {
+
+	uint8_t key[4];
+
+	for (int i = 0; i < 4; i++) key[i] = mask[(offset + i) & 3];
+
+	uint32_t key32;
+	memcpy(&key32, key, sizeof(key32));
+
+	size_t i = 0;
+
+	// every step is a multiple of 4, so key[i & 3] stays aligned with the payload.
+#if defined(__AVX2__)
+	__m256i key256 = _mm256_set1_epi32((int) key32);
+
+	for (; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (data + i));
+		_mm256_storeu_si256((__m256i*) (data + i), _mm256_xor_si256(v, key256));
+	}
+#endif
+
+#if defined(__SSE2__)
+	__m128i key128 = _mm_set1_epi32((int) key32);
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (data + i));
+		_mm_storeu_si128((__m128i*) (data + i), _mm_xor_si128(v, key128));
+	}
+#endif
+
+	uint64_t key64 = ((uint64_t) key32 << 32) | key32;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		v ^= key64;
+		memcpy(data + i, &v, sizeof(v));
+	}
+
+	for (; i < size; i++) {
+		data[i] ^= key[i & 3];
+	}
+}
+
+/**
+* Validate UTF-8 incrementally. A character may span calls, the state is
+* kept in ws->utf8.
+*
+* @return false on invalid sequence.
+*/
+static bool validateUtf8(websocket* ws, const uint8_t* data, size_t size) {
+
+	uint8_t need	= ws->utf8.need;
+	uint8_t lo		= ws->utf8.lo;
+	uint8_t hi		= ws->utf8.hi;
+
+	size_t i = 0;
+
+	while (i < size) {
+
+		if (need == 0) {
+
+			// skip ASCII 8 bytes at a time.
+			while (i + 8 <= size) {
+				uint64_t v;
+				memcpy(&v, data + i, sizeof(v));
+				if (v & 0x8080808080808080ULL) break;
+				i += 8;
+			}
+
+			if (i >= size) break;
+
+			uint8_t c = data[i++];
+
+			if (c < 0x80) continue;
+
+			lo = 0x80;
+			hi = 0xbf;
+
+			if (c >= 0xc2 && c <= 0xdf) {
+				need = 1;
+			} else if (c >= 0xe0 && c <= 0xef) {
+				need = 2;
+				if (c == 0xe0) lo = 0xa0;		// overlong
+				if (c == 0xed) hi = 0x9f;		// surrogates
+			} else if (c >= 0xf0 && c <= 0xf4) {
+				need = 3;
+				if (c == 0xf0) lo = 0x90;		// overlong
+				if (c == 0xf4) hi = 0x8f;		// above U+10FFFF
+			} else {
+				return false;
+			}
+
+			continue;
+		}
+
+		uint8_t c = data[i++];
+
+		if (c < lo || c > hi) return false;
+
+		lo = 0x80;
+		hi = 0xbf;
+		need--;
+	}
+
+	ws->utf8.need	= need;
+	ws->utf8.lo		= lo;
+	ws->utf8.hi		= hi;
+
+	return true;
+}
+
+static bool isValidCloseCode(int code) {
+
+	if (code >= 3000 && code <= 4999) return true;
+
+	switch (code) {
+		case WEBSOCKET_CLOSE_NORMAL:
+		case WEBSOCKET_CLOSE_GOING_AWAY:
+		case WEBSOCKET_CLOSE_PROTOCOL_ERROR:
+		case WEBSOCKET_CLOSE_UNSUPPORTED:
+		case WEBSOCKET_CLOSE_INVALID_DATA:
+		case WEBSOCKET_CLOSE_POLICY:
+		case WEBSOCKET_CLOSE_TOO_BIG:
+		case 1010:		// mandatory extension
+		case WEBSOCKET_CLOSE_INTERNAL_ERROR:
+			return true;
+	}
+
+	return false;
+}
+
+static void freeSession(connection* conn, void* userdata) {
+
+	websocket* ws = (websocket*) userdata;
+
+	if (ws->closecode == 0) ws->closecode = WEBSOCKET_CLOSE_ABNORMAL;
+
+	if (ws->endpoint->onclose) ws->endpoint->onclose(ws, ws->userdata);
+
+	evbuffer_free(ws->message);
+	free(ws);
+}